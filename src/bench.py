@@ -0,0 +1,101 @@
+#!/usr/bin/env python
+import argparse
+import json
+import random
+import subprocess
+import sys
+from pathlib import Path
+
+
+def gen_nesting(n):
+    return '(+ 1 ' * n + '0' + ')' * n + '\n'
+
+
+def gen_lambdas(n):
+    head = ''.join(f'((\\ (x{i}) ' for i in range(n))
+    tail = ''.join(f') {i})' for i in reversed(range(n)))
+    return head + '(+ x0 x' + str(n - 1) + ')' + tail + '\n'
+
+
+def gen_defines(n):
+    lines = ['(define (f0 x) (+ x 1))']
+    for i in range(1, n):
+        if i % 50 == 0:
+            lines.append(f'(define (f{i} x) (+ x {i}))')
+        else:
+            lines.append(f'(define (f{i} x) (f{i - 1} (* x 2)))')
+    lines.append(f'(f{n - 1} 1)')
+    return '\n'.join(lines) + '\n'
+
+
+def gen_strings(n):
+    rnd = random.Random(n)
+    abc = 'abcdefghijklmnopqrstuvwxyz0123456789 '
+    parts = []
+    for i in range(16):
+        s = ''.join(rnd.choice(abc) for _ in range(n))
+        parts.append(f'(. "{s}"')
+    return ' '.join(parts) + ' ""' + ')' * len(parts) + '\n'
+
+
+def gen_numbers(n):
+    rnd = random.Random(n)
+    lines = []
+    for i in range(64):
+        a = rnd.getrandbits(n * 8) | 1
+        b = rnd.getrandbits(n * 8) | 1
+        lines.append(f'(% (* {a} {b}) {b})')
+    return '\n'.join(lines) + '\n'
+
+
+def gen_wide(n):
+    return '\n'.join(f'(? (< {i} {i + 1}) (. "w" "{i}") "-")' for i in range(n)) + '\n'
+
+
+_WORKLOADS = (
+    ('nesting', gen_nesting, 2000),
+    ('lambdas', gen_lambdas, 500),
+    ('defines', gen_defines, 5000),
+    ('strings', gen_strings, 16384),
+    ('numbers', gen_numbers, 512),
+    ('wide', gen_wide, 20000),
+)
+
+
+def run(icfpc, flags, path, repeat):
+    # the fastest run is kept whole, so that its phases sum to its total
+    best = None
+    peak_rss_kb = 0
+    for _ in range(repeat):
+        out = subprocess.run([icfpc, '-b', *flags, str(path)], check=True, capture_output=True, text=True).stdout
+        stats = json.loads(out)
+        peak_rss_kb = max(peak_rss_kb, stats['peak_rss_kb'])
+        if best is None or stats['total_ms'] < best['total_ms']:
+            best = stats
+    best['peak_rss_kb'] = peak_rss_kb
+    best['mb_s'] = round(best['bytes'] / 1e3 / best['total_ms'], 2) if best['total_ms'] > 0 else 0
+    return best
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Time icfpc phases over synthetic workloads.')
+    parser.add_argument('--icfpc', default=str(Path(__file__).parent / 'icfpc'), help='compiler to run')
+    parser.add_argument('--out', default='bench', help='directory for the generated inputs')
+    parser.add_argument('--scale', type=float, default=1.0, help='multiplier for the workload sizes')
+    parser.add_argument('--repeat', type=int, default=5, help='runs per workload, the fastest is kept')
+    parser.add_argument('-O', action='store_true', help='time with the optimizer')
+    args = parser.parse_args()
+
+    outdir = Path(args.out)
+    outdir.mkdir(parents=True, exist_ok=True)
+    flags = ['-O'] if args.O else []
+    for name, gen, size in _WORKLOADS:
+        path = outdir / f'{name}.icf'
+        path.write_text(gen(max(1, int(size * args.scale))))
+        stats = run(args.icfpc, flags, path, args.repeat)
+        stats['file'] = name
+        print(json.dumps(stats), flush=True)
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,5 @@
+# Number literals of any size are written in base 94 as they are, and the
+# evaluator reads them back to the same values.
+./icfpc -e icfp_tests/bignum.icf
+./icfpc -t icfp_tests/bignum.icf
+./icfpc -t icfp_tests/bignum.icf | ./icfpc -i -e
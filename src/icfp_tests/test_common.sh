@@ -0,0 +1,6 @@
+# -c binds a repeated subexpression once, when that makes the output
+# shorter, in the innermost lambda that binds one of its free names. The
+# values are the same as without -c.
+./icfpc -c -t icfp_tests/common.icf
+./icfpc -c -e icfp_tests/common.icf
+./icfpc -e icfp_tests/common.icf
@@ -0,0 +1,13 @@
+# The C++ that -C writes compiles on its own and prints what -e does,
+# and a program failing at run time stops there with status 1.
+d=/tmp/icfpc_cpp.$$
+mkdir -p $d
+compile() {
+    ./icfpc "$@" > $d/p.cpp && ${CXX:-c++} -O1 -w -o $d/p $d/p.cpp -lpthread && $d/p
+    echo "rc $?"
+}
+compile -C icfp_tests/cpp.icf > $d/cpp.out 2>&1
+(./icfpc -e icfp_tests/cpp.icf; echo "rc $?") | cmp - $d/cpp.out && echo same
+cat $d/cpp.out
+compile -i -C icfp_tests/test_free.icfp 2>&1
+rm -rf $d
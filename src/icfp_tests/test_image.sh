@@ -0,0 +1,26 @@
+# -P saves the parsed prelude to an image and maps it on later runs. An
+# image of other prelude sources is stale and saved again, and a damaged
+# one is read from source instead. Each run evaluates the same way.
+d=/tmp/icfpc_image.$$
+mkdir -p $d
+cp icfp_tests/knot_prelude/prelude.icf $d/prelude.icf
+printf '(f 3)\n' > $d/a.icf
+run() {
+    ./icfpc -v -P $d/prelude.img -p $d/prelude.icf -O -e $d/a.icf 2>&1 | grep -e '^image' -e '^!' -e '^[0-9]' | sed "s#$d#DIR#g"
+}
+run
+run
+printf '(define (g n) (* n 10))\n' >> $d/prelude.icf
+printf '(g (f 3))\n' >> $d/a.icf
+run
+run
+python3 -c "
+import sys
+p = sys.argv[1]
+b = bytearray(open(p, 'rb').read())
+b[len(b) // 2] ^= 0xff
+open(p, 'wb').write(b)
+" $d/prelude.img
+run
+run
+rm -rf $d
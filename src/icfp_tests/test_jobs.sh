@@ -0,0 +1,14 @@
+# -j prints the output of each input in the order of the inputs, as
+# compiling them one after another does, and fails when any of them does.
+d=icfp_tests/jobs
+files="$d/f1.icf $d/f2.icf $d/f3.icf $d/f4.icf $d/f5.icf"
+for flags in "-e" "-t" "-O -e"; do
+    seq=`./icfpc $flags $files`
+    par=`./icfpc -j 3 $flags $files`
+    if [ "$seq" = "$par" ]; then echo "-j 3 $flags: same"; else echo "-j 3 $flags: differs"; fi
+done
+./icfpc -j 2 -e $files
+echo "rc $?"
+./icfpc -j 2 -e $d/f1.icf $d/bad.icf $d/f2.icf 2>/dev/null
+echo "rc $?"
+./icfpc -j 2 -e $d/f1.icf $d/bad.icf $d/f2.icf 2>&1 >/dev/null
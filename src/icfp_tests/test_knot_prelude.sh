@@ -0,0 +1,7 @@
+# A recursive define of a prelude that -j and -S compilers share is lowered
+# once, before they start, and each input prints what it does on its own.
+d=icfp_tests/knot_prelude
+./icfpc -p $d/prelude.icf -O -e $d/a.icf $d/b.icf
+./icfpc -p $d/prelude.icf -O -j 2 -e $d/a.icf $d/b.icf
+./icfpc -p $d/prelude.icf -O -j 2 -t $d/a.icf $d/b.icf
+printf '5\n(f 3)11\n(+ (f 3) 1)' | ./icfpc -p $d/prelude.icf -O -S -e
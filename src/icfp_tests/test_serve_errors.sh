@@ -0,0 +1,5 @@
+# A failed -S request replies with status 1 and its diagnostics as the
+# body, and the requests after it are still served.
+req() { printf '%s\n%s' "${#1}" "$1"; }
+{ req '(+ 1'; req '(+ 1 2)'; req '(. "a" (/ 1 0))'; req '(+ 2 2)'; } | ./icfpc -S -e
+echo "rc $?"
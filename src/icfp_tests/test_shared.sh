@@ -0,0 +1,7 @@
+# -s binds each define an expression reaches once, in a B$ around it, in
+# the order they depend on each other, and uses refer to its variable. An
+# expression reaching no define is written as it is, and values are the
+# same as without -s.
+./icfpc -s -t icfp_tests/shared.icf
+./icfpc -s -e icfp_tests/shared.icf
+./icfpc -e icfp_tests/shared.icf
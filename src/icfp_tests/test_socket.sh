@@ -0,0 +1,37 @@
+# -u serves each connection to its Unix socket as a -S stream of its own:
+# replies come in request order, a failed request replies with its
+# diagnostics, and every request sees the prelude.
+sock=/tmp/icfpc_test.$$.sock
+./icfpc -p icfp_tests/knot_prelude/prelude.icf -e -u $sock &
+server=$!
+i=0
+while [ ! -S $sock ] && [ $i -lt 100 ]; do sleep 0.05; i=$((i + 1)); done
+python3 - $sock <<'PY'
+import socket, sys
+
+def request(conn, text):
+    data = text.encode()
+    conn.sendall(b"%d\n" % len(data) + data)
+    head = b""
+    while not head.endswith(b"\n"):
+        head += conn.recv(1)
+    status, size = head.split()
+    body = b""
+    while len(body) < int(size):
+        body += conn.recv(int(size) - len(body))
+    sys.stdout.write("%s %s\n%s" % (status.decode(), size.decode(), body.decode()))
+
+a = socket.socket(socket.AF_UNIX)
+a.connect(sys.argv[1])
+b = socket.socket(socket.AF_UNIX)
+b.connect(sys.argv[1])
+request(a, "(define (g n) (* n 2))\n(g (f 3))")
+request(b, "(. \"b\" \"1\")")
+request(a, "(+ (f 0) (")
+request(b, "(f 1)")
+a.close()
+b.close()
+PY
+kill $server
+wait $server 2>/dev/null
+rm -f $sock
@@ -0,0 +1,9 @@
+# -T sums the counts of every -j job, as a single compile of the inputs
+# counts them, and is rejected for a benchmark or a server.
+counts() { tr ',' '\n' | grep -e tokens -e nodes -e lookups -e out_bytes; }
+./icfpc -T -O -e icfp_tests/jobs/f*.icf 2>&1 >/dev/null | counts > /tmp/icfpc_stats.$$
+./icfpc -T -O -j 3 -e icfp_tests/jobs/f*.icf 2>&1 >/dev/null | counts | cmp - /tmp/icfpc_stats.$$ && echo same
+cat /tmp/icfpc_stats.$$
+rm -f /tmp/icfpc_stats.$$
+./icfpc -T -b icfp_tests/jobs/f1.icf
+./icfpc -T -S < /dev/null
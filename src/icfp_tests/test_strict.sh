@@ -0,0 +1,5 @@
+# -O passes the argument of sq with B!, as its body needs it, and keeps
+# (loop n) lazy with B~, as pick only needs it when it is called with false,
+# so that evaluating still ends.
+./icfpc -O -t icfp_tests/strict.icf
+./icfpc -O -e icfp_tests/strict.icf
@@ -2,1118 +2,2824 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 
 static const char
-_usage[] = R"(usage: icfpc [-a] [-t] [-v] [file...]
+_usage[] = R"(usage: icfpc [-a] [-b] [-B N] [-c] [-C] [-e] [-i] [-j N] [-o DIR] [-O] [-p FILE] [-P FILE] [-s] [-S] [-t] [-T] [-u PATH] [-v] [file...]
 
 ICFP document compiler
 
 Options:
-  -a,--asserts  generate asserts
-  -t,--text     generate ICFP code
-  -v,--verbose  set verbose logging
+  -a,--asserts      generate asserts
+  -b,--bench        time each phase of compiling each file
+  -B,--budget N     reduce each expression and fail past N beta reductions
+  -c,--common       bind repeated subexpressions once
+  -C,--cpp          generate a C++ program that prints the values
+  -e,--eval         evaluate ICFP code
+  -i,--icfp         read ICFP code
+  -j,--jobs N       compile each file on its own, N at a time
+  -o,--outdir DIR   write the output of each file to DIR
+  -O,--optimize     fold constants, inline lambdas, pass arguments by need
+  -p,--prelude FILE read definitions every file sees
+  -P,--image FILE   keep the parsed preludes in FILE
+  -s,--shared       bind each definition once
+  -S,--serve        compile requests read from stdin
+  -t,--text         generate ICFP code
+  -T,--stats        print compile times and counts as JSON
+  -u,--socket PATH  compile requests sent to a Unix socket at PATH
+  -v,--verbose      set verbose logging
 )";
 
 
 static const char
-_usageq[] = "usage: icfpc [-a] [-t] [-v] [file...]";
+_usageq[] = "usage: icfpc [-a] [-b] [-B N] [-c] [-C] [-e] [-i] [-j N] [-o DIR] [-O] [-p FILE] [-P FILE] [-s] [-S] [-t] [-T] [-u PATH] [-v] [file...]";
 
 
-static constexpr const size_t _SymbolBufSizeMax = 0x100000;
+static constexpr const size_t _SymbolBlockSize = 0x10000;
 static constexpr const size_t _TokenSizeMax = 0x1000;
-static constexpr const size_t _ExprTreeSizeMax = 0x10000;
-static constexpr const size_t _NameTableSizeMax = 0x1000;
-static constexpr const size_t _NameTableListSizeMax = 0x1000;
-static constexpr const size_t _NamesSizeMax = 0x10000;
+static constexpr const size_t _NameTableSizeMin = 0x10;
+static constexpr const size_t _NameFrameSize = 3;
+static constexpr const size_t _SymbolIndexSizeMin = 0x400;
+static constexpr const size_t _ReaderBufSize = 0x10000;
+static constexpr const size_t _OutBufSizeMin = 0x10000;
+static constexpr const size_t _ArenaChunkSize = 0x100000;
+static constexpr const size_t _EvalStackSize = 0x40000000;
+static constexpr const size_t _EvalStackReserve = 0x100000;
+static constexpr const size_t _EvalCollectMin = 0x4000000;
+static constexpr const size_t _EvalHeapMax = 0x40000000;
+static constexpr const size_t _KaratsubaThreshold = 64;
+static constexpr const size_t _MulLeafSize = 64;
+static constexpr const size_t _NewtonThreshold = 48;
+static constexpr const size_t _RadixSplitThreshold = 32;
+static constexpr const size_t _InlineBetaBytes = 16;
+static constexpr const size_t _InlineFuel = 10000;
+static constexpr const size_t _InlineDepthMax = 0x1000;
+static constexpr const size_t _StrictFuel = 4096;
+static constexpr const size_t _ShareChunkSize = 0x10000;
+static constexpr const size_t _JobsMax = 0x400;
+static constexpr const size_t _RequestSizeMax = 0x40000000;
+static constexpr const uint64_t _ImageVersion = 2;
+
+
+// Where diagnostics go: stderr, or the reply to the request a server thread
+// compiles.
+static thread_local FILE* _icfp_stderr = stderr;
+
+
+struct _ArenaChunk {
+    struct _ArenaChunk* next;
+    size_t size;
+    size_t used;
+};
 
 
-struct _Number {
-    int64_t value;
+struct _Arena {
+    struct _ArenaChunk* head;
+    size_t chunk_size;
+    size_t used;
+    size_t peak;
 };
 
 
+static constexpr const size_t _ArenaChunkHeader = (sizeof(struct _ArenaChunk) + 15) & ~(size_t)15;
+
+
 static void
-number_init(struct _Number* num) {
-    num->value = 0;
+arena_init(struct _Arena* arena, size_t chunk_size) {
+    arena->head = NULL;
+    arena->chunk_size = chunk_size;
+    arena->used = 0;
+    arena->peak = 0;
 }
 
 
-static int
-number_is_neg(struct _Number* num) {
-    return num->value < 0;
+static struct _ArenaChunk*
+_arena_new_chunk(size_t size) {
+    struct _ArenaChunk* chunk = (struct _ArenaChunk*) malloc(_ArenaChunkHeader + size);
+    if (chunk == NULL) {
+        fprintf(_icfp_stderr, "! out of memory allocating %zu bytes\n", size);
+        abort();
+    }
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
 }
 
 
-static void
-number_add(struct _Number* num, int64_t arg) {
-    num->value += arg;
+static void*
+arena_alloc(struct _Arena* arena, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    arena->used += size;
+    if (arena->used > arena->peak) {
+        arena->peak = arena->used;
+    }
+    struct _ArenaChunk* chunk = arena->head;
+    if (chunk == NULL || chunk->used + size > chunk->size) {
+        if (size > arena->chunk_size / 4) {
+            struct _ArenaChunk* big = _arena_new_chunk(size);
+            big->used = size;
+            if (chunk == NULL) {
+                arena->head = big;
+            }
+            else {
+                big->next = chunk->next;
+                chunk->next = big;
+            }
+            return (char*) big + _ArenaChunkHeader;
+        }
+        chunk = _arena_new_chunk(arena->chunk_size);
+        chunk->next = arena->head;
+        arena->head = chunk;
+    }
+    void* p = (char*) chunk + _ArenaChunkHeader + chunk->used;
+    chunk->used += size;
+    return p;
 }
 
 
 static void
-number_mul(struct _Number* num, int64_t arg) {
-    num->value *= arg;
+arena_free(struct _Arena* arena) {
+    struct _ArenaChunk* chunk = arena->head;
+    while (chunk != NULL) {
+        struct _ArenaChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head = NULL;
+    arena->used = 0;
 }
 
 
-struct _SymbolList {
-    char* buf;
-    size_t bufsize;
-    size_t used;
+// A literal value, big is set only when it does not fit value.
+struct _Number {
+    int64_t value;
+    struct _BigInt* big;
 };
 
 
 static void
-symbol_list_init(struct _SymbolList* list, size_t bufsize, char* buf) {
-    list->buf = buf;
-    list->bufsize = bufsize;
-    list->used = 0;
+number_init(struct _Number* num) {
+    num->value = 0;
+    num->big = NULL;
 }
 
 
-static void
-symbol_list_reset(struct _SymbolList* list) {
-    list->used = 0;
+struct _BigInt {
+    int neg;
+    size_t len;
+    uint32_t* limbs;
+};
+
+
+static struct _BigInt*
+bigint_alloc(struct _Arena* arena, size_t len) {
+    struct _BigInt* num = (struct _BigInt*) arena_alloc(arena, sizeof(struct _BigInt) + len * sizeof(uint32_t));
+    num->neg = 0;
+    num->len = len;
+    num->limbs = (uint32_t*) (num + 1);
+    return num;
 }
 
 
-static char*
-symbol_list_push(struct _SymbolList* list, const char* value) {
-    int n = strlen(value);
-    if (list->used + n >= list->bufsize) {
-        fprintf(stderr, "! out of symbol storage at %zu bytes\n", list->used + n);
-        abort();
+static void
+bigint_trim(struct _BigInt* num) {
+    while (num->len > 0 && num->limbs[num->len - 1] == 0) {
+        num->len -= 1;
     }
-    char* res = strcpy(&list->buf[list->used], value);
-    list->used += n + 1;
-    return res;
+    if (num->len == 0) {
+        num->neg = 0;
+    }
+}
+
+
+static struct _BigInt*
+bigint_from_int64(struct _Arena* arena, int64_t x) {
+    uint64_t m = x < 0 ? 0 - (uint64_t) x : (uint64_t) x;
+    struct _BigInt* num = bigint_alloc(arena, 2);
+    num->limbs[0] = (uint32_t) m;
+    num->limbs[1] = (uint32_t) (m >> 32);
+    num->neg = x < 0;
+    bigint_trim(num);
+    return num;
 }
 
 
 static int
-symbol_list_pop(struct _SymbolList* list, char* value) {
-    int n = strlen(value);
-    size_t pos = list->used - (n + 1);
-    if (&list->buf[pos] != value) {
+bigint_to_int64(const struct _BigInt* num, int64_t* x) {
+    if (num->len > 2) {
         return 1;
     }
-    list->used = pos;
+    uint64_t m = 0;
+    if (num->len > 0) { m = num->limbs[0]; }
+    if (num->len > 1) { m |= (uint64_t) num->limbs[1] << 32; }
+    if (num->neg == 0) {
+        if (m > (uint64_t) INT64_MAX) { return 1; }
+        *x = (int64_t) m;
+        return 0;
+    }
+    if (m > (uint64_t) INT64_MAX + 1) { return 1; }
+    *x = m == (uint64_t) INT64_MAX + 1 ? INT64_MIN : -(int64_t) m;
     return 0;
 }
 
 
-static char*
-symbol_list_concat(struct _SymbolList* list, char* dest, char* value) {
-    int n = strlen(dest);
-    if (&list->buf[list->used] != dest + (n + 1)) {
+static uint32_t*
+_mag_alloc(size_t n) {
+    uint32_t* mag = (uint32_t*) calloc(n + 1, sizeof(uint32_t));
+    if (mag == NULL) {
+        fprintf(_icfp_stderr, "! out of memory allocating %zu limbs\n", n);
         abort();
     }
-    list->used -= 1;
-    return symbol_list_push(list, value);
+    return mag;
 }
 
 
-enum _TokenType {
-    _TokenType_invalid,
-    _TokenType_eof,
-    _TokenType_open_paren,
-    _TokenType_close_paren,
-    _TokenType_identifier,
-    _TokenType_bool_false,
-    _TokenType_bool_true,
-    _TokenType_number,
-    _TokenType_str,
-    _TokenType_str_start,
-    _TokenType_str_data,
-    _TokenType_str_end,
-};
+static size_t
+_mag_len(const uint32_t* a, size_t n) {
+    while (n > 0 && a[n-1] == 0) { --n; }
+    return n;
+}
 
 
-struct _Token {
-    enum _TokenType type;
-    int len;
-    size_t value_size;
-    char* value;
-    int lineno;
-    int colno;
-};
+// out[0..on) += a[0..an), an <= on; returns the carry out of out
+static uint32_t
+_mag_add_into(uint32_t* out, size_t on, const uint32_t* a, size_t an) {
+    uint64_t carry = 0;
+    size_t i = 0;
+    for (; i < an; ++i) {
+        carry += (uint64_t) out[i] + a[i];
+        out[i] = (uint32_t) carry;
+        carry >>= 32;
+    }
+    for (; carry != 0 && i < on; ++i) {
+        carry += out[i];
+        out[i] = (uint32_t) carry;
+        carry >>= 32;
+    }
+    return (uint32_t) carry;
+}
 
 
-static void
-token_init(struct _Token* token, size_t bufsize, char* buf) {
-    token->type = _TokenType_invalid;
-    token->value = buf;
-    token->value_size = bufsize;
-    token->value[0] = '\0';
-    token->len = 0;
-    token->lineno = 0;
-    token->colno = 0;
+// out[0..on) -= a[0..an), an <= on; returns the borrow out of out
+static uint32_t
+_mag_sub_into(uint32_t* out, size_t on, const uint32_t* a, size_t an) {
+    uint64_t borrow = 0;
+    size_t i = 0;
+    for (; i < an; ++i) {
+        uint64_t d = (uint64_t) out[i] - a[i] - borrow;
+        out[i] = (uint32_t) d;
+        borrow = (d >> 32) & 1;
+    }
+    for (; borrow != 0 && i < on; ++i) {
+        uint64_t d = (uint64_t) out[i] - borrow;
+        out[i] = (uint32_t) d;
+        borrow = (d >> 32) & 1;
+    }
+    return (uint32_t) borrow;
 }
 
 
-enum _ExprType {
-    _ExprType_invalid,
-    _ExprType_identifier,
-    _ExprType_literal,
-    _ExprType_apply1,
-    _ExprType_apply2,
-    _ExprType_apply3,
-    _ExprType_lambda,
-    _ExprType_define,
-    _ExprType_assert,
-};
+static int
+mag_cmp(const uint32_t* a, size_t an, const uint32_t* b, size_t bn) {
+    if (an != bn) {
+        return an < bn ? -1 : 1;
+    }
+    for (size_t i = an; i > 0; --i) {
+        if (a[i-1] != b[i-1]) {
+            return a[i-1] < b[i-1] ? -1 : 1;
+        }
+    }
+    return 0;
+}
 
 
-struct _Expr {
-    enum _ExprType type;
-    struct _Token token;
-    struct _Expr* expr0;
-    struct _Expr* expr1;
-    struct _Expr* expr2;
-    struct _Expr* expr3;
-    int lineno;
-    int colno;
-};
+static size_t
+mag_add(const uint32_t* a, size_t an, const uint32_t* b, size_t bn, uint32_t* out) {
+    if (an < bn) {
+        const uint32_t* t = a; a = b; b = t;
+        size_t tn = an; an = bn; bn = tn;
+    }
+    uint64_t carry = 0;
+    size_t i = 0;
+    for (; i < bn; ++i) {
+        carry += (uint64_t) a[i] + b[i];
+        out[i] = (uint32_t) carry;
+        carry >>= 32;
+    }
+    for (; i < an; ++i) {
+        carry += a[i];
+        out[i] = (uint32_t) carry;
+        carry >>= 32;
+    }
+    out[i] = (uint32_t) carry;
+    return an + 1;
+}
 
 
 static void
-expr_init(struct _Expr* expr) {
-    *expr = {};
-    expr->type = _ExprType_invalid;
+mag_sub(const uint32_t* a, size_t an, const uint32_t* b, size_t bn, uint32_t* out) {
+    uint64_t borrow = 0;
+    size_t i = 0;
+    for (; i < bn; ++i) {
+        uint64_t d = (uint64_t) a[i] - b[i] - borrow;
+        out[i] = (uint32_t) d;
+        borrow = (d >> 32) & 1;
+    }
+    for (; i < an; ++i) {
+        uint64_t d = (uint64_t) a[i] - borrow;
+        out[i] = (uint32_t) d;
+        borrow = (d >> 32) & 1;
+    }
 }
 
 
-struct _ExprTree {
-    struct _Expr* exprs;
-    size_t exprs_size;
-    size_t used;
-};
+#if defined(__SIZEOF_INT128__)
+// Leaf product on 64-bit limbs, an and bn at most _MulLeafSize; out gets
+// an + bn limbs.
+static void
+_mag_mul_leaf(const uint32_t* a, size_t an, const uint32_t* b, size_t bn, uint32_t* out) {
+    uint64_t a64[_MulLeafSize / 2];
+    uint64_t b64[_MulLeafSize / 2];
+    uint64_t o64[_MulLeafSize];
+    size_t an2 = (an + 1) / 2;
+    size_t bn2 = (bn + 1) / 2;
+    a64[an2-1] = 0;
+    b64[bn2-1] = 0;
+    memcpy(a64, a, an * sizeof(uint32_t));
+    memcpy(b64, b, bn * sizeof(uint32_t));
+    memset(o64, 0, (an2 + bn2) * sizeof(uint64_t));
+    for (size_t i = 0; i < an2; ++i) {
+        unsigned __int128 carry = 0;
+        uint64_t x = a64[i];
+        for (size_t j = 0; j < bn2; ++j) {
+            carry += (unsigned __int128) x * b64[j] + o64[i + j];
+            o64[i + j] = (uint64_t) carry;
+            carry >>= 64;
+        }
+        o64[i + bn2] = (uint64_t) carry;
+    }
+    memcpy(out, o64, (an + bn) * sizeof(uint32_t));
+}
+#endif
 
 
 static void
-expr_tree_init(struct _ExprTree* tree, size_t bufsize, _Expr* buf) {
-    tree->exprs = buf;
-    tree->exprs_size = bufsize;
-    tree->used = 0;
+_mag_mul_school(const uint32_t* a, size_t an, const uint32_t* b, size_t bn, uint32_t* out) {
+#if defined(__SIZEOF_INT128__)
+    if (bn > 0 && bn <= _MulLeafSize) {
+        // accumulate leaf products over _MulLeafSize slices of a
+        uint32_t t[2 * _MulLeafSize];
+        size_t n = an < _MulLeafSize ? an : _MulLeafSize;
+        _mag_mul_leaf(a, n, b, bn, out);
+        memset(out + n + bn, 0, (an - n) * sizeof(uint32_t));
+        for (size_t i = n; i < an; i += n) {
+            n = an - i < _MulLeafSize ? an - i : _MulLeafSize;
+            _mag_mul_leaf(a + i, n, b, bn, t);
+            _mag_add_into(out + i, an + bn - i, t, n + bn);
+        }
+        return;
+    }
+#endif
+    memset(out, 0, (an + bn) * sizeof(uint32_t));
+    for (size_t i = 0; i < an; ++i) {
+        uint64_t carry = 0;
+        uint64_t x = a[i];
+        if (x == 0) { continue; }
+        for (size_t j = 0; j < bn; ++j) {
+            carry += x * b[j] + out[i + j];
+            out[i + j] = (uint32_t) carry;
+            carry >>= 32;
+        }
+        out[i + bn] = (uint32_t) carry;
+    }
 }
 
 
 static void
-expr_tree_reset(struct _ExprTree* tree) {
-    tree->used = 0;
+mag_mul(const uint32_t* a, size_t an, const uint32_t* b, size_t bn, uint32_t* out);
+
+
+static void
+_mag_mul_karatsuba(const uint32_t* a, size_t an, const uint32_t* b, size_t bn, uint32_t* out) {
+    // bn <= an < 2 * bn, split both at k limbs
+    size_t k = (an + 1) / 2;
+    size_t a1n = an - k;
+    size_t b1n = bn - k;
+    uint32_t* scratch = _mag_alloc(4 * k + 4);
+    uint32_t* sa = scratch;
+    uint32_t* sb = scratch + k + 1;
+    uint32_t* z1 = scratch + 2 * k + 2;
+    mag_mul(a, k, b, k, out);
+    mag_mul(a + k, a1n, b + k, b1n, out + 2 * k);
+    mag_add(a, k, a + k, a1n, sa);
+    mag_add(b, k, b + k, b1n, sb);
+    mag_mul(sa, k + 1, sb, k + 1, z1);
+    _mag_sub_into(z1, 2 * k + 2, out, 2 * k);
+    _mag_sub_into(z1, 2 * k + 2, out + 2 * k, a1n + b1n);
+    _mag_add_into(out + k, an + bn - k, z1, _mag_len(z1, 2 * k + 2));
+    free(scratch);
 }
 
 
-static _Expr*
-expr_tree_push(struct _ExprTree* tree) {
-    if (tree->used >= tree->exprs_size) {
-        fprintf(stderr, "! out of expr storage at %zu used\n", tree->used);
-        abort();
+// out gets an + bn limbs and must not overlap the operands
+static void
+mag_mul(const uint32_t* a, size_t an, const uint32_t* b, size_t bn, uint32_t* out) {
+    if (an < bn) {
+        const uint32_t* t = a; a = b; b = t;
+        size_t tn = an; an = bn; bn = tn;
     }
-    _Expr* expr = &tree->exprs[tree->used++];
-    expr_init(expr);
-    return expr;
+    if (bn < _KaratsubaThreshold) {
+        _mag_mul_school(a, an, b, bn, out);
+        return;
+    }
+    if (bn > (an + 1) / 2) {
+        _mag_mul_karatsuba(a, an, b, bn, out);
+        return;
+    }
+    // unbalanced, multiply b by bn-limb slices of a
+    memset(out, 0, (an + bn) * sizeof(uint32_t));
+    uint32_t* t = _mag_alloc(2 * bn);
+    for (size_t i = 0; i < an; i += bn) {
+        size_t n = an - i < bn ? an - i : bn;
+        mag_mul(a + i, n, b, bn, t);
+        _mag_add_into(out + i, an + bn - i, t, n + bn);
+    }
+    free(t);
 }
 
 
-struct _Name {
-    const char* name;
-    int seqno;
-    const char* filename;
-    int lineno;
-    int colno;
-    struct _Expr* expr;
-};
+static uint32_t
+mag_divmod_small(const uint32_t* a, size_t n, uint32_t d, uint32_t* q) {
+    uint64_t rem = 0;
+    for (size_t i = n; i > 0; --i) {
+        rem = (rem << 32) | a[i-1];
+        q[i-1] = (uint32_t) (rem / d);
+        rem %= d;
+    }
+    return (uint32_t) rem;
+}
 
 
 static void
-name_init(struct _Name* name, const char* s) {
-    *name = {};
-    name->name = s;
+mag_divmod(const uint32_t* u, size_t m, const uint32_t* v, size_t n, uint32_t* q, uint32_t* r, uint32_t* scratch) {
+    // Knuth D, m >= n >= 2, scratch holds m + 1 + n limbs
+    uint32_t* un = scratch;
+    uint32_t* vn = scratch + m + 1;
+    int s = __builtin_clz(v[n-1]);
+    for (size_t i = n - 1; i > 0; --i) {
+        vn[i] = (uint32_t) ((((uint64_t) v[i] << 32) | v[i-1]) >> (32 - s));
+    }
+    vn[0] = v[0] << s;
+    un[m] = (uint32_t) (((uint64_t) u[m-1] << s) >> 32);
+    for (size_t i = m - 1; i > 0; --i) {
+        un[i] = (uint32_t) ((((uint64_t) u[i] << 32) | u[i-1]) >> (32 - s));
+    }
+    un[0] = u[0] << s;
+
+    const uint64_t b = (uint64_t) 1 << 32;
+    for (size_t j = m - n + 1; j > 0; --j) {
+        size_t k = j - 1;
+        uint64_t num = ((uint64_t) un[k+n] << 32) | un[k+n-1];
+        uint64_t qhat = num / vn[n-1];
+        uint64_t rhat = num % vn[n-1];
+        while (qhat >= b || qhat * vn[n-2] > ((rhat << 32) | un[k+n-2])) {
+            qhat -= 1;
+            rhat += vn[n-1];
+            if (rhat >= b) { break; }
+        }
+        uint64_t borrow = 0;
+        uint64_t carry = 0;
+        for (size_t i = 0; i < n; ++i) {
+            uint64_t p = qhat * vn[i] + carry;
+            carry = p >> 32;
+            uint64_t d = (uint64_t) un[i+k] - (uint32_t) p - borrow;
+            un[i+k] = (uint32_t) d;
+            borrow = (d >> 32) & 1;
+        }
+        uint64_t d = (uint64_t) un[k+n] - carry - borrow;
+        un[k+n] = (uint32_t) d;
+        borrow = (d >> 32) & 1;
+        q[k] = (uint32_t) qhat;
+        if (borrow != 0) {
+            q[k] -= 1;
+            uint64_t c = 0;
+            for (size_t i = 0; i < n; ++i) {
+                c += (uint64_t) un[i+k] + vn[i];
+                un[i+k] = (uint32_t) c;
+                c >>= 32;
+            }
+            un[k+n] += (uint32_t) c;
+        }
+    }
+    for (size_t i = 0; i + 1 < n; ++i) {
+        r[i] = (uint32_t) ((((uint64_t) un[i+1] << 32) | un[i]) >> s);
+    }
+    r[n-1] = un[n-1] >> s;
 }
 
 
-struct _NameList {
-    struct _Name* names;
-    size_t names_size;
-    size_t used;
-};
-
+static int
+bigint_cmp(const struct _BigInt* a, const struct _BigInt* b) {
+    if (a->neg != b->neg) {
+        return a->neg ? -1 : 1;
+    }
+    int c = mag_cmp(a->limbs, a->len, b->limbs, b->len);
+    return a->neg ? -c : c;
+}
 
-struct _NameTableList;
 
-struct _NameTable {
-    struct _NameTable* parent;
-    struct _Name* names[_NameTableSizeMax];
-    size_t names_size;
-    size_t used;
-    struct _NameTableList* table_storage;
-    struct _NameList* name_storage;
-};
+static struct _BigInt*
+bigint_add(struct _Arena* arena, const struct _BigInt* a, const struct _BigInt* b) {
+    size_t n = (a->len > b->len ? a->len : b->len) + 1;
+    struct _BigInt* res = bigint_alloc(arena, n);
+    if (a->neg == b->neg) {
+        res->len = mag_add(a->limbs, a->len, b->limbs, b->len, res->limbs);
+        res->neg = a->neg;
+    }
+    else if (mag_cmp(a->limbs, a->len, b->limbs, b->len) >= 0) {
+        mag_sub(a->limbs, a->len, b->limbs, b->len, res->limbs);
+        res->len = a->len;
+        res->neg = a->neg;
+    }
+    else {
+        mag_sub(b->limbs, b->len, a->limbs, a->len, res->limbs);
+        res->len = b->len;
+        res->neg = b->neg;
+    }
+    bigint_trim(res);
+    return res;
+}
 
 
-struct _NameTableList {
-    struct _NameTable* tables;
-    size_t tables_size;
-    size_t used;
-};
+static struct _BigInt*
+bigint_sub(struct _Arena* arena, const struct _BigInt* a, const struct _BigInt* b) {
+    struct _BigInt nb = *b;
+    nb.neg = b->len > 0 && b->neg == 0;
+    return bigint_add(arena, a, &nb);
+}
 
 
-static void
-name_list_init(struct _NameList* list, size_t bufsize, struct _Name* buf) {
-    list->names = buf;
-    list->names_size = bufsize;
-    list->used = 0;
+static struct _BigInt*
+bigint_mul(struct _Arena* arena, const struct _BigInt* a, const struct _BigInt* b) {
+    struct _BigInt* res = bigint_alloc(arena, a->len + b->len);
+    mag_mul(a->limbs, a->len, b->limbs, b->len, res->limbs);
+    res->neg = a->neg != b->neg;
+    bigint_trim(res);
+    return res;
 }
 
 
-static struct _Name*
-name_list_push(struct _NameList* list) {
-    if (list->used + 1 >= list->names_size) {
-        fprintf(stderr, "! out of name storage at %zu\n", list->used);
-        abort();
+static int
+bigint_divmod(struct _Arena* arena, const struct _BigInt* a, const struct _BigInt* b,
+    struct _BigInt** quot, struct _BigInt** rem) {
+
+    if (b->len == 0) {
+        return 1;
     }
-    struct _Name* name = &list->names[list->used++];
-    return name;
+    struct _BigInt* q;
+    struct _BigInt* r;
+    if (mag_cmp(a->limbs, a->len, b->limbs, b->len) < 0) {
+        q = bigint_alloc(arena, 0);
+        r = bigint_alloc(arena, a->len);
+        memcpy(r->limbs, a->limbs, a->len * sizeof(uint32_t));
+    }
+    else if (b->len == 1) {
+        q = bigint_alloc(arena, a->len);
+        r = bigint_alloc(arena, 1);
+        r->limbs[0] = mag_divmod_small(a->limbs, a->len, b->limbs[0], q->limbs);
+    }
+    else {
+        q = bigint_alloc(arena, a->len - b->len + 1);
+        r = bigint_alloc(arena, b->len);
+        uint32_t* scratch = (uint32_t*) malloc((a->len + 1 + b->len) * sizeof(uint32_t));
+        mag_divmod(a->limbs, a->len, b->limbs, b->len, q->limbs, r->limbs, scratch);
+        free(scratch);
+    }
+    q->neg = a->neg != b->neg;
+    r->neg = a->neg;
+    bigint_trim(q);
+    bigint_trim(r);
+    if (quot != NULL) { *quot = q; }
+    if (rem != NULL) { *rem = r; }
+    return 0;
 }
 
 
 static void
-name_table_init(struct _NameTable* table, struct _NameTableList* table_storage, struct _NameList* name_storage) {
-    table->names_size = sizeof(table->names) / sizeof(table->names[0]);
-    table->used = 0;
-    table->table_storage = table_storage;
-    table->name_storage = name_storage;
+_bigint_radix_chunk(uint32_t base, uint32_t* chunk_base, int* chunk_digits) {
+    uint64_t p = base;
+    int k = 1;
+    while (p * base <= UINT32_MAX) {
+        p *= base;
+        k += 1;
+    }
+    *chunk_base = (uint32_t) p;
+    *chunk_digits = k;
 }
 
 
-static struct _NameTable*
-name_table_list_init(struct _NameTableList* list, size_t bufsize, struct _NameTable* buf) {
-    list->tables = buf;
-    list->tables_size = bufsize;
-    list->used = 0;
-    struct _NameTable* table = &list->tables[list->used++];
-    name_table_init(table, list, NULL);
-    return table;
-}
+static const uint32_t _mag_one[1] = {1};
 
 
-static struct _NameTable*
-name_table_list_push(struct _NameTableList* list) {
-    if (list->used + 1 >= list->tables_size) {
-        fprintf(stderr, "! out of name table storage at %zu\n", list->used);
-        abort();
+// r gets floor(B^2n / v) in n + 2 limbs, v has n limbs with a nonzero top
+static void
+_mag_reciprocal(const uint32_t* v, size_t n, uint32_t* r) {
+    memset(r, 0, (n + 2) * sizeof(uint32_t));
+    if (n < _NewtonThreshold) {
+        uint32_t* u = _mag_alloc(2 * n + 1);
+        u[2 * n] = 1;
+        if (n == 1) {
+            mag_divmod_small(u, 2 * n + 1, v[0], r);
+        }
+        else {
+            uint32_t* rem = _mag_alloc(n);
+            uint32_t* scratch = _mag_alloc(3 * n + 2);
+            mag_divmod(u, 2 * n + 1, v, n, r, rem, scratch);
+            free(scratch);
+            free(rem);
+        }
+        free(u);
+        return;
     }
-    struct _NameTable* table = &list->tables[list->used++];
-    name_table_init(table, list, NULL);
-    return table;
+    // the reciprocal of the top h limbs is off by a relative B^-h, one
+    // Newton step squares that and the guard limbs leave a few units
+    size_t h = (n + 1) / 2 + 2;
+    size_t k = n - h;
+    _mag_reciprocal(v + k, h, r + k);
+    uint32_t* p = _mag_alloc(2 * n + 2);
+    uint32_t* e = _mag_alloc(2 * n + 2);
+    uint32_t* d = _mag_alloc(3 * n + 4);
+    mag_mul(v, n, r, n + 2, p);
+    memset(e, 0, (2 * n + 2) * sizeof(uint32_t));
+    e[2 * n] = 1;
+    // only the top of the error term matters, dropping its low n - 2 limbs
+    // costs less than a unit
+    size_t drop = n - 2;
+    uint32_t* err = p;
+    int low = mag_cmp(p, _mag_len(p, 2 * n + 2), e, 2 * n + 1) < 0;
+    if (low) {
+        _mag_sub_into(e, 2 * n + 2, p, 2 * n + 2);
+        err = e;
+    }
+    else {
+        _mag_sub_into(p, 2 * n + 2, e, 2 * n + 1);
+    }
+    size_t errn = _mag_len(err + drop, 2 * n + 2 - drop);
+    if (errn > 0) {
+        memset(d, 0, (3 * n + 4) * sizeof(uint32_t));
+        mag_mul(r, n + 2, err + drop, errn, d);
+        if (low) {
+            _mag_add_into(r, n + 2, d + 2 * n - drop, n + 2);
+        }
+        else {
+            _mag_sub_into(r, n + 2, d + 2 * n - drop, n + 2);
+        }
+    }
+    // settle the last units so that 0 <= B^2n - v * r < v
+    mag_mul(v, n, r, n + 2, p);
+    for (;;) {
+        memset(e, 0, (2 * n + 2) * sizeof(uint32_t));
+        e[2 * n] = 1;
+        if (mag_cmp(p, _mag_len(p, 2 * n + 2), e, 2 * n + 1) > 0) {
+            _mag_sub_into(r, n + 2, _mag_one, 1);
+            _mag_sub_into(p, 2 * n + 2, v, n);
+            continue;
+        }
+        _mag_sub_into(e, 2 * n + 2, p, 2 * n + 2);
+        if (mag_cmp(e, _mag_len(e, 2 * n + 2), v, n) < 0) {
+            break;
+        }
+        _mag_add_into(r, n + 2, _mag_one, 1);
+        _mag_add_into(p, 2 * n + 2, v, n);
+    }
+    free(d);
+    free(e);
+    free(p);
 }
 
 
-static struct _NameTable*
-name_table_add_child(struct _NameTable* table) {
-    struct _NameTable* child = name_table_list_push(table->table_storage);
-    name_table_init(child, table->table_storage, table->name_storage);
-    child->parent = table;
-    return child;
+// q and r get floor(x / v) and x mod v for x < B^2n, given the reciprocal
+// of v; q needs n + 2 limbs and r n + 1
+static void
+_mag_divmod_reciprocal(const uint32_t* x, size_t xn, const uint32_t* v, size_t n, const uint32_t* rv,
+    uint32_t* q, uint32_t* r) {
+
+    uint32_t* t = _mag_alloc(2 * n + 4);
+    // the low n - 2 limbs of x move the estimate by less than a unit, so
+    // it is at most a few units low
+    memset(q, 0, (n + 2) * sizeof(uint32_t));
+    size_t drop = n - 2;
+    if (xn > drop) {
+        mag_mul(x + drop, xn - drop, rv, n + 2, t);
+        size_t tn = xn - drop + n + 2;
+        if (tn > 2 * n - drop) {
+            size_t qn = tn - (2 * n - drop);
+            memcpy(q, t + 2 * n - drop, (qn < n + 2 ? qn : n + 2) * sizeof(uint32_t));
+        }
+    }
+    uint32_t* s = _mag_alloc(xn + 1);
+    memcpy(s, x, xn * sizeof(uint32_t));
+    size_t qn = _mag_len(q, n + 2);
+    if (qn > 0) {
+        mag_mul(q, qn, v, n, t);
+        _mag_sub_into(s, xn + 1, t, _mag_len(t, qn + n));
+    }
+    while (mag_cmp(s, _mag_len(s, xn + 1), v, n) >= 0) {
+        _mag_sub_into(s, xn + 1, v, n);
+        _mag_add_into(q, n + 2, _mag_one, 1);
+    }
+    memset(r, 0, (n + 1) * sizeof(uint32_t));
+    memcpy(r, s, (xn < n ? xn : n) * sizeof(uint32_t));
+    free(s);
+    free(t);
 }
 
 
-static struct _Name*
-name_table_put(struct _NameTable* table, const char* name, struct _Expr* expr) {
-    if (table->used + 1 >= table->names_size) {
-        fprintf(stderr, "! out of name storage in the table at %zu\n", table->used);
-        abort();
+// Same as above for a quotient much shorter than v: divides by the top limbs
+// of v and settles the estimate against the full divisor.
+static void
+_mag_divmod_top(const uint32_t* x, size_t xn, const uint32_t* v, size_t n, uint32_t* q, uint32_t* r) {
+    size_t tn = xn - n + 3;
+    size_t k = n - tn;
+    uint32_t* rt = _mag_alloc(tn + 2);
+    uint32_t* rem = _mag_alloc(tn + 1);
+    _mag_reciprocal(v + k, tn, rt);
+    _mag_divmod_reciprocal(x + k, xn - k, v + k, tn, rt, q, rem);
+    memset(q + tn + 2, 0, (n - tn) * sizeof(uint32_t));
+    size_t qn = _mag_len(q, tn + 2);
+    uint32_t* t = _mag_alloc(qn + n);
+    mag_mul(q, qn, v, n, t);
+    while (mag_cmp(t, _mag_len(t, qn + n), x, xn) > 0) {
+        _mag_sub_into(q, n + 2, _mag_one, 1);
+        _mag_sub_into(t, qn + n, v, n);
     }
-    struct _Name* s = name_list_push(table->name_storage);
-    table->names[table->used++] = s;
-    name_init(s, name);
-    s->expr = expr;
-    return s;
+    uint32_t* s = _mag_alloc(xn + 1);
+    memcpy(s, x, xn * sizeof(uint32_t));
+    _mag_sub_into(s, xn + 1, t, _mag_len(t, qn + n));
+    while (mag_cmp(s, _mag_len(s, xn + 1), v, n) >= 0) {
+        _mag_sub_into(s, xn + 1, v, n);
+        _mag_add_into(q, n + 2, _mag_one, 1);
+    }
+    memset(r, 0, (n + 1) * sizeof(uint32_t));
+    memcpy(r, s, n * sizeof(uint32_t));
+    free(s);
+    free(t);
+    free(rem);
+    free(rt);
 }
 
 
-static int
-name_table_resolve(struct _NameTable* table, struct _Token* token, struct _Name** resolved) {
-    struct _Name** p = table->names;
-    for (size_t i = 0; i < table->used; ++i, ++p) {
-        struct _Name* s = *p;
-        if (strcmp(s->name, token->value) == 0) {
-            if (s->expr == NULL) {
-                *resolved = s;
-                return 0;
-            }
-            if (s->expr->type == _ExprType_identifier) {
-                int res = name_table_resolve(table, &s->expr->token, resolved);
-                if (res == 0) { return 0; }
-            }
-            *resolved = s;
-            return 0;
-        }
-    }
-    table = table->parent;
-    if (table != NULL) {
-        return name_table_resolve(table, token, resolved);
-    }
-    fprintf(stderr, ":%d:%d: use of undeclared name %s\n", token->lineno, token->colno, token->value);
-    return 1;
-}
+// Powers base^(chunk_digits * 2^i) with lazily computed reciprocals.
+struct _RadixPowers {
+    uint32_t base;
+    uint32_t chunk_base;
+    int chunk_digits;
+    size_t count;
+    uint32_t* pw[64];
+    size_t pwn[64];
+    uint32_t* inv[64];
+};
 
 
-struct _ParserState {
-    int out_asserts;
-    int verbose;
-    const char* filename;
-    int lineno;
-    int colno;
-    struct _SymbolList symbols;
-    size_t token_bufsize;
-    char* token_buf;
-    struct _ExprTree expr_tree;
-    struct _NameList name_list;
-};
+static void
+_radix_powers_init(struct _RadixPowers* powers, uint32_t base) {
+    powers->base = base;
+    _bigint_radix_chunk(base, &powers->chunk_base, &powers->chunk_digits);
+    powers->pw[0] = _mag_alloc(1);
+    powers->pw[0][0] = powers->chunk_base;
+    powers->pwn[0] = 1;
+    powers->inv[0] = NULL;
+    powers->count = 1;
+}
 
 
-struct _WriterState {
-    FILE* file;
-    int out_format;
-    const char* filename;
-    int verbose;
-    struct _NameTableList nametable_list;
-    struct _NameTable* nametable;
-};
+static void
+_radix_powers_extend(struct _RadixPowers* powers, size_t level) {
+    while (powers->count <= level) {
+        size_t i = powers->count;
+        size_t n = powers->pwn[i-1];
+        powers->pw[i] = _mag_alloc(2 * n);
+        mag_mul(powers->pw[i-1], n, powers->pw[i-1], n, powers->pw[i]);
+        powers->pwn[i] = _mag_len(powers->pw[i], 2 * n);
+        powers->inv[i] = NULL;
+        powers->count += 1;
+    }
+}
 
 
-static int
-icfp_writer_init(struct _WriterState* context, FILE* file, int oformat) {
-    context->file = file;
-    context->out_format = oformat;
-    return 0;
+static void
+_radix_powers_free(struct _RadixPowers* powers) {
+    for (size_t i = 0; i < powers->count; ++i) {
+        free(powers->pw[i]);
+        free(powers->inv[i]);
+    }
+    powers->count = 0;
 }
 
-static int
-_icfp_parser_skip_comment(struct _ParserState* context, FILE* file, struct _Token* token) {
-    int state = 1;
-    int end_char = 0;
-    for (;;) {
-        int c = fgetc(file);
-        if (c == EOF) {
-            fprintf(stderr, "%s:%d:%d: unterminated comment\n", context->filename, token->lineno, token->colno);
-            return 1;
+
+// Sums digits[0..n) into out, which has room for n / chunk_digits + 2 limbs
+// and receives the trimmed length.
+static size_t
+_radix_from_digits_school(const struct _RadixPowers* powers, const uint8_t* digits, size_t n, uint32_t* out) {
+    uint32_t base = powers->base;
+    size_t len = 0;
+    size_t i = 0;
+    size_t head = n % powers->chunk_digits;
+    if (head == 0) { head = powers->chunk_digits; }
+    while (i < n) {
+        uint32_t mult = 1;
+        uint32_t value = 0;
+        for (size_t end = i + head; i < end; ++i) {
+            value = value * base + digits[i];
+            mult *= base;
         }
-        switch (c) {
-            case '\n':
-                context->lineno += 1;
-                context->colno = 1;
-                break;
-            default:
-                context->colno += 1;
-                break;
+        head = powers->chunk_digits;
+        uint64_t carry = value;
+        for (size_t j = 0; j < len; ++j) {
+            carry += (uint64_t) out[j] * mult;
+            out[j] = (uint32_t) carry;
+            carry >>= 32;
         }
-        switch (state) {
-            case 1:
-                switch (c) {
-                    case '(':
-                        end_char = ')';
-                        state = 5;
-                        break;
-                    case '{':
-                        end_char = '}';
-                        state = 5;
-                        break;
-                    case '<':
-                        end_char = '>';
-                        state = 5;
-                        break;
-                    case '[':
-                        end_char = ']';
-                        state = 5;
-                        break;
-                    case '!': case '"': case '#': case '$': case '%': case '&': case '\'':
-                    case '*': case '+': case '-': case '/': case ':': case ';': case '=':
-                    case '?': case '@': case '^': case '`': case '|': case '~':
-                        end_char = c;
-                        state = 5;
-                        break;
-                    default:
-                        state = 2;
-                        break;
-                }
-                break;
-            case 2:
-                if (c == '}') {
-                    return 0;
-                }
-                break;
-            case 5:
-                if (c == end_char) {
-                    state = 6;
-                }
-                break;
-            case 6:
-                if (c == '}') {
-                    return 0;
-                }
-                else if (c != end_char) {
-                    state = 5;
-                }
-                break;
+        if (carry != 0) {
+            out[len++] = (uint32_t) carry;
         }
     }
+    return _mag_len(out, len);
 }
 
 
-static int
-_icfp_parser_read_str_data(struct _ParserState* context, FILE* file, struct _Token* token) {
-    int state = 0;
-    for (;;) {
-        int c = fgetc(file);
-        if (c == EOF) {
-            fprintf(stderr, "%s:%d:%d: unexpected EOF\n", context->filename, context->lineno, context->colno);
-            return -1;
+static size_t
+_radix_from_digits(struct _RadixPowers* powers, const uint8_t* digits, size_t n, uint32_t* out) {
+    size_t chunk_digits = powers->chunk_digits;
+    if (n <= chunk_digits * _RadixSplitThreshold) {
+        return _radix_from_digits_school(powers, digits, n, out);
+    }
+    // split off the low chunk_digits * 2^level digits, value = hi * pw + lo
+    size_t level = 0;
+    while ((chunk_digits << (level + 1)) < n) {
+        level += 1;
+    }
+    _radix_powers_extend(powers, level);
+    size_t lo_digits = chunk_digits << level;
+    size_t hi_digits = n - lo_digits;
+    uint32_t* hi = _mag_alloc(hi_digits / chunk_digits + 2);
+    size_t hin = _radix_from_digits(powers, digits, hi_digits, hi);
+    size_t outn = n / chunk_digits + 2;
+    memset(out, 0, outn * sizeof(uint32_t));
+    size_t lon = _radix_from_digits(powers, digits + hi_digits, lo_digits, out);
+    if (hin > 0) {
+        size_t pn = powers->pwn[level];
+        uint32_t* t = _mag_alloc(hin + pn);
+        mag_mul(hi, hin, powers->pw[level], pn, t);
+        _mag_add_into(out, outn, t, _mag_len(t, hin + pn));
+        free(t);
+    }
+    free(hi);
+    (void) lon;
+    return _mag_len(out, outn);
+}
+
+
+// Writes exactly width digits of x, zero padded, x < base^width.
+static void
+_radix_to_digits_school(const struct _RadixPowers* powers, const uint32_t* x, size_t n, uint8_t* out, size_t width) {
+    uint32_t base = powers->base;
+    uint32_t* mag = _mag_alloc(n);
+    memcpy(mag, x, n * sizeof(uint32_t));
+    uint8_t* p = out + width;
+    n = _mag_len(mag, n);
+    while (p > out) {
+        uint32_t rem = 0;
+        if (n > 0) {
+            rem = mag_divmod_small(mag, n, powers->chunk_base, mag);
+            n = _mag_len(mag, n);
         }
-        switch (state) {
-            case 0:
-                switch (c) {
-                    case '"':
-                        if (token->len >= token->value_size) {
-                            abort();
-                        }
-                        token->value[token->len] = '\0';
-                        token->type = _TokenType_str_end;
-                        context->colno += 1;
-                        return 0;
-                    case '\\':
-                        if (token->len + 1 >= token->value_size) {
-                            ungetc(c, file);
-                            token->value[token->len] = '\0';
-                            token->type = _TokenType_str_data;
-                            return 0;
-                        }
-                        state = 10;
-                        break;
-                    case 0x20:
-                    case 0x21:
-                    case 0x23 ... 0x5b:
-                    case 0x5d ... 0x7a:
-                    case 0x7c:
-                    case 0x7e:
-                        if (token->len + 1 >= token->value_size) {
-                            ungetc(c, file);
-                            token->value[token->len] = '\0';
-                            return 0;
-                        }
-                        token->value[token->len++] = c;
-                        token->type = _TokenType_str_data;
-                        context->colno += 1;
-                        break;
-                    default:
-                        fprintf(stderr, "%s:%d:%d: invalid string %c\n", context->filename, context->lineno, context->colno, c);
-                        return -1;
-                }
-                break;
+        for (int k = 0; k < powers->chunk_digits && p > out; ++k) {
+            *--p = rem % base;
+            rem /= base;
+        }
+    }
+    free(mag);
+}
 
-            case 10:
-                switch (c) {
-                    case '\\':
-                    case '"':
-                        token->value[token->len++] = c;
-                        token->type = _TokenType_str_data;
-                        context->colno += 2;
-                        state = 0;
-                        break;
-                    case 'n':
-                        token->value[token->len++] = '\n';
-                        token->type = _TokenType_str_data;
-                        context->colno += 2;
-                        state = 0;
-                        break;
-                    default:
-                        fprintf(stderr, "%s:%d:%d: invalid escape %c\n", context->filename, context->lineno, context->colno, c);
-                        return -1;
-                }
-                break;
+
+// Writes the chunk_digits * 2^(level+1) digits of x < pw[level]^2.
+static void
+_radix_to_digits(struct _RadixPowers* powers, const uint32_t* x, size_t n, size_t level, uint8_t* out) {
+    size_t width = (size_t) powers->chunk_digits << (level + 1);
+    n = _mag_len(x, n);
+    if (n <= _RadixSplitThreshold || level == 0) {
+        _radix_to_digits_school(powers, x, n, out, width);
+        return;
+    }
+    const uint32_t* v = powers->pw[level];
+    size_t vn = powers->pwn[level];
+    uint32_t* q = _mag_alloc(vn + 2);
+    uint32_t* r = _mag_alloc(vn + 1);
+    if (mag_cmp(x, n, v, vn) < 0) {
+        memcpy(r, x, n * sizeof(uint32_t));
+    }
+    else if (vn >= _NewtonThreshold && 2 * (n - vn + 3) <= vn) {
+        _mag_divmod_top(x, n, v, vn, q, r);
+    }
+    else if (vn >= _NewtonThreshold) {
+        if (powers->inv[level] == NULL) {
+            powers->inv[level] = _mag_alloc(vn + 2);
+            _mag_reciprocal(v, vn, powers->inv[level]);
         }
+        _mag_divmod_reciprocal(x, n, v, vn, powers->inv[level], q, r);
     }
-    abort();
+    else {
+        uint32_t* scratch = _mag_alloc(n + 1 + vn);
+        mag_divmod(x, n, v, vn, q, r, scratch);
+        free(scratch);
+    }
+    _radix_to_digits(powers, q, vn + 2, level - 1, out);
+    _radix_to_digits(powers, r, vn + 1, level - 1, out + width / 2);
+    free(q);
+    free(r);
 }
 
 
-static int
-_icfp_parser_read_identifier(struct _ParserState* context, FILE* file, struct _Token* token) {
+static struct _BigInt*
+bigint_from_digits(struct _Arena* arena, const uint8_t* digits, size_t n, uint32_t base) {
+    struct _RadixPowers powers;
+    _radix_powers_init(&powers, base);
+    struct _BigInt* num = bigint_alloc(arena, n / powers.chunk_digits + 2);
+    memset(num->limbs, 0, num->len * sizeof(uint32_t));
+    num->len = _radix_from_digits(&powers, digits, n, num->limbs);
+    _radix_powers_free(&powers);
+    return num;
+}
+
+
+static uint8_t*
+bigint_to_digits(struct _Arena* arena, const struct _BigInt* num, uint32_t base, size_t* count) {
+    struct _RadixPowers powers;
+    _radix_powers_init(&powers, base);
+    // find the level whose square exceeds num
+    size_t level = 0;
     for (;;) {
-        int c = fgetc(file);
-        if (c == EOF) {
-            return 0;
-        }
-        switch (c) {
-            case ' ':
-            case '\t':
-            case '\r':
-                context->colno += 1;
-                return 0;
-            case '\n':
-                context->lineno += 1;
-                context->colno = 1;
-                return 0;
-            case '(':
-            case ')':
-                ungetc(c, file);
-                return 0;
-            case 0x21 ... 0x27:
-            case 0x2a ... 0x7e:
-                if (token->len + 1 >= token->value_size) {
-                    fprintf(stderr, "%s:%d:%d: token is too long\n", context->filename, token->lineno, token->colno);
-                    return 1;
-                }
-                token->value[token->len++] = c;
-                token->value[token->len] = '\0';
-                context->colno += 1;
-                break;
-            default:
-                fprintf(stderr, "%s:%d:%d: invalid char %c\n", context->filename, context->lineno, context->colno, c);
-                return 1;
+        _radix_powers_extend(&powers, level + 1);
+        if (mag_cmp(num->limbs, num->len, powers.pw[level+1], powers.pwn[level+1]) < 0) {
+            break;
         }
+        level += 1;
+    }
+    size_t width = (size_t) powers.chunk_digits << (level + 1);
+    uint8_t* buf = (uint8_t*) arena_alloc(arena, width);
+    _radix_to_digits(&powers, num->limbs, num->len, level, buf);
+    _radix_powers_free(&powers);
+    uint8_t* p = buf;
+    while (p < buf + width - 1 && *p == 0) { ++p; }
+    *count = buf + width - p;
+    return p;
+}
+
+
+struct _SymbolList {
+    struct _Arena arena;
+    // the block strings are currently appended to
+    char* buf;
+    size_t bufsize;
+    size_t used;
+    const char** index;
+    size_t index_size;
+    size_t index_used;
+    // the length of the symbols interned, terminators included
+    size_t bytes;
+    // read only symbols interned first, so that pointers stay comparable
+    // with a list shared between threads
+    const struct _SymbolList* base;
+};
+
+
+static void
+symbol_list_init(struct _SymbolList* list) {
+    arena_init(&list->arena, _ArenaChunkSize);
+    list->buf = NULL;
+    list->bufsize = 0;
+    list->used = 0;
+    list->index_size = _SymbolIndexSizeMin;
+    list->index_used = 0;
+    list->bytes = 0;
+    list->index = (const char**) calloc(list->index_size, sizeof(const char*));
+    list->base = NULL;
+}
+
+
+static void
+symbol_list_reset(struct _SymbolList* list) {
+    arena_free(&list->arena);
+    list->buf = NULL;
+    list->bufsize = 0;
+    list->used = 0;
+    list->index_used = 0;
+    list->bytes = 0;
+    memset(list->index, 0, list->index_size * sizeof(const char*));
+}
+
+
+static void
+_symbol_list_new_block(struct _SymbolList* list, size_t need) {
+    size_t size = need > _SymbolBlockSize ? need : _SymbolBlockSize;
+    list->buf = (char*) arena_alloc(&list->arena, size);
+    list->bufsize = size;
+    list->used = 0;
+}
+
+
+static void
+symbol_list_free(struct _SymbolList* list) {
+    arena_free(&list->arena);
+    free(list->index);
+    list->index = NULL;
+}
+
+
+static char*
+symbol_list_push(struct _SymbolList* list, const char* value) {
+    size_t n = strlen(value);
+    if (list->used + n + 1 > list->bufsize) {
+        _symbol_list_new_block(list, n + 1);
     }
+    char* res = (char*) memcpy(&list->buf[list->used], value, n + 1);
+    list->used += n + 1;
+    return res;
 }
 
 
 static int
-_icfp_parser_parse_number(const char* p, struct _Number* value) {
-    int state = 0;
-    number_init(value);
-    int sign = 1;
-    char c = *p;
-    for (; c != '\0'; c = *++p) {
-        switch (state) {
-            case 0:
-                switch (c) {
-                    case '0':
-                        state = 5;
-                        break;
-                    case '-':
-                        sign = -1;
-                        state = 1;
-                        break;
-                    case '1' ... '9':
-                        switch (c) {
-                            case '1': number_add(value, 1); break;
-                            case '2': number_add(value, 2); break;
-                            case '3': number_add(value, 3); break;
-                            case '4': number_add(value, 4); break;
-                            case '5': number_add(value, 5); break;
-                            case '6': number_add(value, 6); break;
-                            case '7': number_add(value, 7); break;
-                            case '8': number_add(value, 8); break;
-                            case '9': number_add(value, 9); break;
-                        }
-                        state = 10;
-                        break;
-                    default:
-                        return 1;
-                }
-                break;
-            case 1:
-                switch (c) {
-                    case '0':
-                        state = 5;
-                        break;
-                    case '1' ... '9':
-                        switch (c) {
-                            case '1': number_add(value, 1); break;
-                            case '2': number_add(value, 2); break;
-                            case '3': number_add(value, 3); break;
-                            case '4': number_add(value, 4); break;
-                            case '5': number_add(value, 5); break;
-                            case '6': number_add(value, 6); break;
-                            case '7': number_add(value, 7); break;
-                            case '8': number_add(value, 8); break;
-                            case '9': number_add(value, 9); break;
-                        }
-                        state = 10;
-                        break;
-                    default:
-                        return 1;
-                }
-                break;
-            case 5:
-                switch (c) {
-                    case 'x':
-                        state = 20;
-                        break;
-                    default:
-                        return 1;
-                }
-                break;
-            case 10:
-                switch (c) {
-                    case '0': number_mul(value, 10); number_add(value, 0); break;
-                    case '1': number_mul(value, 10); number_add(value, 1); break;
-                    case '2': number_mul(value, 10); number_add(value, 2); break;
-                    case '3': number_mul(value, 10); number_add(value, 3); break;
-                    case '4': number_mul(value, 10); number_add(value, 4); break;
-                    case '5': number_mul(value, 10); number_add(value, 5); break;
-                    case '6': number_mul(value, 10); number_add(value, 6); break;
-                    case '7': number_mul(value, 10); number_add(value, 7); break;
-                    case '8': number_mul(value, 10); number_add(value, 8); break;
-                    case '9': number_mul(value, 10); number_add(value, 9); break;
-                    default:
-                        return 1;
-                }
-                break;
-            case 16:
-                switch (c) {
-                    case '0': number_mul(value, 16); number_add(value, 0); break;
-                    case '1': number_mul(value, 16); number_add(value, 1); break;
-                    case '2': number_mul(value, 16); number_add(value, 2); break;
-                    case '3': number_mul(value, 16); number_add(value, 3); break;
-                    case '4': number_mul(value, 16); number_add(value, 4); break;
-                    case '5': number_mul(value, 16); number_add(value, 5); break;
-                    case '6': number_mul(value, 16); number_add(value, 6); break;
-                    case '7': number_mul(value, 16); number_add(value, 7); break;
-                    case '8': number_mul(value, 16); number_add(value, 8); break;
-                    case '9': number_mul(value, 16); number_add(value, 9); break;
-                    case 'A': number_mul(value, 16); number_add(value, 10); break;
-                    case 'B': number_mul(value, 16); number_add(value, 11); break;
-                    case 'C': number_mul(value, 16); number_add(value, 12); break;
-                    case 'D': number_mul(value, 16); number_add(value, 13); break;
-                    case 'E': number_mul(value, 16); number_add(value, 14); break;
-                    case 'F': number_mul(value, 16); number_add(value, 15); break;
-                    case 'a': number_mul(value, 16); number_add(value, 10); break;
-                    case 'b': number_mul(value, 16); number_add(value, 11); break;
-                    case 'c': number_mul(value, 16); number_add(value, 12); break;
-                    case 'd': number_mul(value, 16); number_add(value, 13); break;
-                    case 'e': number_mul(value, 16); number_add(value, 14); break;
-                    case 'f': number_mul(value, 16); number_add(value, 15); break;
-                    default:
-                        return 1;
-                }
-                break;
-            case 20:
-                switch (c) {
-                    case '0':
-                        state = 25;
-                        break;
-                    case '1' ... '9':
-                    case 'A' ... 'F':
-                    case 'a' ... 'f':
-                        switch (c) {
-                            case '0': number_add(value, 0); break;
-                            case '1': number_add(value, 1); break;
-                            case '2': number_add(value, 2); break;
-                            case '3': number_add(value, 3); break;
-                            case '4': number_add(value, 4); break;
-                            case '5': number_add(value, 5); break;
-                            case '6': number_add(value, 6); break;
-                            case '7': number_add(value, 7); break;
-                            case '8': number_add(value, 8); break;
-                            case '9': number_add(value, 9); break;
-                            case 'A': number_add(value, 10); break;
-                            case 'B': number_add(value, 11); break;
-                            case 'C': number_add(value, 12); break;
-                            case 'D': number_add(value, 13); break;
-                            case 'E': number_add(value, 14); break;
-                            case 'F': number_add(value, 15); break;
-                            case 'a': number_add(value, 10); break;
-                            case 'b': number_add(value, 11); break;
-                            case 'c': number_add(value, 12); break;
-                            case 'd': number_add(value, 13); break;
-                            case 'e': number_add(value, 14); break;
-                            case 'f': number_add(value, 15); break;
-                        }
-                        state = 16;
-                        break;
-                }
-                break;
-        }
-    }
-    switch (state) {
-        case 5:
-        case 25:
-            return 0;
-        case 10:
-        case 16:
-            number_mul(value, sign);
-            return 0;
-        default:
-            // fprintf(stderr, "%s:%d:%d: invalid number literal %s\n", context->filename, token->lineno, token->colno, token->value);
-            return 1;
+symbol_list_pop(struct _SymbolList* list, char* value) {
+    size_t n = strlen(value);
+    if (list->used < n + 1 || &list->buf[list->used - (n + 1)] != value) {
+        return 1;
     }
+    list->used -= n + 1;
+    return 0;
 }
 
 
-static const char* _symbols128[128];
-static const char* _symbols_tok[32];
-
-static void
-_icfp_parser_init_symbols(struct _ParserState* context) {
-    struct _SymbolList* list = &context->symbols;
-    _symbols128[0] = NULL;
-    char s[2] = "_";
-    for (int c = 1; c < 128; ++c) {
-        s[0] = c;
-        char* p = symbol_list_push(list, s);
-        _symbols128[c] = p;
+// Appends value to dest, the most recently pushed string. dest moves to a
+// new block when the current one is full, so use the returned pointer.
+static char*
+symbol_list_concat(struct _SymbolList* list, char* dest, char* value) {
+    if (dest < list->buf || dest >= list->buf + list->used) {
+        abort();
+    }
+    size_t len = list->buf + list->used - 1 - dest;
+    size_t n = strlen(value);
+    if (list->used + n > list->bufsize) {
+        // grow geometrically so a long string is copied O(1) times per byte
+        _symbol_list_new_block(list, 2 * (len + n + 1));
+        memcpy(list->buf, dest, len);
+        list->used = len + 1;
+        dest = list->buf;
     }
-    _symbols_tok[_TokenType_bool_false] = symbol_list_push(list, "false");
-    _symbols_tok[_TokenType_bool_true] = symbol_list_push(list, "true");
+    memcpy(&list->buf[list->used - 1], value, n + 1);
+    list->used += n;
+    return dest;
 }
 
 
-static void
-symbolicate_token(struct _ParserState* context, struct _Token* token) {
-    switch (token->type) {
-        case _TokenType_bool_false:
-        case _TokenType_bool_true:
-            token->value = (char*) _symbols_tok[token->type];
-            break;
-        case _TokenType_invalid:
-        case _TokenType_eof:
-            break;
-        case _TokenType_open_paren:
-        case _TokenType_close_paren:
-        case _TokenType_identifier:
-        case _TokenType_number:
-        case _TokenType_str:
-        case _TokenType_str_start:
-        case _TokenType_str_data:
-        case _TokenType_str_end:
-            switch (token->len) {
-                case 0:
-                    break;
-                case 1: {
-                    int c = token->value[0];
-                    if (c > 127) {
-                        fprintf(stderr, "%s:%d:%d: invalid token %c\n", context->filename, token->lineno, token->colno, c);
-                        abort();
-                    }
-                    token->value = (char*) _symbols128[c];
-                    break;
-                }
-                default:
-                    token->value = symbol_list_push(&context->symbols, token->value);
-                    break;
-            }
+static uint64_t
+_symbol_hash(const char* s) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (; *s != '\0'; ++s) {
+        h = (h ^ (uint8_t) *s) * 0x100000001b3ull;
     }
+    return h;
 }
 
 
-static int
-_icfp_parser_tokenize(struct _ParserState* context, FILE* file, struct _Token* token) {
-    token_init(token, context->token_bufsize, context->token_buf);
-    for (;;) {
-        token->lineno = context->lineno;
-        token->colno = context->colno;
-        int c = fgetc(file);
-        if (c == EOF) {
-            token->type = _TokenType_eof;
-            return 0;
-        }
-        switch (c) {
-            case ' ':
-            case '\t':
-            case '\r':
-                context->colno += 1;
-                break;
-            case '\n':
-                context->lineno += 1;
-                context->colno = 1;
-                break;
-            case '(':
-                token->type = _TokenType_open_paren;
-                token->value = (char*) _symbols128[c];
-                token->len = 1;
-                context->colno += 1;
-                return 0;
-            case ')':
-                token->type = _TokenType_close_paren;
-                token->value = (char*) _symbols128[c];
-                token->len = 1;
-                context->colno += 1;
-                return 0;
-            case '"': {
-                context->colno += 1;
-                int res = _icfp_parser_read_str_data(context, file, token);
-                if (res != 0) { return res; }
-                symbolicate_token(context, token);
-                if (token->type == _TokenType_str_end) {
-                    token->type = _TokenType_str;
-                    return 0;
-                }
-                struct _Token temp;
-                token_init(&temp, context->token_bufsize, context->token_buf);
-                for (;;) {
-                    temp.lineno = context->lineno;
-                    temp.colno = context->colno;
-                    int res = _icfp_parser_read_str_data(context, file, &temp);
-                    if (res != 0) { return res; }
-                    token->value = symbol_list_concat(&context->symbols, token->value, temp.value);
-                    token->len += temp.len;
-                    if (temp.type == _TokenType_str_end) {
-                        break;
-                    }
-                }
-                token->type = _TokenType_str;
-                return 0;
-            }
-            case '{': {
-                context->colno += 1;
-                int res = _icfp_parser_skip_comment(context, file, token);
-                if (res != 0) { return res; }
-                break;
-            }
-            case 0x21:
-            case 0x23 ... 0x27:
-            case 0x2a ... 0x7a:
-            case 0x7c:
-            case 0x7e: {
-                token->value[token->len++] = c;
-                token->value[token->len] = '\0';
-                token->type = _TokenType_identifier;
-                context->colno += 1;
-                int res = _icfp_parser_read_identifier(context, file, token);
-                if (res != 0) { return res; }
-
-                if (strcmp(token->value, "false") == 0) {
-                    token->type = _TokenType_bool_false;
-                }
-                else if (strcmp(token->value, "true") == 0) {
-                    token->type = _TokenType_bool_true;
-                }
-                else {
-                    struct _Number num;
-                    res = _icfp_parser_parse_number(token->value, &num);
-                    if (res == 0) {
-                        token->type = _TokenType_number;
-                    }
-                }
-                symbolicate_token(context, token);
-                return 0;
-            }
-            default:
-                fprintf(stderr, "%s:%d:%d: invalid char %c\n", context->filename, context->lineno, context->colno, c);
-                return 1;
+static const char**
+_symbol_list_find(const struct _SymbolList* list, const char* value) {
+    size_t mask = list->index_size - 1;
+    size_t i = _symbol_hash(value) & mask;
+    for (;; i = (i + 1) & mask) {
+        const char** slot = &list->index[i];
+        if (*slot == NULL || strcmp(*slot, value) == 0) {
+            return slot;
         }
     }
 }
 
 
-static int
-_icfp_write_str_data(const char* s, FILE* file) {
-    char c = *s;
-    int res = 0;
-    for (; c != '\0'; c = *++s) {
-        switch (c) {
-            case 'a': res = fputc('!', file); break;
-            case 'b': res = fputc('"', file); break;
-            case 'c': res = fputc('#', file); break;
-            case 'd': res = fputc('$', file); break;
-            case 'e': res = fputc('%', file); break;
-            case 'f': res = fputc('&', file); break;
-            case 'g': res = fputc('\'', file); break;
-            case 'h': res = fputc('(', file); break;
-            case 'i': res = fputc(')', file); break;
-            case 'j': res = fputc('*', file); break;
-            case 'k': res = fputc('+', file); break;
-            case 'l': res = fputc(',', file); break;
-            case 'm': res = fputc('-', file); break;
-            case 'n': res = fputc('.', file); break;
-            case 'o': res = fputc('/', file); break;
-            case 'p': res = fputc('0', file); break;
-            case 'q': res = fputc('1', file); break;
-            case 'r': res = fputc('2', file); break;
-            case 's': res = fputc('3', file); break;
-            case 't': res = fputc('4', file); break;
-            case 'u': res = fputc('5', file); break;
-            case 'v': res = fputc('6', file); break;
-            case 'w': res = fputc('7', file); break;
-            case 'x': res = fputc('8', file); break;
-            case 'y': res = fputc('9', file); break;
-            case 'z': res = fputc(':', file); break;
-            case 'A': res = fputc(';', file); break;
-            case 'B': res = fputc('<', file); break;
-            case 'C': res = fputc('=', file); break;
-            case 'D': res = fputc('>', file); break;
-            case 'E': res = fputc('?', file); break;
-            case 'F': res = fputc('@', file); break;
-            case 'G': res = fputc('A', file); break;
-            case 'H': res = fputc('B', file); break;
-            case 'I': res = fputc('C', file); break;
-            case 'J': res = fputc('D', file); break;
-            case 'K': res = fputc('E', file); break;
-            case 'L': res = fputc('F', file); break;
-            case 'M': res = fputc('G', file); break;
-            case 'N': res = fputc('H', file); break;
-            case 'O': res = fputc('I', file); break;
-            case 'P': res = fputc('J', file); break;
-            case 'Q': res = fputc('K', file); break;
-            case 'R': res = fputc('L', file); break;
-            case 'S': res = fputc('M', file); break;
-            case 'T': res = fputc('N', file); break;
-            case 'U': res = fputc('O', file); break;
-            case 'V': res = fputc('P', file); break;
-            case 'W': res = fputc('Q', file); break;
-            case 'X': res = fputc('R', file); break;
-            case 'Y': res = fputc('S', file); break;
-            case 'Z': res = fputc('T', file); break;
-            case '0': res = fputc('U', file); break;
-            case '1': res = fputc('V', file); break;
-            case '2': res = fputc('W', file); break;
-            case '3': res = fputc('X', file); break;
-            case '4': res = fputc('Y', file); break;
-            case '5': res = fputc('Z', file); break;
-            case '6': res = fputc('[', file); break;
-            case '7': res = fputc('\\', file); break;
-            case '8': res = fputc(']', file); break;
-            case '9': res = fputc('^', file); break;
-            case '!': res = fputc('_', file); break;
-            case '"': res = fputc('`', file); break;
-            case '#': res = fputc('a', file); break;
-            case '$': res = fputc('b', file); break;
-            case '%': res = fputc('c', file); break;
-            case '&': res = fputc('d', file); break;
-            case '\'': res = fputc('e', file); break;
-            case '(': res = fputc('f', file); break;
-            case ')': res = fputc('g', file); break;
-            case '*': res = fputc('h', file); break;
-            case '+': res = fputc('i', file); break;
-            case ',': res = fputc('j', file); break;
-            case '-': res = fputc('k', file); break;
-            case '.': res = fputc('l', file); break;
-            case '/': res = fputc('m', file); break;
-            case ':': res = fputc('n', file); break;
-            case ';': res = fputc('o', file); break;
-            case '<': res = fputc('p', file); break;
-            case '=': res = fputc('q', file); break;
-            case '>': res = fputc('r', file); break;
-            case '?': res = fputc('s', file); break;
-            case '@': res = fputc('t', file); break;
-            case '[': res = fputc('u', file); break;
-            case '\\': res = fputc('v', file); break;
-            case ']': res = fputc('w', file); break;
-            case '^': res = fputc('x', file); break;
-            case '_': res = fputc('y', file); break;
-            case '`': res = fputc('z', file); break;
-            case '|': res = fputc('{', file); break;
-            case '~': res = fputc('|', file); break;
-            case ' ': res = fputc('}', file); break;
-            case '\n': res = fputc('~', file); break;
-            default:
-                fprintf(stderr, "! invalid char in string literal %c\n", c);
-                abort();
-        }
-        if (res == EOF) {
-            perror(NULL);
-            return 1;
+static void
+_symbol_list_reserve(struct _SymbolList* list) {
+    if ((list->index_used + 1) * 4 < list->index_size * 3) {
+        return;
+    }
+    const char** index = list->index;
+    size_t index_size = list->index_size;
+    list->index_size *= 2;
+    list->index = (const char**) calloc(list->index_size, sizeof(const char*));
+    for (size_t i = 0; i < index_size; ++i) {
+        if (index[i] != NULL) {
+            *_symbol_list_find(list, index[i]) = index[i];
         }
     }
-    return 0;
+    free(index);
 }
 
 
-static int
-_icfp_write_str_start(const char* s, FILE* file) {
-    int res = fputc('S', file);
-    if (res == EOF) {
-        perror(NULL);
-        return 1;
+static char*
+symbol_list_intern(struct _SymbolList* list, const char* value) {
+    if (list->base != NULL) {
+        const char* s = *_symbol_list_find(list->base, value);
+        if (s != NULL) {
+            return (char*) s;
+        }
     }
-    return _icfp_write_str_data(s, file);
-}
-
-
-static int
-_icfp_write_str_end(const char* s, FILE* file) {
-    return _icfp_write_str_data(s, file);
-}
-
-
-static int
-_icfp_write_str(const char* s, FILE* file) {
-    return _icfp_write_str_start(s, file);
-}
-
-
-static int
-_icfp_write_bool(enum _TokenType value, FILE* file) {
-    int res;
-    switch (value) {
-        case _TokenType_bool_false:
-            res = fputc('F', file);
-            return res == EOF;
-        case _TokenType_bool_true:
-            res = fputc('T', file);
-            return res == EOF;
-        default:
-            abort();
+    _symbol_list_reserve(list);
+    const char** slot = _symbol_list_find(list, value);
+    if (*slot == NULL) {
+        *slot = symbol_list_push(list, value);
+        list->index_used += 1;
+        list->bytes += strlen(value) + 1;
     }
+    return (char*) *slot;
 }
 
 
-static int
-_icfp_write_number(struct _Number* num, FILE* file) {
-    int64_t x = num->value;
-    if (x == 0) {
-        int res = fputs("I!", file);
-        if (res == EOF) { perror(NULL); return 1; }
-        return 0;
+static char*
+symbol_list_intern_pushed(struct _SymbolList* list, char* value) {
+    if (list->base != NULL) {
+        const char* s = *_symbol_list_find(list->base, value);
+        if (s != NULL) {
+            symbol_list_pop(list, value);
+            return (char*) s;
+        }
     }
-
-    char buf[32];
-    size_t bufsize = sizeof(buf);
-    char* p = &buf[bufsize-1];
-    *p = '\0';
-
-    if (number_is_neg(num)) {
-        int res = fputs("U- ", file);
-        if (res == EOF) { perror(NULL); return 1; }
-        x = -x;
+    _symbol_list_reserve(list);
+    const char** slot = _symbol_list_find(list, value);
+    if (*slot == NULL) {
+        *slot = value;
+        list->index_used += 1;
+        list->bytes += strlen(value) + 1;
+        return value;
     }
-    for (; x != 0; x /= 94) {
-        int v = x % 94 + 33;
-        *--p = v;
+    if (*slot != value) {
+        symbol_list_pop(list, value);
     }
-    *--p = 'I';
-    int res = fputs(p, file);
-    if (res == EOF) { perror(NULL); return 1; }
-    return 0;
+    return (char*) *slot;
 }
 
 
-static int
-_icfp_write_expression(struct _WriterState* context, struct _Expr* expr, struct _NameTable* nametable);
-
-
-static int
-_icfp_write_resolved_name(struct _WriterState* context, struct _Name* name, struct _NameTable* nametable) {
-    struct _Expr* expr = name->expr;
-    if (expr == NULL) {
-        int res = fputc('v', context->file);
-        if (res == EOF) { perror(NULL); return 1; }
-        res = fputs(name->name, context->file);
-        if (res == EOF) { perror(NULL); return 1; }
-        return 0;
-    }
-    if (expr->type == _ExprType_identifier) {
-        int res = fputc('v', context->file);
-        if (res == EOF) { perror(NULL); return 1; }
-        res = fputs(expr->token.value, context->file);
-        if (res == EOF) { perror(NULL); return 1; }
-        return 0;
+// Interns value itself rather than a copy, for text that outlives the
+// list, such as a mapped image.
+static const char*
+symbol_list_intern_static(struct _SymbolList* list, const char* value) {
+    _symbol_list_reserve(list);
+    const char** slot = _symbol_list_find(list, value);
+    if (*slot == NULL) {
+        *slot = value;
+        list->index_used += 1;
+        list->bytes += strlen(value) + 1;
     }
-    int res = _icfp_write_expression(context, expr, nametable);
-    return res;
+    return *slot;
 }
 
 
-static int
-_icfp_write_expr_apply1(struct _WriterState* context, struct _Expr* expr, struct _NameTable* nametable) {
-    switch (expr->expr0->type) {
-        case _ExprType_identifier: {
-            struct _Token* token = &expr->expr0->token;
-            if (token->len == 1) {
-                char c = token->value[0];
+enum _TokenType {
+    _TokenType_invalid,
+    _TokenType_eof,
+    _TokenType_open_paren,
+    _TokenType_close_paren,
+    _TokenType_identifier,
+    _TokenType_bool_false,
+    _TokenType_bool_true,
+    _TokenType_number,
+    _TokenType_str,
+    _TokenType_str_start,
+    _TokenType_str_data,
+    _TokenType_str_end,
+};
+
+
+struct _Token {
+    enum _TokenType type;
+    int len;
+    size_t value_size;
+    char* value;
+    int lineno;
+    int colno;
+    // number literals are decoded once by the tokenizer
+    struct _Number num;
+    const char* encoded;
+};
+
+
+static void
+token_init(struct _Token* token, size_t bufsize, char* buf) {
+    token->type = _TokenType_invalid;
+    token->value = buf;
+    token->value_size = bufsize;
+    token->value[0] = '\0';
+    token->len = 0;
+    token->lineno = 0;
+    token->colno = 0;
+    number_init(&token->num);
+    token->encoded = NULL;
+}
+
+
+enum _ExprType {
+    _ExprType_invalid,
+    _ExprType_identifier,
+    _ExprType_literal,
+    _ExprType_apply1,
+    _ExprType_apply2,
+    _ExprType_apply3,
+    _ExprType_lambda,
+    _ExprType_define,
+    _ExprType_assert,
+};
+
+
+struct _Expr {
+    enum _ExprType type;
+    struct _Token token;
+    struct _Expr* expr0;
+    struct _Expr* expr1;
+    struct _Expr* expr2;
+    struct _Expr* expr3;
+    int lineno;
+    int colno;
+};
+
+
+static void
+expr_init(struct _Expr* expr) {
+    *expr = {};
+    expr->type = _ExprType_invalid;
+}
+
+
+struct _ExprTree {
+    struct _Arena arena;
+    size_t used;
+};
+
+
+static void
+expr_tree_init(struct _ExprTree* tree) {
+    arena_init(&tree->arena, _ArenaChunkSize);
+    tree->used = 0;
+}
+
+
+static void
+expr_tree_reset(struct _ExprTree* tree) {
+    arena_free(&tree->arena);
+    tree->used = 0;
+}
+
+
+static _Expr*
+expr_tree_push(struct _ExprTree* tree) {
+    _Expr* expr = (struct _Expr*) arena_alloc(&tree->arena, sizeof(struct _Expr));
+    tree->used += 1;
+    expr_init(expr);
+    return expr;
+}
+
+
+struct _Name {
+    const char* name;
+    int seqno;
+    const char* filename;
+    int lineno;
+    int colno;
+    struct _Expr* expr;
+    // variable number of a bound name while its scope is written
+    uint64_t var;
+    // the body of a define is only optimized once something reaches it
+    int lowered;
+    // a variable decoded ICFP leaves unbound, var is its number there
+    int free;
+};
+
+
+static void
+name_init(struct _Name* name, const char* s) {
+    *name = {};
+    name->name = s;
+}
+
+
+// Defines being expanded, innermost first. The chain lives on the stack of
+// whoever expands, so defines can be shared by threads.
+struct _Expanding {
+    const struct _Name* name;
+    const struct _Expanding* parent;
+};
+
+
+static int
+expanding_has(const struct _Expanding* expanding, const struct _Name* name) {
+    for (; expanding != NULL; expanding = expanding->parent) {
+        if (expanding->name == name) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+struct _NameList {
+    struct _Arena arena;
+    size_t used;
+};
+
+
+// A prelude image keeps the root scope's defines as they are in memory,
+// with pointers replaced by offsets into the image and strings by their
+// position in the string table at its end, counted from 1.
+struct _ImageHeader {
+    char magic[8];
+    uint64_t version;
+    // of the prelude sources the image was made from
+    uint64_t hash;
+    // of the whole image, with this field as 0
+    uint64_t checksum;
+    uint64_t size;
+    uint64_t expr_size;
+    uint64_t name_size;
+    uint64_t expr_count;
+    uint64_t name_count;
+    uint64_t string_count;
+    uint64_t exprs;
+    uint64_t names;
+    uint64_t numbers;
+    uint64_t strings;
+};
+
+
+static const char _ImageMagic[8] = {'I', 'C', 'F', 'P', 'I', 'M', 'G', '\0'};
+
+
+// A mapped image. The body of a define is only patched to point into
+// memory when the define is first looked up, so that a large prelude
+// costs little more than the defines an input uses.
+struct _Image {
+    char* base;
+    size_t size;
+    const char* path;
+    struct _ImageHeader header;
+    // the symbol of each string
+    const char** strings;
+    // a bit for each expression already patched
+    uint64_t* relocated;
+    struct _Expr** stack;
+};
+
+
+static void
+image_free(struct _Image* image) {
+    free(image->strings);
+    free(image->relocated);
+    free(image->stack);
+    munmap(image->base, image->size);
+    image->base = NULL;
+}
+
+
+// The offsets and string numbers of an image are all checked when it is
+// loaded, so they are turned into pointers as they are.
+static struct _Expr*
+_image_expr(const struct _Image* image, const struct _Expr* ref) {
+    uintptr_t off = (uintptr_t) ref;
+    return off == 0 ? NULL : (struct _Expr*) (image->base + off);
+}
+
+
+static const char*
+_image_symbol(const struct _Image* image, const char* ref) {
+    uintptr_t index = (uintptr_t) ref;
+    return index == 0 ? NULL : image->strings[index - 1];
+}
+
+
+static int
+_image_check_expr_ref(const struct _ImageHeader* header, const struct _Expr* ref) {
+    uintptr_t off = (uintptr_t) ref;
+    return off == 0 || (off >= header->exprs && off < header->names && (off - header->exprs) % sizeof(struct _Expr) == 0);
+}
+
+
+// Returns non-zero when a record of the image points outside of it or
+// holds a tag no expression can have.
+static int
+_image_check(const struct _Image* image) {
+    const struct _ImageHeader* header = &image->header;
+    const struct _Expr* exprs = (const struct _Expr*) (image->base + header->exprs);
+    for (uint64_t i = 0; i < header->expr_count; ++i) {
+        const struct _Expr* expr = &exprs[i];
+        // read as the ints they are stored as, which need not be valid
+        unsigned int type;
+        unsigned int token_type;
+        memcpy(&type, &expr->type, sizeof(type));
+        memcpy(&token_type, &expr->token.type, sizeof(token_type));
+        if (type > _ExprType_assert || token_type > _TokenType_str_end) {
+            return 1;
+        }
+        if (
+            !_image_check_expr_ref(header, expr->expr0) || !_image_check_expr_ref(header, expr->expr1) ||
+            !_image_check_expr_ref(header, expr->expr2) || !_image_check_expr_ref(header, expr->expr3) ||
+            (uintptr_t) expr->token.value > header->string_count ||
+            (uintptr_t) expr->token.encoded > header->string_count
+        ) {
+            return 1;
+        }
+        uintptr_t off = (uintptr_t) expr->token.num.big;
+        if (off != 0) {
+            if (off < header->numbers || off % 8 != 0 || off + sizeof(struct _BigInt) > header->strings) {
+                return 1;
+            }
+            const struct _BigInt* big = (const struct _BigInt*) (image->base + off);
+            if (big->len > (header->strings - off - sizeof(struct _BigInt)) / sizeof(uint32_t)) {
+                return 1;
+            }
+        }
+    }
+    const struct _Name* names = (const struct _Name*) (image->base + header->names);
+    for (uint64_t i = 0; i < header->name_count; ++i) {
+        uintptr_t index = (uintptr_t) names[i].name;
+        if (
+            index == 0 || index > header->string_count ||
+            (uintptr_t) names[i].filename > header->string_count ||
+            !_image_check_expr_ref(header, names[i].expr)
+        ) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// Marks expr as patched, unless it already is.
+static inline int
+_image_mark(struct _Image* image, const struct _Expr* expr) {
+    size_t i = expr - (const struct _Expr*) (image->base + image->header.exprs);
+    uint64_t bit = 1ull << (i % 64);
+    if ((image->relocated[i / 64] & bit) != 0) {
+        return 0;
+    }
+    image->relocated[i / 64] |= bit;
+    return 1;
+}
+
+
+static void
+_image_relocate(struct _Image* image, struct _Expr* expr) {
+    if (!_image_mark(image, expr)) {
+        return;
+    }
+    const struct _ImageHeader* header = &image->header;
+    if (image->stack == NULL) {
+        image->stack = (struct _Expr**) malloc(header->expr_count * sizeof(struct _Expr*));
+    }
+    // every expression is pushed once, when it is marked
+    size_t used = 0;
+    image->stack[used++] = expr;
+    while (used > 0) {
+        expr = image->stack[--used];
+        struct _Expr** children[4] = {&expr->expr0, &expr->expr1, &expr->expr2, &expr->expr3};
+        for (int k = 0; k < 4; ++k) {
+            *children[k] = _image_expr(image, *children[k]);
+            if (*children[k] != NULL && _image_mark(image, *children[k])) {
+                image->stack[used++] = *children[k];
+            }
+        }
+        expr->token.value = (char*) _image_symbol(image, expr->token.value);
+        expr->token.encoded = _image_symbol(image, expr->token.encoded);
+        uintptr_t off = (uintptr_t) expr->token.num.big;
+        if (off != 0) {
+            struct _BigInt* big = (struct _BigInt*) (image->base + off);
+            big->limbs = (uint32_t*) (big + 1);
+            expr->token.num.big = big;
+        }
+    }
+}
+
+
+// Patches the body of a define read from an image, once.
+static inline void
+image_relocate_name(struct _Image* image, struct _Name* name) {
+    const char* p = (const char*) name->expr;
+    if (p >= image->base + image->header.exprs && p < image->base + image->header.names) {
+        _image_relocate(image, name->expr);
+    }
+}
+
+
+// Patches every define up front, for an image that threads will share.
+static void
+image_relocate_all(struct _Image* image) {
+    struct _Name* names = (struct _Name*) (image->base + image->header.names);
+    for (uint64_t i = 0; i < image->header.name_count; ++i) {
+        image_relocate_name(image, &names[i]);
+    }
+}
+
+
+struct _NameTableList;
+
+struct _NameTable {
+    struct _NameTable* parent;
+    // the root scope does open addressing on the interned name pointer,
+    // lambda scopes keep their few bindings inline in frame
+    struct _Name** names;
+    size_t names_size;
+    size_t used;
+    struct _NameTableList* table_storage;
+    struct _NameList* name_storage;
+    // the image the defines of a root scope were read from
+    struct _Image* image;
+    struct _Name frame[_NameFrameSize];
+};
+
+
+struct _NameTableList {
+    struct _Arena arena;
+    // released lambda scopes, linked through parent
+    struct _NameTable* free;
+    size_t used;
+    size_t peak;
+    size_t pushed;
+    // resolves started in these scopes, and the scopes they looked in
+    size_t lookups;
+    size_t lookup_depth;
+};
+
+
+static void
+name_list_init(struct _NameList* list) {
+    arena_init(&list->arena, _ArenaChunkSize);
+    list->used = 0;
+}
+
+
+static struct _Name*
+name_list_push(struct _NameList* list) {
+    list->used += 1;
+    return (struct _Name*) arena_alloc(&list->arena, sizeof(struct _Name));
+}
+
+
+static struct _Name**
+_name_table_alloc_slots(struct _NameTableList* list, size_t size) {
+    struct _Name** names = (struct _Name**) arena_alloc(&list->arena, size * sizeof(struct _Name*));
+    memset(names, 0, size * sizeof(struct _Name*));
+    return names;
+}
+
+
+static struct _NameTable*
+name_table_list_push(struct _NameTableList* list) {
+    struct _NameTable* table = list->free;
+    if (table != NULL) {
+        list->free = table->parent;
+    }
+    else {
+        table = (struct _NameTable*) arena_alloc(&list->arena, sizeof(struct _NameTable));
+    }
+    list->used += 1;
+    list->pushed += 1;
+    if (list->used > list->peak) {
+        list->peak = list->used;
+    }
+    table->parent = NULL;
+    table->names = NULL;
+    table->names_size = 0;
+    table->used = 0;
+    table->table_storage = list;
+    table->name_storage = NULL;
+    table->image = NULL;
+    return table;
+}
+
+
+static struct _NameTable*
+name_table_list_init(struct _NameTableList* list) {
+    arena_init(&list->arena, _ArenaChunkSize);
+    list->free = NULL;
+    list->used = 0;
+    list->peak = 0;
+    list->pushed = 0;
+    list->lookups = 0;
+    list->lookup_depth = 0;
+    struct _NameTable* table = name_table_list_push(list);
+    table->names = _name_table_alloc_slots(list, _NameTableSizeMin);
+    table->names_size = _NameTableSizeMin;
+    return table;
+}
+
+
+static struct _NameTable*
+name_table_add_child(struct _NameTable* table) {
+    struct _NameTable* child = name_table_list_push(table->table_storage);
+    child->parent = table;
+    return child;
+}
+
+
+// Returns a lambda scope to the free list once its body is written.
+static void
+name_table_release(struct _NameTable* table) {
+    struct _NameTableList* list = table->table_storage;
+    table->parent = list->free;
+    list->free = table;
+    list->used -= 1;
+}
+
+
+static struct _Name**
+_name_table_slot(struct _NameTable* table, const char* name) {
+    size_t mask = table->names_size - 1;
+    size_t i = (size_t) (((uint64_t) (uintptr_t) name * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+    for (;; i = (i + 1) & mask) {
+        struct _Name** slot = &table->names[i];
+        if (*slot == NULL || (*slot)->name == name) {
+            return slot;
+        }
+    }
+}
+
+
+static struct _Name*
+_name_table_find(struct _NameTable* table, const char* name) {
+    if (table->names != NULL) {
+        struct _Name* s = *_name_table_slot(table, name);
+        if (s != NULL && table->image != NULL) {
+            image_relocate_name(table->image, s);
+        }
+        return s;
+    }
+    for (size_t i = 0; i < table->used; ++i) {
+        if (table->frame[i].name == name) {
+            return &table->frame[i];
+        }
+    }
+    return NULL;
+}
+
+
+static void
+_name_table_grow(struct _NameTable* table) {
+    struct _Name** names = table->names;
+    size_t names_size = table->names_size;
+    table->names_size *= 2;
+    table->names = _name_table_alloc_slots(table->table_storage, table->names_size);
+    for (size_t i = 0; i < names_size; ++i) {
+        if (names[i] != NULL) {
+            *_name_table_slot(table, names[i]->name) = names[i];
+        }
+    }
+}
+
+
+static struct _Name*
+name_table_put(struct _NameTable* table, const char* name, struct _Expr* expr) {
+    struct _Name* s;
+    if (table->names == NULL) {
+        s = _name_table_find(table, name);
+        if (s != NULL) {
+            return s;
+        }
+        if (table->used >= _NameFrameSize) {
+            fprintf(_icfp_stderr, "! too many bindings in a lambda scope\n");
+            abort();
+        }
+        s = &table->frame[table->used++];
+    }
+    else {
+        if ((table->used + 1) * 4 >= table->names_size * 3) {
+            _name_table_grow(table);
+        }
+        struct _Name** slot = _name_table_slot(table, name);
+        if (*slot != NULL) {
+            return *slot;
+        }
+        s = name_list_push(table->name_storage);
+        *slot = s;
+        table->used += 1;
+    }
+    name_init(s, name);
+    s->expr = expr;
+    return s;
+}
+
+
+// Binds a name kept elsewhere, such as in a mapped image, in the root scope.
+static void
+name_table_put_name(struct _NameTable* table, struct _Name* name) {
+    if ((table->used + 1) * 4 >= table->names_size * 3) {
+        _name_table_grow(table);
+    }
+    struct _Name** slot = _name_table_slot(table, name->name);
+    if (*slot == NULL) {
+        table->used += 1;
+    }
+    *slot = name;
+}
+
+
+static int
+_name_table_resolve(struct _NameTable* table, struct _Token* token, struct _Name** resolved, size_t* depth) {
+    *depth += 1;
+    struct _Name* s = _name_table_find(table, token->value);
+    if (s != NULL) {
+        if (s->expr == NULL) {
+            *resolved = s;
+            return 0;
+        }
+        if (s->expr->type == _ExprType_identifier) {
+            int res = _name_table_resolve(table, &s->expr->token, resolved, depth);
+            if (res == 0) { return 0; }
+        }
+        *resolved = s;
+        return 0;
+    }
+    table = table->parent;
+    if (table != NULL) {
+        return _name_table_resolve(table, token, resolved, depth);
+    }
+    fprintf(_icfp_stderr, ":%d:%d: use of undeclared name %s\n", token->lineno, token->colno, token->value);
+    return 1;
+}
+
+
+// Counts go to the scopes the lookup starts in; the parents may be a
+// prelude's, shared by other threads.
+static int
+name_table_resolve(struct _NameTable* table, struct _Token* token, struct _Name** resolved) {
+    struct _NameTableList* list = table->table_storage;
+    size_t depth = 0;
+    int res = _name_table_resolve(table, token, resolved, &depth);
+    list->lookups += 1;
+    list->lookup_depth += depth;
+    return res;
+}
+
+
+static uint64_t
+_clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+// Wall and CPU times at the start of a phase, and what it took once ended.
+struct _StatsTimer {
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+};
+
+
+static void
+stats_timer_start(struct _StatsTimer* timer) {
+    timer->wall_ns = _clock_ns(CLOCK_MONOTONIC);
+    timer->cpu_ns = _clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+
+static void
+stats_timer_stop(struct _StatsTimer* timer) {
+    timer->wall_ns = _clock_ns(CLOCK_MONOTONIC) - timer->wall_ns;
+    timer->cpu_ns = _clock_ns(CLOCK_PROCESS_CPUTIME_ID) - timer->cpu_ns;
+}
+
+
+struct _ParserState {
+    int out_asserts;
+    int optimize;
+    int share;
+    // only defines are expected, for a prelude shared by later inputs
+    int prelude;
+    int verbose;
+    const char* filename;
+    int lineno;
+    int colno;
+    struct _SymbolList symbols;
+    size_t token_bufsize;
+    char* token_buf;
+    struct _Arena numbers;
+    struct _ExprTree expr_tree;
+    struct _NameList name_list;
+    size_t folds;
+    size_t inlines;
+    size_t lowered;
+    size_t shares;
+    size_t knots;
+    size_t tokens;
+    // time spent in each pass over top-level expressions, under --stats
+    int stats;
+    uint64_t parse_ns;
+    uint64_t optimize_ns;
+    uint64_t write_ns;
+};
+
+
+struct _OutBuf {
+    char* data;
+    size_t size;
+    size_t used;
+    // bytes flushed so far
+    size_t written;
+};
+
+
+static void
+outbuf_init(struct _OutBuf* buf) {
+    buf->data = NULL;
+    buf->size = 0;
+    buf->used = 0;
+    buf->written = 0;
+}
+
+
+static void
+outbuf_free(struct _OutBuf* buf) {
+    free(buf->data);
+    outbuf_init(buf);
+}
+
+
+static void
+_outbuf_grow(struct _OutBuf* buf, size_t need) {
+    size_t size = buf->size > 0 ? buf->size : _OutBufSizeMin;
+    while (size < buf->used + need) {
+        size *= 2;
+    }
+    char* data = (char*) realloc(buf->data, size);
+    if (data == NULL) {
+        fprintf(_icfp_stderr, "! out of memory allocating %zu bytes\n", size);
+        abort();
+    }
+    buf->data = data;
+    buf->size = size;
+}
+
+
+static inline char*
+outbuf_reserve(struct _OutBuf* buf, size_t need) {
+    if (buf->used + need > buf->size) {
+        _outbuf_grow(buf, need);
+    }
+    return buf->data + buf->used;
+}
+
+
+static inline void
+outbuf_putc(struct _OutBuf* buf, char c) {
+    *outbuf_reserve(buf, 1) = c;
+    buf->used += 1;
+}
+
+
+static inline void
+outbuf_write(struct _OutBuf* buf, const char* s, size_t n) {
+    memcpy(outbuf_reserve(buf, n), s, n);
+    buf->used += n;
+}
+
+
+static inline void
+outbuf_puts(struct _OutBuf* buf, const char* s) {
+    outbuf_write(buf, s, strlen(s));
+}
+
+
+static int
+outbuf_flush(struct _OutBuf* buf, FILE* file) {
+    size_t used = buf->used;
+    buf->used = 0;
+    buf->written += used;
+    if (used > 0 && fwrite(buf->data, 1, used, file) != used) {
+        perror(NULL);
+        return 1;
+    }
+    return 0;
+}
+
+
+struct _EvalState;
+
+// Where the writer expanded a define into the output, for -B to charge the
+// reductions of its lambdas to it.
+struct _WriteSpan {
+    size_t start;
+    size_t end;
+    const char* name;
+};
+
+// The numbering of a C++ program being written for -C: every term but a
+// variable gets an id its function, thunk or static value is named by.
+struct _CppWriter {
+    struct _OutBuf* out;
+    // what the function being written names its environment, NULL in the
+    // functions of whole programs
+    const char* env;
+    size_t ids;
+    size_t temps;
+    size_t indent;
+    size_t runs;
+};
+
+struct _WriterState {
+    FILE* file;
+    int out_format;
+    int out_shared;
+    const char* filename;
+    int verbose;
+    struct _NameTableList nametable_list;
+    struct _NameTable* nametable;
+    struct _EvalState* eval;
+    struct _OutBuf out;
+    struct _Name** defines;
+    size_t defines_size;
+    size_t defines_used;
+    size_t defines_pending;
+    // binders enclosing the expression being written
+    uint64_t var_depth;
+    const struct _Expanding* expanding;
+    // whether applications of known lambdas pick B! or B~ by the body
+    int strict;
+    size_t strict_applies;
+    size_t lazy_applies;
+    // defines expanded into the expression being written, when budgeted
+    int spans_on;
+    struct _WriteSpan* spans;
+    size_t spans_size;
+    size_t spans_used;
+    struct _CppWriter cpp;
+};
+
+
+static int
+icfp_writer_init(struct _WriterState* context, FILE* file, int oformat) {
+    context->file = file;
+    context->out_format = oformat;
+    context->out_shared = 0;
+    outbuf_init(&context->out);
+    context->defines = NULL;
+    context->defines_size = 0;
+    context->defines_used = 0;
+    context->defines_pending = 0;
+    context->var_depth = 0;
+    context->expanding = NULL;
+    context->strict = 0;
+    context->strict_applies = 0;
+    context->lazy_applies = 0;
+    context->spans_on = 0;
+    context->spans = NULL;
+    context->spans_size = 0;
+    context->spans_used = 0;
+    context->cpp = {};
+    return 0;
+}
+
+struct _Reader {
+    const char* p;
+    const char* end;
+    FILE* file;
+    char* buf;
+    size_t bufsize;
+    void* map;
+    size_t map_size;
+};
+
+
+static int
+reader_init(struct _Reader* reader, FILE* file) {
+    *reader = {};
+    reader->file = file;
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode)) {
+        if (st.st_size == 0) {
+            return 0;
+        }
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            reader->map = map;
+            reader->map_size = st.st_size;
+            reader->p = (const char*) map;
+            reader->end = reader->p + st.st_size;
+            return 0;
+        }
+    }
+    reader->bufsize = _ReaderBufSize;
+    reader->buf = (char*) malloc(reader->bufsize);
+    if (reader->buf == NULL) {
+        perror(NULL);
+        return 1;
+    }
+    return 0;
+}
+
+
+// Reads text already in memory, which must outlive the reader.
+static void
+reader_init_text(struct _Reader* reader, const char* text, size_t size) {
+    *reader = {};
+    reader->p = text;
+    reader->end = text + size;
+}
+
+
+static void
+reader_close(struct _Reader* reader) {
+    if (reader->map != NULL) {
+        munmap(reader->map, reader->map_size);
+    }
+    free(reader->buf);
+    *reader = {};
+}
+
+
+static int
+_reader_refill(struct _Reader* reader) {
+    if (reader->buf == NULL) {
+        return EOF;
+    }
+    size_t n = fread(reader->buf, 1, reader->bufsize, reader->file);
+    if (n == 0) {
+        return EOF;
+    }
+    reader->p = reader->buf;
+    reader->end = reader->buf + n;
+    return (uint8_t) *reader->p++;
+}
+
+
+static inline int
+reader_getc(struct _Reader* reader) {
+    if (reader->p < reader->end) {
+        return (uint8_t) *reader->p++;
+    }
+    return _reader_refill(reader);
+}
+
+
+static inline void
+reader_ungetc(struct _Reader* reader) {
+    reader->p -= 1;
+}
+
+
+static int
+reader_contents(struct _Reader* reader, const char** text, size_t* size) {
+    if (reader->buf == NULL) {
+        *text = reader->p;
+        *size = reader->end - reader->p;
+        return 0;
+    }
+    size_t used = reader->end - reader->p;
+    memmove(reader->buf, reader->p, used);
+    for (;;) {
+        if (used == reader->bufsize) {
+            reader->bufsize *= 2;
+            reader->buf = (char*) realloc(reader->buf, reader->bufsize);
+        }
+        size_t n = fread(reader->buf + used, 1, reader->bufsize - used, reader->file);
+        if (n == 0) { break; }
+        used += n;
+    }
+    if (ferror(reader->file)) {
+        perror(NULL);
+        return 1;
+    }
+    reader->p = reader->buf;
+    reader->end = reader->buf + used;
+    *text = reader->p;
+    *size = used;
+    return 0;
+}
+
+
+static int
+_icfp_parser_skip_comment(struct _ParserState* context, struct _Reader* reader, struct _Token* token) {
+    int state = 1;
+    int end_char = 0;
+    for (;;) {
+        int c = reader_getc(reader);
+        if (c == EOF) {
+            fprintf(_icfp_stderr, "%s:%d:%d: unterminated comment\n", context->filename, token->lineno, token->colno);
+            return 1;
+        }
+        switch (c) {
+            case '\n':
+                context->lineno += 1;
+                context->colno = 1;
+                break;
+            default:
+                context->colno += 1;
+                break;
+        }
+        switch (state) {
+            case 1:
+                switch (c) {
+                    case '(':
+                        end_char = ')';
+                        state = 5;
+                        break;
+                    case '{':
+                        end_char = '}';
+                        state = 5;
+                        break;
+                    case '<':
+                        end_char = '>';
+                        state = 5;
+                        break;
+                    case '[':
+                        end_char = ']';
+                        state = 5;
+                        break;
+                    case '!': case '"': case '#': case '$': case '%': case '&': case '\'':
+                    case '*': case '+': case '-': case '/': case ':': case ';': case '=':
+                    case '?': case '@': case '^': case '`': case '|': case '~':
+                        end_char = c;
+                        state = 5;
+                        break;
+                    default:
+                        state = 2;
+                        break;
+                }
+                break;
+            case 2:
+                if (c == '}') {
+                    return 0;
+                }
+                break;
+            case 5:
+                if (c == end_char) {
+                    state = 6;
+                }
+                break;
+            case 6:
+                if (c == '}') {
+                    return 0;
+                }
+                else if (c != end_char) {
+                    state = 5;
+                }
+                break;
+        }
+    }
+}
+
+
+static int
+_icfp_parser_read_str_data(struct _ParserState* context, struct _Reader* reader, struct _Token* token) {
+    int state = 0;
+    for (;;) {
+        int c = reader_getc(reader);
+        if (c == EOF) {
+            fprintf(_icfp_stderr, "%s:%d:%d: unexpected EOF\n", context->filename, context->lineno, context->colno);
+            return -1;
+        }
+        switch (state) {
+            case 0:
+                switch (c) {
+                    case '"':
+                        if (token->len >= token->value_size) {
+                            abort();
+                        }
+                        token->value[token->len] = '\0';
+                        token->type = _TokenType_str_end;
+                        context->colno += 1;
+                        return 0;
+                    case '\\':
+                        if (token->len + 1 >= token->value_size) {
+                            reader_ungetc(reader);
+                            token->value[token->len] = '\0';
+                            token->type = _TokenType_str_data;
+                            return 0;
+                        }
+                        state = 10;
+                        break;
+                    case 0x20:
+                    case 0x21:
+                    case 0x23 ... 0x5b:
+                    case 0x5d ... 0x7a:
+                    case 0x7c:
+                    case 0x7e:
+                        if (token->len + 1 >= token->value_size) {
+                            reader_ungetc(reader);
+                            token->value[token->len] = '\0';
+                            return 0;
+                        }
+                        token->value[token->len++] = c;
+                        token->type = _TokenType_str_data;
+                        context->colno += 1;
+                        break;
+                    default:
+                        fprintf(_icfp_stderr, "%s:%d:%d: invalid string %c\n", context->filename, context->lineno, context->colno, c);
+                        return -1;
+                }
+                break;
+
+            case 10:
+                switch (c) {
+                    case '\\':
+                    case '"':
+                        token->value[token->len++] = c;
+                        token->type = _TokenType_str_data;
+                        context->colno += 2;
+                        state = 0;
+                        break;
+                    case 'n':
+                        token->value[token->len++] = '\n';
+                        token->type = _TokenType_str_data;
+                        context->colno += 2;
+                        state = 0;
+                        break;
+                    default:
+                        fprintf(_icfp_stderr, "%s:%d:%d: invalid escape %c\n", context->filename, context->lineno, context->colno, c);
+                        return -1;
+                }
+                break;
+        }
+    }
+    abort();
+}
+
+
+static int
+_icfp_parser_read_identifier(struct _ParserState* context, struct _Reader* reader, struct _Token* token) {
+    for (;;) {
+        int c = reader_getc(reader);
+        if (c == EOF) {
+            return 0;
+        }
+        switch (c) {
+            case ' ':
+            case '\t':
+            case '\r':
+                context->colno += 1;
+                return 0;
+            case '\n':
+                context->lineno += 1;
+                context->colno = 1;
+                return 0;
+            case '(':
+            case ')':
+                reader_ungetc(reader);
+                return 0;
+            case 0x21 ... 0x27:
+            case 0x2a ... 0x7e:
+                if (token->len + 1 >= token->value_size) {
+                    // number literals may run to hundreds of thousands of digits
+                    size_t size = 2 * context->token_bufsize;
+                    char* buf = (char*) realloc(context->token_buf, size);
+                    if (buf == NULL) {
+                        fprintf(_icfp_stderr, "%s:%d:%d: token is too long\n", context->filename, token->lineno, token->colno);
+                        return 1;
+                    }
+                    context->token_buf = buf;
+                    context->token_bufsize = size;
+                    token->value = buf;
+                    token->value_size = size;
+                }
+                token->value[token->len++] = c;
+                token->value[token->len] = '\0';
+                context->colno += 1;
+                break;
+            default:
+                fprintf(_icfp_stderr, "%s:%d:%d: invalid char %c\n", context->filename, context->lineno, context->colno, c);
+                return 1;
+        }
+    }
+}
+
+
+static int
+_icfp_parser_parse_number(struct _Arena* arena, const char* p, struct _Number* value) {
+    number_init(value);
+    int neg = *p == '-';
+    if (neg) { ++p; }
+    uint32_t base = 10;
+    if (p[0] == '0' && p[1] == 'x') {
+        base = 16;
+        p += 2;
+    }
+    else if (p[0] == '0') {
+        return p[1] == '\0' ? 0 : 1;
+    }
+    size_t n = strlen(p);
+    if (n == 0) {
+        return 1;
+    }
+    uint8_t* digits = (uint8_t*) malloc(n);
+    for (size_t i = 0; i < n; ++i) {
+        int c = p[i];
+        int d;
+        switch (c) {
+            case '0' ... '9': d = c - '0'; break;
+            case 'A' ... 'F': d = c - 'A' + 10; break;
+            case 'a' ... 'f': d = c - 'a' + 10; break;
+            default: d = 16; break;
+        }
+        if (d >= (int) base) {
+            free(digits);
+            return 1;
+        }
+        digits[i] = d;
+    }
+    // up to 15 digits fit either base without building a bigint
+    if (n <= 15) {
+        int64_t x = 0;
+        for (size_t i = 0; i < n; ++i) {
+            x = x * base + digits[i];
+        }
+        value->value = neg ? -x : x;
+    }
+    else {
+        struct _BigInt* big = bigint_from_digits(arena, digits, n, base);
+        big->neg = neg && big->len > 0;
+        if (bigint_to_int64(big, &value->value) != 0) {
+            value->big = big;
+        }
+    }
+    free(digits);
+    return 0;
+}
+
+
+// Writes the ICFP form of a small num ending at end and returns its start.
+static char*
+_icfp_encode_number(const struct _Number* num, char* end) {
+    int64_t x = num->value;
+    char* p = end;
+    *--p = '\0';
+    if (x == 0) {
+        *--p = '!';
+    }
+    int neg = x < 0;
+    for (; x != 0; x /= 94) {
+        int v = x % 94;
+        *--p = (neg ? -v : v) + 33;
+    }
+    *--p = 'I';
+    if (neg) {
+        p -= 3;
+        memcpy(p, "U- ", 3);
+    }
+    return p;
+}
+
+
+// Same for a literal of any size, the result lives in arena.
+static char*
+_icfp_encode_big_number(struct _Arena* arena, const struct _Number* num) {
+    size_t count;
+    uint8_t* digits = bigint_to_digits(arena, num->big, 94, &count);
+    char* res = (char*) arena_alloc(arena, count + 5);
+    char* p = res;
+    if (num->big->neg) {
+        memcpy(p, "U- ", 3);
+        p += 3;
+    }
+    *p++ = 'I';
+    for (size_t i = 0; i < count; ++i) {
+        *p++ = digits[i] + 33;
+    }
+    *p = '\0';
+    return res;
+}
+
+
+static const char* _symbols128[128];
+static const char* _symbols_tok[32];
+static const char* _symbols_empty;
+
+static void
+_icfp_parser_init_symbols(struct _ParserState* context) {
+    struct _SymbolList* list = &context->symbols;
+    _symbols128[0] = NULL;
+    char s[2] = "_";
+    for (int c = 1; c < 128; ++c) {
+        s[0] = c;
+        char* p = symbol_list_intern(list, s);
+        _symbols128[c] = p;
+    }
+    _symbols_tok[_TokenType_bool_false] = symbol_list_intern(list, "false");
+    _symbols_tok[_TokenType_bool_true] = symbol_list_intern(list, "true");
+    _symbols_empty = symbol_list_intern(list, "");
+}
+
+
+static void
+symbolicate_token(struct _ParserState* context, struct _Token* token) {
+    switch (token->type) {
+        case _TokenType_bool_false:
+        case _TokenType_bool_true:
+            token->value = (char*) _symbols_tok[token->type];
+            break;
+        case _TokenType_invalid:
+        case _TokenType_eof:
+            break;
+        case _TokenType_open_paren:
+        case _TokenType_close_paren:
+        case _TokenType_identifier:
+        case _TokenType_number:
+        case _TokenType_str:
+        case _TokenType_str_start:
+        case _TokenType_str_data:
+        case _TokenType_str_end:
+            switch (token->len) {
+                case 0:
+                    token->value = (char*) _symbols_empty;
+                    break;
+                case 1: {
+                    int c = token->value[0];
+                    if (c > 127) {
+                        fprintf(_icfp_stderr, "%s:%d:%d: invalid token %c\n", context->filename, token->lineno, token->colno, c);
+                        abort();
+                    }
+                    token->value = (char*) _symbols128[c];
+                    break;
+                }
+                default:
+                    token->value = symbol_list_intern(&context->symbols, token->value);
+                    break;
+            }
+    }
+}
+
+
+static int
+_icfp_parser_tokenize(struct _ParserState* context, struct _Reader* reader, struct _Token* token) {
+    context->tokens += 1;
+    token_init(token, context->token_bufsize, context->token_buf);
+    for (;;) {
+        token->lineno = context->lineno;
+        token->colno = context->colno;
+        int c = reader_getc(reader);
+        if (c == EOF) {
+            token->type = _TokenType_eof;
+            return 0;
+        }
+        switch (c) {
+            case ' ':
+            case '\t':
+            case '\r':
+                context->colno += 1;
+                break;
+            case '\n':
+                context->lineno += 1;
+                context->colno = 1;
+                break;
+            case '(':
+                token->type = _TokenType_open_paren;
+                token->value = (char*) _symbols128[c];
+                token->len = 1;
+                context->colno += 1;
+                return 0;
+            case ')':
+                token->type = _TokenType_close_paren;
+                token->value = (char*) _symbols128[c];
+                token->len = 1;
+                context->colno += 1;
+                return 0;
+            case '"': {
+                context->colno += 1;
+                int res = _icfp_parser_read_str_data(context, reader, token);
+                if (res != 0) { return res; }
+                if (token->type == _TokenType_str_end) {
+                    symbolicate_token(context, token);
+                    token->type = _TokenType_str;
+                    return 0;
+                }
+                token->value = symbol_list_push(&context->symbols, token->value);
+                struct _Token temp;
+                for (;;) {
+                    token_init(&temp, context->token_bufsize, context->token_buf);
+                    temp.lineno = context->lineno;
+                    temp.colno = context->colno;
+                    int res = _icfp_parser_read_str_data(context, reader, &temp);
+                    if (res != 0) { return res; }
+                    token->value = symbol_list_concat(&context->symbols, token->value, temp.value);
+                    token->len += temp.len;
+                    if (temp.type == _TokenType_str_end) {
+                        break;
+                    }
+                }
+                token->value = symbol_list_intern_pushed(&context->symbols, token->value);
+                token->type = _TokenType_str;
+                return 0;
+            }
+            case '{': {
+                context->colno += 1;
+                int res = _icfp_parser_skip_comment(context, reader, token);
+                if (res != 0) { return res; }
+                break;
+            }
+            case 0x21:
+            case 0x23 ... 0x27:
+            case 0x2a ... 0x7a:
+            case 0x7c:
+            case 0x7e: {
+                token->value[token->len++] = c;
+                token->value[token->len] = '\0';
+                token->type = _TokenType_identifier;
+                context->colno += 1;
+                int res = _icfp_parser_read_identifier(context, reader, token);
+                if (res != 0) { return res; }
+
+                if (strcmp(token->value, "false") == 0) {
+                    token->type = _TokenType_bool_false;
+                }
+                else if (strcmp(token->value, "true") == 0) {
+                    token->type = _TokenType_bool_true;
+                }
+                else {
+                    res = _icfp_parser_parse_number(&context->numbers, token->value, &token->num);
+                    if (res == 0) {
+                        token->type = _TokenType_number;
+                    }
+                }
+                symbolicate_token(context, token);
+                if (token->type == _TokenType_number && token->num.big != NULL) {
+                    token->encoded = symbol_list_intern(&context->symbols, _icfp_encode_big_number(&context->numbers, &token->num));
+                }
+                else if (token->type == _TokenType_number) {
+                    char buf[32];
+                    token->encoded = symbol_list_intern(&context->symbols, _icfp_encode_number(&token->num, buf + sizeof(buf)));
+                }
+                return 0;
+            }
+            default:
+                fprintf(_icfp_stderr, "%s:%d:%d: invalid char %c\n", context->filename, context->lineno, context->colno, c);
+                return 1;
+        }
+    }
+}
+
+
+static const char
+_icfp_abc94[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789!\"#$%&'()*+,-./:;<=>?@[\\]^_`|~ \n";
+
+
+static uint8_t _icfp_abc94_index[256];
+
+
+static void
+_icfp_init_abc94(void) {
+    memset(_icfp_abc94_index, 0xff, sizeof(_icfp_abc94_index));
+    for (int i = 0; i < 94; ++i) {
+        _icfp_abc94_index[(uint8_t) _icfp_abc94[i]] = i;
+    }
+}
+
+
+#if defined(__SSE2__)
+// the alphabet is ten runs of consecutive ASCII codes, each shifted by a
+// constant; a block is valid when every byte falls into one of the runs
+struct _Abc94Run {
+    char lo;
+    char hi;
+    char delta;
+};
+
+
+static const struct _Abc94Run
+_icfp_abc94_runs[] = {
+    {'a', 'z', '!' - 'a'},
+    {'A', 'Z', ';' - 'A'},
+    {'0', '9', 'U' - '0'},
+    {'!', '/', '_' - '!'},
+    {':', '@', 'n' - ':'},
+    {'[', '`', 'u' - '['},
+    {'|', '|', '{' - '|'},
+    {'~', '~', '|' - '~'},
+    {' ', ' ', '}' - ' '},
+    {'\n', '\n', '~' - '\n'},
+};
+
+
+static inline int
+_icfp_encode_block16(const char* s, char* dest) {
+    __m128i v = _mm_loadu_si128((const __m128i*) s);
+    __m128i res = _mm_setzero_si128();
+    __m128i hit = _mm_setzero_si128();
+    for (const struct _Abc94Run& run : _icfp_abc94_runs) {
+        __m128i m = _mm_and_si128(
+            _mm_cmpgt_epi8(v, _mm_set1_epi8(run.lo - 1)),
+            _mm_cmplt_epi8(v, _mm_set1_epi8(run.hi + 1)));
+        res = _mm_or_si128(res, _mm_and_si128(m, _mm_add_epi8(v, _mm_set1_epi8(run.delta))));
+        hit = _mm_or_si128(hit, m);
+    }
+    if (_mm_movemask_epi8(hit) != 0xffff) {
+        return 1;
+    }
+    _mm_storeu_si128((__m128i*) dest, res);
+    return 0;
+}
+#endif
+
+
+// Returns the offset of the first char outside the alphabet, or n.
+static size_t
+_icfp_encode_str(const char* s, size_t n, char* dest) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= n; i += 16) {
+        if (_icfp_encode_block16(s + i, dest + i) != 0) {
+            break;
+        }
+    }
+#endif
+    for (; i < n; ++i) {
+        uint8_t index = _icfp_abc94_index[(uint8_t) s[i]];
+        if (index == 0xff) {
+            return i;
+        }
+        dest[i] = '!' + index;
+    }
+    return n;
+}
+
+
+static int
+_icfp_write_str(struct _WriterState* context, struct _Expr* expr, struct _OutBuf* out) {
+    const char* s = expr->token.value;
+    size_t n = strlen(s);
+    char* dest = outbuf_reserve(out, n + 1);
+    *dest++ = 'S';
+    size_t pos = _icfp_encode_str(s, n, dest);
+    if (pos != n) {
+        fprintf(_icfp_stderr, "%s:%d:%d: invalid char in string literal at offset %zu: 0x%02x\n",
+                context->filename, expr->lineno, expr->colno, pos, (uint8_t) s[pos]);
+        return 1;
+    }
+    out->used += n + 1;
+    return 0;
+}
+
+
+static int
+_icfp_write_bool(enum _TokenType value, struct _OutBuf* out) {
+    switch (value) {
+        case _TokenType_bool_false:
+            outbuf_putc(out, 'F');
+            return 0;
+        case _TokenType_bool_true:
+            outbuf_putc(out, 'T');
+            return 0;
+        default:
+            abort();
+    }
+}
+
+
+static int
+_icfp_write_expression(struct _WriterState* context, struct _Expr* expr, struct _NameTable* nametable);
+
+
+// Writes the base-94 digits of a variable number ending at end and returns
+// their start.
+static char*
+_icfp_encode_var(uint64_t var, char* end) {
+    char* p = end;
+    *--p = '\0';
+    do {
+        *--p = '!' + (char) (var % 94);
+        var /= 94;
+    } while (var != 0);
+    return p;
+}
+
+
+static void
+_icfp_write_var(struct _OutBuf* out, char prefix, uint64_t var) {
+    char buf[16];
+    char* p = _icfp_encode_var(var, buf + sizeof(buf));
+    *--p = prefix;
+    outbuf_puts(out, p);
+}
+
+
+// Binds name to the next variable number. Binders are numbered by depth,
+// so an inner binder never reuses a number still visible from its body,
+// and siblings share the short ones: the first 94 levels take one byte.
+static struct _Name*
+_icfp_write_binder(struct _WriterState* context, struct _NameTable* nametable, const struct _Token* token) {
+    struct _Name* name = name_table_put(nametable, token->value, NULL);
+    name->var = context->var_depth++;
+    _icfp_write_var(&context->out, 'L', name->var);
+    outbuf_putc(&context->out, ' ');
+    if (context->verbose) {
+        char buf[16];
+        fprintf(_icfp_stderr, "%s:%d:%d: var %s is %s\n", context->filename, token->lineno, token->colno,
+            _icfp_encode_var(name->var, buf + sizeof(buf)), token->value);
+    }
+    return name;
+}
+
+
+static size_t
+_icfp_write_span_open(struct _WriterState* context, const char* name) {
+    if (context->spans_used == context->spans_size) {
+        context->spans_size = context->spans_size ? context->spans_size * 2 : 64;
+        context->spans = (struct _WriteSpan*) realloc(context->spans, context->spans_size * sizeof(struct _WriteSpan));
+    }
+    struct _WriteSpan* span = &context->spans[context->spans_used];
+    span->start = context->out.used;
+    span->end = context->out.used;
+    span->name = name;
+    return context->spans_used++;
+}
+
+
+static void
+_icfp_write_span_close(struct _WriterState* context, size_t span) {
+    context->spans[span].end = context->out.used;
+}
+
+
+static int
+_icfp_write_resolved_name(struct _WriterState* context, struct _Name* name, struct _NameTable* nametable) {
+    struct _OutBuf* out = &context->out;
+    struct _Expr* expr = name->expr;
+    if (expr == NULL) {
+        uint64_t var = name->var;
+        if (name->free && var < context->var_depth) {
+            // binders are numbered by depth, so none in scope takes a free
+            // variable past them
+            var += context->var_depth;
+        }
+        _icfp_write_var(out, 'v', var);
+        return 0;
+    }
+    if (expr->type == _ExprType_identifier) {
+        outbuf_putc(out, 'v');
+        outbuf_puts(out, expr->token.value);
+        return 0;
+    }
+    if (expanding_has(context->expanding, name)) {
+        fprintf(_icfp_stderr, "%s:%d:%d: recursive definition of %s\n", context->filename, expr->lineno, expr->colno, name->name);
+        return 1;
+    }
+    struct _Expanding expanding = {name, context->expanding};
+    context->expanding = &expanding;
+    size_t span = context->spans_on ? _icfp_write_span_open(context, name->name) : 0;
+    int res = _icfp_write_expression(context, expr, context->nametable);
+    if (context->spans_on) {
+        _icfp_write_span_close(context, span);
+    }
+    context->expanding = expanding.parent;
+    return res;
+}
+
+
+static int
+_icfp_write_apply_op(struct _WriterState* context, struct _NameTable* nametable, struct _Expr* lamb, int define,
+    int param, int full, struct _Expr* arg);
+
+
+static void
+_icfp_write_apply(struct _OutBuf* out, int op) {
+    char s[4] = "B_ ";
+    s[1] = op;
+    outbuf_puts(out, s);
+}
+
+
+// The lambda a resolved name stands for, when it is a define.
+static struct _Expr*
+_icfp_write_resolved_lambda(struct _Name* name) {
+    return name->expr != NULL && name->expr->type == _ExprType_lambda ? name->expr : NULL;
+}
+
+
+static int
+_icfp_write_expr_apply1(struct _WriterState* context, struct _Expr* expr, struct _NameTable* nametable) {
+    struct _OutBuf* out = &context->out;
+    switch (expr->expr0->type) {
+        case _ExprType_identifier: {
+            struct _Token* token = &expr->expr0->token;
+            if (token->len == 1) {
+                char c = token->value[0];
                 switch (c) {
                     case '-':
                     case '!':
@@ -1121,943 +2827,6907 @@ _icfp_write_expr_apply1(struct _WriterState* context, struct _Expr* expr, struct
                     case '$': {
                         char s[4] = "U_ ";
                         s[1] = c;
-                        int res = fputs(s, context->file);
-                        if (res == EOF) { perror(NULL); return 1; }
+                        outbuf_puts(out, s);
                         return _icfp_write_expression(context, expr->expr1, nametable);
                     }
-                    default:
-                        break;
+                    default:
+                        break;
+                }
+            }
+            struct _Name* resolved_name;
+            int res = name_table_resolve(nametable, token, &resolved_name);
+            if (res != 0) { return res; }
+            struct _Expr* lamb = _icfp_write_resolved_lambda(resolved_name);
+            int full = lamb != NULL && lamb->expr1->type == _ExprType_apply1;
+            _icfp_write_apply(out, _icfp_write_apply_op(context, nametable, lamb, 1, 0, full, expr->expr1));
+            res = _icfp_write_resolved_name(context, resolved_name, nametable);
+            if (res != 0) { return res; }
+            outbuf_putc(out, ' ');
+            return _icfp_write_expression(context, expr->expr1, nametable);
+        }
+        case _ExprType_apply1:
+        case _ExprType_apply2:
+        case _ExprType_apply3:
+        case _ExprType_literal:
+        case _ExprType_assert: {
+            // decoded ICFP may apply any term, which fails when evaluated
+            outbuf_puts(out, "B$ ");
+            int res = _icfp_write_expression(context, expr->expr0, nametable);
+            if (res != 0) { return res; }
+            outbuf_putc(out, ' ');
+            return _icfp_write_expression(context, expr->expr1, nametable);
+        }
+        case _ExprType_lambda: {
+            int res;
+            struct _Expr* args = expr->expr0->expr1;
+            enum _ExprType arity = args->type;
+            switch (arity) {
+                case _ExprType_apply2:
+                case _ExprType_apply1:
+                    // one argument, a second parameter is left unapplied
+                    _icfp_write_apply(out, _icfp_write_apply_op(context, nametable, expr->expr0, 0, 0,
+                        arity == _ExprType_apply1, expr->expr1));
+                    break;
+                default:
+                    fprintf(_icfp_stderr, "! invalid lambda arity %d\n", arity);
+                    abort();
+            }
+            res = _icfp_write_expression(context, expr->expr0, nametable);
+            if (res != 0) { return res; }
+            outbuf_putc(out, ' ');
+            return _icfp_write_expression(context, expr->expr1, nametable);
+        }
+        default:
+            fprintf(_icfp_stderr, "! invalid expression to apply %d\n", expr->expr0->type);
+            abort();
+    }
+}
+
+
+static int
+_icfp_write_expression(struct _WriterState* context, struct _Expr* expr, struct _NameTable* nametable) {
+    struct _OutBuf* out = &context->out;
+    switch (expr->type) {
+        case _ExprType_identifier: {
+            struct _Name* resolved_name;
+            int res = name_table_resolve(nametable, &expr->token, &resolved_name);
+            if (res != 0) { return res; }
+            res = _icfp_write_resolved_name(context, resolved_name, nametable);
+            if (res != 0) { return res; }
+            return 0;
+        }
+        case _ExprType_apply1:
+            return _icfp_write_expr_apply1(context, expr, nametable);
+        case _ExprType_apply2: {
+            if (expr->expr0->type != _ExprType_identifier) {
+                // a function written in place or computed, as where a knot
+                // stands for itself
+                struct _Expr* lamb = expr->expr0;
+                if (lamb->type != _ExprType_lambda || lamb->expr1->type != _ExprType_apply2) {
+                    lamb = NULL;
+                }
+                _icfp_write_apply(out, _icfp_write_apply_op(context, nametable, lamb, 0, 1, 1, expr->expr2));
+                _icfp_write_apply(out, _icfp_write_apply_op(context, nametable, lamb, 0, 0, 1, expr->expr1));
+                int res = _icfp_write_expression(context, expr->expr0, nametable);
+                if (res != 0) { return res; }
+                outbuf_putc(out, ' ');
+                res = _icfp_write_expression(context, expr->expr1, nametable);
+                if (res != 0) { return res; }
+                outbuf_putc(out, ' ');
+                return _icfp_write_expression(context, expr->expr2, nametable);
+            }
+            struct _Token* token = &expr->expr0->token;
+            if (token->len == 1) {
+                char c = token->value[0];
+                switch (c) {
+                    case '+':
+                    case '-':
+                    case '*':
+                    case '/':
+                    case '%':
+                    case '<':
+                    case '>':
+                    case '=':
+                    case '|':
+                    case '&':
+                    case '.':
+                    case 'T':
+                    case 'D':
+                    case '$':
+                    case '~':
+                    case '!': {
+                        char s[4] = "B_ ";
+                        s[1] = c;
+                        outbuf_puts(out, s);
+                        int res = _icfp_write_expression(context, expr->expr1, nametable);
+                        if (res != 0) { return res; }
+                        outbuf_putc(out, ' ');
+                        return _icfp_write_expression(context, expr->expr2, nametable);
+                    }
+                    default:
+                        break;
+                }
+            }
+            struct _Name* resolved_name;
+            int res = name_table_resolve(nametable, token, &resolved_name);
+            if (res != 0) { return res; }
+            struct _Expr* lamb = _icfp_write_resolved_lambda(resolved_name);
+            if (lamb != NULL && lamb->expr1->type != _ExprType_apply2) {
+                // a one parameter define returns what takes the second
+                lamb = NULL;
+            }
+            _icfp_write_apply(out, _icfp_write_apply_op(context, nametable, lamb, 1, 1, 1, expr->expr2));
+            _icfp_write_apply(out, _icfp_write_apply_op(context, nametable, lamb, 1, 0, 1, expr->expr1));
+            res = _icfp_write_resolved_name(context, resolved_name, nametable);
+            if (res != 0) { return res; }
+            outbuf_putc(out, ' ');
+            res = _icfp_write_expression(context, expr->expr1, nametable);
+            if (res != 0) { return res; }
+            outbuf_putc(out, ' ');
+            return _icfp_write_expression(context, expr->expr2, nametable);
+        }
+        case _ExprType_apply3: {
+            struct _Token* token = &expr->expr0->token;
+            if (token->len == 1) {
+                char c = token->value[0];
+                switch (c) {
+                    case '?': {
+                        outbuf_putc(out, '?');
+                        outbuf_putc(out, ' ');
+                        int res = _icfp_write_expression(context, expr->expr1, nametable);
+                        if (res != 0) { return res; }
+                        outbuf_putc(out, ' ');
+                        res = _icfp_write_expression(context, expr->expr2, nametable);
+                        if (res != 0) { return res; }
+                        outbuf_putc(out, ' ');
+                        return _icfp_write_expression(context, expr->expr3, nametable);
+                    }
+                    default:
+                        break;
+                }
+            }
+            fprintf(_icfp_stderr, "! apply3 not implemented\n");
+            abort();
+        }
+        case _ExprType_lambda: {
+            struct _Expr* args = expr->expr1;
+            enum _ExprType arity = args->type;
+            struct _NameTable* body_nametable = name_table_add_child(nametable);
+            uint64_t depth = context->var_depth;
+            switch (arity) {
+                case _ExprType_apply1: {
+                    _icfp_write_binder(context, body_nametable, &args->expr1->token);
+                    break;
+                }
+                case _ExprType_apply2: {
+                    _icfp_write_binder(context, body_nametable, &args->expr1->token);
+                    _icfp_write_binder(context, body_nametable, &args->expr2->token);
+                    break;
+                }
+                default:
+                    fprintf(_icfp_stderr, "unhandled lambda arity %d\n", arity);
+                    abort();
+            }
+            int res = _icfp_write_expression(context, expr->expr2, body_nametable);
+            context->var_depth = depth;
+            name_table_release(body_nametable);
+            return res;
+        }
+        case _ExprType_literal:
+            switch (expr->token.type) {
+                case _TokenType_str:
+                    return _icfp_write_str(context, expr, out);
+                case _TokenType_number:
+                    outbuf_puts(out, expr->token.encoded);
+                    return 0;
+                case _TokenType_bool_false:
+                case _TokenType_bool_true:
+                    return _icfp_write_bool(expr->token.type, out);
+                case _TokenType_invalid:
+                case _TokenType_eof:
+                case _TokenType_open_paren:
+                case _TokenType_close_paren:
+                case _TokenType_identifier:
+                case _TokenType_str_start:
+                case _TokenType_str_data:
+                case _TokenType_str_end:
+                    abort();
+            }
+            break;
+        case _ExprType_assert: {
+            outbuf_puts(out, "AT ");
+            return _icfp_write_expression(context, expr->expr1, nametable);
+        }
+        case _ExprType_define:
+        case _ExprType_invalid:
+            fprintf(_icfp_stderr, "! write of invalid expression\n");
+            return 1;
+    }
+    return 1;
+}
+
+
+static int
+_icfp_expr_unary_op(struct _Expr* expr) {
+    if (expr->type != _ExprType_identifier || expr->token.len != 1) {
+        return 0;
+    }
+    switch (expr->token.value[0]) {
+        case '-':
+        case '!':
+        case '#':
+        case '$':
+            return expr->token.value[0];
+    }
+    return 0;
+}
+
+
+static int
+_icfp_expr_binary_op(struct _Expr* expr) {
+    if (expr->token.len != 1) {
+        return 0;
+    }
+    switch (expr->token.value[0]) {
+        case '+': case '-': case '*': case '/': case '%':
+        case '<': case '>': case '=': case '|': case '&':
+        case '.': case 'T': case 'D': case '$': case '~': case '!':
+            return expr->token.value[0];
+    }
+    return 0;
+}
+
+
+static int
+_icfp_collect_expression(struct _WriterState* context, struct _Expr* expr, struct _NameTable* nametable);
+
+
+static int
+_icfp_collect_define(struct _WriterState* context, struct _Name* name) {
+    if (name->expr == NULL || name->expr->type == _ExprType_identifier) {
+        return 0;
+    }
+    for (size_t i = 0; i < context->defines_used; ++i) {
+        if (context->defines[i] == name) {
+            return 0;
+        }
+    }
+    for (size_t i = context->defines_size - context->defines_pending; i < context->defines_size; ++i) {
+        if (context->defines[i] == name) {
+            fprintf(_icfp_stderr, "%s:%d:%d: recursive definition of %s\n", context->filename, name->expr->lineno, name->expr->colno, name->name);
+            return 1;
+        }
+    }
+    if (context->defines_used + context->defines_pending + 1 >= context->defines_size) {
+        size_t size = context->defines_size ? context->defines_size * 2 : 64;
+        struct _Name** defines = (struct _Name**) calloc(size, sizeof(struct _Name*));
+        if (context->defines != NULL) {
+            memcpy(defines, context->defines, context->defines_used * sizeof(struct _Name*));
+            memcpy(&defines[size - context->defines_pending], &context->defines[context->defines_size - context->defines_pending],
+                context->defines_pending * sizeof(struct _Name*));
+        }
+        free(context->defines);
+        context->defines = defines;
+        context->defines_size = size;
+    }
+    context->defines_pending += 1;
+    context->defines[context->defines_size - context->defines_pending] = name;
+    int res = _icfp_collect_expression(context, name->expr, context->nametable);
+    context->defines_pending -= 1;
+    if (res != 0) { return res; }
+    context->defines[context->defines_used++] = name;
+    return 0;
+}
+
+
+static int
+_icfp_collect_expression(struct _WriterState* context, struct _Expr* expr, struct _NameTable* nametable) {
+    switch (expr->type) {
+        case _ExprType_identifier: {
+            struct _Name* resolved_name;
+            int res = name_table_resolve(nametable, &expr->token, &resolved_name);
+            if (res != 0) { return res; }
+            return _icfp_collect_define(context, resolved_name);
+        }
+        case _ExprType_apply1:
+            if (_icfp_expr_unary_op(expr->expr0) == 0) {
+                int res = _icfp_collect_expression(context, expr->expr0, nametable);
+                if (res != 0) { return res; }
+            }
+            return _icfp_collect_expression(context, expr->expr1, nametable);
+        case _ExprType_apply2: {
+            if (_icfp_expr_binary_op(expr->expr0) == 0) {
+                int res = _icfp_collect_expression(context, expr->expr0, nametable);
+                if (res != 0) { return res; }
+            }
+            int res = _icfp_collect_expression(context, expr->expr1, nametable);
+            if (res != 0) { return res; }
+            return _icfp_collect_expression(context, expr->expr2, nametable);
+        }
+        case _ExprType_apply3: {
+            int res = _icfp_collect_expression(context, expr->expr1, nametable);
+            if (res != 0) { return res; }
+            res = _icfp_collect_expression(context, expr->expr2, nametable);
+            if (res != 0) { return res; }
+            return _icfp_collect_expression(context, expr->expr3, nametable);
+        }
+        case _ExprType_lambda: {
+            struct _Expr* args = expr->expr1;
+            struct _NameTable* body_nametable = name_table_add_child(nametable);
+            name_table_put(body_nametable, args->expr1->token.value, NULL);
+            if (args->type == _ExprType_apply2) {
+                name_table_put(body_nametable, args->expr2->token.value, NULL);
+            }
+            int res = _icfp_collect_expression(context, expr->expr2, body_nametable);
+            name_table_release(body_nametable);
+            return res;
+        }
+        case _ExprType_assert:
+            return _icfp_collect_expression(context, expr->expr1, nametable);
+        case _ExprType_literal:
+            return 0;
+        case _ExprType_define:
+        case _ExprType_invalid:
+            fprintf(_icfp_stderr, "! collect of invalid expression\n");
+            return 1;
+    }
+    return 1;
+}
+
+
+static int
+_icfp_resolve_expression(struct _WriterState* context, struct _Expr* expr, struct _NameTable* nametable);
+
+
+static int
+_icfp_resolve_name(struct _WriterState* context, struct _Name* name) {
+    struct _Expr* expr = name->expr;
+    if (expr == NULL || expr->type == _ExprType_identifier) {
+        return 0;
+    }
+    if (expanding_has(context->expanding, name)) {
+        fprintf(_icfp_stderr, "%s:%d:%d: recursive definition of %s\n", context->filename, expr->lineno, expr->colno, name->name);
+        return 1;
+    }
+    struct _Expanding expanding = {name, context->expanding};
+    context->expanding = &expanding;
+    int res = _icfp_resolve_expression(context, expr, context->nametable);
+    context->expanding = expanding.parent;
+    return res;
+}
+
+
+// Resolves every name the writer would, expanding defines where it does,
+// and writes nothing. A benchmark takes it from the writer's time.
+static int
+_icfp_resolve_expression(struct _WriterState* context, struct _Expr* expr, struct _NameTable* nametable) {
+    switch (expr->type) {
+        case _ExprType_identifier: {
+            struct _Name* resolved_name;
+            int res = name_table_resolve(nametable, &expr->token, &resolved_name);
+            if (res != 0) { return res; }
+            return _icfp_resolve_name(context, resolved_name);
+        }
+        case _ExprType_apply1:
+            if (_icfp_expr_unary_op(expr->expr0) == 0) {
+                int res = _icfp_resolve_expression(context, expr->expr0, nametable);
+                if (res != 0) { return res; }
+            }
+            return _icfp_resolve_expression(context, expr->expr1, nametable);
+        case _ExprType_apply2: {
+            if (_icfp_expr_binary_op(expr->expr0) == 0) {
+                int res = _icfp_resolve_expression(context, expr->expr0, nametable);
+                if (res != 0) { return res; }
+            }
+            int res = _icfp_resolve_expression(context, expr->expr1, nametable);
+            if (res != 0) { return res; }
+            return _icfp_resolve_expression(context, expr->expr2, nametable);
+        }
+        case _ExprType_apply3: {
+            int res = _icfp_resolve_expression(context, expr->expr1, nametable);
+            if (res != 0) { return res; }
+            res = _icfp_resolve_expression(context, expr->expr2, nametable);
+            if (res != 0) { return res; }
+            return _icfp_resolve_expression(context, expr->expr3, nametable);
+        }
+        case _ExprType_lambda: {
+            struct _Expr* args = expr->expr1;
+            struct _NameTable* body_nametable = name_table_add_child(nametable);
+            name_table_put(body_nametable, args->expr1->token.value, NULL);
+            if (args->type == _ExprType_apply2) {
+                name_table_put(body_nametable, args->expr2->token.value, NULL);
+            }
+            int res = _icfp_resolve_expression(context, expr->expr2, body_nametable);
+            name_table_release(body_nametable);
+            return res;
+        }
+        case _ExprType_assert:
+            return _icfp_resolve_expression(context, expr->expr1, nametable);
+        case _ExprType_literal:
+            return 0;
+        case _ExprType_define:
+        case _ExprType_invalid:
+            fprintf(_icfp_stderr, "! resolve of invalid expression\n");
+            return 1;
+    }
+    return 1;
+}
+
+
+static int
+_icfp_write_shared(struct _WriterState* context, struct _Expr* expr) {
+    struct _OutBuf* out = &context->out;
+    context->defines_used = 0;
+    int res = _icfp_collect_expression(context, expr, context->nametable);
+    if (res != 0) { return res; }
+
+    struct _NameTable* scope = context->nametable;
+    context->var_depth = 0;
+    for (size_t i = 0; i < context->defines_used; ++i) {
+        struct _Name* name = context->defines[i];
+        struct _Token token = name->expr->token;
+        token.value = (char*) name->name;
+        outbuf_puts(out, "B$ ");
+        scope = name_table_add_child(scope);
+        _icfp_write_binder(context, scope, &token);
+    }
+    res = _icfp_write_expression(context, expr, scope);
+    for (size_t i = context->defines_used; i > 0; --i) {
+        struct _NameTable* parent = scope->parent;
+        name_table_release(scope);
+        scope = parent;
+        if (res == 0) {
+            // a define sees the ones collected before it
+            context->var_depth = i - 1;
+            outbuf_putc(out, ' ');
+            size_t span = context->spans_on ? _icfp_write_span_open(context, context->defines[i-1]->name) : 0;
+            res = _icfp_write_expression(context, context->defines[i-1]->expr, scope);
+            if (context->spans_on) {
+                _icfp_write_span_close(context, span);
+            }
+        }
+    }
+    context->var_depth = 0;
+    return res;
+}
+
+
+static int
+icfp_write_toplevel(struct _WriterState* context, struct _Expr* expr) {
+    if (context->out_shared) {
+        return _icfp_write_shared(context, expr);
+    }
+    return _icfp_write_expression(context, expr, context->nametable);
+}
+
+
+struct _Nesting {
+    int level;
+    int popped;
+};
+
+
+static void
+dump_arg_list(struct _Expr* expr, FILE* file) {
+    switch (expr->type) {
+        case _ExprType_apply1:
+            fputc('(', file);
+            if (expr->expr0->type == _ExprType_identifier) {
+                fputs(expr->expr0->token.value, file);
+                fputc(' ', file);
+            }
+            fputs(expr->expr1->token.value, file);
+            fputc(')', file);
+            break;
+        case _ExprType_apply2:
+            fputc('(', file);
+            if (expr->expr0->type == _ExprType_identifier) {
+                fputs(expr->expr0->token.value, file);
+                fputc(' ', file);
+            }
+            fputs(expr->expr1->token.value, file);
+            fputc(' ', file);
+            fputs(expr->expr2->token.value, file);
+            fputc(')', file);
+            break;
+        case _ExprType_apply3:
+            fputc('(', file);
+            if (expr->expr0->type == _ExprType_identifier) {
+                fputs(expr->expr0->token.value, file);
+                fputc(' ', file);
+            }
+            fputs(expr->expr1->token.value, file);
+            fputc(' ', file);
+            fputs(expr->expr2->token.value, file);
+            fputc(' ', file);
+            fputs(expr->expr3->token.value, file);
+            fputc(')', file);
+            break;
+        case _ExprType_identifier:
+        case _ExprType_literal:
+        case _ExprType_lambda:
+        case _ExprType_define:
+        case _ExprType_assert:
+        case _ExprType_invalid:
+            fprintf(file, "expr:err%d", expr->type);
+            break;
+    }
+}
+
+
+static void
+dump_expr(struct _Expr* expr, FILE* file) {
+    switch (expr->type) {
+        case _ExprType_invalid:
+            fprintf(file, "expr:err%d", expr->type);
+            break;
+        case _ExprType_identifier:
+            fprintf(file, "expr:id %s", expr->token.value);
+            break;
+        case _ExprType_literal:
+            fprintf(file, "expr:literal %s", expr->token.value);
+            break;
+        case _ExprType_apply1:
+            fprintf(file, "expr:apply (");
+            dump_expr(expr->expr0, file);
+            fputc(')', file);
+            fputc(' ', file);
+            fputc('(', file);
+            dump_expr(expr->expr1, file);
+            fputc(')', file);
+            break;
+        case _ExprType_apply2:
+            fprintf(file, "expr:apply (");
+            dump_expr(expr->expr0, file);
+            fputc(')', file);
+            fputc(' ', file);
+            fputc('(', file);
+            dump_expr(expr->expr1, file);
+            fputc(')', file);
+            fputc(' ', file);
+            fputc('(', file);
+            dump_expr(expr->expr2, file);
+            fputc(')', file);
+            break;
+        case _ExprType_apply3:
+            fprintf(file, "expr:apply (");
+            dump_expr(expr->expr0, file);
+            fputc(')', file);
+            fputc(' ', file);
+            fputc('(', file);
+            dump_expr(expr->expr1, file);
+            fputc(')', file);
+            fputc(' ', file);
+            fputc('(', file);
+            dump_expr(expr->expr2, file);
+            fputc(')', file);
+            fputc(' ', file);
+            fputc('(', file);
+            dump_expr(expr->expr3, file);
+            fputc(')', file);
+            break;
+        case _ExprType_lambda:
+            fprintf(file, "expr:lambda ");
+            dump_arg_list(expr->expr1, file);
+            fputc(' ', file);
+            fputc('(', file);
+            dump_expr(expr->expr2, file);
+            fputc(')', file);
+            break;
+        case _ExprType_define:
+            fprintf(file, "expr:define ");
+            dump_arg_list(expr->expr1, file);
+            fputc(' ', file);
+            fputc('(', file);
+            dump_expr(expr->expr2, file);
+            fputc(')', file);
+            break;
+        case _ExprType_assert:
+            fprintf(file, "expr:assert (");
+            dump_expr(expr->expr0, file);
+            fputc(')', file);
+            fputc(' ', file);
+            fputc('(', file);
+            dump_expr(expr->expr1, file);
+            fputc(')', file);
+            break;
+    }
+}
+
+
+static int
+_icfp_parser_parse_expression(struct _ParserState* context, struct _Reader* reader,
+    struct _Nesting* nesting, struct _Expr** parsed_expr);
+
+
+static int
+_icfp_parser_parse_arg_list(struct _ParserState* context, struct _Reader* reader,
+    struct _Nesting* nesting, int minargs, struct _Expr** expr) {
+
+    struct _Token token;
+    struct _Expr* args;
+    struct _Expr* nested;
+    int state = 0;
+    for (;;) {
+        int res = _icfp_parser_tokenize(context, reader, &token);
+        if (res != 0) { return -1; }
+        if (context->verbose) {
+            fprintf(_icfp_stderr, "%s:%d:%d: token %d %s\n", context->filename, token.lineno, token.colno, token.type, token.value);
+        }
+        switch (state) {
+            case 0:
+                switch (token.type) {
+                    case _TokenType_open_paren:
+                        args = expr_tree_push(&context->expr_tree);
+                        args->token = token;
+                        args->lineno = token.lineno;
+                        args->colno = token.colno;
+                        args->expr0 = expr_tree_push(&context->expr_tree);
+                        state = 1;
+                        break;
+                    default:
+                        fprintf(_icfp_stderr, "%s:%d:%d: expecting an argument list\n", context->filename, token.lineno, token.colno);
+                        return 1;
+                }
+                break;
+            case 1:
+                switch (token.type) {
+                    case _TokenType_identifier:
+                        nested = expr_tree_push(&context->expr_tree);
+                        nested->type = _ExprType_identifier;
+                        nested->token = token;
+                        nested->lineno = token.lineno;
+                        nested->colno = token.colno;
+                        args->expr1 = nested;
+                        state = 2;
+                        break;
+                    case _TokenType_close_paren:
+                        if (minargs > 0) {
+                            fprintf(_icfp_stderr, "%s:%d:%d: expecting an identifier\n", context->filename, token.lineno, token.colno);
+                            return 1;
+                        }
+                        *expr = args;
+                        fprintf(_icfp_stderr, "%s:%d:%d: empty arg list\n", context->filename, token.lineno, token.colno);
+                        abort();
+                        return 0;
+                    default:
+                        fprintf(_icfp_stderr, "%s:%d:%d: expecting an identifier\n", context->filename, token.lineno, token.colno);
+                        return 1;
+                }
+                break;
+            case 2:
+                switch (token.type) {
+                    case _TokenType_identifier:
+                        nested = expr_tree_push(&context->expr_tree);
+                        nested->type = _ExprType_identifier;
+                        nested->token = token;
+                        nested->lineno = token.lineno;
+                        nested->colno = token.colno;
+                        args->type = _ExprType_apply1;
+                        args->expr2 = nested;
+                        state = 3;
+                        break;
+                    case _TokenType_close_paren:
+                        if (minargs > 1) {
+                            fprintf(_icfp_stderr, "%s:%d:%d: expecting an identifier\n", context->filename, token.lineno, token.colno);
+                            return 1;
+                        }
+                        args->type = _ExprType_apply1;
+                        *expr = args;
+                        return 0;
+                    default:
+                        fprintf(_icfp_stderr, "%s:%d:%d: expecting an identifier\n", context->filename, token.lineno, token.colno);
+                        return 1;
+                }
+                break;
+            case 3:
+                switch (token.type) {
+                    case _TokenType_identifier:
+                        nested = expr_tree_push(&context->expr_tree);
+                        nested->type = _ExprType_identifier;
+                        nested->token = token;
+                        nested->lineno = token.lineno;
+                        nested->colno = token.colno;
+                        args->type = _ExprType_apply3;
+                        args->expr3 = nested;
+                        state = 4;
+                        break;
+                    case _TokenType_close_paren:
+                        args->type = _ExprType_apply2;
+                        *expr = args;
+                        return 0;
+                    default:
+                        fprintf(_icfp_stderr, "%s:%d:%d: expecting an identifier\n", context->filename, token.lineno, token.colno);
+                        return 1;
+                }
+                break;
+            case 4:
+                switch (token.type) {
+                    case _TokenType_close_paren:
+                        args->type = _ExprType_apply3;
+                        *expr = args;
+                        return 0;
+                    default:
+                        fprintf(_icfp_stderr, "%s:%d:%d: expecting a closing paren\n", context->filename, token.lineno, token.colno);
+                        return 1;
+                }
+                break;
+        }
+    }
+    abort();
+}
+
+
+static int
+_icfp_parser_parse_lambda(struct _ParserState* context, struct _Reader* reader,
+    struct _Nesting* nesting, struct _Expr* expr) {
+
+    struct _Expr* nested;
+    struct _Expr* args;
+    int minargs = 1;
+    int res = _icfp_parser_parse_arg_list(context, reader, nesting, minargs, &args);
+    if (res != 0) { return res; }
+    if (args->type == _ExprType_apply3) {
+        fprintf(_icfp_stderr, "%s:%d:%d: too many parameters\n", context->filename, args->lineno, args->colno);
+        return 1;
+    }
+
+    expr->expr1 = args;
+
+    struct _Nesting deeper = {};
+    res = _icfp_parser_parse_expression(context, reader, &deeper, &nested);
+    if (res == 0) {
+        fprintf(_icfp_stderr, "%s:%d:%d: expecting expression\n", context->filename, context->lineno, context->colno);
+        return 1;
+    }
+    if (res != 1) { return 1; }
+    expr->expr2 = nested;
+
+    struct _Token token;
+    res = _icfp_parser_tokenize(context, reader, &token);
+    if (res != 0) { return -1; }
+    if (context->verbose) {
+        fprintf(_icfp_stderr, "%s:%d:%d: token %d %s\n", context->filename, token.lineno, token.colno, token.type, token.value);
+    }
+    switch (token.type) {
+        case _TokenType_close_paren:
+            expr->type = _ExprType_lambda;
+            return 0;
+        default:
+            fprintf(_icfp_stderr, "%s:%d:%d: expecting a closing paren\n", context->filename, token.lineno, token.colno);
+            return 1;
+    }
+}
+
+
+static int
+_icfp_parser_parse_define(struct _ParserState* context, struct _Reader* reader,
+    struct _Nesting* nesting, struct _Expr* expr) {
+
+    struct _Expr* nested;
+    struct _Expr* args;
+    int minargs = 2;
+    int res = _icfp_parser_parse_arg_list(context, reader, nesting, minargs, &args);
+    if (res != 0) { return res; }
+
+    args->expr0 = args->expr1;
+    args->expr1 = args->expr2;
+    args->expr2 = args->expr3;
+    args->expr3 = NULL;
+    switch (args->type) {
+        case _ExprType_apply2:
+            args->type = _ExprType_apply1;
+            break;
+        case _ExprType_apply3:
+            args->type = _ExprType_apply2;
+            break;
+        default:
+            abort();
+    }
+    expr->expr1 = args;
+
+    struct _Nesting deeper = {};
+    res = _icfp_parser_parse_expression(context, reader, &deeper, &nested);
+    if (res == 0) {
+        fprintf(_icfp_stderr, "%s:%d:%d: expecting expression\n", context->filename, context->lineno, context->colno);
+        return 1;
+    }
+    if (res != 1) { return 1; }
+    expr->expr2 = nested;
+
+    struct _Token token;
+    res = _icfp_parser_tokenize(context, reader, &token);
+    if (res != 0) { return -1; }
+    if (context->verbose) {
+        fprintf(_icfp_stderr, "%s:%d:%d: token %d %s\n", context->filename, token.lineno, token.colno, token.type, token.value);
+    }
+    switch (token.type) {
+        case _TokenType_close_paren:
+            expr->type = _ExprType_define;
+            return 0;
+        default:
+            fprintf(_icfp_stderr, "%s:%d:%d: expecting a closing paren\n", context->filename, token.lineno, token.colno);
+            return 1;
+    }
+}
+
+
+static int
+_icfp_parser_parse_expression_body(struct _ParserState* context, struct _Reader* reader,
+    struct _Nesting* nesting, struct _Expr* expr) {
+
+    struct _Expr* nested;
+    nesting->popped = 0;
+    int res = _icfp_parser_parse_expression(context, reader, nesting, &nested);
+    if (res == 0) {
+        fprintf(_icfp_stderr, "%s:%d:%d: expecting expression\n", context->filename, context->lineno, context->colno);
+        return 1;
+    }
+    if (res != 1) { return 1; }
+    switch (nested->type) {
+        case _ExprType_identifier:
+            expr->expr0 = nested;
+            if (strcmp(nested->token.value, "\\") == 0) {
+                return _icfp_parser_parse_lambda(context, reader, nesting, expr);
+            }
+            else if (strcmp(nested->token.value, "define") == 0) {
+                return _icfp_parser_parse_define(context, reader, nesting, expr);
+            }
+            break;
+        case _ExprType_apply1:
+        case _ExprType_apply2:
+        case _ExprType_apply3:
+        case _ExprType_lambda:
+            expr->expr0 = nested;
+            break;
+        case _ExprType_literal:
+        case _ExprType_define:
+        case _ExprType_assert:
+        case _ExprType_invalid:
+            fprintf(_icfp_stderr, "%s:%d:%d: expecting identifier\n", context->filename, nested->lineno, nested->colno);
+            return 1;
+    }
+
+    nesting->popped = 0;
+    res = _icfp_parser_parse_expression(context, reader, nesting, &nested);
+    if (res == 0) {
+        fprintf(_icfp_stderr, "%s:%d:%d: expecting expression\n", context->filename, context->lineno, context->colno);
+        return 1;
+    }
+    if (res != 1) { return 1; }
+    switch (nested->type) {
+        case _ExprType_identifier:
+        case _ExprType_apply1:
+        case _ExprType_apply2:
+        case _ExprType_apply3:
+        case _ExprType_literal:
+        case _ExprType_lambda:
+            expr->expr1 = nested;
+            break;
+        case _ExprType_define:
+        case _ExprType_assert:
+        case _ExprType_invalid:
+            fprintf(_icfp_stderr, "%s:%d:%d: expecting identifier\n", context->filename, nested->lineno, nested->colno);
+            return 1;
+    }
+
+    nesting->popped = 0;
+    res = _icfp_parser_parse_expression(context, reader, nesting, &nested);
+    if (res == 0 && nesting->popped != 0) {
+        expr->type = _ExprType_apply1;
+        if (strcmp(expr->expr0->token.value, "assert") == 0) {
+            expr->type = _ExprType_assert;
+        }
+        return 0;
+    }
+    if (res != 1) { return 1; }
+    switch (nested->type) {
+        case _ExprType_identifier:
+        case _ExprType_apply1:
+        case _ExprType_apply2:
+        case _ExprType_apply3:
+        case _ExprType_literal:
+            expr->expr2 = nested;
+            break;
+        case _ExprType_lambda:
+        case _ExprType_define:
+        case _ExprType_assert:
+        case _ExprType_invalid:
+            fprintf(_icfp_stderr, "%s:%d:%d: expecting identifier\n", context->filename, nested->lineno, nested->colno);
+            return 1;
+    }
+
+    nesting->popped = 0;
+    res = _icfp_parser_parse_expression(context, reader, nesting, &nested);
+    if (res == 0 && nesting->popped != 0) {
+        expr->type = _ExprType_apply2;
+        if (strcmp(expr->expr0->token.value, "define") == 0) {
+            expr->type = _ExprType_define;
+        }
+        return 0;
+    }
+    if (res != 1) { return 1; }
+    switch (nested->type) {
+        case _ExprType_identifier:
+        case _ExprType_apply1:
+        case _ExprType_apply2:
+        case _ExprType_apply3:
+        case _ExprType_literal:
+            expr->expr3 = nested;
+            break;
+        case _ExprType_lambda:
+        case _ExprType_define:
+        case _ExprType_assert:
+        case _ExprType_invalid:
+            fprintf(_icfp_stderr, "%s:%d:%d: expecting identifier\n", context->filename, nested->lineno, nested->colno);
+            return 1;
+    }
+
+    nesting->popped = 0;
+    res = _icfp_parser_parse_expression(context, reader, nesting, &nested);
+    if (res == 0 && nesting->popped != 0) {
+        expr->type = _ExprType_apply3;
+        return 0;
+    }
+    if (res != 1) { return 1; }
+    fprintf(_icfp_stderr, "%s:%d:%d: expecting close paren\n", context->filename, nested->lineno, nested->colno);
+    return 1;
+}
+
+
+static void
+_icfp_parser_log_expr(struct _ParserState* context, struct _Expr* expr, FILE* file) {
+    fprintf(_icfp_stderr, "%s:%d:%d: ", context->filename, expr->lineno, expr->colno);
+    dump_expr(expr, _icfp_stderr);
+    fprintf(_icfp_stderr, "\n");
+}
+
+
+static int
+_icfp_parser_parse_expression(struct _ParserState* context, struct _Reader* reader,
+    struct _Nesting* nesting, struct _Expr** parsed_expr) {
+
+    struct _Token token;
+    int res = _icfp_parser_tokenize(context, reader, &token);
+    if (res != 0) { return -1; }
+    if (context->verbose) {
+        fprintf(_icfp_stderr, "%s:%d:%d: token %d %s\n", context->filename, token.lineno, token.colno, token.type, token.value);
+    }
+    switch (token.type) {
+        case _TokenType_open_paren: {
+            struct _Nesting deeper = {};
+            deeper.level = nesting->level + 1;
+            struct _Expr* expr = expr_tree_push(&context->expr_tree);
+            expr->token = token;
+            expr->lineno = token.lineno;
+            expr->colno = token.colno;
+            int res = _icfp_parser_parse_expression_body(context, reader, &deeper, expr);
+            if (res != 0) { return -1; }
+            *parsed_expr = expr;
+            if (context->verbose) {
+                _icfp_parser_log_expr(context, expr, _icfp_stderr);
+            }
+            return 1;
+        }
+        case _TokenType_close_paren:
+            if (nesting->level > 0) {
+                nesting->popped = 1;
+                return 0;
+            }
+            else {
+                fprintf(_icfp_stderr, "%s:%d:%d: expecting expression %s\n", context->filename, token.lineno, token.colno, token.value);
+                return -1;
+            }
+        case _TokenType_number:
+        case _TokenType_bool_false:
+        case _TokenType_bool_true:
+        case _TokenType_str: {
+            struct _Expr* expr = expr_tree_push(&context->expr_tree);
+            expr->type = _ExprType_literal;
+            expr->token = token;
+            expr->lineno = token.lineno;
+            expr->colno = token.colno;
+            *parsed_expr = expr;
+            if (context->verbose) {
+                _icfp_parser_log_expr(context, expr, _icfp_stderr);
+            }
+            return 1;
+        }
+        case _TokenType_identifier: {
+            // fprintf(_icfp_stderr, "%s:%d:%d: expecting expression %s\n", context->filename, token.lineno, token.colno, token.value);
+            struct _Expr* expr = expr_tree_push(&context->expr_tree);
+            expr->type = _ExprType_identifier;
+            expr->token = token;
+            expr->lineno = token.lineno;
+            expr->colno = token.colno;
+            *parsed_expr = expr;
+            if (context->verbose) {
+                _icfp_parser_log_expr(context, expr, _icfp_stderr);
+            }
+            return 1;
+        }
+        case _TokenType_eof:
+            if (nesting->level > 0) {
+                fprintf(_icfp_stderr, "%s:%d:%d: unexpected EOF\n", context->filename, token.lineno, token.colno);
+                return -1;
+            }
+            return 0;
+        case _TokenType_invalid:
+        case _TokenType_str_start:
+        case _TokenType_str_data:
+        case _TokenType_str_end:
+            fprintf(_icfp_stderr, "%s:%d:%d: invalid token %c\n", context->filename, token.lineno, token.colno, token.value[0]);
+            return -1;
+    }
+}
+
+
+enum _TermType {
+    _TermType_literal,
+    _TermType_var,
+    _TermType_lambda,
+    _TermType_unary,
+    _TermType_binary,
+    _TermType_if,
+    // a variable no lambda binds, named by its value, which fails once
+    // evaluated
+    _TermType_free,
+};
+
+
+enum _ValueType {
+    _ValueType_bool,
+    _ValueType_int,
+    _ValueType_str,
+    _ValueType_lambda,
+};
+
+
+struct _Term;
+struct _Env;
+
+
+struct _Value {
+    enum _ValueType type;
+    size_t len;
+    int64_t num;
+    union {
+        struct _BigInt* big;
+        const char* str;
+        struct _Term* term;
+    };
+    struct _Env* env;
+    // the copy the collector made, or the value itself where it is not
+    // collected, as literals are not
+    struct _Value* moved;
+};
+
+
+struct _Term {
+    enum _TermType type;
+    int op;
+    size_t index;
+    struct _Term* t0;
+    struct _Term* t1;
+    struct _Term* t2;
+    struct _Value* value;
+    // for a lambda, 1 + the write span of the define it came from, or 0
+    size_t owner;
+};
+
+
+struct _Thunk {
+    union {
+        struct _Term* term;
+        // the copy the collector made, once forcing is -1
+        struct _Thunk* moved;
+    };
+    struct _Env* env;
+    struct _Value* value;
+    int forcing;
+    // evaluated again on every force, as B$ does
+    int by_name;
+};
+
+
+// A frame the collector copied has no thunk, and next is the copy.
+struct _Env {
+    struct _Thunk* thunk;
+    struct _Env* next;
+};
+
+
+// What an evaluation in progress holds on to while it evaluates another
+// term, for the collector to find and update.
+struct _EvalRoot {
+    struct _Env* env;
+    struct _Value* value;
+    struct _Thunk* thunk;
+    struct _EvalRoot* parent;
+};
+
+
+// The reductions -B allows a program and what it spent. B$ passes its
+// argument by name then, so the counts are those of the contest evaluator.
+struct _EvalBudget {
+    size_t limit;
+    int exceeded;
+    size_t unary_ops[128];
+    size_t binary_ops[128];
+    size_t ifs;
+    // the defines the writer expanded, in the order it started them
+    const struct _WriteSpan* spans;
+    size_t spans_used;
+    // reductions of the lambdas each span holds, none at 0
+    size_t* charges;
+    size_t charges_size;
+};
+
+
+// Terms and their literals stay put while the heap is collected: values,
+// thunks and frames reachable from the roots are copied to a new heap once
+// the heap grows past twice what was live after the last collection.
+struct _EvalState {
+    struct _Arena heap;
+    struct _Arena terms;
+    struct _EvalRoot* roots;
+    size_t collect_at;
+    size_t peak;
+    size_t betas;
+    const char* stack_limit;
+    int verbose;
+    struct _Value* value_false;
+    struct _Value* value_true;
+    struct _EvalBudget* budget;
+    // where the program being evaluated starts, for its errors
+    const char* label;
+    // over every program evaluated, for --stats
+    uint64_t eval_ns;
+    size_t written;
+};
+
+
+struct _TermReader {
+    const char* filename;
+    const char* text;
+    const char* p;
+    const char* end;
+    struct _Arena* heap;
+    uint64_t* binders;
+    size_t binders_size;
+    size_t depth;
+    // the spans enclosing the token being read
+    const struct _WriteSpan* spans;
+    size_t spans_used;
+    size_t spans_next;
+    size_t* spans_open;
+    size_t spans_depth;
+};
+
+
+static void
+icfp_eval_init(struct _EvalState* context, int verbose) {
+    arena_init(&context->heap, _ArenaChunkSize);
+    arena_init(&context->terms, _ArenaChunkSize);
+    context->roots = NULL;
+    context->label = NULL;
+    context->eval_ns = 0;
+    context->written = 0;
+    context->collect_at = _EvalCollectMin;
+    context->peak = 0;
+    context->betas = 0;
+    context->verbose = verbose;
+    context->budget = NULL;
+    context->value_false = (struct _Value*) arena_alloc(&context->terms, sizeof(struct _Value));
+    *context->value_false = {};
+    context->value_false->type = _ValueType_bool;
+    context->value_false->moved = context->value_false;
+    context->value_true = (struct _Value*) arena_alloc(&context->terms, sizeof(struct _Value));
+    *context->value_true = {};
+    context->value_true->type = _ValueType_bool;
+    context->value_true->num = 1;
+    context->value_true->moved = context->value_true;
+}
+
+
+static void
+icfp_eval_free(struct _EvalState* context) {
+    arena_free(&context->heap);
+    arena_free(&context->terms);
+}
+
+
+static void
+icfp_eval_reset(struct _EvalState* context) {
+    struct _EvalBudget* budget = context->budget;
+    uint64_t eval_ns = context->eval_ns;
+    size_t written = context->written;
+    icfp_eval_free(context);
+    icfp_eval_init(context, context->verbose);
+    context->budget = budget;
+    context->eval_ns = eval_ns;
+    context->written = written;
+}
+
+
+// The most heap an evaluation held at once, collections aside.
+static size_t
+icfp_eval_peak(struct _EvalState* context) {
+    return context->heap.peak > context->peak ? context->heap.peak : context->peak;
+}
+
+
+static struct _Value*
+_icfp_eval_new_value(struct _Arena* heap, enum _ValueType type) {
+    struct _Value* value = (struct _Value*) arena_alloc(heap, sizeof(struct _Value));
+    *value = {};
+    value->type = type;
+    return value;
+}
+
+
+static struct _Value*
+_icfp_eval_new_int(struct _Arena* heap, int64_t x) {
+    struct _Value* value = _icfp_eval_new_value(heap, _ValueType_int);
+    value->num = x;
+    return value;
+}
+
+
+static struct _Value*
+_icfp_eval_new_bigint(struct _Arena* heap, struct _BigInt* num) {
+    int64_t x;
+    if (bigint_to_int64(num, &x) == 0) {
+        return _icfp_eval_new_int(heap, x);
+    }
+    struct _Value* value = _icfp_eval_new_value(heap, _ValueType_int);
+    value->big = num;
+    return value;
+}
+
+
+static struct _BigInt*
+_icfp_eval_bigint(struct _Arena* heap, struct _Value* value) {
+    if (value->big != NULL) {
+        return value->big;
+    }
+    return bigint_from_int64(heap, value->num);
+}
+
+
+static int
+_icfp_reader_token(struct _TermReader* reader, const char** token, size_t* len) {
+    const char* p = reader->p;
+    const char* end = reader->end;
+    while (p < end && (*p == ' ' || *p == '\n' || *p == '\t' || *p == '\r')) { ++p; }
+    if (p == end) {
+        reader->p = p;
+        return 1;
+    }
+    const char* q = p;
+    while (q < end && *q > ' ' && *q < 0x7f) { ++q; }
+    if (q == p) {
+        fprintf(_icfp_stderr, "%s:%zu: invalid char %c\n", reader->filename, (size_t) (p - reader->text), *p);
+        return -1;
+    }
+    reader->p = q;
+    *token = p;
+    *len = q - p;
+    return 0;
+}
+
+
+static int
+_icfp_reader_var_number(struct _TermReader* reader, const char* s, size_t len, uint64_t* number) {
+    uint64_t x = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (x > (UINT64_MAX - 93) / 94) {
+            fprintf(_icfp_stderr, "%s: variable number is too large\n", reader->filename);
+            return 1;
+        }
+        x = x * 94 + (uint8_t) (s[i] - '!');
+    }
+    *number = x;
+    return 0;
+}
+
+
+// The write span a token at p lies in the innermost of, plus 1, or 0. Spans
+// nest and come in the order they start, and tokens are read in order.
+static size_t
+_icfp_reader_owner(struct _TermReader* reader, const char* p) {
+    size_t at = p - reader->text;
+    const struct _WriteSpan* spans = reader->spans;
+    while (reader->spans_depth > 0 && spans[reader->spans_open[reader->spans_depth-1]].end <= at) {
+        reader->spans_depth -= 1;
+    }
+    while (reader->spans_next < reader->spans_used && spans[reader->spans_next].start <= at) {
+        if (spans[reader->spans_next].end > at) {
+            reader->spans_open[reader->spans_depth++] = reader->spans_next;
+        }
+        reader->spans_next += 1;
+    }
+    return reader->spans_depth > 0 ? reader->spans_open[reader->spans_depth-1] + 1 : 0;
+}
+
+
+static int
+_icfp_reader_read_term(struct _TermReader* reader, struct _Term** parsed) {
+    const char* token;
+    size_t len;
+    int res = _icfp_reader_token(reader, &token, &len);
+    if (res > 0) {
+        fprintf(_icfp_stderr, "%s: unexpected end of ICFP\n", reader->filename);
+        return 1;
+    }
+    if (res != 0) { return 1; }
+
+    struct _Arena* heap = reader->heap;
+    struct _Term* term = (struct _Term*) arena_alloc(heap, sizeof(struct _Term));
+    *term = {};
+    *parsed = term;
+    switch (token[0]) {
+        case 'T':
+        case 'F':
+            term->type = _TermType_literal;
+            term->value = _icfp_eval_new_value(heap, _ValueType_bool);
+            term->value->num = token[0] == 'T';
+            term->value->moved = term->value;
+            return 0;
+        case 'I': {
+            term->type = _TermType_literal;
+            uint8_t* digits = (uint8_t*) arena_alloc(heap, len);
+            for (size_t i = 1; i < len; ++i) {
+                digits[i-1] = token[i] - '!';
+            }
+            struct _BigInt* num = bigint_from_digits(heap, digits, len - 1, 94);
+            term->value = _icfp_eval_new_bigint(heap, num);
+            term->value->moved = term->value;
+            return 0;
+        }
+        case 'S': {
+            term->type = _TermType_literal;
+            char* s = (char*) arena_alloc(heap, len);
+            for (size_t i = 1; i < len; ++i) {
+                s[i-1] = _icfp_abc94[token[i] - '!'];
+            }
+            term->value = _icfp_eval_new_value(heap, _ValueType_str);
+            term->value->str = s;
+            term->value->len = len - 1;
+            term->value->moved = term->value;
+            return 0;
+        }
+        case 'A':
+            if (len != 2 || token[1] != 'T') { break; }
+            term->type = _TermType_unary;
+            term->op = 'A';
+            return _icfp_reader_read_term(reader, &term->t0);
+        case 'U':
+            if (len != 2) { break; }
+            switch (token[1]) {
+                case '-':
+                case '!':
+                case '#':
+                case '$':
+                    term->type = _TermType_unary;
+                    term->op = token[1];
+                    return _icfp_reader_read_term(reader, &term->t0);
+            }
+            break;
+        case 'B':
+            if (len != 2) { break; }
+            switch (token[1]) {
+                case '+': case '-': case '*': case '/': case '%':
+                case '<': case '>': case '=': case '|': case '&':
+                case '.': case 'T': case 'D': case '$': case '~': case '!':
+                    term->type = _TermType_binary;
+                    term->op = token[1];
+                    res = _icfp_reader_read_term(reader, &term->t0);
+                    if (res != 0) { return res; }
+                    return _icfp_reader_read_term(reader, &term->t1);
+            }
+            break;
+        case '?':
+            if (len != 1) { break; }
+            term->type = _TermType_if;
+            res = _icfp_reader_read_term(reader, &term->t0);
+            if (res != 0) { return res; }
+            res = _icfp_reader_read_term(reader, &term->t1);
+            if (res != 0) { return res; }
+            return _icfp_reader_read_term(reader, &term->t2);
+        case 'L': {
+            uint64_t number;
+            res = _icfp_reader_var_number(reader, token + 1, len - 1, &number);
+            if (res != 0) { return res; }
+            if (reader->depth >= reader->binders_size) {
+                reader->binders_size = reader->binders_size ? reader->binders_size * 2 : 64;
+                reader->binders = (uint64_t*) realloc(reader->binders, reader->binders_size * sizeof(uint64_t));
+            }
+            reader->binders[reader->depth++] = number;
+            term->type = _TermType_lambda;
+            if (reader->spans_used > 0) {
+                term->owner = _icfp_reader_owner(reader, token);
+            }
+            res = _icfp_reader_read_term(reader, &term->t0);
+            reader->depth -= 1;
+            return res;
+        }
+        case 'v': {
+            uint64_t number;
+            res = _icfp_reader_var_number(reader, token + 1, len - 1, &number);
+            if (res != 0) { return res; }
+            for (size_t i = reader->depth; i > 0; --i) {
+                if (reader->binders[i-1] == number) {
+                    term->type = _TermType_var;
+                    term->index = reader->depth - i;
+                    return 0;
+                }
+            }
+            term->type = _TermType_free;
+            char* s = (char*) arena_alloc(heap, len);
+            memcpy(s, token, len);
+            term->value = _icfp_eval_new_value(heap, _ValueType_str);
+            term->value->str = s;
+            term->value->len = len;
+            term->value->moved = term->value;
+            return 0;
+        }
+    }
+    fprintf(_icfp_stderr, "%s: invalid token %.*s\n", reader->filename, (int) len, token);
+    return 1;
+}
+
+
+static int
+icfp_eval_read(struct _EvalState* context, const char* filename, const char* text, size_t size, struct _Term** parsed) {
+    struct _TermReader reader = {};
+    reader.filename = filename;
+    reader.text = text;
+    reader.p = text;
+    reader.end = text + size;
+    reader.heap = &context->terms;
+    if (context->budget != NULL && context->budget->spans_used > 0) {
+        reader.spans = context->budget->spans;
+        reader.spans_used = context->budget->spans_used;
+        reader.spans_open = (size_t*) malloc(reader.spans_used * sizeof(size_t));
+    }
+    int res = _icfp_reader_read_term(&reader, parsed);
+    free(reader.binders);
+    free(reader.spans_open);
+    if (res != 0) { return res; }
+    const char* token;
+    size_t len;
+    res = _icfp_reader_token(&reader, &token, &len);
+    if (res == 0) {
+        fprintf(_icfp_stderr, "%s: unexpected token %.*s\n", filename, (int) len, token);
+        return 1;
+    }
+    return res < 0;
+}
+
+
+// Copies what the roots reach to a new heap. Objects are copied as they are
+// found and queued for their own pointers to be updated, so that long
+// chains of frames take no stack. Strings and big ints are copied with the
+// value that holds them.
+enum _GcItemType {
+    _GcItemType_value,
+    _GcItemType_thunk,
+    _GcItemType_env,
+};
+
+
+struct _GcItem {
+    enum _GcItemType type;
+    void* p;
+};
+
+
+struct _Collector {
+    struct _Arena to;
+    struct _GcItem* items;
+    size_t items_size;
+    size_t items_used;
+};
+
+
+static void
+_icfp_gc_push(struct _Collector* gc, enum _GcItemType type, void* p) {
+    if (gc->items_used == gc->items_size) {
+        gc->items_size = gc->items_size ? gc->items_size * 2 : 0x1000;
+        gc->items = (struct _GcItem*) realloc(gc->items, gc->items_size * sizeof(struct _GcItem));
+    }
+    gc->items[gc->items_used++] = {type, p};
+}
+
+
+static struct _Value*
+_icfp_gc_value(struct _Collector* gc, struct _Value* value) {
+    if (value == NULL) {
+        return NULL;
+    }
+    if (value->moved != NULL) {
+        return value->moved;
+    }
+    struct _Value* copy = (struct _Value*) arena_alloc(&gc->to, sizeof(struct _Value));
+    *copy = *value;
+    value->moved = copy;
+    switch (value->type) {
+        case _ValueType_int:
+            if (value->big != NULL) {
+                copy->big = bigint_alloc(&gc->to, value->big->len);
+                copy->big->neg = value->big->neg;
+                memcpy(copy->big->limbs, value->big->limbs, value->big->len * sizeof(uint32_t));
+            }
+            break;
+        case _ValueType_str: {
+            // a string may be a slice of another, so only its own bytes go
+            char* str = (char*) arena_alloc(&gc->to, value->len);
+            memcpy(str, value->str, value->len);
+            copy->str = str;
+            break;
+        }
+        case _ValueType_lambda:
+            if (value->env != NULL) {
+                _icfp_gc_push(gc, _GcItemType_value, copy);
+            }
+            break;
+        case _ValueType_bool:
+            break;
+    }
+    return copy;
+}
+
+
+static struct _Thunk*
+_icfp_gc_thunk(struct _Collector* gc, struct _Thunk* thunk) {
+    if (thunk->forcing < 0) {
+        return thunk->moved;
+    }
+    struct _Thunk* copy = (struct _Thunk*) arena_alloc(&gc->to, sizeof(struct _Thunk));
+    *copy = *thunk;
+    thunk->moved = copy;
+    thunk->forcing = -1;
+    _icfp_gc_push(gc, _GcItemType_thunk, copy);
+    return copy;
+}
+
+
+static struct _Env*
+_icfp_gc_env(struct _Collector* gc, struct _Env* env) {
+    if (env == NULL) {
+        return NULL;
+    }
+    if (env->thunk == NULL) {
+        return env->next;
+    }
+    struct _Env* copy = (struct _Env*) arena_alloc(&gc->to, sizeof(struct _Env));
+    *copy = *env;
+    env->thunk = NULL;
+    env->next = copy;
+    _icfp_gc_push(gc, _GcItemType_env, copy);
+    return copy;
+}
+
+
+// Reports a runtime error of the program, by where it starts when the
+// writer says so.
+static void
+_icfp_eval_fail(const struct _EvalState* context, const char* message) {
+    if (context->label != NULL) {
+        fprintf(_icfp_stderr, "! %s: %s\n", context->label, message);
+    }
+    else {
+        fprintf(_icfp_stderr, "! eval: %s\n", message);
+    }
+}
+
+
+// Collects the heap, and fails once what is live takes more than half of
+// _EvalHeapMax, as the next collection would let the heap outgrow it.
+static int
+_icfp_eval_collect(struct _EvalState* context) {
+    struct _Collector gc = {};
+    arena_init(&gc.to, _ArenaChunkSize);
+    for (struct _EvalRoot* root = context->roots; root != NULL; root = root->parent) {
+        root->env = _icfp_gc_env(&gc, root->env);
+        root->value = _icfp_gc_value(&gc, root->value);
+        if (root->thunk != NULL) {
+            root->thunk = _icfp_gc_thunk(&gc, root->thunk);
+        }
+    }
+    while (gc.items_used > 0) {
+        struct _GcItem item = gc.items[--gc.items_used];
+        switch (item.type) {
+            case _GcItemType_value: {
+                struct _Value* value = (struct _Value*) item.p;
+                value->env = _icfp_gc_env(&gc, value->env);
+                break;
+            }
+            case _GcItemType_thunk: {
+                struct _Thunk* thunk = (struct _Thunk*) item.p;
+                thunk->env = _icfp_gc_env(&gc, thunk->env);
+                thunk->value = _icfp_gc_value(&gc, thunk->value);
+                break;
+            }
+            case _GcItemType_env: {
+                struct _Env* env = (struct _Env*) item.p;
+                env->thunk = _icfp_gc_thunk(&gc, env->thunk);
+                env->next = _icfp_gc_env(&gc, env->next);
+                break;
+            }
+        }
+    }
+    free(gc.items);
+    context->peak = icfp_eval_peak(context);
+    arena_free(&context->heap);
+    context->heap = gc.to;
+    size_t live = context->heap.used;
+    if (context->verbose) {
+        fprintf(_icfp_stderr, "eval: %zu bytes of heap live after collecting\n", live);
+    }
+    if (live > _EvalHeapMax / 2) {
+        char message[64];
+        snprintf(message, sizeof(message), "out of memory, %zu bytes of heap live", live);
+        _icfp_eval_fail(context, message);
+        return 1;
+    }
+    context->collect_at = live * 2 > _EvalCollectMin ? live * 2 : _EvalCollectMin;
+    return 0;
+}
+
+
+static struct _Value*
+_icfp_eval_term(struct _EvalState* context, struct _Term* term, struct _Env* env);
+
+
+static struct _Value*
+_icfp_eval_force(struct _EvalState* context, struct _Thunk* thunk) {
+    if (thunk->value != NULL) {
+        return thunk->value;
+    }
+    if (thunk->forcing) {
+        _icfp_eval_fail(context, "infinite loop");
+        return NULL;
+    }
+    thunk->forcing = 1;
+    struct _EvalRoot root = {NULL, NULL, thunk, context->roots};
+    context->roots = &root;
+    struct _Value* value = _icfp_eval_term(context, thunk->term, thunk->env);
+    context->roots = root.parent;
+    thunk = root.thunk;
+    thunk->forcing = 0;
+    if (thunk->by_name) {
+        return value;
+    }
+    thunk->value = value;
+    thunk->term = NULL;
+    thunk->env = NULL;
+    return value;
+}
+
+
+static struct _Thunk*
+_icfp_eval_new_thunk(struct _EvalState* context, struct _Term* term, struct _Env* env) {
+    struct _Thunk* thunk = (struct _Thunk*) arena_alloc(&context->heap, sizeof(struct _Thunk));
+    thunk->forcing = 0;
+    thunk->by_name = 0;
+    if (term->type == _TermType_literal) {
+        thunk->value = term->value;
+        thunk->term = NULL;
+        thunk->env = NULL;
+    }
+    else {
+        thunk->value = NULL;
+        thunk->term = term;
+        thunk->env = env;
+    }
+    return thunk;
+}
+
+
+static struct _Thunk*
+_icfp_eval_delay(struct _EvalState* context, struct _Term* term, struct _Env* env) {
+    if (term->type == _TermType_var) {
+        struct _Env* p = env;
+        for (size_t i = term->index; i > 0; --i) { p = p->next; }
+        return p->thunk;
+    }
+    return _icfp_eval_new_thunk(context, term, env);
+}
+
+
+static const char*
+_icfp_eval_type_name(enum _ValueType type) {
+    switch (type) {
+        case _ValueType_bool: return "bool";
+        case _ValueType_int: return "int";
+        case _ValueType_str: return "string";
+        case _ValueType_lambda: return "lambda";
+    }
+    return "?";
+}
+
+
+static struct _Value*
+_icfp_eval_expect(const struct _EvalState* context, struct _Value* value, enum _ValueType type, int op) {
+    if (value == NULL) {
+        return NULL;
+    }
+    if (value->type != type) {
+        char message[64];
+        snprintf(message, sizeof(message), "operator %c expects %s, got %s", op, _icfp_eval_type_name(type),
+            _icfp_eval_type_name(value->type));
+        _icfp_eval_fail(context, message);
+        return NULL;
+    }
+    return value;
+}
+
+
+static struct _Value*
+_icfp_eval_unary(struct _EvalState* context, int op, struct _Value* x) {
+    struct _Arena* heap = &context->heap;
+    switch (op) {
+        case 'A':
+            if (_icfp_eval_expect(context, x, _ValueType_bool, op) == NULL) { return NULL; }
+            if (x->num == 0) {
+                _icfp_eval_fail(context, "assertion failed");
+                return NULL;
+            }
+            return x;
+        case '-':
+            if (_icfp_eval_expect(context, x, _ValueType_int, op) == NULL) { return NULL; }
+            if (x->big == NULL && x->num != INT64_MIN) {
+                return _icfp_eval_new_int(heap, -x->num);
+            }
+            else {
+                struct _BigInt* num = bigint_from_int64(heap, 0);
+                return _icfp_eval_new_bigint(heap, bigint_sub(heap, num, _icfp_eval_bigint(heap, x)));
+            }
+        case '!':
+            if (_icfp_eval_expect(context, x, _ValueType_bool, op) == NULL) { return NULL; }
+            return x->num ? context->value_false : context->value_true;
+        case '#': {
+            if (_icfp_eval_expect(context, x, _ValueType_str, op) == NULL) { return NULL; }
+            uint8_t* digits = (uint8_t*) arena_alloc(heap, x->len + 1);
+            for (size_t i = 0; i < x->len; ++i) {
+                digits[i] = _icfp_abc94_index[(uint8_t) x->str[i]];
+            }
+            return _icfp_eval_new_bigint(heap, bigint_from_digits(heap, digits, x->len, 94));
+        }
+        case '$': {
+            if (_icfp_eval_expect(context, x, _ValueType_int, op) == NULL) { return NULL; }
+            struct _Value* value = _icfp_eval_new_value(heap, _ValueType_str);
+            if (x->big == NULL && x->num <= 0) {
+                value->str = _icfp_abc94;
+                value->len = 1;
+                return value;
+            }
+            size_t count;
+            uint8_t* digits = bigint_to_digits(heap, _icfp_eval_bigint(heap, x), 94, &count);
+            for (size_t i = 0; i < count; ++i) {
+                digits[i] = _icfp_abc94[digits[i]];
+            }
+            value->str = (const char*) digits;
+            value->len = count;
+            return value;
+        }
+    }
+    abort();
+}
+
+
+static struct _Value*
+_icfp_eval_arith(struct _EvalState* context, int op, struct _Value* x, struct _Value* y) {
+    struct _Arena* heap = &context->heap;
+    if (x->big == NULL && y->big == NULL) {
+        int64_t a = x->num;
+        int64_t b = y->num;
+        int64_t r;
+        switch (op) {
+            case '+':
+                if (!__builtin_add_overflow(a, b, &r)) { return _icfp_eval_new_int(heap, r); }
+                break;
+            case '-':
+                if (!__builtin_sub_overflow(a, b, &r)) { return _icfp_eval_new_int(heap, r); }
+                break;
+            case '*':
+                if (!__builtin_mul_overflow(a, b, &r)) { return _icfp_eval_new_int(heap, r); }
+                break;
+            case '/':
+            case '%':
+                if (b == 0) {
+                    _icfp_eval_fail(context, "division by zero");
+                    return NULL;
+                }
+                if (a == INT64_MIN && b == -1) { break; }
+                return _icfp_eval_new_int(heap, op == '/' ? a / b : a % b);
+            case '<':
+                return a < b ? context->value_true : context->value_false;
+            case '>':
+                return a > b ? context->value_true : context->value_false;
+            case '=':
+                return a == b ? context->value_true : context->value_false;
+        }
+    }
+    struct _BigInt* a = _icfp_eval_bigint(heap, x);
+    struct _BigInt* b = _icfp_eval_bigint(heap, y);
+    switch (op) {
+        case '+':
+            return _icfp_eval_new_bigint(heap, bigint_add(heap, a, b));
+        case '-':
+            return _icfp_eval_new_bigint(heap, bigint_sub(heap, a, b));
+        case '*':
+            return _icfp_eval_new_bigint(heap, bigint_mul(heap, a, b));
+        case '/':
+        case '%': {
+            struct _BigInt* q;
+            struct _BigInt* r;
+            if (bigint_divmod(heap, a, b, &q, &r) != 0) {
+                _icfp_eval_fail(context, "division by zero");
+                return NULL;
+            }
+            return _icfp_eval_new_bigint(heap, op == '/' ? q : r);
+        }
+        case '<':
+            return bigint_cmp(a, b) < 0 ? context->value_true : context->value_false;
+        case '>':
+            return bigint_cmp(a, b) > 0 ? context->value_true : context->value_false;
+        case '=':
+            return bigint_cmp(a, b) == 0 ? context->value_true : context->value_false;
+    }
+    abort();
+}
+
+
+static struct _Value*
+_icfp_eval_binary(struct _EvalState* context, int op, struct _Value* x, struct _Value* y) {
+    struct _Arena* heap = &context->heap;
+    if (x == NULL || y == NULL) {
+        return NULL;
+    }
+    switch (op) {
+        case '+':
+        case '-':
+        case '*':
+        case '/':
+        case '%':
+        case '<':
+        case '>':
+            if (_icfp_eval_expect(context, x, _ValueType_int, op) == NULL) { return NULL; }
+            if (_icfp_eval_expect(context, y, _ValueType_int, op) == NULL) { return NULL; }
+            return _icfp_eval_arith(context, op, x, y);
+        case '=':
+            if (x->type != y->type) {
+                return context->value_false;
+            }
+            switch (x->type) {
+                case _ValueType_int:
+                    return _icfp_eval_arith(context, op, x, y);
+                case _ValueType_bool:
+                    return x->num == y->num ? context->value_true : context->value_false;
+                case _ValueType_str:
+                    return x->len == y->len && memcmp(x->str, y->str, x->len) == 0 ? context->value_true : context->value_false;
+                case _ValueType_lambda:
+                    _icfp_eval_fail(context, "cannot compare lambdas");
+                    return NULL;
+            }
+            break;
+        case '|':
+        case '&':
+            if (_icfp_eval_expect(context, x, _ValueType_bool, op) == NULL) { return NULL; }
+            if (_icfp_eval_expect(context, y, _ValueType_bool, op) == NULL) { return NULL; }
+            if (op == '|') {
+                return x->num || y->num ? context->value_true : context->value_false;
+            }
+            return x->num && y->num ? context->value_true : context->value_false;
+        case '.': {
+            if (_icfp_eval_expect(context, x, _ValueType_str, op) == NULL) { return NULL; }
+            if (_icfp_eval_expect(context, y, _ValueType_str, op) == NULL) { return NULL; }
+            struct _Value* value = _icfp_eval_new_value(heap, _ValueType_str);
+            char* s = (char*) arena_alloc(heap, x->len + y->len + 1);
+            memcpy(s, x->str, x->len);
+            memcpy(s + x->len, y->str, y->len);
+            value->str = s;
+            value->len = x->len + y->len;
+            return value;
+        }
+        case 'T':
+        case 'D': {
+            if (_icfp_eval_expect(context, x, _ValueType_int, op) == NULL) { return NULL; }
+            if (_icfp_eval_expect(context, y, _ValueType_str, op) == NULL) { return NULL; }
+            size_t n = y->len;
+            if ((x->big == NULL && x->num <= 0) || (x->big != NULL && x->big->neg)) {
+                n = 0;
+            }
+            else if (x->big == NULL && (uint64_t) x->num < y->len) {
+                n = x->num;
+            }
+            struct _Value* value = _icfp_eval_new_value(heap, _ValueType_str);
+            if (op == 'T') {
+                value->str = y->str;
+                value->len = n;
+            }
+            else {
+                value->str = y->str + n;
+                value->len = y->len - n;
+            }
+            return value;
+        }
+    }
+    abort();
+}
+
+
+// Evaluates term in the frame root holds, which the collector updates, as
+// it does the values and thunks root holds on to meanwhile. The heap is
+// only collected as a term starts, where nothing else is live.
+static struct _Value*
+_icfp_eval_loop(struct _EvalState* context, struct _Term* term, struct _EvalRoot* root) {
+    char mark;
+    if (&mark < context->stack_limit) {
+        _icfp_eval_fail(context, "recursion is too deep");
+        return NULL;
+    }
+    for (;;) {
+        if (context->heap.used > context->collect_at && _icfp_eval_collect(context) != 0) {
+            return NULL;
+        }
+        switch (term->type) {
+            case _TermType_literal:
+                return term->value;
+            case _TermType_var: {
+                struct _Env* p = root->env;
+                for (size_t i = term->index; i > 0; --i) { p = p->next; }
+                return _icfp_eval_force(context, p->thunk);
+            }
+            case _TermType_lambda: {
+                struct _Value* value = _icfp_eval_new_value(&context->heap, _ValueType_lambda);
+                value->term = term;
+                value->env = root->env;
+                return value;
+            }
+            case _TermType_unary: {
+                struct _Value* x = _icfp_eval_term(context, term->t0, root->env);
+                if (x == NULL) { return NULL; }
+                if (context->budget != NULL) {
+                    context->budget->unary_ops[term->op] += 1;
+                }
+                return _icfp_eval_unary(context, term->op, x);
+            }
+            case _TermType_binary:
+                switch (term->op) {
+                    case '$':
+                    case '~':
+                    case '!': {
+                        struct _Value* f = _icfp_eval_term(context, term->t0, root->env);
+                        if (_icfp_eval_expect(context, f, _ValueType_lambda, term->op) == NULL) { return NULL; }
+                        struct _Thunk* thunk = _icfp_eval_delay(context, term->t1, root->env);
+                        if (thunk->by_name && term->op != '$') {
+                            // B~ and B! evaluate a variable bound by name once,
+                            // rather than at each use
+                            thunk = _icfp_eval_new_thunk(context, term->t1, root->env);
+                        }
+                        if (term->op == '!') {
+                            root->value = f;
+                            root->thunk = thunk;
+                            struct _Value* x = _icfp_eval_force(context, thunk);
+                            f = root->value;
+                            thunk = root->thunk;
+                            root->value = NULL;
+                            root->thunk = NULL;
+                            if (x == NULL) { return NULL; }
+                        }
+                        struct _Env* frame = (struct _Env*) arena_alloc(&context->heap, sizeof(struct _Env));
+                        frame->thunk = thunk;
+                        frame->next = f->env;
+                        context->betas += 1;
+                        struct _EvalBudget* budget = context->budget;
+                        if (budget != NULL) {
+                            if (term->op == '$' && term->t1->type != _TermType_var) {
+                                // a variable's thunk is its binder's to keep
+                                thunk->by_name = 1;
+                            }
+                            budget->charges[f->term->owner] += 1;
+                            if (context->betas > budget->limit) {
+                                budget->exceeded = 1;
+                                return NULL;
+                            }
+                        }
+                        term = f->term->t0;
+                        root->env = frame;
+                        continue;
+                    }
+                    default: {
+                        struct _Value* x = _icfp_eval_term(context, term->t0, root->env);
+                        if (x == NULL) { return NULL; }
+                        root->value = x;
+                        struct _Value* y = _icfp_eval_term(context, term->t1, root->env);
+                        x = root->value;
+                        root->value = NULL;
+                        if (context->budget != NULL && y != NULL) {
+                            context->budget->binary_ops[term->op] += 1;
+                        }
+                        return _icfp_eval_binary(context, term->op, x, y);
+                    }
+                }
+            case _TermType_if: {
+                struct _Value* c = _icfp_eval_term(context, term->t0, root->env);
+                if (_icfp_eval_expect(context, c, _ValueType_bool, '?') == NULL) { return NULL; }
+                if (context->budget != NULL) {
+                    context->budget->ifs += 1;
+                }
+                term = c->num ? term->t1 : term->t2;
+                continue;
+            }
+            case _TermType_free: {
+                char message[64];
+                snprintf(message, sizeof(message), "unbound variable %.*s", (int) term->value->len, term->value->str);
+                _icfp_eval_fail(context, message);
+                return NULL;
+            }
+        }
+        abort();
+    }
+}
+
+
+static struct _Value*
+_icfp_eval_term(struct _EvalState* context, struct _Term* term, struct _Env* env) {
+    struct _EvalRoot root = {env, NULL, NULL, context->roots};
+    context->roots = &root;
+    struct _Value* value = _icfp_eval_loop(context, term, &root);
+    context->roots = root.parent;
+    return value;
+}
+
+
+static int
+icfp_eval_print_value(struct _EvalState* context, struct _Value* value, FILE* file) {
+    int res = 0;
+    size_t len = 0;
+    switch (value->type) {
+        case _ValueType_bool:
+            res = fputs(value->num ? "true" : "false", file);
+            len = value->num ? 4 : 5;
+            break;
+        case _ValueType_int: {
+            if (value->big == NULL) {
+                res = fprintf(file, "%lld", (long long) value->num);
+                len = res > 0 ? res : 0;
+                break;
+            }
+            size_t count;
+            uint8_t* digits = bigint_to_digits(&context->heap, value->big, 10, &count);
+            for (size_t i = 0; i < count; ++i) {
+                digits[i] += '0';
+            }
+            if (value->big->neg) {
+                res = fputc('-', file);
+                if (res == EOF) { break; }
+            }
+            res = fwrite(digits, 1, count, file) == count ? 0 : EOF;
+            len = count + value->big->neg;
+            break;
+        }
+        case _ValueType_str:
+            res = fwrite(value->str, 1, value->len, file) == value->len ? 0 : EOF;
+            len = value->len;
+            break;
+        case _ValueType_lambda:
+            res = fputs("<lambda>", file);
+            len = 8;
+            break;
+    }
+    if (res == EOF) { perror(NULL); return 1; }
+    context->written += len;
+    return 0;
+}
+
+
+struct _EvalTask {
+    struct _EvalState* context;
+    struct _Term* term;
+    struct _Value* value;
+    size_t stack_size;
+    FILE* errors;
+};
+
+
+static void*
+_icfp_eval_task_run(void* arg) {
+    struct _EvalTask* task = (struct _EvalTask*) arg;
+    _icfp_stderr = task->errors;
+    char mark;
+    task->context->stack_limit = (const char*) ((uintptr_t) &mark - (task->stack_size - _EvalStackReserve));
+    task->value = _icfp_eval_term(task->context, task->term, NULL);
+    return NULL;
+}
+
+
+static void
+_icfp_eval_budget_start(struct _EvalBudget* budget) {
+    budget->exceeded = 0;
+    memset(budget->unary_ops, 0, sizeof(budget->unary_ops));
+    memset(budget->binary_ops, 0, sizeof(budget->binary_ops));
+    budget->ifs = 0;
+    if (budget->charges_size < budget->spans_used + 1) {
+        budget->charges_size = budget->spans_used + 1;
+        budget->charges = (size_t*) realloc(budget->charges, budget->charges_size * sizeof(size_t));
+    }
+    memset(budget->charges, 0, (budget->spans_used + 1) * sizeof(size_t));
+}
+
+
+struct _BudgetCharge {
+    const char* name;
+    size_t betas;
+};
+
+
+static int
+_icfp_eval_by_charge(const void* a, const void* b) {
+    const struct _BudgetCharge* x = (const struct _BudgetCharge*) a;
+    const struct _BudgetCharge* y = (const struct _BudgetCharge*) b;
+    if (x->betas != y->betas) {
+        return x->betas < y->betas ? 1 : -1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+
+// Reports what a budgeted program spent, with its reductions summed by the
+// define whose lambda was applied, and whether it kept to the budget.
+static int
+_icfp_eval_budget_report(struct _EvalState* context, const char* filename) {
+    struct _EvalBudget* budget = context->budget;
+    if (budget->exceeded) {
+        fprintf(_icfp_stderr, "! %s: beta reductions exceed the budget of %zu\n", filename, budget->limit);
+    }
+    else {
+        fprintf(_icfp_stderr, "%s: %zu beta reductions of %zu\n", filename, context->betas, budget->limit);
+    }
+    fprintf(_icfp_stderr, "%s: %zu bytes of heap at most\n", filename, icfp_eval_peak(context));
+    fprintf(_icfp_stderr, "%s: ops", filename);
+    for (int op = 0; op < 128; ++op) {
+        if (budget->unary_ops[op] == 0) { continue; }
+        if (op == 'A') {
+            fprintf(_icfp_stderr, " AT %zu", budget->unary_ops[op]);
+        }
+        else {
+            fprintf(_icfp_stderr, " U%c %zu", op, budget->unary_ops[op]);
+        }
+    }
+    for (int op = 0; op < 128; ++op) {
+        if (budget->binary_ops[op] == 0) { continue; }
+        fprintf(_icfp_stderr, " B%c %zu", op, budget->binary_ops[op]);
+    }
+    fprintf(_icfp_stderr, " ? %zu\n", budget->ifs);
+
+    // a define expanded more than once sums over its spans
+    struct _BudgetCharge* charges = (struct _BudgetCharge*) calloc(budget->spans_used + 1, sizeof(struct _BudgetCharge));
+    size_t count = 0;
+    for (size_t i = 1; i <= budget->spans_used; ++i) {
+        if (budget->charges[i] == 0) { continue; }
+        const char* name = budget->spans[i-1].name;
+        size_t j = 0;
+        while (j < count && charges[j].name != name && strcmp(charges[j].name, name) != 0) { ++j; }
+        if (j == count) {
+            charges[count++] = {name, 0};
+        }
+        charges[j].betas += budget->charges[i];
+    }
+    qsort(charges, count, sizeof(struct _BudgetCharge), _icfp_eval_by_charge);
+    for (size_t j = 0; j < count; ++j) {
+        fprintf(_icfp_stderr, "%s: %zu in %s\n", filename, charges[j].betas, charges[j].name);
+    }
+    if (budget->charges[0] > 0) {
+        fprintf(_icfp_stderr, "%s: %zu outside defines\n", filename, budget->charges[0]);
+    }
+    free(charges);
+    return budget->exceeded;
+}
+
+
+// Evaluates a program and writes its value to file, or only checks it
+// against the budget when file is NULL.
+static int
+icfp_eval_text(struct _EvalState* context, const char* filename, const char* text, size_t size, FILE* file) {
+    uint64_t start = _clock_ns(CLOCK_MONOTONIC);
+    struct _EvalTask task = {};
+    task.context = context;
+    task.errors = _icfp_stderr;
+    int res = icfp_eval_read(context, filename, text, size, &task.term);
+    if (res != 0) { return res; }
+    context->label = filename;
+
+    context->betas = 0;
+    if (context->budget != NULL) {
+        _icfp_eval_budget_start(context->budget);
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, _EvalStackSize);
+    pthread_t thread;
+    task.stack_size = _EvalStackSize;
+    if (pthread_create(&thread, &attr, _icfp_eval_task_run, &task) == 0) {
+        pthread_join(thread, NULL);
+    }
+    else {
+        task.stack_size = _EvalStackReserve * 2;
+        _icfp_eval_task_run(&task);
+    }
+    pthread_attr_destroy(&attr);
+
+    if (context->verbose) {
+        fprintf(_icfp_stderr, "%s: %zu beta reductions\n", filename, context->betas);
+        fprintf(_icfp_stderr, "%s: %zu bytes of heap\n", filename, icfp_eval_peak(context));
+    }
+    res = 1;
+    if (context->budget != NULL && _icfp_eval_budget_report(context, filename) != 0) {
+        task.value = NULL;
+    }
+    if (task.value != NULL && file == NULL) {
+        res = 0;
+    }
+    else if (task.value != NULL) {
+        res = icfp_eval_print_value(context, task.value, file);
+        if (res == 0 && fputc('\n', file) == EOF) {
+            perror(NULL);
+            res = 1;
+        }
+        context->written += res == 0;
+    }
+    context->label = NULL;
+    icfp_eval_reset(context);
+    context->eval_ns += _clock_ns(CLOCK_MONOTONIC) - start;
+    return res;
+}
+
+
+// C++ output for -C. The program is written after a runtime of its own:
+// values as the evaluator has them, with small ints unboxed and big ones in
+// 32-bit limbs, thunks that keep the value they are forced to, and
+// environments of thunks that variables index like the ICFP does. The
+// heap is never collected, as the generated functions hold it in plain
+// locals; it is bounded instead by HEAP_MAX, which a build may set.
+
+static const char
+_icfp_cpp_runtime[] = R"__(// generated by icfpc
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum { T_BOOL, T_INT, T_STR, T_LAMBDA };
+
+struct Env;
+struct Value;
+typedef Value* (*Code)(Env*);
+
+struct Big {
+    int neg;
+    size_t len;
+    uint32_t* limbs;
+};
+
+struct Value {
+    int type;
+    int64_t num;
+    Big* big;
+    const char* str;
+    size_t len;
+    Code code;
+    Env* env;
+};
+
+struct Thunk {
+    Code code;
+    Env* env;
+    Value* value;
+    int forcing;
+};
+
+struct Env {
+    Thunk* thunk;
+    Env* next;
+};
+
+static const char abc94[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789!\"#$%&'()*+,-./:;<=>?@[\\]^_`|~ \n";
+static uint8_t abc94_index[256];
+static char* heap_p;
+static char* heap_end;
+static size_t heap_size;
+static Value value_false = {T_BOOL, 0};
+static Value value_true = {T_BOOL, 1};
+
+// nothing is freed, so a program fails once it has allocated HEAP_MAX bytes
+#ifndef HEAP_MAX
+#define HEAP_MAX 0x40000000
+#endif
+
+static void*
+alloc(size_t n) {
+    n = (n + 15) & ~(size_t) 15;
+    if ((size_t) (heap_end - heap_p) < n) {
+        size_t size = n > 0x100000 ? n : 0x100000;
+        heap_size += size;
+        heap_p = heap_size <= (size_t) HEAP_MAX ? (char*) malloc(size) : NULL;
+        if (heap_p == NULL) {
+            fflush(stdout);
+            fprintf(stderr, "! eval: out of memory, %zu bytes of heap\n", heap_size - size);
+            exit(1);
+        }
+        heap_end = heap_p + size;
+    }
+    void* p = heap_p;
+    heap_p += n;
+    return p;
+}
+
+static void
+fail(const char* message) {
+    fflush(stdout);
+    fprintf(stderr, "! eval: %s\n", message);
+    exit(1);
+}
+
+static const char*
+type_name(int type) {
+    switch (type) {
+        case T_BOOL: return "bool";
+        case T_INT: return "int";
+        case T_STR: return "string";
+        case T_LAMBDA: return "lambda";
+    }
+    return "?";
+}
+
+static inline Value*
+expect(Value* x, int type, int op) {
+    if (x->type != type) {
+        fflush(stdout);
+        fprintf(stderr, "! eval: operator %c expects %s, got %s\n", op, type_name(type), type_name(x->type));
+        exit(1);
+    }
+    return x;
+}
+
+static inline Value*
+truth(int x) {
+    return x ? &value_true : &value_false;
+}
+
+static inline int
+test(Value* c) {
+    return expect(c, T_BOOL, '?')->num != 0;
+}
+
+static Value*
+new_value(int type) {
+    Value* value = (Value*) alloc(sizeof(Value));
+    memset(value, 0, sizeof(Value));
+    value->type = type;
+    return value;
+}
+
+static inline Value*
+new_int(int64_t x) {
+    Value* value = new_value(T_INT);
+    value->num = x;
+    return value;
+}
+
+static Value*
+new_str(const char* s, size_t len) {
+    Value* value = new_value(T_STR);
+    value->str = s;
+    value->len = len;
+    return value;
+}
+
+static Big*
+big_alloc(size_t len) {
+    Big* num = (Big*) alloc(sizeof(Big) + len * sizeof(uint32_t));
+    num->neg = 0;
+    num->len = len;
+    num->limbs = (uint32_t*) (num + 1);
+    memset(num->limbs, 0, len * sizeof(uint32_t));
+    return num;
+}
+
+static Big*
+big_trim(Big* num) {
+    while (num->len > 0 && num->limbs[num->len - 1] == 0) {
+        num->len -= 1;
+    }
+    if (num->len == 0) {
+        num->neg = 0;
+    }
+    return num;
+}
+
+static Big*
+big_of(Value* x) {
+    if (x->big != NULL) {
+        return x->big;
+    }
+    uint64_t m = x->num < 0 ? 0 - (uint64_t) x->num : (uint64_t) x->num;
+    Big* num = big_alloc(2);
+    num->limbs[0] = (uint32_t) m;
+    num->limbs[1] = (uint32_t) (m >> 32);
+    num->neg = x->num < 0;
+    return big_trim(num);
+}
+
+static Value*
+new_big(Big* num) {
+    if (num->len <= 2) {
+        uint64_t m = 0;
+        if (num->len > 0) { m = num->limbs[0]; }
+        if (num->len > 1) { m |= (uint64_t) num->limbs[1] << 32; }
+        if (num->neg == 0 && m <= (uint64_t) INT64_MAX) {
+            return new_int((int64_t) m);
+        }
+        if (num->neg != 0 && m <= (uint64_t) INT64_MAX + 1) {
+            return new_int(m == (uint64_t) INT64_MAX + 1 ? INT64_MIN : -(int64_t) m);
+        }
+    }
+    Value* value = new_value(T_INT);
+    value->big = num;
+    return value;
+}
+
+static int
+mag_cmp(const Big* a, const Big* b) {
+    if (a->len != b->len) {
+        return a->len < b->len ? -1 : 1;
+    }
+    for (size_t i = a->len; i > 0; --i) {
+        if (a->limbs[i-1] != b->limbs[i-1]) {
+            return a->limbs[i-1] < b->limbs[i-1] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+static int
+big_cmp(const Big* a, const Big* b) {
+    if (a->neg != b->neg) {
+        return a->neg ? -1 : 1;
+    }
+    int c = mag_cmp(a, b);
+    return a->neg ? -c : c;
+}
+
+// a + b, or a - b when flip, by the signs
+static Big*
+big_add(const Big* a, const Big* b, int flip) {
+    int bneg = b->neg != flip && b->len > 0;
+    if (a->neg == bneg) {
+        size_t n = (a->len > b->len ? a->len : b->len) + 1;
+        Big* out = big_alloc(n);
+        uint64_t carry = 0;
+        for (size_t i = 0; i < n; ++i) {
+            carry += (uint64_t) (i < a->len ? a->limbs[i] : 0) + (i < b->len ? b->limbs[i] : 0);
+            out->limbs[i] = (uint32_t) carry;
+            carry >>= 32;
+        }
+        out->neg = a->neg;
+        return big_trim(out);
+    }
+    if (mag_cmp(a, b) < 0) {
+        const Big* t = a;
+        a = b;
+        b = t;
+        bneg = !bneg;
+    }
+    // |a| >= |b|, the sign is a's
+    Big* out = big_alloc(a->len);
+    uint64_t borrow = 0;
+    for (size_t i = 0; i < a->len; ++i) {
+        uint64_t d = (uint64_t) a->limbs[i] - (i < b->len ? b->limbs[i] : 0) - borrow;
+        out->limbs[i] = (uint32_t) d;
+        borrow = (d >> 32) & 1;
+    }
+    out->neg = !bneg;
+    return big_trim(out);
+}
+
+static Big*
+big_mul(const Big* a, const Big* b) {
+    Big* out = big_alloc(a->len + b->len);
+    for (size_t i = 0; i < a->len; ++i) {
+        uint64_t carry = 0;
+        for (size_t j = 0; j < b->len; ++j) {
+            carry += (uint64_t) a->limbs[i] * b->limbs[j] + out->limbs[i+j];
+            out->limbs[i+j] = (uint32_t) carry;
+            carry >>= 32;
+        }
+        out->limbs[i + b->len] = (uint32_t) carry;
+    }
+    out->neg = a->neg != b->neg;
+    return big_trim(out);
+}
+
+// q = a / d in place of a's limbs, returns a % d
+static uint32_t
+mag_divmod_small(uint32_t* a, size_t n, uint32_t d) {
+    uint64_t r = 0;
+    for (size_t i = n; i > 0; --i) {
+        uint64_t x = (r << 32) | a[i-1];
+        a[i-1] = (uint32_t) (x / d);
+        r = x % d;
+    }
+    return (uint32_t) r;
+}
+
+// Knuth D, m >= n >= 2
+static void
+mag_divmod(const uint32_t* u, size_t m, const uint32_t* v, size_t n, uint32_t* q, uint32_t* r) {
+    uint32_t* un = (uint32_t*) alloc((m + 1 + n) * sizeof(uint32_t));
+    uint32_t* vn = un + m + 1;
+    int s = __builtin_clz(v[n-1]);
+    for (size_t i = n - 1; i > 0; --i) {
+        vn[i] = (uint32_t) ((((uint64_t) v[i] << 32) | v[i-1]) >> (32 - s));
+    }
+    vn[0] = v[0] << s;
+    un[m] = (uint32_t) (((uint64_t) u[m-1] << s) >> 32);
+    for (size_t i = m - 1; i > 0; --i) {
+        un[i] = (uint32_t) ((((uint64_t) u[i] << 32) | u[i-1]) >> (32 - s));
+    }
+    un[0] = u[0] << s;
+    const uint64_t b = (uint64_t) 1 << 32;
+    for (size_t j = m - n + 1; j > 0; --j) {
+        size_t k = j - 1;
+        uint64_t num = ((uint64_t) un[k+n] << 32) | un[k+n-1];
+        uint64_t qhat = num / vn[n-1];
+        uint64_t rhat = num % vn[n-1];
+        while (qhat >= b || qhat * vn[n-2] > ((rhat << 32) | un[k+n-2])) {
+            qhat -= 1;
+            rhat += vn[n-1];
+            if (rhat >= b) { break; }
+        }
+        uint64_t borrow = 0;
+        uint64_t carry = 0;
+        for (size_t i = 0; i < n; ++i) {
+            uint64_t p = qhat * vn[i] + carry;
+            carry = p >> 32;
+            uint64_t d = (uint64_t) un[i+k] - (uint32_t) p - borrow;
+            un[i+k] = (uint32_t) d;
+            borrow = (d >> 32) & 1;
+        }
+        uint64_t d = (uint64_t) un[k+n] - carry - borrow;
+        un[k+n] = (uint32_t) d;
+        borrow = (d >> 32) & 1;
+        q[k] = (uint32_t) qhat;
+        if (borrow != 0) {
+            q[k] -= 1;
+            uint64_t c = 0;
+            for (size_t i = 0; i < n; ++i) {
+                c += (uint64_t) un[i+k] + vn[i];
+                un[i+k] = (uint32_t) c;
+                c >>= 32;
+            }
+            un[k+n] += (uint32_t) c;
+        }
+    }
+    for (size_t i = 0; i + 1 < n; ++i) {
+        r[i] = (uint32_t) ((((uint64_t) un[i+1] << 32) | un[i]) >> s);
+    }
+    r[n-1] = un[n-1] >> s;
+}
+
+// truncated division, the remainder has a's sign
+static Big*
+big_divmod(const Big* a, const Big* b, int rem) {
+    if (b->len == 0) {
+        fail("division by zero");
+    }
+    Big* q;
+    Big* r;
+    if (mag_cmp(a, b) < 0) {
+        q = big_alloc(0);
+        r = big_alloc(a->len);
+        memcpy(r->limbs, a->limbs, a->len * sizeof(uint32_t));
+    }
+    else if (b->len == 1) {
+        q = big_alloc(a->len);
+        memcpy(q->limbs, a->limbs, a->len * sizeof(uint32_t));
+        r = big_alloc(1);
+        r->limbs[0] = mag_divmod_small(q->limbs, q->len, b->limbs[0]);
+    }
+    else {
+        q = big_alloc(a->len - b->len + 1);
+        r = big_alloc(b->len);
+        mag_divmod(a->limbs, a->len, b->limbs, b->len, q->limbs, r->limbs);
+    }
+    q->neg = a->neg != b->neg;
+    r->neg = a->neg;
+    return big_trim(rem ? r : q);
+}
+
+static Value*
+op_arith(int op, Value* x, Value* y) {
+    if (x->big == NULL && y->big == NULL) {
+        int64_t a = x->num;
+        int64_t b = y->num;
+        int64_t r;
+        switch (op) {
+            case '+':
+                if (!__builtin_add_overflow(a, b, &r)) { return new_int(r); }
+                break;
+            case '-':
+                if (!__builtin_sub_overflow(a, b, &r)) { return new_int(r); }
+                break;
+            case '*':
+                if (!__builtin_mul_overflow(a, b, &r)) { return new_int(r); }
+                break;
+            case '/':
+            case '%':
+                if (b == 0) { fail("division by zero"); }
+                if (a == INT64_MIN && b == -1) { break; }
+                return new_int(op == '/' ? a / b : a % b);
+            case '<':
+                return truth(a < b);
+            case '>':
+                return truth(a > b);
+            case '=':
+                return truth(a == b);
+        }
+    }
+    Big* a = big_of(x);
+    Big* b = big_of(y);
+    switch (op) {
+        case '+': return new_big(big_add(a, b, 0));
+        case '-': return new_big(big_add(a, b, 1));
+        case '*': return new_big(big_mul(a, b));
+        case '/': return new_big(big_divmod(a, b, 0));
+        case '%': return new_big(big_divmod(a, b, 1));
+        case '<': return truth(big_cmp(a, b) < 0);
+        case '>': return truth(big_cmp(a, b) > 0);
+        case '=': return truth(big_cmp(a, b) == 0);
+    }
+    abort();
+}
+
+// a program need not use every operator, nor print anything
+static __attribute__((unused)) Value*
+op1(int op, Value* x) {
+    switch (op) {
+        case 'A':
+            if (expect(x, T_BOOL, op)->num == 0) { fail("assertion failed"); }
+            return x;
+        case '-':
+            expect(x, T_INT, op);
+            if (x->big == NULL && x->num != INT64_MIN) {
+                return new_int(-x->num);
+            }
+            return new_big(big_add(big_of(new_int(0)), big_of(x), 1));
+        case '!':
+            return truth(expect(x, T_BOOL, op)->num == 0);
+        case '#': {
+            expect(x, T_STR, op);
+            Big* num = big_alloc(x->len / 5 + 2);
+            num->len = 0;
+            for (size_t i = 0; i < x->len; ++i) {
+                uint64_t carry = abc94_index[(uint8_t) x->str[i]];
+                for (size_t j = 0; j < num->len; ++j) {
+                    carry += (uint64_t) num->limbs[j] * 94;
+                    num->limbs[j] = (uint32_t) carry;
+                    carry >>= 32;
+                }
+                if (carry != 0) {
+                    num->limbs[num->len++] = (uint32_t) carry;
+                }
+            }
+            return new_big(num);
+        }
+        case '$': {
+            expect(x, T_INT, op);
+            if (x->big == NULL && x->num <= 0) {
+                return new_str(abc94, 1);
+            }
+            Big* num = big_of(x);
+            uint32_t* limbs = (uint32_t*) alloc(num->len * sizeof(uint32_t));
+            memcpy(limbs, num->limbs, num->len * sizeof(uint32_t));
+            size_t n = num->len;
+            size_t size = n * 5 + 1;
+            char* s = (char*) alloc(size);
+            size_t i = size;
+            while (n > 0) {
+                s[--i] = abc94[mag_divmod_small(limbs, n, 94)];
+                while (n > 0 && limbs[n-1] == 0) { --n; }
+            }
+            return new_str(s + i, size - i);
+        }
+    }
+    abort();
+}
+
+static __attribute__((unused)) Value*
+op2(int op, Value* x, Value* y) {
+    switch (op) {
+        case '+':
+        case '-':
+        case '*':
+        case '/':
+        case '%':
+        case '<':
+        case '>':
+            expect(x, T_INT, op);
+            expect(y, T_INT, op);
+            return op_arith(op, x, y);
+        case '=':
+            if (x->type != y->type) {
+                return &value_false;
+            }
+            switch (x->type) {
+                case T_INT:
+                    return op_arith(op, x, y);
+                case T_BOOL:
+                    return truth(x->num == y->num);
+                case T_STR:
+                    return truth(x->len == y->len && memcmp(x->str, y->str, x->len) == 0);
+            }
+            fail("cannot compare lambdas");
+            break;
+        case '|':
+        case '&':
+            expect(x, T_BOOL, op);
+            expect(y, T_BOOL, op);
+            return truth(op == '|' ? x->num || y->num : x->num && y->num);
+        case '.': {
+            expect(x, T_STR, op);
+            expect(y, T_STR, op);
+            char* s = (char*) alloc(x->len + y->len + 1);
+            memcpy(s, x->str, x->len);
+            memcpy(s + x->len, y->str, y->len);
+            return new_str(s, x->len + y->len);
+        }
+        case 'T':
+        case 'D': {
+            expect(x, T_INT, op);
+            expect(y, T_STR, op);
+            size_t n = y->len;
+            if ((x->big == NULL && x->num <= 0) || (x->big != NULL && x->big->neg)) {
+                n = 0;
+            }
+            else if (x->big == NULL && (uint64_t) x->num < y->len) {
+                n = x->num;
+            }
+            return op == 'T' ? new_str(y->str, n) : new_str(y->str + n, y->len - n);
+        }
+    }
+    abort();
+}
+
+static inline Value*
+force(Thunk* thunk) {
+    if (thunk->value != NULL) {
+        return thunk->value;
+    }
+    if (thunk->forcing) {
+        fail("infinite loop");
+    }
+    thunk->forcing = 1;
+    Value* value = thunk->code(thunk->env);
+    thunk->forcing = 0;
+    thunk->value = value;
+    thunk->code = NULL;
+    thunk->env = NULL;
+    return value;
+}
+
+static inline Thunk*
+delay(Code code, Env* env) {
+    Thunk* thunk = (Thunk*) alloc(sizeof(Thunk));
+    thunk->code = code;
+    thunk->env = env;
+    thunk->value = NULL;
+    thunk->forcing = 0;
+    return thunk;
+}
+
+static inline Thunk*
+ready(Value* value) {
+    Thunk* thunk = delay(NULL, NULL);
+    thunk->value = value;
+    return thunk;
+}
+
+static inline Thunk*
+strict(Thunk* thunk) {
+    force(thunk);
+    return thunk;
+}
+
+static inline Thunk*
+at(Env* env, size_t index) {
+    for (; index > 0; --index) { env = env->next; }
+    return env->thunk;
+}
+
+static inline Env*
+push(Thunk* thunk, Env* next) {
+    Env* env = (Env*) alloc(sizeof(Env));
+    env->thunk = thunk;
+    env->next = next;
+    return env;
+}
+
+static inline Value*
+lambda(Code code, Env* env) {
+    Value* value = new_value(T_LAMBDA);
+    value->code = code;
+    value->env = env;
+    return value;
+}
+
+static inline Value*
+apply(Value* f, Thunk* arg, int op) {
+    expect(f, T_LAMBDA, op);
+    return f->code(push(arg, f->env));
+}
+
+static __attribute__((unused)) void
+print(Value* value) {
+    switch (value->type) {
+        case T_BOOL:
+            fputs(value->num ? "true" : "false", stdout);
+            break;
+        case T_INT: {
+            if (value->big == NULL) {
+                printf("%lld", (long long) value->num);
+                break;
+            }
+            Big* num = value->big;
+            uint32_t* limbs = (uint32_t*) alloc(num->len * sizeof(uint32_t));
+            memcpy(limbs, num->limbs, num->len * sizeof(uint32_t));
+            size_t n = num->len;
+            size_t size = n * 10 + 1;
+            char* s = (char*) alloc(size);
+            size_t i = size;
+            while (n > 0) {
+                uint32_t chunk = mag_divmod_small(limbs, n, 1000000000);
+                while (n > 0 && limbs[n-1] == 0) { --n; }
+                for (int k = 0; k < 9 && (n > 0 || chunk > 0); ++k) {
+                    s[--i] = '0' + chunk % 10;
+                    chunk /= 10;
+                }
+            }
+            if (num->neg) {
+                fputc('-', stdout);
+            }
+            fwrite(s + i, 1, size - i, stdout);
+            break;
+        }
+        case T_STR:
+            fwrite(value->str, 1, value->len, stdout);
+            break;
+        case T_LAMBDA:
+            fputs("<lambda>", stdout);
+            break;
+    }
+    fputc('\n', stdout);
+}
+
+// the program
+)__";
+
+
+static const char
+_icfp_cpp_main[] = R"__(
+static void*
+run_task(void*) {
+    run();
+    return NULL;
+}
+
+int
+main() {
+    for (size_t i = 0; i < sizeof(abc94) - 1; ++i) {
+        abc94_index[(uint8_t) abc94[i]] = i;
+    }
+    // thunks are forced on the stack
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 0x40000000);
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, run_task, NULL) != 0) {
+        run();
+    }
+    else {
+        pthread_join(thread, NULL);
+    }
+    return fflush(stdout) != 0;
+}
+)__";
+
+
+static void
+_icfp_cpp_number(struct _CppWriter* context, struct _Term* term) {
+    if (term->type == _TermType_var) {
+        return;
+    }
+    term->index = context->ids++;
+    if (term->t0 != NULL) { _icfp_cpp_number(context, term->t0); }
+    if (term->t1 != NULL) { _icfp_cpp_number(context, term->t1); }
+    if (term->t2 != NULL) { _icfp_cpp_number(context, term->t2); }
+}
+
+
+// Whether an argument is passed as a thunk of a function of its own.
+static int
+_icfp_cpp_delayed(const struct _Term* term) {
+    return term->type != _TermType_var && term->type != _TermType_literal && term->type != _TermType_lambda;
+}
+
+
+// Writes the characters of a string between the quotes of a C++ literal.
+static void
+_icfp_cpp_chars(struct _OutBuf* out, const char* s, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        char c = s[i];
+        switch (c) {
+            case '\n': outbuf_puts(out, "\\n"); break;
+            case '"': outbuf_puts(out, "\\\""); break;
+            case '\\': outbuf_puts(out, "\\\\"); break;
+            case '?': outbuf_puts(out, "\\?"); break;
+            default: outbuf_putc(out, c); break;
+        }
+    }
+}
+
+
+static void
+_icfp_cpp_literal(struct _CppWriter* context, struct _Term* term) {
+    struct _OutBuf* out = context->out;
+    struct _Value* value = term->value;
+    char buf[64];
+    switch (value->type) {
+        case _ValueType_bool:
+            snprintf(buf, sizeof(buf), "static Value c%zu = {T_BOOL, %d};\n", term->index, (int) value->num);
+            outbuf_puts(out, buf);
+            return;
+        case _ValueType_int:
+            if (value->big == NULL) {
+                snprintf(buf, sizeof(buf), "static Value c%zu = {T_INT, %lldLL};\n", term->index, (long long) value->num);
+                outbuf_puts(out, buf);
+                return;
+            }
+            // big ones keep their limbs
+            snprintf(buf, sizeof(buf), "static uint32_t l%zu[] = {", term->index);
+            outbuf_puts(out, buf);
+            for (size_t i = 0; i < value->big->len; ++i) {
+                snprintf(buf, sizeof(buf), i > 0 ? ", %uu" : "%uu", value->big->limbs[i]);
+                outbuf_puts(out, buf);
+            }
+            snprintf(buf, sizeof(buf), "};\nstatic Big b%zu = {%d, %zu, l%zu};\n", term->index, value->big->neg,
+                value->big->len, term->index);
+            outbuf_puts(out, buf);
+            snprintf(buf, sizeof(buf), "static Value c%zu = {T_INT, 0, &b%zu};\n", term->index, term->index);
+            outbuf_puts(out, buf);
+            return;
+        case _ValueType_str:
+            snprintf(buf, sizeof(buf), "static Value c%zu = {T_STR, 0, NULL, \"", term->index);
+            outbuf_puts(out, buf);
+            _icfp_cpp_chars(out, value->str, value->len);
+            snprintf(buf, sizeof(buf), "\", %zu};\n", value->len);
+            outbuf_puts(out, buf);
+            return;
+        case _ValueType_lambda:
+            break;
+    }
+    abort();
+}
+
+
+// Declares the functions and defines the static values of a term, which is
+// an argument when arg.
+static void
+_icfp_cpp_declare(struct _CppWriter* context, struct _Term* term, int arg) {
+    char buf[64];
+    switch (term->type) {
+        case _TermType_var:
+            return;
+        case _TermType_literal:
+            _icfp_cpp_literal(context, term);
+            return;
+        case _TermType_lambda:
+            snprintf(buf, sizeof(buf), "static Value* f%zu(Env* e);\n", term->index);
+            outbuf_puts(context->out, buf);
+            _icfp_cpp_declare(context, term->t0, 0);
+            return;
+        default:
+            break;
+    }
+    if (arg) {
+        snprintf(buf, sizeof(buf), "static Value* t%zu(Env* e);\n", term->index);
+        outbuf_puts(context->out, buf);
+    }
+    int apply = term->type == _TermType_binary && (term->op == '$' || term->op == '~' || term->op == '!');
+    if (term->t0 != NULL) { _icfp_cpp_declare(context, term->t0, 0); }
+    if (term->t1 != NULL) { _icfp_cpp_declare(context, term->t1, apply); }
+    if (term->t2 != NULL) { _icfp_cpp_declare(context, term->t2, 0); }
+}
+
+
+static void
+_icfp_cpp_indent(struct _CppWriter* context) {
+    for (size_t i = 0; i < context->indent; ++i) {
+        outbuf_puts(context->out, "    ");
+    }
+}
+
+
+// The thunk an application passes its argument in.
+static void
+_icfp_cpp_arg(struct _CppWriter* context, struct _Term* term, char* buf, size_t size) {
+    switch (term->type) {
+        case _TermType_var:
+            snprintf(buf, size, "at(%s, %zu)", context->env, term->index);
+            return;
+        case _TermType_literal:
+            snprintf(buf, size, "ready(&c%zu)", term->index);
+            return;
+        case _TermType_lambda:
+            snprintf(buf, size, "ready(lambda(f%zu, %s))", term->index, context->env);
+            return;
+        default:
+            snprintf(buf, size, "delay(t%zu, %s)", term->index, context->env);
+            return;
+    }
+}
+
+
+static void
+_icfp_cpp_value(struct _CppWriter* context, struct _Term* term, const char* dest);
+
+
+// Names the value of an operand, in a temporary it is written to first
+// unless it is a literal.
+static void
+_icfp_cpp_operand(struct _CppWriter* context, struct _Term* term, char* name, size_t size) {
+    if (term->type == _TermType_literal) {
+        snprintf(name, size, "&c%zu", term->index);
+        return;
+    }
+    char dest[32];
+    size_t temp = context->temps++;
+    _icfp_cpp_indent(context);
+    snprintf(dest, sizeof(dest), "Value* v%zu;\n", temp);
+    outbuf_puts(context->out, dest);
+    snprintf(dest, sizeof(dest), "v%zu = ", temp);
+    _icfp_cpp_value(context, term, dest);
+    snprintf(name, size, "v%zu", temp);
+}
+
+
+// Writes the statements that compute term and pass it to dest, which is
+// "return " in tail position. Applications of lambdas written in place are
+// direct calls of their functions.
+static void
+_icfp_cpp_value(struct _CppWriter* context, struct _Term* term, const char* dest) {
+    struct _OutBuf* out = context->out;
+    char buf[160];
+    switch (term->type) {
+        case _TermType_literal:
+            snprintf(buf, sizeof(buf), "%s&c%zu;\n", dest, term->index);
+            break;
+        case _TermType_var:
+            snprintf(buf, sizeof(buf), "%sforce(at(%s, %zu));\n", dest, context->env, term->index);
+            break;
+        case _TermType_lambda:
+            snprintf(buf, sizeof(buf), "%slambda(f%zu, %s);\n", dest, term->index, context->env);
+            break;
+        case _TermType_unary: {
+            char x[32];
+            _icfp_cpp_operand(context, term->t0, x, sizeof(x));
+            snprintf(buf, sizeof(buf), "%sop1('%c', %s);\n", dest, term->op, x);
+            break;
+        }
+        case _TermType_if: {
+            char c[32];
+            _icfp_cpp_operand(context, term->t0, c, sizeof(c));
+            _icfp_cpp_indent(context);
+            snprintf(buf, sizeof(buf), "if (test(%s)) {\n", c);
+            outbuf_puts(out, buf);
+            context->indent += 1;
+            _icfp_cpp_value(context, term->t1, dest);
+            context->indent -= 1;
+            _icfp_cpp_indent(context);
+            outbuf_puts(out, "}\n");
+            _icfp_cpp_indent(context);
+            outbuf_puts(out, "else {\n");
+            context->indent += 1;
+            _icfp_cpp_value(context, term->t2, dest);
+            context->indent -= 1;
+            _icfp_cpp_indent(context);
+            outbuf_puts(out, "}\n");
+            return;
+        }
+        case _TermType_free:
+            _icfp_cpp_indent(context);
+            outbuf_puts(out, "fail(\"unbound variable ");
+            _icfp_cpp_chars(out, term->value->str, term->value->len);
+            outbuf_puts(out, "\");\n");
+            snprintf(buf, sizeof(buf), "%sNULL;\n", dest);
+            break;
+        case _TermType_binary: {
+            if (term->op != '$' && term->op != '~' && term->op != '!') {
+                char x[32];
+                char y[32];
+                _icfp_cpp_operand(context, term->t0, x, sizeof(x));
+                _icfp_cpp_operand(context, term->t1, y, sizeof(y));
+                snprintf(buf, sizeof(buf), "%sop2('%c', %s, %s);\n", dest, term->op, x, y);
+                break;
+            }
+            char arg[64];
+            _icfp_cpp_arg(context, term->t1, arg, sizeof(arg));
+            const char* open = term->op == '!' ? "strict(" : "";
+            const char* close = term->op == '!' ? ")" : "";
+            if (term->t0->type == _TermType_lambda) {
+                snprintf(buf, sizeof(buf), "%sf%zu(push(%s%s%s, %s));\n", dest, term->t0->index, open, arg, close,
+                    context->env);
+                break;
+            }
+            char f[32];
+            _icfp_cpp_operand(context, term->t0, f, sizeof(f));
+            snprintf(buf, sizeof(buf), "%sapply(%s, %s%s%s, '%c');\n", dest, f, open, arg, close, term->op);
+            break;
+        }
+    }
+    _icfp_cpp_indent(context);
+    outbuf_puts(out, buf);
+}
+
+
+static void
+_icfp_cpp_function(struct _CppWriter* context, char prefix, size_t index, struct _Term* body) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "\nstatic Value*\n%c%zu(Env* e) {\n", prefix, index);
+    outbuf_puts(context->out, buf);
+    context->env = "e";
+    context->temps = 0;
+    context->indent = 1;
+    _icfp_cpp_value(context, body, "return ");
+    outbuf_puts(context->out, "}\n");
+}
+
+
+// Defines the functions of a term's lambdas and delayed arguments.
+static void
+_icfp_cpp_define(struct _CppWriter* context, struct _Term* term, int arg) {
+    switch (term->type) {
+        case _TermType_var:
+        case _TermType_literal:
+            return;
+        case _TermType_lambda:
+            _icfp_cpp_function(context, 'f', term->index, term->t0);
+            _icfp_cpp_define(context, term->t0, 0);
+            return;
+        default:
+            break;
+    }
+    if (arg) {
+        _icfp_cpp_function(context, 't', term->index, term);
+    }
+    int apply = term->type == _TermType_binary && (term->op == '$' || term->op == '~' || term->op == '!');
+    if (term->t0 != NULL) { _icfp_cpp_define(context, term->t0, 0); }
+    if (term->t1 != NULL) { _icfp_cpp_define(context, term->t1, apply); }
+    if (term->t2 != NULL) { _icfp_cpp_define(context, term->t2, 0); }
+}
+
+
+static void
+icfp_cpp_begin(struct _CppWriter* context, struct _OutBuf* out) {
+    context->out = out;
+    context->ids = 0;
+    context->runs = 0;
+    outbuf_puts(out, _icfp_cpp_runtime);
+}
+
+
+// Writes a program as a function r<N> of the next N, for main to print the
+// value of.
+static void
+icfp_cpp_write(struct _CppWriter* context, struct _Term* term) {
+    _icfp_cpp_number(context, term);
+    outbuf_putc(context->out, '\n');
+    _icfp_cpp_declare(context, term, 0);
+    _icfp_cpp_define(context, term, 0);
+    char buf[64];
+    snprintf(buf, sizeof(buf), "\nstatic Value*\nr%zu(void) {\n", context->runs++);
+    outbuf_puts(context->out, buf);
+    context->env = "NULL";
+    context->temps = 0;
+    context->indent = 1;
+    _icfp_cpp_value(context, term, "return ");
+    outbuf_puts(context->out, "}\n");
+}
+
+
+static void
+icfp_cpp_end(struct _CppWriter* context) {
+    struct _OutBuf* out = context->out;
+    outbuf_puts(out, "\nstatic void\nrun(void) {\n");
+    char buf[64];
+    for (size_t i = 0; i < context->runs; ++i) {
+        snprintf(buf, sizeof(buf), "    print(r%zu());\n", i);
+        outbuf_puts(out, buf);
+    }
+    outbuf_puts(out, "}\n");
+    outbuf_puts(out, _icfp_cpp_main);
+}
+
+// Optimizations for -O. Operators applied to literals are computed with the
+// evaluator's own semantics, a ? with a literal condition keeps only the
+// taken branch, adjacent string literals in . chains are joined, and
+// applications of lambdas and defines are reduced when that pays off.
+
+static struct _Value*
+_icfp_fold_value(struct _EvalState* eval, struct _Expr* expr) {
+    if (expr->type != _ExprType_literal) {
+        return NULL;
+    }
+    switch (expr->token.type) {
+        case _TokenType_number: {
+            struct _Value* value = _icfp_eval_new_int(&eval->heap, expr->token.num.value);
+            value->big = expr->token.num.big;
+            return value;
+        }
+        case _TokenType_bool_false:
+            return eval->value_false;
+        case _TokenType_bool_true:
+            return eval->value_true;
+        case _TokenType_str: {
+            // leave strings the writer would reject for it to report
+            const char* s = expr->token.value;
+            size_t n = strlen(s);
+            for (size_t i = 0; i < n; ++i) {
+                if (_icfp_abc94_index[(uint8_t) s[i]] == 0xff) {
+                    return NULL;
+                }
+            }
+            struct _Value* value = _icfp_eval_new_value(&eval->heap, _ValueType_str);
+            value->str = s;
+            value->len = n;
+            return value;
+        }
+        default:
+            return NULL;
+    }
+}
+
+
+// Whether the evaluator would apply op to x and y without an error.
+static int
+_icfp_fold_accepts(int op, struct _Value* x, struct _Value* y) {
+    switch (op) {
+        case '-':
+            return y == NULL ? x->type == _ValueType_int : x->type == _ValueType_int && y->type == _ValueType_int;
+        case '!':
+            return x->type == _ValueType_bool;
+        case '#':
+            return x->type == _ValueType_str;
+        case '$':
+            return x->type == _ValueType_int;
+        case '+':
+        case '*':
+        case '<':
+        case '>':
+            return x->type == _ValueType_int && y->type == _ValueType_int;
+        case '/':
+        case '%':
+            return x->type == _ValueType_int && y->type == _ValueType_int &&
+                (y->big != NULL || y->num != 0);
+        case '=':
+            return 1;
+        case '|':
+        case '&':
+            return x->type == _ValueType_bool && y->type == _ValueType_bool;
+        case '.':
+            return x->type == _ValueType_str && y->type == _ValueType_str;
+        case 'T':
+        case 'D':
+            return x->type == _ValueType_int && y->type == _ValueType_str;
+    }
+    return 0;
+}
+
+
+static const char*
+_icfp_fold_number_text(struct _ParserState* context, const struct _Number* num) {
+    if (num->big == NULL) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%lld", (long long) num->value);
+        return symbol_list_intern(&context->symbols, buf);
+    }
+    size_t count;
+    uint8_t* digits = bigint_to_digits(&context->numbers, num->big, 10, &count);
+    char* s = (char*) arena_alloc(&context->numbers, count + 2);
+    char* p = s;
+    if (num->big->neg) {
+        *p++ = '-';
+    }
+    for (size_t i = 0; i < count; ++i) {
+        *p++ = '0' + digits[i];
+    }
+    *p = '\0';
+    return symbol_list_intern(&context->symbols, s);
+}
+
+
+// A literal expression of a value, at the place of another expression.
+static struct _Expr*
+_icfp_literal_expr(struct _ParserState* context, const struct _Expr* at, struct _Value* value) {
+    struct _Expr* expr = expr_tree_push(&context->expr_tree);
+    expr->type = _ExprType_literal;
+    expr->lineno = at->lineno;
+    expr->colno = at->colno;
+    struct _Token* token = &expr->token;
+    token->lineno = at->lineno;
+    token->colno = at->colno;
+    switch (value->type) {
+        case _ValueType_bool:
+            token->type = value->num ? _TokenType_bool_true : _TokenType_bool_false;
+            token->value = (char*) _symbols_tok[token->type];
+            token->len = strlen(token->value);
+            break;
+        case _ValueType_int: {
+            token->type = _TokenType_number;
+            token->num.value = value->num;
+            if (value->big != NULL) {
+                // the evaluator heap is scratch, literals live with the parser
+                struct _BigInt* big = bigint_alloc(&context->numbers, value->big->len);
+                memcpy(big->limbs, value->big->limbs, value->big->len * sizeof(uint32_t));
+                big->neg = value->big->neg;
+                token->num.big = big;
+                token->encoded = symbol_list_intern(&context->symbols, _icfp_encode_big_number(&context->numbers, &token->num));
+            }
+            else {
+                char buf[32];
+                token->encoded = symbol_list_intern(&context->symbols, _icfp_encode_number(&token->num, buf + sizeof(buf)));
+            }
+            token->value = (char*) _icfp_fold_number_text(context, &token->num);
+            token->len = strlen(token->value);
+            break;
+        }
+        case _ValueType_str: {
+            char* s = (char*) malloc(value->len + 1);
+            memcpy(s, value->str, value->len);
+            s[value->len] = '\0';
+            token->type = _TokenType_str;
+            token->value = symbol_list_intern(&context->symbols, s);
+            token->len = value->len;
+            free(s);
+            break;
+        }
+        case _ValueType_lambda:
+            abort();
+    }
+    return expr;
+}
+
+
+static struct _Expr*
+_icfp_fold_literal(struct _ParserState* context, struct _Expr* at, struct _Value* value) {
+    context->folds += 1;
+    return _icfp_literal_expr(context, at, value);
+}
+
+
+// Lambda parameters in scope while optimizing, innermost first.
+struct _OptScope {
+    const char* name;
+    const struct _OptScope* parent;
+};
+
+
+// Lambdas whose reductions are being optimized, so that a self
+// application like the one in Y unrolls once rather than until out of fuel.
+struct _OptActive {
+    struct _Expr* lamb;
+    const struct _OptActive* parent;
+};
+
+
+struct _Optimizer {
+    struct _ParserState* parser;
+    struct _EvalState* eval;
+    // defines live in the writer's root scope
+    struct _NameTable* root;
+    int shared;
+    // whether define bodies may be optimized as they are reached
+    int lower;
+    size_t fuel;
+    const struct _OptActive* active;
+    const struct _Expanding* expanding;
+};
+
+
+static int
+_icfp_opt_is_local(const struct _OptScope* scope, const char* name) {
+    for (; scope != NULL; scope = scope->parent) {
+        if (scope->name == name) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static struct _Expr*
+_icfp_fold_expression(struct _Optimizer* context, const struct _OptScope* scope, struct _Expr* expr);
+
+
+static int
+_icfp_knot_is_fix(struct _Expr* lamb);
+
+
+// Optimizes the body of a define the first time it is reached, so that
+// defines nothing refers to cost no more than their parse. A fixed point
+// combinator is kept as written, for its applications to be recognized.
+static void
+_icfp_opt_lower(struct _Optimizer* context, struct _Name* name) {
+    if (name->lowered || !context->lower) {
+        return;
+    }
+    // set first, a recursive define is reported by the writer
+    name->lowered = 1;
+    context->parser->lowered += 1;
+    if (!_icfp_knot_is_fix(name->expr)) {
+        name->expr = _icfp_fold_expression(context, NULL, name->expr);
+    }
+}
+
+
+static struct _Name*
+_icfp_opt_define_name(struct _Optimizer* context, const struct _OptScope* scope, struct _Expr* expr) {
+    if (expr->type != _ExprType_identifier || _icfp_opt_is_local(scope, expr->token.value)) {
+        return NULL;
+    }
+    struct _Name* name = NULL;
+    // a prelude shared between inputs is the parent of the root scope, and
+    // was lowered before it was shared
+    struct _NameTable* table = context->root;
+    for (; table != NULL; table = table->parent) {
+        name = _name_table_find(table, expr->token.value);
+        if (name != NULL) { break; }
+    }
+    if (name == NULL || name->expr == NULL || name->expr->type == _ExprType_identifier) {
+        return NULL;
+    }
+    if (table == context->root) {
+        _icfp_opt_lower(context, name);
+    }
+    // a recursive define is bound to its knot, which is not inlined
+    return name->expr->type == _ExprType_lambda ? name : NULL;
+}
+
+
+static struct _Expr*
+_icfp_opt_define(struct _Optimizer* context, const struct _OptScope* scope, struct _Expr* expr) {
+    struct _Name* name = _icfp_opt_define_name(context, scope, expr);
+    return name != NULL ? name->expr : NULL;
+}
+
+
+// Whether expr0 of an application is an operator rather than a function.
+static int
+_icfp_opt_is_op(struct _Expr* expr) {
+    switch (expr->type) {
+        case _ExprType_apply1:
+            return _icfp_expr_unary_op(expr->expr0) != 0;
+        case _ExprType_apply2:
+            return expr->expr0->type == _ExprType_identifier && _icfp_expr_binary_op(expr->expr0) != 0;
+        case _ExprType_apply3:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+
+static int
+_icfp_opt_binds(struct _Expr* lamb, const char* name) {
+    struct _Expr* args = lamb->expr1;
+    return args->expr1->token.value == name || (args->type == _ExprType_apply2 && args->expr2->token.value == name);
+}
+
+
+static struct _Expr*
+_icfp_opt_clone(struct _Optimizer* context, struct _Expr* expr) {
+    struct _Expr* copy = expr_tree_push(&context->parser->expr_tree);
+    *copy = *expr;
+    return copy;
+}
+
+
+// Approximate length of the ICFP text for expr.
+static size_t
+_icfp_opt_size(struct _Optimizer* context, const struct _OptScope* scope, struct _Expr* expr) {
+    switch (expr->type) {
+        case _ExprType_identifier: {
+            struct _Name* name = context->shared ? NULL : _icfp_opt_define_name(context, scope, expr);
+            if (name != NULL && !expanding_has(context->expanding, name)) {
+                // unshared defines are written out at every use
+                struct _Expanding expanding = {name, context->expanding};
+                context->expanding = &expanding;
+                size_t n = _icfp_opt_size(context, NULL, name->expr);
+                context->expanding = expanding.parent;
+                return n;
+            }
+            // variables are mostly one base-94 digit
+            return 2;
+        }
+        case _ExprType_literal:
+            switch (expr->token.type) {
+                case _TokenType_number:
+                    return strlen(expr->token.encoded);
+                case _TokenType_str:
+                    return 1 + strlen(expr->token.value);
+                default:
+                    return 1;
+            }
+        case _ExprType_apply1:
+            if (_icfp_opt_is_op(expr)) {
+                return 3 + _icfp_opt_size(context, scope, expr->expr1);
+            }
+            return 4 + _icfp_opt_size(context, scope, expr->expr0) + _icfp_opt_size(context, scope, expr->expr1);
+        case _ExprType_apply2: {
+            size_t n = 4 + _icfp_opt_size(context, scope, expr->expr1) + _icfp_opt_size(context, scope, expr->expr2);
+            if (_icfp_opt_is_op(expr)) {
+                return n;
+            }
+            return n + 4 + _icfp_opt_size(context, scope, expr->expr0);
+        }
+        case _ExprType_apply3:
+            return 4 + _icfp_opt_size(context, scope, expr->expr1) + _icfp_opt_size(context, scope, expr->expr2) +
+                _icfp_opt_size(context, scope, expr->expr3);
+        case _ExprType_lambda: {
+            struct _Expr* args = expr->expr1;
+            struct _OptScope inner = {args->expr1->token.value, scope};
+            struct _OptScope inner2 = {NULL, &inner};
+            size_t n = 3;
+            if (args->type == _ExprType_apply2) {
+                inner2.name = args->expr2->token.value;
+                n += 3;
+            }
+            return n + _icfp_opt_size(context, &inner2, expr->expr2);
+        }
+        case _ExprType_assert:
+            return 3 + _icfp_opt_size(context, scope, expr->expr1);
+        case _ExprType_define:
+        case _ExprType_invalid:
+            return 0;
+    }
+    return 0;
+}
+
+
+// Free occurrences of a name, and where they sit.
+struct _BetaUses {
+    size_t count;
+    // some use is inside a nested lambda, so may be evaluated many times
+    int under_lambda;
+    // some use is the function of a one or two argument application
+    int head1;
+    int head2;
+};
+
+
+static void
+_icfp_beta_uses(struct _Expr* expr, const char* name, int depth, struct _BetaUses* uses) {
+    switch (expr->type) {
+        case _ExprType_identifier:
+            if (expr->token.value == name) {
+                uses->count += 1;
+                uses->under_lambda |= depth > 0;
+            }
+            return;
+        case _ExprType_apply1:
+        case _ExprType_apply2:
+            if (!_icfp_opt_is_op(expr)) {
+                if (expr->expr0->type == _ExprType_identifier && expr->expr0->token.value == name) {
+                    *(expr->type == _ExprType_apply1 ? &uses->head1 : &uses->head2) = 1;
+                }
+                _icfp_beta_uses(expr->expr0, name, depth, uses);
+            }
+            _icfp_beta_uses(expr->expr1, name, depth, uses);
+            if (expr->type == _ExprType_apply2) {
+                _icfp_beta_uses(expr->expr2, name, depth, uses);
+            }
+            return;
+        case _ExprType_apply3:
+            _icfp_beta_uses(expr->expr1, name, depth, uses);
+            _icfp_beta_uses(expr->expr2, name, depth, uses);
+            _icfp_beta_uses(expr->expr3, name, depth, uses);
+            return;
+        case _ExprType_lambda:
+            if (!_icfp_opt_binds(expr, name)) {
+                _icfp_beta_uses(expr->expr2, name, depth + 1, uses);
+            }
+            return;
+        case _ExprType_assert:
+            _icfp_beta_uses(expr->expr1, name, depth, uses);
+            return;
+        case _ExprType_literal:
+        case _ExprType_define:
+        case _ExprType_invalid:
+            return;
+    }
+}
+
+
+static int
+_icfp_beta_is_free(struct _Expr* expr, const char* name) {
+    struct _BetaUses uses = {};
+    _icfp_beta_uses(expr, name, 0, &uses);
+    return uses.count > 0;
+}
+
+
+// Whether a lambda inside expr binds a name that is free in arg.
+static int
+_icfp_beta_captures(struct _Expr* expr, struct _Expr* arg) {
+    switch (expr->type) {
+        case _ExprType_apply1:
+        case _ExprType_apply2:
+            if (!_icfp_opt_is_op(expr) && _icfp_beta_captures(expr->expr0, arg)) {
+                return 1;
+            }
+            if (_icfp_beta_captures(expr->expr1, arg)) {
+                return 1;
+            }
+            return expr->type == _ExprType_apply2 && _icfp_beta_captures(expr->expr2, arg);
+        case _ExprType_apply3:
+            return _icfp_beta_captures(expr->expr1, arg) || _icfp_beta_captures(expr->expr2, arg) ||
+                _icfp_beta_captures(expr->expr3, arg);
+        case _ExprType_lambda: {
+            struct _Expr* args = expr->expr1;
+            if (_icfp_beta_is_free(arg, args->expr1->token.value)) {
+                return 1;
+            }
+            if (args->type == _ExprType_apply2 && _icfp_beta_is_free(arg, args->expr2->token.value)) {
+                return 1;
+            }
+            return _icfp_beta_captures(expr->expr2, arg);
+        }
+        case _ExprType_assert:
+            return _icfp_beta_captures(expr->expr1, arg);
+        case _ExprType_identifier:
+        case _ExprType_literal:
+        case _ExprType_define:
+        case _ExprType_invalid:
+            return 0;
+    }
+    return 0;
+}
+
+
+// Strictness of lambda parameters, for picking how an argument is passed
+// to a lambda the writer knows. Each question gets _StrictFuel nodes to
+// look at, and answers no once out of them.
+struct _Strictness {
+    // the scopes identifiers outside of any local binder resolve in
+    struct _NameTable* nametable;
+    struct _NameTable* root;
+    size_t fuel;
+};
+
+
+static int
+_icfp_strict(struct _Strictness* context, const struct _OptScope* scope, struct _Expr* expr, const char* name);
+
+
+// The lambda a name applied in scope stands for, when it is a define.
+static struct _Expr*
+_icfp_strict_define(struct _Strictness* context, const struct _OptScope* scope, struct _Expr* expr) {
+    if (_icfp_opt_is_local(scope, expr->token.value)) {
+        return NULL;
+    }
+    const char* value = expr->token.value;
+    for (int aliases = 0; aliases < 8; ++aliases) {
+        struct _Name* name = NULL;
+        for (struct _NameTable* table = context->nametable; name == NULL && table != NULL; table = table->parent) {
+            name = _name_table_find(table, value);
+        }
+        if (name == NULL || name->expr == NULL) {
+            return NULL;
+        }
+        if (name->expr->type != _ExprType_identifier) {
+            return name->expr->type == _ExprType_lambda ? name->expr : NULL;
+        }
+        value = name->expr->token.value;
+    }
+    return NULL;
+}
+
+
+static const char*
+_icfp_strict_param(struct _Expr* lamb, int param) {
+    struct _Expr* args = lamb->expr1;
+    if (args->type != _ExprType_apply2) {
+        return args->expr1->token.value;
+    }
+    // of two equal names, the second is the one the body sees
+    if (param == 0 && args->expr1->token.value == args->expr2->token.value) {
+        return NULL;
+    }
+    return param == 0 ? args->expr1->token.value : args->expr2->token.value;
+}
+
+
+// Whether applying lamb to all its parameters evaluates the one numbered
+// param. A define's body sees the root scope only.
+static int
+_icfp_strict_in_param(struct _Strictness* context, const struct _OptScope* scope, struct _Expr* lamb,
+    int define, int param) {
+
+    const char* name = _icfp_strict_param(lamb, param);
+    if (name == NULL) {
+        return 0;
+    }
+    struct _Expr* args = lamb->expr1;
+    struct _OptScope inner = {args->expr1->token.value, define ? NULL : scope};
+    struct _OptScope inner2 = {args->type == _ExprType_apply2 ? args->expr2->token.value : NULL, &inner};
+    struct _NameTable* nametable = context->nametable;
+    if (define) {
+        context->nametable = context->root;
+    }
+    int res = _icfp_strict(context, &inner2, lamb->expr2, name);
+    context->nametable = nametable;
+    return res;
+}
+
+
+static int
+_icfp_strict_apply(struct _Strictness* context, const struct _OptScope* scope, struct _Expr* head,
+    struct _Expr** args, int count, const char* name) {
+
+    // the function is evaluated first
+    if (_icfp_strict(context, scope, head, name)) {
+        return 1;
+    }
+    struct _Expr* lamb = NULL;
+    int define = 0;
+    if (head->type == _ExprType_identifier) {
+        lamb = _icfp_strict_define(context, scope, head);
+        define = 1;
+    }
+    else if (head->type == _ExprType_lambda) {
+        lamb = head;
+    }
+    if (lamb == NULL) {
+        return 0;
+    }
+    int arity = lamb->expr1->type == _ExprType_apply2 ? 2 : 1;
+    if (count < arity) {
+        return 0;
+    }
+    // then its body, with the arguments its parameters are strict in
+    for (int i = 0; i < arity; ++i) {
+        if (_icfp_strict(context, scope, args[i], name) && _icfp_strict_in_param(context, scope, lamb, define, i)) {
+            return 1;
+        }
+    }
+    if (define || _icfp_opt_binds(lamb, name)) {
+        return 0;
+    }
+    struct _Expr* params = lamb->expr1;
+    struct _OptScope inner = {params->expr1->token.value, scope};
+    struct _OptScope inner2 = {arity == 2 ? params->expr2->token.value : NULL, &inner};
+    return _icfp_strict(context, &inner2, lamb->expr2, name);
+}
+
+
+// Whether evaluating expr certainly evaluates name. Only the first operand
+// of | and & counts, in case they are short-circuited.
+static int
+_icfp_strict(struct _Strictness* context, const struct _OptScope* scope, struct _Expr* expr, const char* name) {
+    if (context->fuel == 0) {
+        return 0;
+    }
+    context->fuel -= 1;
+    switch (expr->type) {
+        case _ExprType_identifier:
+            return expr->token.value == name;
+        case _ExprType_apply1:
+            if (_icfp_expr_unary_op(expr->expr0) != 0) {
+                return _icfp_strict(context, scope, expr->expr1, name);
+            }
+            return _icfp_strict_apply(context, scope, expr->expr0, &expr->expr1, 1, name);
+        case _ExprType_apply2: {
+            if (!_icfp_opt_is_op(expr)) {
+                return _icfp_strict_apply(context, scope, expr->expr0, &expr->expr1, 2, name);
+            }
+            switch (_icfp_expr_binary_op(expr->expr0)) {
+                case '$':
+                case '~':
+                case '!':
+                    return _icfp_strict_apply(context, scope, expr->expr1, &expr->expr2, 1, name);
+                case '|':
+                case '&':
+                    return _icfp_strict(context, scope, expr->expr1, name);
+                default:
+                    return _icfp_strict(context, scope, expr->expr1, name) || _icfp_strict(context, scope, expr->expr2, name);
+            }
+        }
+        case _ExprType_apply3:
+            return _icfp_strict(context, scope, expr->expr1, name) ||
+                (_icfp_strict(context, scope, expr->expr2, name) && _icfp_strict(context, scope, expr->expr3, name));
+        case _ExprType_lambda:
+        case _ExprType_literal:
+        case _ExprType_assert:
+        case _ExprType_define:
+        case _ExprType_invalid:
+            return 0;
+    }
+    return 0;
+}
+
+
+// Whether name may be evaluated more than once in expr: it occurs twice,
+// or once inside a lambda that may run many times.
+static int
+_icfp_strict_repeats(struct _Strictness* context, struct _Expr* expr, const char* name, int depth, size_t* count) {
+    if (context->fuel == 0) {
+        return 0;
+    }
+    context->fuel -= 1;
+    switch (expr->type) {
+        case _ExprType_identifier:
+            if (expr->token.value != name) {
+                return 0;
+            }
+            *count += 1;
+            return *count > 1 || depth > 0;
+        case _ExprType_apply1:
+        case _ExprType_apply2:
+            if (!_icfp_opt_is_op(expr) && _icfp_strict_repeats(context, expr->expr0, name, depth, count)) {
+                return 1;
+            }
+            if (_icfp_strict_repeats(context, expr->expr1, name, depth, count)) {
+                return 1;
+            }
+            return expr->type == _ExprType_apply2 && _icfp_strict_repeats(context, expr->expr2, name, depth, count);
+        case _ExprType_apply3:
+            return _icfp_strict_repeats(context, expr->expr1, name, depth, count) ||
+                _icfp_strict_repeats(context, expr->expr2, name, depth, count) ||
+                _icfp_strict_repeats(context, expr->expr3, name, depth, count);
+        case _ExprType_lambda:
+            return !_icfp_opt_binds(expr, name) && _icfp_strict_repeats(context, expr->expr2, name, depth + 1, count);
+        case _ExprType_literal:
+        case _ExprType_assert:
+        case _ExprType_define:
+        case _ExprType_invalid:
+            return 0;
+    }
+    return 0;
+}
+
+
+// Picks the application that passes arg to the parameter numbered param
+// of lamb, written in nametable: B! when the body certainly evaluates the
+// parameter, which the application then does once up front, B~ when the
+// body may evaluate it more than once and it is not a value yet, which
+// shares the evaluation, and B$ otherwise. full is whether every parameter
+// gets an argument, so that the body is evaluated at all.
+static int
+_icfp_write_apply_op(struct _WriterState* context, struct _NameTable* nametable, struct _Expr* lamb, int define,
+    int param, int full, struct _Expr* arg) {
+
+    if (!context->strict || lamb == NULL) {
+        return '$';
+    }
+    const char* name = _icfp_strict_param(lamb, param);
+    if (name == NULL) {
+        return '$';
+    }
+    struct _Strictness strictness = {nametable, context->nametable, _StrictFuel};
+    if (full && _icfp_strict_in_param(&strictness, NULL, lamb, define, param)) {
+        context->strict_applies += 1;
+        return '!';
+    }
+    if (arg->type == _ExprType_literal || arg->type == _ExprType_lambda) {
+        return '$';
+    }
+    if (arg->type == _ExprType_identifier && _icfp_strict_define(&strictness, NULL, arg) != NULL) {
+        return '$';
+    }
+    // a parameter of a partial application is seen through the lambda left
+    int depth = !full && lamb->expr1->type == _ExprType_apply2 ? 1 : 0;
+    strictness.fuel = _StrictFuel;
+    size_t count = 0;
+    if (_icfp_strict_repeats(&strictness, lamb->expr2, name, depth, &count)) {
+        context->lazy_applies += 1;
+        return '~';
+    }
+    return '$';
+}
+
+
+static struct _Expr*
+_icfp_beta_subst(struct _Optimizer* context, struct _Expr* expr, const char* name, struct _Expr* arg) {
+    switch (expr->type) {
+        case _ExprType_identifier:
+            return expr->token.value == name ? arg : expr;
+        case _ExprType_apply1:
+        case _ExprType_apply2:
+        case _ExprType_apply3:
+        case _ExprType_assert: {
+            struct _Expr* e0 = expr->expr0;
+            if (expr->type != _ExprType_assert && !_icfp_opt_is_op(expr)) {
+                e0 = _icfp_beta_subst(context, e0, name, arg);
+            }
+            struct _Expr* e1 = _icfp_beta_subst(context, expr->expr1, name, arg);
+            struct _Expr* e2 = expr->expr2 != NULL ? _icfp_beta_subst(context, expr->expr2, name, arg) : NULL;
+            struct _Expr* e3 = expr->expr3 != NULL ? _icfp_beta_subst(context, expr->expr3, name, arg) : NULL;
+            if (e0 == expr->expr0 && e1 == expr->expr1 && e2 == expr->expr2 && e3 == expr->expr3) {
+                return expr;
+            }
+            expr = _icfp_opt_clone(context, expr);
+            expr->expr0 = e0;
+            expr->expr1 = e1;
+            expr->expr2 = e2;
+            expr->expr3 = e3;
+            return expr;
+        }
+        case _ExprType_lambda: {
+            if (_icfp_opt_binds(expr, name)) {
+                return expr;
+            }
+            struct _Expr* body = _icfp_beta_subst(context, expr->expr2, name, arg);
+            if (body == expr->expr2) {
+                return expr;
+            }
+            expr = _icfp_opt_clone(context, expr);
+            expr->expr2 = body;
+            return expr;
+        }
+        case _ExprType_literal:
+        case _ExprType_define:
+        case _ExprType_invalid:
+            return expr;
+    }
+    return expr;
+}
+
+
+// Fixed points. (Y F) with F = (\ (z ...) e) and Y = \f. (\x. f (x x))
+// (\x. f (x x)) reduces the self application and then F again at every
+// use of z. Passing the lambda itself, as in
+// ((\ (s) (s s)) (\ (s ...) e[z := (s s)])), reduces only the self
+// application: one reduction less at each recursive step.
+static int
+_icfp_knot_is_self_apply(struct _Expr* expr, const char* x) {
+    return expr->type == _ExprType_apply1 && expr->expr0->type == _ExprType_identifier &&
+        expr->expr0->token.value == x && expr->expr1->type == _ExprType_identifier && expr->expr1->token.value == x;
+}
+
+
+// Whether half is \x. f (x x), or \x. f (\v. x x v) as it is written for
+// strict evaluation.
+static int
+_icfp_knot_is_half(struct _Expr* half, const char* f) {
+    if (half->type != _ExprType_lambda || half->expr1->type != _ExprType_apply1) {
+        return 0;
+    }
+    const char* x = half->expr1->expr1->token.value;
+    struct _Expr* body = half->expr2;
+    if (x == f || body->type != _ExprType_apply1 || _icfp_opt_is_op(body) ||
+        body->expr0->type != _ExprType_identifier || body->expr0->token.value != f) {
+        return 0;
+    }
+    struct _Expr* arg = body->expr1;
+    if (_icfp_knot_is_self_apply(arg, x)) {
+        return 1;
+    }
+    if (arg->type != _ExprType_lambda || arg->expr1->type != _ExprType_apply1) {
+        return 0;
+    }
+    const char* v = arg->expr1->expr1->token.value;
+    struct _Expr* inner = arg->expr2;
+    if (v == x || v == f) {
+        return 0;
+    }
+    if (inner->type == _ExprType_apply1 && !_icfp_opt_is_op(inner)) {
+        return _icfp_knot_is_self_apply(inner->expr0, x) && inner->expr1->type == _ExprType_identifier &&
+            inner->expr1->token.value == v;
+    }
+    return inner->type == _ExprType_apply2 && !_icfp_opt_is_op(inner) && _icfp_knot_is_self_apply(inner, x) &&
+        inner->expr2->type == _ExprType_identifier && inner->expr2->token.value == v;
+}
+
+
+static int
+_icfp_knot_is_fix(struct _Expr* lamb) {
+    if (lamb == NULL || lamb->type != _ExprType_lambda || lamb->expr1->type != _ExprType_apply1) {
+        return 0;
+    }
+    const char* f = lamb->expr1->expr1->token.value;
+    struct _Expr* body = lamb->expr2;
+    return body->type == _ExprType_apply1 && _icfp_knot_is_half(body->expr0, f) && _icfp_knot_is_half(body->expr1, f);
+}
+
+
+static struct _Expr*
+_icfp_knot_node(struct _ParserState* parser, const struct _Expr* at, enum _ExprType type) {
+    struct _Expr* expr = expr_tree_push(&parser->expr_tree);
+    expr->type = type;
+    expr->lineno = at->lineno;
+    expr->colno = at->colno;
+    return expr;
+}
+
+
+// Ties the knot of f, a lambda whose first parameter stands for f itself.
+static struct _Expr*
+icfp_knot(struct _Optimizer* context, struct _Expr* f) {
+    struct _ParserState* parser = context->parser;
+    struct _Expr* self = _icfp_knot_node(parser, f, _ExprType_identifier);
+    self->token.type = _TokenType_identifier;
+    self->token.lineno = f->lineno;
+    self->token.colno = f->colno;
+    struct _Expr* self_apply = _icfp_knot_node(parser, f, _ExprType_apply1);
+    self_apply->expr0 = self;
+    self_apply->expr1 = self;
+    // names are counted per compiler, and a prelude's knots may be inlined
+    size_t index = parser->knots;
+    do {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "(self %zu)", ++index);
+        self->token.value = symbol_list_intern(&parser->symbols, buf);
+        self->token.len = strlen(buf);
+    } while (_icfp_beta_captures(f, self_apply) || _icfp_beta_is_free(f, self->token.value));
+    parser->knots += 1;
+
+    struct _Expr* args = f->expr1;
+    const char* z = args->expr1->token.value;
+    struct _Expr* body = f->expr2;
+    // a second parameter of the same name hides z
+    if (args->type != _ExprType_apply2 || args->expr2->token.value != z) {
+        body = _icfp_beta_subst(context, body, z, self_apply);
+    }
+    struct _Expr* rec_args = _icfp_opt_clone(context, args);
+    rec_args->expr1 = self;
+    struct _Expr* rec = _icfp_opt_clone(context, f);
+    rec->expr0 = NULL;
+    rec->expr1 = rec_args;
+    rec->expr2 = body;
+
+    struct _Expr* tie_args = _icfp_knot_node(parser, f, _ExprType_apply1);
+    tie_args->expr1 = self;
+    struct _Expr* tie = _icfp_knot_node(parser, f, _ExprType_lambda);
+    tie->expr1 = tie_args;
+    tie->expr2 = self_apply;
+    struct _Expr* apply = _icfp_knot_node(parser, f, _ExprType_apply1);
+    apply->expr0 = tie;
+    apply->expr1 = rec;
+    return apply;
+}
+
+
+// Whether a local binder in scope hides a name the body of a define refers
+// to, as the body sees the root scope only. Such a define is not inlined.
+static int
+_icfp_opt_shadows(const struct _OptScope* scope, struct _Expr* lamb) {
+    for (const struct _OptScope* p = scope; p != NULL; p = p->parent) {
+        if (p->name != NULL && _icfp_beta_is_free(lamb, p->name)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// The depth of expr, or limit when it is at least that deep.
+static size_t
+_icfp_opt_depth(const struct _Expr* expr, size_t limit) {
+    if (expr == NULL || limit == 0) {
+        return 0;
+    }
+    const struct _Expr* children[4] = {expr->expr0, expr->expr1, expr->expr2, expr->expr3};
+    size_t depth = 0;
+    for (int k = 0; k < 4; ++k) {
+        size_t d = _icfp_opt_depth(children[k], limit - 1);
+        if (d > depth) {
+            depth = d;
+        }
+    }
+    return depth + 1;
+}
+
+
+// Applies lamb to arg at compile time when the cost model favours it, and
+// returns NULL otherwise. A two parameter lambda reduces to a one parameter
+// lambda. called names the define lamb came from, if any.
+static struct _Expr*
+_icfp_beta_reduce(struct _Optimizer* context, const struct _OptScope* scope, struct _Expr* lamb,
+    struct _Expr* called, struct _Expr* arg) {
+
+    if (context->fuel == 0) {
+        return NULL;
+    }
+    for (const struct _OptActive* p = context->active; p != NULL; p = p->parent) {
+        if (p->lamb == lamb) {
+            return NULL;
+        }
+    }
+    struct _Expr* args = lamb->expr1;
+    const char* name = args->expr1->token.value;
+    struct _Expr* body = lamb->expr2;
+    if (args->type == _ExprType_apply2) {
+        struct _Expr* rest = _icfp_opt_clone(context, args);
+        rest->type = _ExprType_apply1;
+        rest->expr1 = args->expr2;
+        rest->expr2 = NULL;
+        body = _icfp_opt_clone(context, lamb);
+        body->expr0 = NULL;
+        body->expr1 = rest;
+    }
+    if (called != NULL && _icfp_opt_shadows(scope, lamb)) {
+        return NULL;
+    }
+    struct _BetaUses uses = {};
+    _icfp_beta_uses(body, name, 0, &uses);
+    if (uses.count > 0 && _icfp_beta_captures(body, arg)) {
+        return NULL;
+    }
+    // the writer only takes names as the function of a two argument
+    // application, and one parameter lambdas, names or applications for one
+    if (uses.head2 && arg->type != _ExprType_identifier) {
+        return NULL;
+    }
+    if (uses.head1) {
+        switch (arg->type) {
+            case _ExprType_identifier:
+            case _ExprType_apply1:
+            case _ExprType_apply2:
+            case _ExprType_apply3:
+                break;
+            case _ExprType_lambda:
+                if (arg->expr1->type == _ExprType_apply1) { break; }
+                return NULL;
+            default:
+                return NULL;
+        }
+    }
+    // call-by-need evaluates a bound argument once, so only values may be
+    // copied to several uses or into a lambda that may run many times
+    int value = arg->type == _ExprType_identifier || arg->type == _ExprType_literal || arg->type == _ExprType_lambda;
+    if (!value && (uses.count > 1 || uses.under_lambda)) {
+        return NULL;
+    }
+    // the fold and the writer recurse on the tree, so a reduction must not
+    // make it deeper than _InlineDepthMax, as chains of defines that each
+    // apply the last twice would double it
+    if (_icfp_opt_depth(body, _InlineDepthMax) + _icfp_opt_depth(arg, _InlineDepthMax) > _InlineDepthMax) {
+        return NULL;
+    }
+    // one reduction saved is worth _InlineBetaBytes of output
+    size_t arg_size = _icfp_opt_size(context, scope, arg);
+    size_t grown = uses.count * arg_size;
+    size_t saved = arg_size + 7 + uses.count * 2;
+    if (called != NULL && context->shared) {
+        grown += _icfp_opt_size(context, NULL, lamb);
+        saved += 2;
+    }
+    if (grown > saved + _InlineBetaBytes) {
+        return NULL;
+    }
+    context->fuel -= 1;
+    context->parser->inlines += 1;
+    return _icfp_beta_subst(context, body, name, arg);
+}
+
+
+static struct _Expr*
+_icfp_fold_reduced(struct _Optimizer* context, const struct _OptScope* scope, struct _Expr* lamb, struct _Expr* reduced) {
+    struct _OptActive active = {lamb, context->active};
+    context->active = &active;
+    reduced = _icfp_fold_expression(context, scope, reduced);
+    context->active = active.parent;
+    return reduced;
+}
+
+
+static struct _Expr*
+_icfp_fold_apply(struct _Optimizer* context, const struct _OptScope* scope, struct _Expr* expr) {
+    struct _EvalState* eval = context->eval;
+    struct _ParserState* parser = context->parser;
+    struct _Expr* e0 = expr->expr0;
+    if (!_icfp_opt_is_op(expr) && e0->type != _ExprType_identifier) {
+        e0 = _icfp_fold_expression(context, scope, e0);
+    }
+    struct _Expr* e1 = _icfp_fold_expression(context, scope, expr->expr1);
+    struct _Expr* e2 = expr->expr2 != NULL ? _icfp_fold_expression(context, scope, expr->expr2) : NULL;
+    struct _Expr* e3 = expr->expr3 != NULL ? _icfp_fold_expression(context, scope, expr->expr3) : NULL;
+    if (e0 != expr->expr0 || e1 != expr->expr1 || e2 != expr->expr2 || e3 != expr->expr3) {
+        expr = _icfp_opt_clone(context, expr);
+        expr->expr0 = e0;
+        expr->expr1 = e1;
+        expr->expr2 = e2;
+        expr->expr3 = e3;
+    }
+
+    switch (expr->type) {
+        case _ExprType_apply1: {
+            int op = _icfp_expr_unary_op(expr->expr0);
+            if (op == 0) {
+                struct _Expr* called = expr->expr0->type == _ExprType_identifier ? expr->expr0 : NULL;
+                struct _Expr* lamb = called != NULL ? _icfp_opt_define(context, scope, called) : expr->expr0;
+                if (lamb == NULL || lamb->type != _ExprType_lambda) {
+                    return expr;
+                }
+                if (_icfp_knot_is_fix(lamb)) {
+                    struct _Expr* f = expr->expr1;
+                    if (f->type == _ExprType_identifier) {
+                        f = _icfp_opt_define(context, scope, f);
+                        if (f != NULL && _icfp_opt_shadows(scope, f)) {
+                            f = NULL;
+                        }
+                    }
+                    if (f != NULL && f->type == _ExprType_lambda) {
+                        return icfp_knot(context, f);
+                    }
+                }
+                struct _Expr* reduced = _icfp_beta_reduce(context, scope, lamb, called, expr->expr1);
+                return reduced != NULL ? _icfp_fold_reduced(context, scope, lamb, reduced) : expr;
+            }
+            struct _Value* x = _icfp_fold_value(eval, expr->expr1);
+            if (x == NULL || !_icfp_fold_accepts(op, x, NULL)) {
+                return expr;
+            }
+            return _icfp_fold_literal(parser, expr, _icfp_eval_unary(eval, op, x));
+        }
+        case _ExprType_apply2: {
+            if (!_icfp_opt_is_op(expr)) {
+                struct _Expr* called = expr->expr0->type == _ExprType_identifier ? expr->expr0 : NULL;
+                struct _Expr* lamb = called != NULL ? _icfp_opt_define(context, scope, called) : expr->expr0;
+                if (lamb == NULL || lamb->type != _ExprType_lambda || lamb->expr1->type != _ExprType_apply2) {
+                    return expr;
+                }
+                struct _Expr* partial = _icfp_beta_reduce(context, scope, lamb, called, expr->expr1);
+                if (partial == NULL) {
+                    return expr;
                 }
+                // what is left applies a one parameter lambda
+                struct _Expr* rest = _icfp_opt_clone(context, expr);
+                rest->type = _ExprType_apply1;
+                rest->expr0 = partial;
+                rest->expr1 = expr->expr2;
+                rest->expr2 = NULL;
+                return _icfp_fold_reduced(context, scope, lamb, rest);
+            }
+            int op = _icfp_expr_binary_op(expr->expr0);
+            if (op == '$' || op == '~' || op == '!') {
+                return expr;
+            }
+            struct _Value* x = _icfp_fold_value(eval, expr->expr1);
+            struct _Value* y = _icfp_fold_value(eval, expr->expr2);
+            if (x != NULL && y != NULL && _icfp_fold_accepts(op, x, y)) {
+                return _icfp_fold_literal(parser, expr, _icfp_eval_binary(eval, op, x, y));
+            }
+            if (op != '.' || (x == NULL) == (y == NULL) || (x != NULL ? x : y)->type != _ValueType_str) {
+                return expr;
+            }
+            // . is associative, so join a literal with the near end of a
+            // nested . that has one
+            struct _Expr* nested = x != NULL ? expr->expr2 : expr->expr1;
+            if (nested->type != _ExprType_apply2 || !_icfp_opt_is_op(nested) || _icfp_expr_binary_op(nested->expr0) != '.') {
+                return expr;
+            }
+            struct _Expr* near = x != NULL ? nested->expr1 : nested->expr2;
+            struct _Value* z = _icfp_fold_value(eval, near);
+            if (z == NULL || z->type != _ValueType_str) {
+                return expr;
+            }
+            struct _Expr* joined = _icfp_opt_clone(context, nested);
+            if (x != NULL) {
+                joined->expr1 = _icfp_fold_literal(parser, expr, _icfp_eval_binary(eval, op, x, z));
+            }
+            else {
+                joined->expr2 = _icfp_fold_literal(parser, expr, _icfp_eval_binary(eval, op, z, y));
+            }
+            return joined;
+        }
+        case _ExprType_apply3: {
+            if (expr->expr0->token.len != 1 || expr->expr0->token.value[0] != '?') {
+                return expr;
+            }
+            struct _Value* c = _icfp_fold_value(eval, expr->expr1);
+            if (c == NULL || c->type != _ValueType_bool) {
+                return expr;
+            }
+            parser->folds += 1;
+            return c->num ? expr->expr2 : expr->expr3;
+        }
+        default:
+            abort();
+    }
+}
+
+
+static struct _Expr*
+_icfp_fold_expression(struct _Optimizer* context, const struct _OptScope* scope, struct _Expr* expr) {
+    switch (expr->type) {
+        case _ExprType_apply1:
+        case _ExprType_apply2:
+        case _ExprType_apply3:
+            return _icfp_fold_apply(context, scope, expr);
+        case _ExprType_lambda: {
+            struct _Expr* args = expr->expr1;
+            struct _OptScope inner = {args->expr1->token.value, scope};
+            struct _OptScope inner2 = {NULL, &inner};
+            if (args->type == _ExprType_apply2) {
+                inner2.name = args->expr2->token.value;
+            }
+            struct _Expr* body = _icfp_fold_expression(context, &inner2, expr->expr2);
+            if (body == expr->expr2) {
+                return expr;
+            }
+            expr = _icfp_opt_clone(context, expr);
+            expr->expr2 = body;
+            return expr;
+        }
+        case _ExprType_assert: {
+            struct _Expr* cond = _icfp_fold_expression(context, scope, expr->expr1);
+            if (cond == expr->expr1) {
+                return expr;
+            }
+            expr = _icfp_opt_clone(context, expr);
+            expr->expr1 = cond;
+            return expr;
+        }
+        case _ExprType_identifier:
+            // reached from an emitted expression
+            _icfp_opt_define_name(context, scope, expr);
+            return expr;
+        case _ExprType_literal:
+        case _ExprType_define:
+        case _ExprType_invalid:
+            return expr;
+    }
+    return expr;
+}
+
+
+// Folds constants and reduces lambda applications in expr, which sees the
+// defines made so far. Nodes are copied on write, so define bodies shared
+// with expr stay intact. Defines expr reaches are optimized on the way.
+static struct _Expr*
+icfp_fold_toplevel(struct _ParserState* context, struct _WriterState* wstate, struct _Expr* expr) {
+    struct _Optimizer opt;
+    opt.parser = context;
+    opt.eval = wstate->eval;
+    opt.root = wstate->nametable;
+    opt.shared = wstate->out_shared;
+    opt.lower = 1;
+    opt.fuel = _InlineFuel;
+    opt.active = NULL;
+    opt.expanding = NULL;
+    expr = _icfp_fold_expression(&opt, NULL, expr);
+    icfp_eval_reset(wstate->eval);
+    return expr;
+}
+
+
+// Repeated subexpressions. Structurally equal subtrees of an emitted
+// expression are hash-consed into one _ShareNode. Where a node occurs often
+// enough under the same innermost binder of its free names, which makes the
+// occurrences mean the same thing, they are replaced by a variable bound
+// once at the top of that binder's body, or around the whole expression
+// when the node is closed.
+struct _ShareNode {
+    uint64_t hash;
+    enum _ExprType type;
+    const void* key;
+    const void* key2;
+    struct _ShareNode* child[4];
+    // written wherever an occurrence keeps all of its subtrees
+    struct _Expr* expr;
+    size_t size;
+    // names used and not bound inside, for finding the binder
+    const char** free;
+    size_t free_count;
+    // occurrences, linked through next
+    size_t first;
+    size_t count;
+};
+
+
+struct _ShareBinding {
+    struct _Expr* var;
+    // occurrence the bound value is built from
+    size_t occ;
+    // the next binding at the same binder, which encloses this one
+    struct _ShareBinding* next;
+};
+
+
+struct _ShareOcc {
+    struct _Expr* expr;
+    struct _ShareNode* node;
+    size_t parent;
+    // one past the last occurrence inside this one
+    size_t end;
+    size_t next;
+    // replaced by the variable of binding
+    struct _ShareBinding* binding;
+    // for lambdas, bound at the top of the body
+    struct _ShareBinding* bindings;
+    // a copy dropped for a binding, so nothing inside counts
+    int dead;
+};
+
+
+struct _Sharer {
+    struct _Optimizer opt;
+    struct _Arena arena;
+    struct _ShareNode** nodes;
+    size_t nodes_size;
+    size_t nodes_used;
+    struct _ShareOcc* occs;
+    size_t occs_size;
+    size_t occs_used;
+    // closed nodes, bound around the whole expression
+    struct _ShareBinding* root;
+    size_t bindings;
+};
+
+
+static constexpr const size_t _ShareNone = SIZE_MAX;
+
+
+static uint64_t
+_share_mix(uint64_t h, uint64_t x) {
+    h ^= x + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+    return h;
+}
+
+
+static struct _ShareNode**
+_icfp_share_slot(struct _Sharer* context, uint64_t hash, enum _ExprType type, const void* key, const void* key2,
+    struct _ShareNode* const* child) {
+
+    size_t mask = context->nodes_size - 1;
+    for (size_t i = (size_t) (hash >> 20) & mask;; i = (i + 1) & mask) {
+        struct _ShareNode** slot = &context->nodes[i];
+        struct _ShareNode* node = *slot;
+        if (node == NULL) {
+            return slot;
+        }
+        if (node->hash == hash && node->type == type && node->key == key && node->key2 == key2 &&
+            memcmp(node->child, child, sizeof(node->child)) == 0) {
+            return slot;
+        }
+    }
+}
+
+
+static void
+_icfp_share_grow(struct _Sharer* context) {
+    struct _ShareNode** nodes = context->nodes;
+    size_t nodes_size = context->nodes_size;
+    context->nodes_size = nodes_size ? nodes_size * 2 : 0x40;
+    context->nodes = (struct _ShareNode**) calloc(context->nodes_size, sizeof(struct _ShareNode*));
+    for (size_t i = 0; i < nodes_size; ++i) {
+        struct _ShareNode* node = nodes[i];
+        if (node != NULL) {
+            *_icfp_share_slot(context, node->hash, node->type, node->key, node->key2, node->child) = node;
+        }
+    }
+    free(nodes);
+}
+
+
+// Adds name to the free names being collected in free, once.
+static size_t
+_icfp_share_add_free(const char** free, size_t count, const char* name) {
+    for (size_t i = 0; i < count; ++i) {
+        if (free[i] == name) {
+            return count;
+        }
+    }
+    free[count] = name;
+    return count + 1;
+}
+
+
+static struct _ShareNode*
+_icfp_share_intern(struct _Sharer* context, struct _Expr* expr, const void* key, const void* key2,
+    struct _ShareNode* const* child, size_t size) {
+
+    uint64_t hash = _share_mix(expr->type, (uintptr_t) key);
+    hash = _share_mix(hash, (uintptr_t) key2);
+    for (int i = 0; i < 4; ++i) {
+        hash = _share_mix(hash, (uintptr_t) child[i]);
+    }
+    if ((context->nodes_used + 1) * 4 >= context->nodes_size * 3) {
+        _icfp_share_grow(context);
+    }
+    struct _ShareNode** slot = _icfp_share_slot(context, hash, expr->type, key, key2, child);
+    if (*slot != NULL) {
+        return *slot;
+    }
+    struct _ShareNode* node = (struct _ShareNode*) arena_alloc(&context->arena, sizeof(struct _ShareNode));
+    node->hash = hash;
+    node->type = expr->type;
+    node->key = key;
+    node->key2 = key2;
+    memcpy(node->child, child, sizeof(node->child));
+    node->expr = expr;
+    node->size = size;
+    node->first = _ShareNone;
+    node->count = 0;
+
+    size_t n = expr->type == _ExprType_identifier ? 1 : 0;
+    for (int i = 0; i < 4; ++i) {
+        n += child[i] != NULL ? child[i]->free_count : 0;
+    }
+    node->free = (const char**) arena_alloc(&context->arena, (n ? n : 1) * sizeof(const char*));
+    node->free_count = 0;
+    if (expr->type == _ExprType_identifier) {
+        node->free[node->free_count++] = expr->token.value;
+    }
+    for (int i = 0; i < 4; ++i) {
+        for (size_t j = 0; child[i] != NULL && j < child[i]->free_count; ++j) {
+            const char* name = child[i]->free[j];
+            if (expr->type == _ExprType_lambda && _icfp_opt_binds(expr, name)) {
+                continue;
+            }
+            node->free_count = _icfp_share_add_free(node->free, node->free_count, name);
+        }
+    }
+    *slot = node;
+    context->nodes_used += 1;
+    return node;
+}
+
+
+static struct _ShareNode*
+_icfp_share_walk(struct _Sharer* context, const struct _OptScope* scope, struct _Expr* expr, size_t parent) {
+    if (context->occs_used >= context->occs_size) {
+        context->occs_size = context->occs_size ? context->occs_size * 2 : 0x40;
+        context->occs = (struct _ShareOcc*) realloc(context->occs, context->occs_size * sizeof(struct _ShareOcc));
+    }
+    size_t index = context->occs_used++;
+    context->occs[index] = {};
+    context->occs[index].expr = expr;
+    context->occs[index].parent = parent;
+
+    struct _ShareNode* child[4] = {};
+    const void* key = NULL;
+    const void* key2 = NULL;
+    size_t size = 0;
+    switch (expr->type) {
+        case _ExprType_identifier:
+            // a local and a define of the same name differ in size
+            key = expr->token.value;
+            key2 = (const void*) (uintptr_t) _icfp_opt_is_local(scope, expr->token.value);
+            size = _icfp_opt_size(&context->opt, scope, expr);
+            break;
+        case _ExprType_literal:
+            key = expr->token.type == _TokenType_number ? expr->token.encoded : expr->token.value;
+            key2 = (const void*) (uintptr_t) expr->token.type;
+            size = _icfp_opt_size(&context->opt, scope, expr);
+            break;
+        case _ExprType_apply1:
+        case _ExprType_apply2:
+        case _ExprType_apply3: {
+            int op = _icfp_opt_is_op(expr);
+            if (op) {
+                key = expr->expr0->token.value;
+            }
+            else {
+                child[0] = _icfp_share_walk(context, scope, expr->expr0, index);
+                size += 4 + child[0]->size;
+            }
+            child[1] = _icfp_share_walk(context, scope, expr->expr1, index);
+            size += (expr->type == _ExprType_apply1 && op ? 3 : 4) + child[1]->size;
+            if (expr->expr2 != NULL) {
+                child[2] = _icfp_share_walk(context, scope, expr->expr2, index);
+                size += child[2]->size;
+            }
+            if (expr->expr3 != NULL) {
+                child[3] = _icfp_share_walk(context, scope, expr->expr3, index);
+                size += child[3]->size;
+            }
+            break;
+        }
+        case _ExprType_lambda: {
+            struct _Expr* args = expr->expr1;
+            struct _OptScope inner = {args->expr1->token.value, scope};
+            struct _OptScope inner2 = {NULL, &inner};
+            key = args->expr1->token.value;
+            size = 3;
+            if (args->type == _ExprType_apply2) {
+                inner2.name = args->expr2->token.value;
+                key2 = args->expr2->token.value;
+                size += 3;
+            }
+            child[2] = _icfp_share_walk(context, &inner2, expr->expr2, index);
+            size += child[2]->size;
+            break;
+        }
+        case _ExprType_assert:
+            child[1] = _icfp_share_walk(context, scope, expr->expr1, index);
+            size = 3 + child[1]->size;
+            break;
+        case _ExprType_define:
+        case _ExprType_invalid:
+            fprintf(_icfp_stderr, "! share of invalid expression\n");
+            abort();
+    }
+    struct _ShareNode* node = _icfp_share_intern(context, expr, key, key2, child, size);
+    struct _ShareOcc* occ = &context->occs[index];
+    occ->node = node;
+    occ->end = context->occs_used;
+    occ->next = node->first;
+    node->first = index;
+    node->count += 1;
+    return node;
+}
+
+
+// Finds the innermost lambda binding a free name of occurrence index, or
+// _ShareNone for a closed one. Returns 0 if the occurrence was dropped.
+static int
+_icfp_share_anchor(struct _Sharer* context, size_t index, size_t* anchor) {
+    struct _ShareNode* node = context->occs[index].node;
+    *anchor = _ShareNone;
+    for (size_t i = index; i != _ShareNone; i = context->occs[i].parent) {
+        struct _ShareOcc* occ = &context->occs[i];
+        if (occ->dead) {
+            return 0;
+        }
+        if (i == index || *anchor != _ShareNone || occ->expr->type != _ExprType_lambda) {
+            continue;
+        }
+        for (size_t j = 0; j < node->free_count; ++j) {
+            if (_icfp_opt_binds(occ->expr, node->free[j])) {
+                *anchor = i;
+                break;
+            }
+        }
+    }
+    return 1;
+}
+
+
+// Whether binding k occurrences of a node of size saves more output than
+// the reduction it costs.
+static int
+_icfp_share_pays(size_t size, size_t k) {
+    return (k - 1) * size > 7 + 2 * k + _InlineBetaBytes;
+}
+
+
+static int
+_icfp_share_by_size(const void* a, const void* b) {
+    const struct _ShareNode* x = *(struct _ShareNode* const*) a;
+    const struct _ShareNode* y = *(struct _ShareNode* const*) b;
+    if (x->size != y->size) {
+        return x->size < y->size ? 1 : -1;
+    }
+    // the table is in hash order, so ties go by where they first occur
+    return x->first < y->first ? -1 : x->first > y->first ? 1 : 0;
+}
+
+
+struct _ShareUse {
+    size_t anchor;
+    size_t occ;
+};
+
+
+static int
+_icfp_share_by_anchor(const void* a, const void* b) {
+    const struct _ShareUse* x = (const struct _ShareUse*) a;
+    const struct _ShareUse* y = (const struct _ShareUse*) b;
+    if (x->anchor != y->anchor) {
+        return x->anchor < y->anchor ? -1 : 1;
+    }
+    return x->occ < y->occ ? -1 : x->occ > y->occ ? 1 : 0;
+}
+
+
+static void
+_icfp_share_bind(struct _Sharer* context, struct _ShareUse* uses, size_t k) {
+    struct _ParserState* parser = context->opt.parser;
+    struct _ShareOcc* first = &context->occs[uses[0].occ];
+    char buf[32];
+    snprintf(buf, sizeof(buf), "(shared %zu)", ++context->bindings);
+    struct _Expr* var = expr_tree_push(&parser->expr_tree);
+    var->type = _ExprType_identifier;
+    var->lineno = first->expr->lineno;
+    var->colno = first->expr->colno;
+    var->token.type = _TokenType_identifier;
+    var->token.value = symbol_list_intern(&parser->symbols, buf);
+    var->token.len = strlen(buf);
+    var->token.lineno = var->lineno;
+    var->token.colno = var->colno;
+
+    struct _ShareBinding* binding = (struct _ShareBinding*) arena_alloc(&context->arena, sizeof(struct _ShareBinding));
+    binding->var = var;
+    binding->occ = uses[0].occ;
+    for (size_t i = 0; i < k; ++i) {
+        context->occs[uses[i].occ].binding = binding;
+        context->occs[uses[i].occ].dead = i > 0;
+    }
+    // nodes are bound larger first, so later bindings go outside
+    struct _ShareBinding** list = uses[0].anchor == _ShareNone ? &context->root : &context->occs[uses[0].anchor].bindings;
+    binding->next = *list;
+    *list = binding;
+    parser->shares += 1;
+    if (parser->verbose) {
+        fprintf(_icfp_stderr, "%s:%d:%d: %s shares %zu uses of %zu bytes\n", parser->filename, var->lineno, var->colno,
+            buf, k, first->node->size);
+    }
+}
+
+
+// Picks the bindings. Larger nodes go first, so a node inside one that is
+// bound only counts the copy left in the binding.
+static void
+_icfp_share_select(struct _Sharer* context) {
+    size_t n = 0;
+    struct _ShareNode** candidates = (struct _ShareNode**) arena_alloc(&context->arena,
+        (context->nodes_used ? context->nodes_used : 1) * sizeof(struct _ShareNode*));
+    for (size_t i = 0; i < context->nodes_size; ++i) {
+        struct _ShareNode* node = context->nodes[i];
+        if (node != NULL && node->count > 1 && _icfp_share_pays(node->size, node->count)) {
+            candidates[n++] = node;
+        }
+    }
+    qsort(candidates, n, sizeof(struct _ShareNode*), _icfp_share_by_size);
+
+    for (size_t c = 0; c < n; ++c) {
+        struct _ShareNode* node = candidates[c];
+        struct _ShareUse* uses = (struct _ShareUse*) arena_alloc(&context->arena, node->count * sizeof(struct _ShareUse));
+        size_t live = 0;
+        for (size_t i = node->first; i != _ShareNone; i = context->occs[i].next) {
+            if (_icfp_share_anchor(context, i, &uses[live].anchor)) {
+                uses[live++].occ = i;
             }
-            struct _Name* resolved_name;
-            int res = name_table_resolve(nametable, token, &resolved_name);
-            if (res != 0) { return res; }
-            res = fputs("B$ ", context->file);
-            if (res == EOF) { perror(NULL); return 1; }
-            res = _icfp_write_resolved_name(context, resolved_name, nametable);
-            if (res != 0) { return res; }
-            res = fputc(' ', context->file);
-            if (res == EOF) { perror(NULL); return 1; }
-            return _icfp_write_expression(context, expr->expr1, nametable);
         }
-        case _ExprType_apply1:
-        case _ExprType_apply2:
-        case _ExprType_apply3: {
-            int res = fputs("B$ ", context->file);
-            if (res == EOF) { perror(NULL); return 1; }
-            res = _icfp_write_expression(context, expr->expr0, nametable);
-            if (res != 0) { return res; }
-            res = fputc(' ', context->file);
-            if (res == EOF) { perror(NULL); return 1; }
-            return _icfp_write_expression(context, expr->expr1, nametable);
+        qsort(uses, live, sizeof(struct _ShareUse), _icfp_share_by_anchor);
+        for (size_t i = 0, j; i < live; i = j) {
+            for (j = i + 1; j < live && uses[j].anchor == uses[i].anchor; ++j) {
+            }
+            if (j - i > 1 && _icfp_share_pays(node->size, j - i)) {
+                _icfp_share_bind(context, &uses[i], j - i);
+            }
         }
-        case _ExprType_lambda: {
-            int res;
-            struct _Expr* args = expr->expr0->expr1;
-            enum _ExprType arity = args->type;
-            switch (arity) {
-                case _ExprType_apply3:
-                    res = fputs("B$ ", context->file);
-                    if (res == EOF) { perror(NULL); return 1; }
-                    // fallthrough
-                case _ExprType_apply2:
-                    res = fputs("B$ ", context->file);
-                    if (res == EOF) { perror(NULL); return 1; }
-                    // fallthrough
-                case _ExprType_apply1:
-                    res = fputs("B$ ", context->file);
-                    if (res == EOF) { perror(NULL); return 1; }
-                    break;
-                default:
-                    fprintf(stderr, "! invalid lambda arity %d\n", arity);
-                    abort();
+    }
+}
+
+
+static struct _Expr*
+_icfp_share_build_node(struct _Sharer* context, size_t index);
+
+
+static struct _Expr*
+_icfp_share_build(struct _Sharer* context, size_t index) {
+    struct _ShareBinding* binding = context->occs[index].binding;
+    return binding != NULL ? binding->var : _icfp_share_build_node(context, index);
+}
+
+
+// Wraps body in the bindings of list, the first one outermost.
+static struct _Expr*
+_icfp_share_wrap(struct _Sharer* context, struct _Expr* body, struct _ShareBinding* binding) {
+    if (binding == NULL) {
+        return body;
+    }
+    struct _ExprTree* tree = &context->opt.parser->expr_tree;
+    struct _Expr* var = binding->var;
+    struct _Expr* args = expr_tree_push(tree);
+    args->type = _ExprType_apply1;
+    args->lineno = var->lineno;
+    args->colno = var->colno;
+    args->expr1 = var;
+    struct _Expr* lamb = expr_tree_push(tree);
+    lamb->type = _ExprType_lambda;
+    lamb->lineno = var->lineno;
+    lamb->colno = var->colno;
+    lamb->expr1 = args;
+    lamb->expr2 = _icfp_share_wrap(context, body, binding->next);
+    struct _Expr* apply = expr_tree_push(tree);
+    apply->type = _ExprType_apply1;
+    apply->lineno = var->lineno;
+    apply->colno = var->colno;
+    apply->expr0 = lamb;
+    apply->expr1 = _icfp_share_build_node(context, binding->occ);
+    return apply;
+}
+
+
+// Builds occurrence index, ignoring a binding of its own.
+static struct _Expr*
+_icfp_share_build_node(struct _Sharer* context, size_t index) {
+    struct _ShareOcc* occ = &context->occs[index];
+    struct _Expr* expr = occ->expr;
+    struct _ShareNode* node = occ->node;
+    struct _Expr* built[4] = {};
+    int changed = 0;
+    size_t next = index + 1;
+    for (int i = 0; i < 4; ++i) {
+        if (node->child[i] == NULL) {
+            continue;
+        }
+        built[i] = _icfp_share_build(context, next);
+        changed |= built[i] != node->child[i]->expr;
+        next = context->occs[next].end;
+    }
+    if (occ->bindings != NULL) {
+        built[2] = _icfp_share_wrap(context, built[2], occ->bindings);
+        changed = 1;
+    }
+    if (!changed) {
+        return node->expr;
+    }
+    struct _Expr* copy = expr_tree_push(&context->opt.parser->expr_tree);
+    *copy = *expr;
+    for (int i = 0; i < 4; ++i) {
+        if (node->child[i] != NULL) {
+            (&copy->expr0)[i] = built[i];
+        }
+    }
+    return copy;
+}
+
+
+// Binds subexpressions that expr repeats, when that makes the output
+// smaller. Equal subtrees left in place are written from one node.
+static struct _Expr*
+icfp_share_toplevel(struct _ParserState* context, struct _WriterState* wstate, struct _Expr* expr) {
+    if (expr->type == _ExprType_assert) {
+        struct _Expr* cond = icfp_share_toplevel(context, wstate, expr->expr1);
+        if (cond == expr->expr1) {
+            return expr;
+        }
+        struct _Expr* copy = expr_tree_push(&context->expr_tree);
+        *copy = *expr;
+        copy->expr1 = cond;
+        return copy;
+    }
+    struct _Sharer sharer = {};
+    sharer.opt.parser = context;
+    sharer.opt.eval = wstate->eval;
+    sharer.opt.root = wstate->nametable;
+    sharer.opt.shared = wstate->out_shared;
+    sharer.opt.lower = context->optimize;
+    arena_init(&sharer.arena, _ShareChunkSize);
+    _icfp_share_walk(&sharer, NULL, expr, _ShareNone);
+    _icfp_share_select(&sharer);
+    expr = _icfp_share_wrap(&sharer, _icfp_share_build(&sharer, 0), sharer.root);
+    free(sharer.nodes);
+    free(sharer.occs);
+    arena_free(&sharer.arena);
+    return expr;
+}
+
+
+// Optimizes every define up front, knots included, for a prelude that
+// compilers running on other threads will share and so must not change.
+static void
+icfp_lower_defines(struct _ParserState* context, struct _WriterState* wstate) {
+    struct _NameTable* root = wstate->nametable;
+    for (size_t i = 0; i < root->names_size; ++i) {
+        struct _Name* name = root->names[i];
+        if (name == NULL || name->expr == NULL || name->expr->type == _ExprType_identifier) {
+            continue;
+        }
+        struct _Optimizer opt = {};
+        opt.parser = context;
+        opt.eval = wstate->eval;
+        opt.root = root;
+        opt.shared = wstate->out_shared;
+        opt.lower = 1;
+        opt.fuel = _InlineFuel;
+        _icfp_opt_lower(&opt, name);
+        icfp_eval_reset(wstate->eval);
+    }
+}
+
+
+static int
+_icfp_process_eval(struct _WriterState* wstate, const struct _Expr* at, FILE* file) {
+    struct _OutBuf* out = &wstate->out;
+    struct _EvalBudget* budget = wstate->eval->budget;
+    // errors and a budget report on each top-level expression by where it
+    // starts
+    char label[1024];
+    snprintf(label, sizeof(label), "%s:%d:%d", wstate->filename, at->lineno, at->colno);
+    if (budget != NULL) {
+        budget->spans = wstate->spans;
+        budget->spans_used = wstate->spans_used;
+    }
+    return icfp_eval_text(wstate->eval, label, out->data, out->used, file);
+}
+
+
+// Writes expr out, where at is the top-level expression it was optimized
+// from.
+static int
+_icfp_process_expression(struct _WriterState* wstate, struct _Expr* expr, const struct _Expr* at) {
+    wstate->spans_used = 0;
+    switch (wstate->out_format) {
+        case 1: {
+            int res = icfp_write_toplevel(wstate, expr);
+            if (res == 0 && wstate->eval->budget != NULL) {
+                res = _icfp_process_eval(wstate, at, NULL);
             }
-            res = _icfp_write_expression(context, expr->expr0, nametable);
-            if (res != 0) { return res; }
-            res = fputc(' ', context->file);
-            if (res == EOF) { perror(NULL); return 1; }
-            return _icfp_write_expression(context, expr->expr1, nametable);
+            if (res != 0) {
+                wstate->out.used = 0;
+                return res;
+            }
+            return outbuf_flush(&wstate->out, wstate->file);
+        }
+        case 2: {
+            struct _OutBuf* out = &wstate->out;
+            int res = icfp_write_toplevel(wstate, expr);
+            if (res == 0) {
+                res = _icfp_process_eval(wstate, at, wstate->file);
+            }
+            out->used = 0;
+            return res;
+        }
+        case 3: {
+            // written as ICFP, read back as terms
+            struct _OutBuf* out = &wstate->out;
+            size_t start = out->used;
+            int res = icfp_write_toplevel(wstate, expr);
+            struct _Term* term;
+            if (res == 0) {
+                res = icfp_eval_read(wstate->eval, wstate->filename, out->data + start, out->used - start, &term);
+            }
+            out->used = start;
+            if (res == 0) {
+                icfp_cpp_write(&wstate->cpp, term);
+                res = outbuf_flush(out, wstate->file);
+            }
+            icfp_eval_reset(wstate->eval);
+            return res;
         }
-        default:
-            fprintf(stderr, "! invalid expression to apply %d\n", expr->expr0->type);
-            abort();
     }
+    abort();
 }
 
 
+// Optimizes a top-level expression as configured and writes it out.
 static int
-_icfp_write_expression(struct _WriterState* context, struct _Expr* expr, struct _NameTable* nametable) {
-    FILE* file = context->file;
-    switch (expr->type) {
-        case _ExprType_identifier: {
-            struct _Name* resolved_name;
-            int res = name_table_resolve(nametable, &expr->token, &resolved_name);
-            if (res != 0) { return res; }
-            res = _icfp_write_resolved_name(context, resolved_name, nametable);
-            if (res != 0) { return res; }
-            return 0;
+_icfp_parser_toplevel(struct _ParserState* context, struct _WriterState* wstate, struct _Expr* expr) {
+    uint64_t start = context->stats ? _clock_ns(CLOCK_MONOTONIC) : 0;
+    struct _Expr* at = expr;
+    if (context->optimize) {
+        expr = icfp_fold_toplevel(context, wstate, expr);
+    }
+    if (context->share) {
+        expr = icfp_share_toplevel(context, wstate, expr);
+    }
+    uint64_t mid = context->stats ? _clock_ns(CLOCK_MONOTONIC) : 0;
+    uint64_t eval_ns = wstate->eval->eval_ns;
+    int res = _icfp_process_expression(wstate, expr, at);
+    if (context->stats) {
+        context->optimize_ns += mid - start;
+        // what -e spends evaluating is a phase of its own
+        context->write_ns += _clock_ns(CLOCK_MONOTONIC) - mid - (wstate->eval->eval_ns - eval_ns);
+    }
+    return res;
+}
+
+
+// Binds the name of a define in the root scope to a lambda of its
+// parameters and body. A define that calls itself is bound to the knot of
+// a lambda that takes it as its first parameter.
+static void
+_icfp_parser_define(struct _ParserState* context, struct _WriterState* wstate, struct _Expr* expr) {
+    struct _Expr* args = expr->expr1;
+    struct _Expr* body = expr->expr2;
+    const char* name = args->expr0->token.value;
+    struct _Expr* lamb = expr_tree_push(&context->expr_tree);
+    lamb->type = _ExprType_lambda;
+    lamb->token = expr->token;
+    lamb->lineno = expr->token.lineno;
+    lamb->colno = expr->token.colno;
+    lamb->expr0 = args->expr0;
+    lamb->expr1 = args;
+    lamb->expr2 = body;
+    if (_icfp_beta_is_free(lamb, name)) {
+        struct _Optimizer opt = {};
+        opt.parser = context;
+        struct _Expr* rec_args = _icfp_knot_node(context, lamb, _ExprType_apply2);
+        rec_args->expr1 = args->expr0;
+        rec_args->expr2 = args->expr1;
+        struct _Expr* rec = _icfp_knot_node(context, lamb, _ExprType_lambda);
+        rec->expr1 = rec_args;
+        rec->expr2 = body;
+        if (args->type == _ExprType_apply2) {
+            // lambdas take two parameters at most, the last gets its own
+            struct _Expr* last_args = _icfp_knot_node(context, lamb, _ExprType_apply1);
+            last_args->expr1 = args->expr2;
+            struct _Expr* last = _icfp_knot_node(context, lamb, _ExprType_lambda);
+            last->expr1 = last_args;
+            last->expr2 = body;
+            rec->expr2 = last;
         }
-        case _ExprType_apply1:
-            return _icfp_write_expr_apply1(context, expr, nametable);
-        case _ExprType_apply2: {
-            struct _Token* token = &expr->expr0->token;
-            if (token->len == 1) {
-                char c = token->value[0];
-                switch (c) {
-                    case '+':
-                    case '-':
-                    case '*':
-                    case '/':
-                    case '%':
-                    case '<':
-                    case '>':
-                    case '=':
-                    case '|':
-                    case '&':
-                    case '.':
-                    case 'T':
-                    case 'D':
-                    case '$': {
-                        char s[4] = "B_ ";
-                        s[1] = c;
-                        int res = fputs(s, file);
-                        if (res == EOF) { perror(NULL); return 1; }
-                        res = _icfp_write_expression(context, expr->expr1, nametable);
-                        if (res != 0) { return res; }
-                        res = fputc(' ', file);
-                        if (res == EOF) { perror(NULL); return 1; }
-                        return _icfp_write_expression(context, expr->expr2, nametable);
-                    }
-                    default:
-                        break;
+        lamb = icfp_knot(&opt, rec);
+    }
+    name_table_put(wstate->nametable, name, lamb);
+}
+
+
+static int
+icfp_parser_process(struct _ParserState* context, struct _WriterState* wstate, const char* filename, struct _Reader* reader) {
+    context->filename = filename;
+    context->lineno = 1;
+    context->colno = 1;
+    wstate->filename = filename;
+    switch (wstate->out_format) {
+        case 1:
+        case 2:
+            break;
+        case 3:
+            if (!context->prelude) {
+                icfp_cpp_begin(&wstate->cpp, &wstate->out);
+            }
+            break;
+        default:
+            fprintf(_icfp_stderr, "! unhandled output format %d\n", wstate->out_format);
+            return 1;
+    }
+
+    struct _Expr* expr;
+    int count = 0;
+    for (;;) {
+        if (count > 0 && wstate->out_format == 1) {
+            outbuf_putc(&wstate->out, '\n');
+        }
+        struct _Nesting nesting = {};
+        uint64_t start = context->stats ? _clock_ns(CLOCK_MONOTONIC) : 0;
+        int res = _icfp_parser_parse_expression(context, reader, &nesting, &expr);
+        if (context->stats) {
+            context->parse_ns += _clock_ns(CLOCK_MONOTONIC) - start;
+        }
+        if (res != 1) {
+            if (res == 0 && wstate->out_format == 3 && !context->prelude) {
+                icfp_cpp_end(&wstate->cpp);
+            }
+            // the pending separator still goes out at EOF
+            if (outbuf_flush(&wstate->out, wstate->file) != 0) { return 1; }
+            return res;
+        }
+        switch (expr->type) {
+            case _ExprType_literal:
+            case _ExprType_apply1:
+            case _ExprType_apply2:
+            case _ExprType_apply3:
+            case _ExprType_lambda: {
+                if (context->prelude) {
+                    fprintf(_icfp_stderr, "%s:%d:%d: expecting a definition in a prelude\n", context->filename, expr->lineno, expr->colno);
+                    return 1;
+                }
+                int res = _icfp_parser_toplevel(context, wstate, expr);
+                if (res != 0) { return res; }
+                ++count;
+                break;
+            }
+            case _ExprType_define:
+                _icfp_parser_define(context, wstate, expr);
+                break;
+            case _ExprType_assert:
+                // a prelude has no output to check its asserts in
+                if (context->out_asserts != 0 && !context->prelude) {
+                    int res = _icfp_parser_toplevel(context, wstate, expr);
+                    if (res != 0) { return res; }
+                    ++count;
+                }
+                break;
+            case _ExprType_invalid:
+            case _ExprType_identifier:
+                fprintf(_icfp_stderr, "%s:%d:%d: expecting expression\n", context->filename, expr->lineno, expr->colno);
+                return 1;
+        }
+    }
+    return 0;
+}
+
+
+// ICFP input is decoded into the expressions the parser makes, so that
+// the optimizer and writers take it as they take source. Terms come in
+// prefix order, so one pass over the text with a stack of the terms still
+// taking operands builds the tree, however deep.
+struct _DecodeFrame {
+    struct _Expr* expr;
+    // operands fill expr0..expr3 from first on
+    int first;
+    int operands;
+    int filled;
+};
+
+
+struct _Decoder {
+    struct _ParserState* parser;
+    // the scope free variables are put in
+    struct _NameTable* nametable;
+    struct _DecodeFrame* stack;
+    size_t stack_size;
+    size_t depth;
+    uint64_t* binders;
+    size_t binders_size;
+    size_t binders_used;
+    char* scratch;
+    size_t scratch_size;
+};
+
+
+static struct _Expr**
+_icfp_decode_operand(struct _Expr* expr, int i) {
+    switch (i) {
+        case 0: return &expr->expr0;
+        case 1: return &expr->expr1;
+        case 2: return &expr->expr2;
+        case 3: return &expr->expr3;
+    }
+    abort();
+}
+
+
+static struct _Expr*
+_icfp_decode_node(struct _Decoder* context, enum _ExprType type, int lineno, int colno) {
+    struct _Expr* expr = expr_tree_push(&context->parser->expr_tree);
+    expr->type = type;
+    expr->lineno = lineno;
+    expr->colno = colno;
+    return expr;
+}
+
+
+static struct _Expr*
+_icfp_decode_identifier(struct _Decoder* context, const char* name, int lineno, int colno) {
+    struct _Expr* expr = _icfp_decode_node(context, _ExprType_identifier, lineno, colno);
+    struct _Token* token = &expr->token;
+    token->type = _TokenType_identifier;
+    token->value = name[1] == '\0' ? (char*) _symbols128[(uint8_t) name[0]] : symbol_list_intern(&context->parser->symbols, name);
+    token->len = strlen(name);
+    token->lineno = lineno;
+    token->colno = colno;
+    return expr;
+}
+
+
+// The name a binder number goes by, as no source name can be spelled.
+static const char*
+_icfp_decode_var_name(uint64_t number, char* buf, size_t size) {
+    snprintf(buf, size, "(var %llu)", (unsigned long long) number);
+    return buf;
+}
+
+
+static const char*
+_icfp_decode_free_name(uint64_t number, char* buf, size_t size) {
+    snprintf(buf, size, "(free %llu)", (unsigned long long) number);
+    return buf;
+}
+
+
+static char*
+_icfp_decode_scratch(struct _Decoder* context, size_t size) {
+    if (context->scratch_size < size) {
+        context->scratch_size = size > 2 * context->scratch_size ? size : 2 * context->scratch_size;
+        context->scratch = (char*) realloc(context->scratch, context->scratch_size);
+    }
+    return context->scratch;
+}
+
+
+// Makes the expression of one token, with the number of operands it takes.
+static struct _Expr*
+_icfp_decode_token(struct _Decoder* context, const char* filename, const char* token, size_t len, int lineno,
+    int colno, int* first, int* operands) {
+
+    struct _ParserState* parser = context->parser;
+    *first = 1;
+    *operands = 0;
+    struct _Expr at = {};
+    at.lineno = lineno;
+    at.colno = colno;
+    struct _Value value = {};
+    switch (token[0]) {
+        case 'T':
+        case 'F':
+            if (len != 1) { break; }
+            value.type = _ValueType_bool;
+            value.num = token[0] == 'T';
+            return _icfp_literal_expr(parser, &at, &value);
+        case 'I': {
+            value.type = _ValueType_int;
+            if (len <= 10) {
+                // nine digits fit
+                uint64_t x = 0;
+                for (size_t i = 1; i < len; ++i) {
+                    x = x * 94 + (uint8_t) (token[i] - '!');
+                }
+                value.num = (int64_t) x;
+                return _icfp_literal_expr(parser, &at, &value);
+            }
+            uint8_t* digits = (uint8_t*) _icfp_decode_scratch(context, len);
+            for (size_t i = 1; i < len; ++i) {
+                digits[i-1] = token[i] - '!';
+            }
+            struct _BigInt* num = bigint_from_digits(&parser->numbers, digits, len - 1, 94);
+            if (bigint_to_int64(num, &value.num) != 0) {
+                value.big = num;
+            }
+            return _icfp_literal_expr(parser, &at, &value);
+        }
+        case 'S': {
+            char* s = _icfp_decode_scratch(context, len);
+            for (size_t i = 1; i < len; ++i) {
+                s[i-1] = _icfp_abc94[token[i] - '!'];
+            }
+            value.type = _ValueType_str;
+            value.str = s;
+            value.len = len - 1;
+            return _icfp_literal_expr(parser, &at, &value);
+        }
+        case 'A': {
+            if (len != 2 || token[1] != 'T') { break; }
+            struct _Expr* expr = _icfp_decode_node(context, _ExprType_assert, lineno, colno);
+            expr->expr0 = _icfp_decode_identifier(context, "assert", lineno, colno);
+            *operands = 1;
+            return expr;
+        }
+        case 'U': {
+            if (len != 2 || (token[1] != '-' && token[1] != '!' && token[1] != '#' && token[1] != '$')) { break; }
+            char op[2] = {token[1], '\0'};
+            struct _Expr* expr = _icfp_decode_node(context, _ExprType_apply1, lineno, colno);
+            expr->expr0 = _icfp_decode_identifier(context, op, lineno, colno);
+            *operands = 1;
+            return expr;
+        }
+        case 'B': {
+            if (len != 2) { break; }
+            switch (token[1]) {
+                case '$': {
+                    *first = 0;
+                    *operands = 2;
+                    return _icfp_decode_node(context, _ExprType_apply1, lineno, colno);
+                }
+                case '+': case '-': case '*': case '/': case '%':
+                case '<': case '>': case '=': case '|': case '&':
+                case '.': case 'T': case 'D': case '~': case '!': {
+                    char op[2] = {token[1], '\0'};
+                    struct _Expr* expr = _icfp_decode_node(context, _ExprType_apply2, lineno, colno);
+                    expr->expr0 = _icfp_decode_identifier(context, op, lineno, colno);
+                    *operands = 2;
+                    return expr;
+                }
+            }
+            break;
+        }
+        case '?': {
+            if (len != 1) { break; }
+            struct _Expr* expr = _icfp_decode_node(context, _ExprType_apply3, lineno, colno);
+            expr->expr0 = _icfp_decode_identifier(context, "?", lineno, colno);
+            *operands = 3;
+            return expr;
+        }
+        case 'L':
+        case 'v': {
+            uint64_t number = 0;
+            for (size_t i = 1; i < len; ++i) {
+                if (number > (UINT64_MAX - 93) / 94) {
+                    fprintf(_icfp_stderr, "%s:%d:%d: variable number is too large\n", filename, lineno, colno);
+                    return NULL;
+                }
+                number = number * 94 + (uint8_t) (token[i] - '!');
+            }
+            char buf[32];
+            const char* name = _icfp_decode_var_name(number, buf, sizeof(buf));
+            if (token[0] == 'v') {
+                for (size_t i = context->binders_used; i > 0; --i) {
+                    if (context->binders[i-1] == number) {
+                        return _icfp_decode_identifier(context, name, lineno, colno);
+                    }
                 }
+                // only an error once evaluated
+                struct _Expr* expr = _icfp_decode_identifier(context, _icfp_decode_free_name(number, buf, sizeof(buf)),
+                    lineno, colno);
+                struct _Name* unbound = name_table_put(context->nametable, expr->token.value, NULL);
+                unbound->var = number;
+                unbound->free = 1;
+                return expr;
             }
-            struct _Name* resolved_name;
-            int res = name_table_resolve(nametable, token, &resolved_name);
-            if (res != 0) { return res; }
-            res = fputs("B$ ", file);
-            if (res == EOF) { perror(NULL); return 1; }
-            res = fputs("B$ ", file);
-            if (res == EOF) { perror(NULL); return 1; }
-            res = _icfp_write_resolved_name(context, resolved_name, nametable);
-            if (res != 0) { return res; }
-            res = fputc(' ', file);
-            if (res == EOF) { perror(NULL); return 1; }
-            res = _icfp_write_expression(context, expr->expr1, nametable);
-            if (res != 0) { return res; }
-            res = fputc(' ', file);
-            if (res == EOF) { perror(NULL); return 1; }
-            return _icfp_write_expression(context, expr->expr2, nametable);
+            if (context->binders_used == context->binders_size) {
+                context->binders_size = context->binders_size ? context->binders_size * 2 : 64;
+                context->binders = (uint64_t*) realloc(context->binders, context->binders_size * sizeof(uint64_t));
+            }
+            context->binders[context->binders_used++] = number;
+            struct _Expr* args = _icfp_decode_node(context, _ExprType_apply1, lineno, colno);
+            args->expr1 = _icfp_decode_identifier(context, name, lineno, colno);
+            struct _Expr* expr = _icfp_decode_node(context, _ExprType_lambda, lineno, colno);
+            expr->expr1 = args;
+            *first = 2;
+            *operands = 1;
+            return expr;
         }
-        case _ExprType_apply3: {
-            struct _Token* token = &expr->expr0->token;
-            if (token->len == 1) {
-                char c = token->value[0];
-                switch (c) {
-                    case '?': {
-                        int res = fputc('?', file);
-                        if (res == EOF) { perror(NULL); return 1; }
-                        res = fputc(' ', file);
-                        if (res == EOF) { perror(NULL); return 1; }
-                        res = _icfp_write_expression(context, expr->expr1, nametable);
-                        if (res != 0) { return res; }
-                        res = fputc(' ', file);
-                        if (res == EOF) { perror(NULL); return 1; }
-                        res = _icfp_write_expression(context, expr->expr2, nametable);
-                        if (res != 0) { return res; }
-                        res = fputc(' ', file);
-                        if (res == EOF) { perror(NULL); return 1; }
-                        return _icfp_write_expression(context, expr->expr3, nametable);
-                    }
-                    default:
-                        break;
+    }
+    fprintf(_icfp_stderr, "%s:%d:%d: invalid token %.*s\n", filename, lineno, colno, (int) len, token);
+    return NULL;
+}
+
+
+// Decodes the ICFP programs of a file, each a top-level expression.
+static int
+icfp_decoder_process(struct _ParserState* parser, struct _WriterState* wstate, const char* filename, struct _Reader* reader) {
+    parser->filename = filename;
+    wstate->filename = filename;
+    const char* text;
+    size_t size;
+    int res = reader_contents(reader, &text, &size);
+    if (res != 0) { return res; }
+    if (wstate->out_format == 3) {
+        icfp_cpp_begin(&wstate->cpp, &wstate->out);
+    }
+
+    struct _Decoder decoder = {};
+    decoder.parser = parser;
+    decoder.nametable = wstate->nametable;
+    const char* p = text;
+    const char* end = text + size;
+    const char* line = text;
+    int lineno = 1;
+    int count = 0;
+    uint64_t start = parser->stats ? _clock_ns(CLOCK_MONOTONIC) : 0;
+    for (;;) {
+        while (p < end && (*p == ' ' || *p == '\n' || *p == '\t' || *p == '\r')) {
+            if (*p == '\n') {
+                lineno += 1;
+                line = p + 1;
+            }
+            ++p;
+        }
+        if (p == end) {
+            if (decoder.depth > 0) {
+                fprintf(_icfp_stderr, "%s:%d:%d: unexpected end of ICFP\n", filename, lineno, (int) (p - line) + 1);
+                res = 1;
+            }
+            break;
+        }
+        const char* q = p;
+        while (q < end && *q > ' ' && *q < 0x7f) { ++q; }
+        int colno = (int) (p - line) + 1;
+        if (q == p) {
+            fprintf(_icfp_stderr, "%s:%d:%d: invalid char %c\n", filename, lineno, colno, *p);
+            res = 1;
+            break;
+        }
+        parser->tokens += 1;
+        int first;
+        int operands;
+        struct _Expr* expr = _icfp_decode_token(&decoder, filename, p, q - p, lineno, colno, &first, &operands);
+        p = q;
+        if (expr == NULL) {
+            res = 1;
+            break;
+        }
+        if (operands > 0) {
+            if (decoder.depth == decoder.stack_size) {
+                decoder.stack_size = decoder.stack_size ? decoder.stack_size * 2 : 64;
+                decoder.stack = (struct _DecodeFrame*) realloc(decoder.stack, decoder.stack_size * sizeof(struct _DecodeFrame));
+            }
+            decoder.stack[decoder.depth++] = {expr, first, operands, 0};
+            continue;
+        }
+        // a complete term fills the operands of those waiting on it
+        while (expr != NULL && decoder.depth > 0) {
+            struct _DecodeFrame* frame = &decoder.stack[decoder.depth - 1];
+            *_icfp_decode_operand(frame->expr, frame->first + frame->filled) = expr;
+            frame->filled += 1;
+            expr = NULL;
+            if (frame->filled == frame->operands) {
+                expr = frame->expr;
+                if (expr->type == _ExprType_lambda) {
+                    decoder.binders_used -= 1;
                 }
+                decoder.depth -= 1;
             }
-            fprintf(stderr, "! apply3 not implemented\n");
-            abort();
         }
-        case _ExprType_lambda: {
-            struct _Expr* args = expr->expr1;
-            enum _ExprType arity = args->type;
-            struct _NameTable* body_nametable = name_table_add_child(nametable);
-            switch (arity) {
-                case _ExprType_apply1: {
-                    int res = fputc('L', file);
-                    if (res == EOF) { perror(NULL); return 1; }
-                    res = fputs(args->expr1->token.value, file);
-                    if (res == EOF) { perror(NULL); return 1; }
-                    res = fputc(' ', file);
-                    if (res == EOF) { perror(NULL); return 1; }
-                    name_table_put(body_nametable, args->expr1->token.value, NULL);
-                    break;
+        if (expr == NULL) {
+            continue;
+        }
+        if (count > 0 && wstate->out_format == 1) {
+            outbuf_putc(&wstate->out, '\n');
+        }
+        if (parser->stats) {
+            parser->parse_ns += _clock_ns(CLOCK_MONOTONIC) - start;
+        }
+        res = _icfp_parser_toplevel(parser, wstate, expr);
+        start = parser->stats ? _clock_ns(CLOCK_MONOTONIC) : 0;
+        if (res != 0) { break; }
+        ++count;
+    }
+    if (parser->stats) {
+        parser->parse_ns += _clock_ns(CLOCK_MONOTONIC) - start;
+    }
+    if (count > 0 && wstate->out_format == 1) {
+        outbuf_putc(&wstate->out, '\n');
+    }
+    free(decoder.stack);
+    free(decoder.binders);
+    free(decoder.scratch);
+    if (res == 0 && wstate->out_format == 3) {
+        icfp_cpp_end(&wstate->cpp);
+    }
+    if (outbuf_flush(&wstate->out, wstate->file) != 0) { return 1; }
+    return res;
+}
+
+struct _Config {
+    int filename_count;
+    const char** filenames;
+    int prelude_count;
+    const char** preludes;
+    const char* image;
+    const char* outdir;
+    int jobs;
+    int serve;
+    const char* socket_path;
+    int bench;
+    int stats;
+    int budgeted;
+    size_t budget;
+    int verbose;
+    int out_text;
+    int out_eval;
+    int out_cpp;
+    int out_asserts;
+    int out_shared;
+    int out_common;
+    int optimize;
+    int in_icfp;
+};
+
+
+static int
+_parse_args(int argc, const char* argv[], struct _Config* config) {
+    config->filename_count = 0;
+    config->filenames = (const char**) calloc(argc + 1, sizeof(const char*));
+    config->prelude_count = 0;
+    config->preludes = (const char**) calloc(argc + 1, sizeof(const char*));
+    config->image = NULL;
+    config->outdir = NULL;
+    config->jobs = 0;
+    config->serve = 0;
+    config->socket_path = NULL;
+    config->bench = 0;
+    config->stats = 0;
+    config->budgeted = 0;
+    config->budget = 0;
+    config->verbose = 0;
+    config->out_text = 1;
+    config->out_eval = 0;
+    config->out_cpp = 0;
+    config->out_asserts = 0;
+    config->out_shared = 0;
+    config->out_common = 0;
+    config->optimize = 0;
+    config->in_icfp = 0;
+    const char* option = NULL;
+    int state = 0;
+    for (size_t argi = 1; argi < argc; ++argi) {
+        const char* arg = argv[argi];
+        int narg = strlen(arg);
+        switch (state) {
+            case 0: {
+                if (narg == 1 && arg[0] == '-') {
+                    config->filenames[config->filename_count++] = arg;
                 }
-                case _ExprType_apply2: {
-                    int res = fputc('L', file);
-                    if (res == EOF) { perror(NULL); return 1; }
-                    res = fputs(args->expr1->token.value, file);
-                    if (res == EOF) { perror(NULL); return 1; }
-                    res = fputc(' ', file);
-                    if (res == EOF) { perror(NULL); return 1; }
-                    name_table_put(body_nametable, args->expr1->token.value, NULL);
-
-                    res = fputc('L', file);
-                    if (res == EOF) { perror(NULL); return 1; }
-                    res = fputs(args->expr2->token.value, file);
-                    if (res == EOF) { perror(NULL); return 1; }
-                    res = fputc(' ', file);
-                    if (res == EOF) { perror(NULL); return 1; }
-                    name_table_put(body_nametable, args->expr2->token.value, NULL);
-                    break;
+                else if (narg > 0 && arg[0] == '-') {
+                    if (
+                        strcmp(arg, "-h") == 0 ||
+                        strcmp(arg, "-help") == 0 ||
+                        strcmp(arg, "--help") == 0
+                    ) {
+                        printf("%s", _usage);
+                        exit(0);
+                    }
+                    else if (
+                        strcmp(arg, "-v") == 0 ||
+                        strcmp(arg, "--verbose") == 0
+                    ) {
+                        config->verbose = 1;
+                    }
+                    else if (
+                        strcmp(arg, "-T") == 0 ||
+                        strcmp(arg, "--stats") == 0
+                    ) {
+                        config->stats = 1;
+                    }
+                    else if (
+                        strcmp(arg, "-t") == 0 ||
+                        strcmp(arg, "--text") == 0
+                    ) {
+                        config->out_text = 1;
+                    }
+                    else if (
+                        strcmp(arg, "-a") == 0 ||
+                        strcmp(arg, "--asserts") == 0
+                    ) {
+                        config->out_asserts = 1;
+                    }
+                    else if (
+                        strcmp(arg, "-b") == 0 ||
+                        strcmp(arg, "--bench") == 0
+                    ) {
+                        config->bench = 1;
+                    }
+                    else if (
+                        strcmp(arg, "-B") == 0 ||
+                        strcmp(arg, "--budget") == 0
+                    ) {
+                        option = arg;
+                        state = 6;
+                    }
+                    else if (
+                        strcmp(arg, "-C") == 0 ||
+                        strcmp(arg, "--cpp") == 0
+                    ) {
+                        config->out_cpp = 1;
+                    }
+                    else if (
+                        strcmp(arg, "-c") == 0 ||
+                        strcmp(arg, "--common") == 0
+                    ) {
+                        config->out_common = 1;
+                    }
+                    else if (
+                        strcmp(arg, "-e") == 0 ||
+                        strcmp(arg, "--eval") == 0
+                    ) {
+                        config->out_eval = 1;
+                    }
+                    else if (
+                        strcmp(arg, "-i") == 0 ||
+                        strcmp(arg, "--icfp") == 0
+                    ) {
+                        config->in_icfp = 1;
+                    }
+                    else if (
+                        strcmp(arg, "-j") == 0 ||
+                        strcmp(arg, "--jobs") == 0
+                    ) {
+                        option = arg;
+                        state = 1;
+                    }
+                    else if (
+                        strcmp(arg, "-o") == 0 ||
+                        strcmp(arg, "--outdir") == 0
+                    ) {
+                        option = arg;
+                        state = 2;
+                    }
+                    else if (
+                        strcmp(arg, "-p") == 0 ||
+                        strcmp(arg, "--prelude") == 0
+                    ) {
+                        option = arg;
+                        state = 3;
+                    }
+                    else if (
+                        strcmp(arg, "-P") == 0 ||
+                        strcmp(arg, "--image") == 0
+                    ) {
+                        option = arg;
+                        state = 5;
+                    }
+                    else if (
+                        strcmp(arg, "-O") == 0 ||
+                        strcmp(arg, "--optimize") == 0
+                    ) {
+                        config->optimize = 1;
+                    }
+                    else if (
+                        strcmp(arg, "-s") == 0 ||
+                        strcmp(arg, "--shared") == 0
+                    ) {
+                        config->out_shared = 1;
+                    }
+                    else if (
+                        strcmp(arg, "-S") == 0 ||
+                        strcmp(arg, "--serve") == 0
+                    ) {
+                        config->serve = 1;
+                    }
+                    else if (
+                        strcmp(arg, "-u") == 0 ||
+                        strcmp(arg, "--socket") == 0
+                    ) {
+                        option = arg;
+                        state = 4;
+                    }
+                    else {
+                        fprintf(_icfp_stderr, "! invalid option %s\n", arg);
+                        fprintf(_icfp_stderr, "%s\n", _usageq);
+                        return 1;
+                    }
                 }
-                default:
-                    fprintf(stderr, "unhandled lambda arity %d\n", arity);
-                    abort();
+                else {
+                    config->filenames[config->filename_count++] = arg;
+                }
+                break;
             }
-            return _icfp_write_expression(context, expr->expr2, body_nametable);
-        }
-        case _ExprType_literal:
-            switch (expr->token.type) {
-                case _TokenType_str:
-                    return _icfp_write_str(expr->token.value, file);
-                case _TokenType_number: {
-                    struct _Number num;
-                    int res = _icfp_parser_parse_number(expr->token.value, &num);
-                    if (res != 0) { return res; }
-                    res = _icfp_write_number(&num, file);
-                    return res;
+            case 1: {
+                char* end;
+                long jobs = strtol(arg, &end, 10);
+                if (narg == 0 || *end != '\0' || jobs < 1 || jobs > (long) _JobsMax) {
+                    fprintf(_icfp_stderr, "! invalid job count %s\n", arg);
+                    fprintf(_icfp_stderr, "%s\n", _usageq);
+                    return 1;
                 }
-                case _TokenType_bool_false:
-                case _TokenType_bool_true:
-                    return _icfp_write_bool(expr->token.type, file);
-                case _TokenType_invalid:
-                case _TokenType_eof:
-                case _TokenType_open_paren:
-                case _TokenType_close_paren:
-                case _TokenType_identifier:
-                case _TokenType_str_start:
-                case _TokenType_str_data:
-                case _TokenType_str_end:
-                    abort();
+                config->jobs = (int) jobs;
+                state = 0;
+                break;
             }
-            break;
-        case _ExprType_assert: {
-            int res = fprintf(file, "AT ");
-            if (res < 0) {
-                perror(NULL);
-                return 1;
+            case 2:
+                config->outdir = arg;
+                state = 0;
+                break;
+            case 3:
+                config->preludes[config->prelude_count++] = arg;
+                state = 0;
+                break;
+            case 4:
+                config->serve = 1;
+                config->socket_path = arg;
+                state = 0;
+                break;
+            case 5:
+                config->image = arg;
+                state = 0;
+                break;
+            case 6: {
+                char* end;
+                errno = 0;
+                unsigned long long budget = strtoull(arg, &end, 10);
+                if (narg == 0 || *end != '\0' || arg[0] == '-' || errno != 0) {
+                    fprintf(_icfp_stderr, "! invalid budget %s\n", arg);
+                    fprintf(_icfp_stderr, "%s\n", _usageq);
+                    return 1;
+                }
+                config->budgeted = 1;
+                config->budget = (size_t) budget;
+                state = 0;
+                break;
             }
-            return _icfp_write_expression(context, expr->expr1, nametable);
         }
-        case _ExprType_define:
-        case _ExprType_invalid:
-            fprintf(stderr, "! write of invalid expression\n");
+    }
+    if (state != 0) {
+        fprintf(_icfp_stderr, "! option %s requires a value\n", option);
+        fprintf(_icfp_stderr, "%s\n", _usageq);
+        return 1;
+    }
+    if (config->serve && (config->filename_count > 0 || config->outdir != NULL || config->jobs > 0)) {
+        fprintf(_icfp_stderr, "! a server takes its inputs from requests\n");
+        fprintf(_icfp_stderr, "%s\n", _usageq);
+        return 1;
+    }
+    if (config->bench && (config->in_icfp || config->serve || config->jobs > 0 || config->outdir != NULL || config->budgeted)) {
+        fprintf(_icfp_stderr, "! a benchmark compiles source files one by one\n");
+        fprintf(_icfp_stderr, "%s\n", _usageq);
+        return 1;
+    }
+    if (config->stats && (config->bench || config->serve)) {
+        fprintf(_icfp_stderr, "! stats are kept for a compile of the inputs, not a benchmark or a server\n");
+        fprintf(_icfp_stderr, "%s\n", _usageq);
+        return 1;
+    }
+    if (config->socket_path != NULL && strlen(config->socket_path) >= sizeof(((struct sockaddr_un*) NULL)->sun_path)) {
+        fprintf(_icfp_stderr, "! socket path is too long %s\n", config->socket_path);
+        fprintf(_icfp_stderr, "%s\n", _usageq);
+        return 1;
+    }
+    if (config->filename_count == 0) {
+        config->filenames[config->filename_count++] = "-";
+    }
+    if (config->out_cpp && (config->out_eval || config->bench || config->budgeted)) {
+        fprintf(_icfp_stderr, "! C++ output is compiled, not evaluated\n");
+        fprintf(_icfp_stderr, "%s\n", _usageq);
+        return 1;
+    }
+    if (config->in_icfp && config->prelude_count > 0) {
+        fprintf(_icfp_stderr, "! a prelude requires source input\n");
+        fprintf(_icfp_stderr, "%s\n", _usageq);
+        return 1;
+    }
+    if (config->image != NULL) {
+        int files = config->prelude_count > 0;
+        for (int i = 0; i < config->prelude_count; ++i) {
+            files = files && strcmp(config->preludes[i], "-") != 0;
+        }
+        if (!files) {
+            fprintf(_icfp_stderr, "! an image requires prelude files\n");
+            fprintf(_icfp_stderr, "%s\n", _usageq);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// The state of one compilation. Inputs compiled on their own get one each,
+// with the prelude's root scope as the parent of theirs.
+struct _Compiler {
+    struct _ParserState pstate;
+    struct _EvalState estate;
+    struct _WriterState wstate;
+    // the prelude image the root scope's defines live in, when mapped
+    struct _Image image;
+};
+
+
+static int
+icfp_compiler_init(struct _Compiler* context, const struct _Config* config, FILE* file, const struct _Compiler* prelude) {
+    context->image.base = NULL;
+    struct _ParserState* pstate = &context->pstate;
+    pstate->token_buf = (char*) calloc(_TokenSizeMax, sizeof(char));
+    pstate->token_bufsize = _TokenSizeMax;
+    arena_init(&pstate->numbers, _ArenaChunkSize);
+    symbol_list_init(&pstate->symbols);
+    expr_tree_init(&pstate->expr_tree);
+    name_list_init(&pstate->name_list);
+    pstate->verbose = config->verbose;
+    pstate->out_asserts = config->out_asserts;
+    pstate->optimize = config->optimize;
+    pstate->share = config->out_common;
+    pstate->prelude = 0;
+    pstate->folds = 0;
+    pstate->inlines = 0;
+    pstate->lowered = 0;
+    pstate->shares = 0;
+    pstate->knots = 0;
+    pstate->tokens = 0;
+    pstate->stats = config->stats;
+    pstate->parse_ns = 0;
+    pstate->optimize_ns = 0;
+    pstate->write_ns = 0;
+    if (prelude != NULL) {
+        // keywords and defines keep the prelude's symbols
+        pstate->symbols.base = &prelude->pstate.symbols;
+    }
+    else {
+        _icfp_parser_init_symbols(pstate);
+    }
+
+    icfp_eval_init(&context->estate, config->verbose);
+    if (config->budgeted) {
+        context->estate.budget = (struct _EvalBudget*) calloc(1, sizeof(struct _EvalBudget));
+        context->estate.budget->limit = config->budget;
+    }
+
+    struct _WriterState* wstate = &context->wstate;
+    int res = icfp_writer_init(wstate, file, config->out_cpp ? 3 : config->out_eval ? 2 : config->out_text);
+    if (res != 0) { return res; }
+    wstate->filename = NULL;
+    wstate->verbose = config->verbose;
+    wstate->out_shared = config->out_shared;
+    wstate->strict = config->optimize;
+    wstate->spans_on = config->budgeted;
+    struct _NameTable* root_nametable = name_table_list_init(&wstate->nametable_list);
+    root_nametable->name_storage = &pstate->name_list;
+    if (prelude != NULL) {
+        root_nametable->parent = prelude->wstate.nametable;
+    }
+    wstate->nametable = root_nametable;
+    wstate->eval = &context->estate;
+    return 0;
+}
+
+
+static void
+icfp_compiler_free(struct _Compiler* context) {
+    outbuf_free(&context->wstate.out);
+    free(context->wstate.defines);
+    free(context->wstate.spans);
+    if (context->estate.budget != NULL) {
+        free(context->estate.budget->charges);
+        free(context->estate.budget);
+    }
+    arena_free(&context->wstate.nametable_list.arena);
+    arena_free(&context->pstate.name_list.arena);
+    arena_free(&context->pstate.expr_tree.arena);
+    symbol_list_free(&context->pstate.symbols);
+    icfp_eval_free(&context->estate);
+    arena_free(&context->pstate.numbers);
+    free(context->pstate.token_buf);
+    if (context->image.base != NULL) {
+        image_free(&context->image);
+    }
+}
+
+
+static int
+icfp_compiler_process(struct _Compiler* context, const struct _Config* config, const char* filename, struct _Reader* reader) {
+    if (config->in_icfp) {
+        return icfp_decoder_process(&context->pstate, &context->wstate, filename, reader);
+    }
+    return icfp_parser_process(&context->pstate, &context->wstate, filename, reader);
+}
+
+
+static int
+icfp_compiler_process_file(struct _Compiler* context, const struct _Config* config, const char* filename) {
+    FILE* fp;
+    if (strcmp(filename, "-") == 0) {
+        filename = "<stdin>";
+        fp = stdin;
+    }
+    else {
+        fp = fopen(filename, "r");
+        if (fp == NULL) {
+            perror(filename);
             return 1;
+        }
     }
-    return 1;
+
+    if (config->verbose) {
+        fprintf(_icfp_stderr, "procesing %s\n", filename);
+    }
+
+    struct _Reader reader;
+    int res = reader_init(&reader, fp);
+    if (res != 0) { return res; }
+
+    res = icfp_compiler_process(context, config, filename, &reader);
+    reader_close(&reader);
+
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    return res;
 }
 
 
-struct _Nesting {
-    int level;
-    int popped;
+// Numbers the pointers an image refers to, in the order they are added.
+struct _ImageMap {
+    const void** keys;
+    size_t* values;
+    size_t size;
+    size_t used;
 };
 
 
 static void
-dump_arg_list(struct _Expr* expr, FILE* file) {
-    switch (expr->type) {
-        case _ExprType_apply1:
-            fputc('(', file);
-            if (expr->expr0->type == _ExprType_identifier) {
-                fputs(expr->expr0->token.value, file);
-                fputc(' ', file);
-            }
-            fputs(expr->expr1->token.value, file);
-            fputc(')', file);
-            break;
-        case _ExprType_apply2:
-            fputc('(', file);
-            if (expr->expr0->type == _ExprType_identifier) {
-                fputs(expr->expr0->token.value, file);
-                fputc(' ', file);
-            }
-            fputs(expr->expr1->token.value, file);
-            fputc(' ', file);
-            fputs(expr->expr2->token.value, file);
-            fputc(')', file);
-            break;
-        case _ExprType_apply3:
-            fputc('(', file);
-            if (expr->expr0->type == _ExprType_identifier) {
-                fputs(expr->expr0->token.value, file);
-                fputc(' ', file);
-            }
-            fputs(expr->expr1->token.value, file);
-            fputc(' ', file);
-            fputs(expr->expr2->token.value, file);
-            fputc(' ', file);
-            fputs(expr->expr3->token.value, file);
-            fputc(')', file);
-            break;
-        case _ExprType_identifier:
-        case _ExprType_literal:
-        case _ExprType_lambda:
-        case _ExprType_define:
-        case _ExprType_assert:
-        case _ExprType_invalid:
-            fprintf(file, "expr:err%d", expr->type);
-            break;
+_image_map_init(struct _ImageMap* map, size_t count) {
+    map->size = _NameTableSizeMin;
+    while (map->size < 2 * count) {
+        map->size *= 2;
     }
+    map->keys = (const void**) calloc(map->size, sizeof(const void*));
+    map->values = (size_t*) calloc(map->size, sizeof(size_t));
+    map->used = 0;
 }
 
 
 static void
-dump_expr(struct _Expr* expr, FILE* file) {
-    switch (expr->type) {
-        case _ExprType_invalid:
-            fprintf(file, "expr:err%d", expr->type);
-            break;
-        case _ExprType_identifier:
-            fprintf(file, "expr:id %s", expr->token.value);
-            break;
-        case _ExprType_literal:
-            fprintf(file, "expr:literal %s", expr->token.value);
-            break;
-        case _ExprType_apply1:
-            fprintf(file, "expr:apply (");
-            dump_expr(expr->expr0, file);
-            fputc(')', file);
-            fputc(' ', file);
-            fputc('(', file);
-            dump_expr(expr->expr1, file);
-            fputc(')', file);
-            break;
-        case _ExprType_apply2:
-            fprintf(file, "expr:apply (");
-            dump_expr(expr->expr0, file);
-            fputc(')', file);
-            fputc(' ', file);
-            fputc('(', file);
-            dump_expr(expr->expr1, file);
-            fputc(')', file);
-            fputc(' ', file);
-            fputc('(', file);
-            dump_expr(expr->expr2, file);
-            fputc(')', file);
-            break;
-        case _ExprType_apply3:
-            fprintf(file, "expr:apply (");
-            dump_expr(expr->expr0, file);
-            fputc(')', file);
-            fputc(' ', file);
-            fputc('(', file);
-            dump_expr(expr->expr1, file);
-            fputc(')', file);
-            fputc(' ', file);
-            fputc('(', file);
-            dump_expr(expr->expr2, file);
-            fputc(')', file);
-            fputc(' ', file);
-            fputc('(', file);
-            dump_expr(expr->expr3, file);
-            fputc(')', file);
-            break;
-        case _ExprType_lambda:
-            fprintf(file, "expr:lambda ");
-            dump_arg_list(expr->expr1, file);
-            fputc(' ', file);
-            fputc('(', file);
-            dump_expr(expr->expr2, file);
-            fputc(')', file);
-            break;
-        case _ExprType_define:
-            fprintf(file, "expr:define ");
-            dump_arg_list(expr->expr1, file);
-            fputc(' ', file);
-            fputc('(', file);
-            dump_expr(expr->expr2, file);
-            fputc(')', file);
-            break;
-        case _ExprType_assert:
-            fprintf(file, "expr:assert (");
-            dump_expr(expr->expr0, file);
-            fputc(')', file);
-            fputc(' ', file);
-            fputc('(', file);
-            dump_expr(expr->expr1, file);
-            fputc(')', file);
+_image_map_free(struct _ImageMap* map) {
+    free(map->keys);
+    free(map->values);
+}
+
+
+// Returns the number of key, and adds it as the next one when it is new.
+static size_t
+_image_map_add(struct _ImageMap* map, const void* key, int* added) {
+    size_t mask = map->size - 1;
+    size_t i = (size_t) (((uint64_t) (uintptr_t) key * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+    for (;; i = (i + 1) & mask) {
+        if (map->keys[i] == key) {
+            *added = 0;
+            return map->values[i];
+        }
+        if (map->keys[i] == NULL) {
             break;
+        }
+    }
+    if (map->used * 2 >= map->size) {
+        fprintf(_icfp_stderr, "! image map is full\n");
+        abort();
     }
+    map->keys[i] = key;
+    map->values[i] = map->used++;
+    *added = 1;
+    return map->values[i];
 }
 
 
-static int
-_icfp_parser_parse_expression(struct _ParserState* context, FILE* file,
-    struct _Nesting* nesting, struct _Expr** parsed_expr);
+// FNV-1a over words rather than bytes, with the high bits folded back in
+// so that every byte reaches them.
+static uint64_t
+_image_hash_bytes(uint64_t h, const void* data, size_t size) {
+    const uint8_t* p = (const uint8_t*) data;
+    for (; size >= 8; p += 8, size -= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        h = (h ^ w) * 0x100000001b3ull;
+        h ^= h >> 32;
+    }
+    for (; size > 0; ++p, --size) {
+        h = (h ^ *p) * 0x100000001b3ull;
+    }
+    return h;
+}
 
 
-static int
-_icfp_parser_parse_arg_list(struct _ParserState* context, FILE* file,
-    struct _Nesting* nesting, int minargs, struct _Expr** expr) {
+// Hashes an image as it is written, with the checksum in its header as 0.
+static uint64_t
+_image_checksum(const char* image, size_t size) {
+    struct _ImageHeader header;
+    memcpy(&header, image, sizeof(header));
+    header.checksum = 0;
+    uint64_t h = _image_hash_bytes(0xcbf29ce484222325ull, &header, sizeof(header));
+    return _image_hash_bytes(h, image + sizeof(header), size - sizeof(header));
+}
 
-    struct _Token token;
-    struct _Expr* args;
-    struct _Expr* nested;
-    int state = 0;
-    for (;;) {
-        int res = _icfp_parser_tokenize(context, file, &token);
-        if (res != 0) { return -1; }
-        if (context->verbose) {
-            fprintf(stderr, "%s:%d:%d: token %d %s\n", context->filename, token.lineno, token.colno, token.type, token.value);
+
+// Hashes the contents of the prelude files, in order.
+static int
+icfp_image_hash(const struct _Config* config, uint64_t* hash) {
+    uint64_t h = _image_hash_bytes(0xcbf29ce484222325ull, &_ImageVersion, sizeof(_ImageVersion));
+    for (int i = 0; i < config->prelude_count; ++i) {
+        const char* filename = config->preludes[i];
+        FILE* fp = fopen(filename, "r");
+        if (fp == NULL) {
+            perror(filename);
+            return 1;
         }
-        switch (state) {
-            case 0:
-                switch (token.type) {
-                    case _TokenType_open_paren:
-                        args = expr_tree_push(&context->expr_tree);
-                        args->token = token;
-                        args->lineno = token.lineno;
-                        args->colno = token.colno;
-                        args->expr0 = expr_tree_push(&context->expr_tree);
-                        state = 1;
-                        break;
-                    default:
-                        fprintf(stderr, "%s:%d:%d: expecting an argument list\n", context->filename, token.lineno, token.colno);
-                        return 1;
-                }
-                break;
-            case 1:
-                switch (token.type) {
-                    case _TokenType_identifier:
-                        nested = expr_tree_push(&context->expr_tree);
-                        nested->type = _ExprType_identifier;
-                        nested->token = token;
-                        nested->lineno = token.lineno;
-                        nested->colno = token.colno;
-                        args->expr1 = nested;
-                        state = 2;
-                        break;
-                    case _TokenType_close_paren:
-                        if (minargs > 0) {
-                            fprintf(stderr, "%s:%d:%d: expecting an identifier\n", context->filename, token.lineno, token.colno);
-                            return 1;
-                        }
-                        *expr = args;
-                        fprintf(stderr, "%s:%d:%d: empty arg list\n", context->filename, token.lineno, token.colno);
-                        abort();
-                        return 0;
-                    default:
-                        fprintf(stderr, "%s:%d:%d: expecting an identifier\n", context->filename, token.lineno, token.colno);
-                        return 1;
-                }
-                break;
-            case 2:
-                switch (token.type) {
-                    case _TokenType_identifier:
-                        nested = expr_tree_push(&context->expr_tree);
-                        nested->type = _ExprType_identifier;
-                        nested->token = token;
-                        nested->lineno = token.lineno;
-                        nested->colno = token.colno;
-                        args->type = _ExprType_apply1;
-                        args->expr2 = nested;
-                        state = 3;
-                        break;
-                    case _TokenType_close_paren:
-                        if (minargs > 1) {
-                            fprintf(stderr, "%s:%d:%d: expecting an identifier\n", context->filename, token.lineno, token.colno);
-                            return 1;
-                        }
-                        args->type = _ExprType_apply1;
-                        *expr = args;
-                        return 0;
-                    default:
-                        fprintf(stderr, "%s:%d:%d: expecting an identifier\n", context->filename, token.lineno, token.colno);
-                        return 1;
-                }
-                break;
-            case 3:
-                switch (token.type) {
-                    case _TokenType_identifier:
-                        nested = expr_tree_push(&context->expr_tree);
-                        nested->type = _ExprType_identifier;
-                        nested->token = token;
-                        nested->lineno = token.lineno;
-                        nested->colno = token.colno;
-                        args->type = _ExprType_apply2;
-                        args->expr3 = nested;
-                        state = 3;
-                        break;
-                    case _TokenType_close_paren:
-                        args->type = _ExprType_apply2;
-                        *expr = args;
-                        return 0;
-                    default:
-                        fprintf(stderr, "%s:%d:%d: expecting an identifier\n", context->filename, token.lineno, token.colno);
-                        return 1;
-                }
-                break;
-            case 4:
-                switch (token.type) {
-                    case _TokenType_close_paren:
-                        args->type = _ExprType_apply3;
-                        *expr = args;
-                        return 0;
-                    default:
-                        fprintf(stderr, "%s:%d:%d: expecting a closing paren\n", context->filename, token.lineno, token.colno);
-                        return 1;
-                }
-                break;
+        struct _Reader reader;
+        int res = reader_init(&reader, fp);
+        const char* text = NULL;
+        size_t size = 0;
+        if (res == 0) {
+            res = reader_contents(&reader, &text, &size);
+        }
+        if (res == 0) {
+            uint64_t n = size;
+            h = _image_hash_bytes(h, &n, sizeof(n));
+            h = _image_hash_bytes(h, text, size);
         }
+        reader_close(&reader);
+        fclose(fp);
+        if (res != 0) { return res; }
+    }
+    *hash = h;
+    return 0;
+}
+
+
+static uintptr_t
+_image_string(struct _ImageMap* strings, const char** order, const char* s) {
+    if (s == NULL) {
+        return 0;
     }
-    abort();
+    int added;
+    size_t i = _image_map_add(strings, s, &added);
+    order[i] = s;
+    return i + 1;
 }
 
 
+// Writes the defines of the root scope to path, through a temporary file
+// so that a reader never sees half an image.
 static int
-_icfp_parser_parse_lambda(struct _ParserState* context, FILE* file,
-    struct _Nesting* nesting, struct _Expr* expr) {
+icfp_image_save(const struct _Compiler* context, const char* path, uint64_t hash) {
+    const struct _NameTable* root = context->wstate.nametable;
+    size_t expr_bound = context->pstate.expr_tree.used;
+    struct _Name** names = (struct _Name**) calloc(root->used + 1, sizeof(struct _Name*));
+    struct _Expr** exprs = (struct _Expr**) calloc(expr_bound + 1, sizeof(struct _Expr*));
+    struct _ImageMap expr_map;
+    _image_map_init(&expr_map, expr_bound);
+
+    // exprs are numbered as they are found, and the list of those found is
+    // also the queue of those whose children are still to be found
+    size_t name_count = 0;
+    size_t expr_count = 0;
+    for (size_t i = 0; i < root->names_size; ++i) {
+        struct _Name* name = root->names[i];
+        if (name == NULL) {
+            continue;
+        }
+        names[name_count++] = name;
+        int added;
+        if (name->expr != NULL) {
+            _image_map_add(&expr_map, name->expr, &added);
+            if (added) {
+                exprs[expr_count++] = name->expr;
+            }
+        }
+    }
+    for (size_t i = 0; i < expr_count; ++i) {
+        struct _Expr* expr = exprs[i];
+        struct _Expr* children[4] = {expr->expr0, expr->expr1, expr->expr2, expr->expr3};
+        for (int k = 0; k < 4; ++k) {
+            int added;
+            if (children[k] == NULL) {
+                continue;
+            }
+            _image_map_add(&expr_map, children[k], &added);
+            if (added) {
+                if (expr_count == expr_bound) {
+                    fprintf(_icfp_stderr, "! expression outside of the prelude tree\n");
+                    abort();
+                }
+                exprs[expr_count++] = children[k];
+            }
+        }
+    }
 
-    struct _Expr* nested;
-    struct _Expr* args;
-    int minargs = 1;
-    int res = _icfp_parser_parse_arg_list(context, file, nesting, minargs, &args);
-    if (res != 0) { return res; }
+    size_t string_bound = 3 * expr_count + 2 * name_count;
+    const char** strings = (const char**) calloc(string_bound + 1, sizeof(const char*));
+    struct _ImageMap string_map;
+    _image_map_init(&string_map, string_bound);
+
+    struct _ImageHeader header = {};
+    memcpy(header.magic, _ImageMagic, sizeof(header.magic));
+    header.version = _ImageVersion;
+    header.hash = hash;
+    header.expr_size = sizeof(struct _Expr);
+    header.name_size = sizeof(struct _Name);
+    header.expr_count = expr_count;
+    header.name_count = name_count;
+    header.exprs = (sizeof(header) + 15) & ~(size_t)15;
+    header.names = header.exprs + expr_count * sizeof(struct _Expr);
+    header.numbers = header.names + name_count * sizeof(struct _Name);
+    size_t numbers_size = 0;
+    for (size_t i = 0; i < expr_count; ++i) {
+        const struct _BigInt* big = exprs[i]->token.num.big;
+        if (big != NULL) {
+            numbers_size += (sizeof(struct _BigInt) + big->len * sizeof(uint32_t) + 7) & ~(size_t)7;
+        }
+    }
+    header.strings = header.numbers + numbers_size;
+
+    // strings are only known once every record refers to them, so they go
+    // in last
+    char* image = (char*) calloc(header.strings, 1);
+    struct _Expr* out_exprs = (struct _Expr*) (image + header.exprs);
+    char* out_number = image + header.numbers;
+    for (size_t i = 0; i < expr_count; ++i) {
+        struct _Expr* expr = &out_exprs[i];
+        *expr = *exprs[i];
+        int added;
+        struct _Expr** children[4] = {&expr->expr0, &expr->expr1, &expr->expr2, &expr->expr3};
+        for (int k = 0; k < 4; ++k) {
+            if (*children[k] != NULL) {
+                size_t index = _image_map_add(&expr_map, *children[k], &added);
+                *children[k] = (struct _Expr*) (uintptr_t) (header.exprs + index * sizeof(struct _Expr));
+            }
+        }
+        expr->token.value = (char*) _image_string(&string_map, strings, expr->token.value);
+        expr->token.encoded = (const char*) _image_string(&string_map, strings, expr->token.encoded);
+        const struct _BigInt* big = expr->token.num.big;
+        if (big != NULL) {
+            struct _BigInt* num = (struct _BigInt*) out_number;
+            num->neg = big->neg;
+            num->len = big->len;
+            num->limbs = NULL;
+            memcpy(num + 1, big->limbs, big->len * sizeof(uint32_t));
+            expr->token.num.big = (struct _BigInt*) (uintptr_t) (out_number - image);
+            out_number += (sizeof(struct _BigInt) + big->len * sizeof(uint32_t) + 7) & ~(size_t)7;
+        }
+    }
+    struct _Name* out_names = (struct _Name*) (image + header.names);
+    for (size_t i = 0; i < name_count; ++i) {
+        struct _Name* name = &out_names[i];
+        name_init(name, (const char*) _image_string(&string_map, strings, names[i]->name));
+        name->seqno = names[i]->seqno;
+        name->filename = (const char*) _image_string(&string_map, strings, names[i]->filename);
+        name->lineno = names[i]->lineno;
+        name->colno = names[i]->colno;
+        if (names[i]->expr != NULL) {
+            int added;
+            size_t index = _image_map_add(&expr_map, names[i]->expr, &added);
+            name->expr = (struct _Expr*) (uintptr_t) (header.exprs + index * sizeof(struct _Expr));
+        }
+    }
+    header.string_count = string_map.used;
+    header.size = header.strings;
+    for (size_t i = 0; i < string_map.used; ++i) {
+        header.size += strlen(strings[i]) + 1;
+    }
+    image = (char*) realloc(image, header.size);
+    char* out_string = image + header.strings;
+    for (size_t i = 0; i < string_map.used; ++i) {
+        size_t len = strlen(strings[i]) + 1;
+        memcpy(out_string, strings[i], len);
+        out_string += len;
+    }
+    memcpy(image, &header, sizeof(header));
+    header.checksum = _image_checksum(image, header.size);
+    memcpy(image, &header, sizeof(header));
 
-    expr->expr1 = args;
+    size_t tmp_size = strlen(path) + 32;
+    char* tmp = (char*) malloc(tmp_size);
+    snprintf(tmp, tmp_size, "%s.%d", path, (int) getpid());
+    int res = 0;
+    FILE* file = fopen(tmp, "wb");
+    if (file == NULL) {
+        perror(tmp);
+        res = 1;
+    }
+    else {
+        fwrite(image, 1, header.size, file);
+        if (ferror(file) | fclose(file)) {
+            perror(tmp);
+            res = 1;
+        }
+        else if (rename(tmp, path) != 0) {
+            perror(path);
+            res = 1;
+        }
+        if (res != 0) {
+            unlink(tmp);
+        }
+    }
+    if (res == 0 && context->pstate.verbose) {
+        fprintf(_icfp_stderr, "image: %zu defines, %zu exprs written to %s\n", name_count, expr_count, path);
+    }
+    free(tmp);
+    free(image);
+    _image_map_free(&string_map);
+    free(strings);
+    _image_map_free(&expr_map);
+    free(exprs);
+    free(names);
+    return res;
+}
 
-    struct _Nesting deeper = {};
-    res = _icfp_parser_parse_expression(context, file, &deeper, &nested);
+
+// Maps the image at path into the root scope, unless it is missing or was
+// made from other sources or by another build. Its strings join the
+// symbols in place, and its defines are used where they lie.
+static int
+icfp_image_load(struct _Compiler* context, const char* path, uint64_t hash) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 1;
+    }
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(struct _ImageHeader)) {
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return 1;
+    }
+    struct _Image* image = &context->image;
+    image->base = (char*) map;
+    image->size = st.st_size;
+    image->path = path;
+    image->strings = NULL;
+    image->relocated = NULL;
+    image->stack = NULL;
+    struct _ImageHeader* header = &image->header;
+    memcpy(header, image->base, sizeof(*header));
+    if (
+        memcmp(header->magic, _ImageMagic, sizeof(header->magic)) != 0 ||
+        header->version != _ImageVersion ||
+        header->hash != hash ||
+        header->size != image->size ||
+        header->expr_size != sizeof(struct _Expr) ||
+        header->name_size != sizeof(struct _Name)
+    ) {
+        if (context->pstate.verbose) {
+            fprintf(_icfp_stderr, "image: %s is stale\n", path);
+        }
+        image_free(image);
+        return 1;
+    }
+
+    // a damaged image is read from source again, like a stale one
+    int res = header->checksum != _image_checksum(image->base, image->size);
+    res = res || !(
+        header->exprs >= sizeof(*header) && header->exprs % 16 == 0 &&
+        header->expr_count <= image->size / sizeof(struct _Expr) &&
+        header->name_count <= image->size / sizeof(struct _Name) &&
+        header->string_count <= image->size &&
+        header->names == header->exprs + header->expr_count * sizeof(struct _Expr) &&
+        header->numbers == header->names + header->name_count * sizeof(struct _Name) &&
+        header->strings >= header->numbers && header->strings <= image->size
+    );
+    if (res == 0) {
+        image->strings = (const char**) calloc(header->string_count + 1, sizeof(const char*));
+        const char* p = image->base + header->strings;
+        const char* end = image->base + image->size;
+        for (uint64_t i = 0; i < header->string_count; ++i) {
+            const char* nul = (const char*) memchr(p, '\0', end - p);
+            if (nul == NULL) {
+                res = 1;
+                break;
+            }
+            image->strings[i] = p;
+            p = nul + 1;
+        }
+    }
     if (res == 0) {
-        fprintf(stderr, "%s:%d:%d: expecting expression\n", context->filename, context->lineno, context->colno);
+        res = _image_check(image);
+    }
+    if (res != 0) {
+        fprintf(_icfp_stderr, "! image %s is corrupt, reading the preludes\n", path);
+        image_free(image);
         return 1;
     }
-    if (res != 1) { return 1; }
-    expr->expr2 = nested;
 
-    struct _Token token;
-    res = _icfp_parser_tokenize(context, file, &token);
-    if (res != 0) { return -1; }
-    if (context->verbose) {
-        fprintf(stderr, "%s:%d:%d: token %d %s\n", context->filename, token.lineno, token.colno, token.type, token.value);
+    // the strings are checked, so none of them is left dangling from the
+    // symbols once they join
+    struct _SymbolList* symbols = &context->pstate.symbols;
+    for (uint64_t i = 0; i < header->string_count; ++i) {
+        image->strings[i] = symbol_list_intern_static(symbols, image->strings[i]);
     }
-    switch (token.type) {
-        case _TokenType_close_paren:
-            expr->type = _ExprType_lambda;
-            return 0;
-        default:
-            fprintf(stderr, "%s:%d:%d: expecting a closing paren\n", context->filename, token.lineno, token.colno);
-            return 1;
+    image->relocated = (uint64_t*) calloc(header->expr_count / 64 + 1, sizeof(uint64_t));
+    struct _Name* names = (struct _Name*) (image->base + header->names);
+    struct _NameTable* root = context->wstate.nametable;
+    for (uint64_t i = 0; i < header->name_count; ++i) {
+        struct _Name* name = &names[i];
+        name->name = _image_symbol(image, name->name);
+        name->filename = _image_symbol(image, name->filename);
+        name->expr = _image_expr(image, name->expr);
+        name_table_put_name(root, name);
     }
+    root->image = image;
+    if (context->pstate.verbose) {
+        fprintf(_icfp_stderr, "image: %zu defines, %zu exprs read from %s\n", (size_t) header->name_count,
+            (size_t) header->expr_count, path);
+    }
+    return 0;
 }
 
 
-static int
-_icfp_parser_parse_define(struct _ParserState* context, FILE* file,
-    struct _Nesting* nesting, struct _Expr* expr) {
+static void
+icfp_compiler_report(const struct _Compiler* context, const struct _Config* config) {
+    const struct _ParserState* pstate = &context->pstate;
+    fprintf(_icfp_stderr, "symbols: %zu bytes peak\n", pstate->symbols.arena.peak);
+    fprintf(_icfp_stderr, "exprs: %zu bytes peak, %zu nodes\n", pstate->expr_tree.arena.peak, pstate->expr_tree.used);
+    fprintf(_icfp_stderr, "names: %zu bytes peak, %zu names\n", pstate->name_list.arena.peak, pstate->name_list.used);
+    if (config->optimize) {
+        fprintf(_icfp_stderr, "folds: %zu expressions, %zu beta reductions\n", pstate->folds, pstate->inlines);
+        fprintf(_icfp_stderr, "lowered: %zu of %zu defines\n", pstate->lowered, pstate->name_list.used);
+        fprintf(_icfp_stderr, "applies: %zu strict, %zu lazy\n", context->wstate.strict_applies, context->wstate.lazy_applies);
+    }
+    if (config->out_common) {
+        fprintf(_icfp_stderr, "shared: %zu subexpressions\n", pstate->shares);
+    }
+    if (pstate->knots > 0) {
+        fprintf(_icfp_stderr, "knots: %zu fixed points\n", pstate->knots);
+    }
+    fprintf(_icfp_stderr, "scopes: %zu bytes peak, %zu live at most\n", context->wstate.nametable_list.arena.peak,
+        context->wstate.nametable_list.peak);
+}
 
-    struct _Expr* nested;
-    struct _Expr* args;
-    int minargs = 2;
-    int res = _icfp_parser_parse_arg_list(context, file, nesting, minargs, &args);
-    if (res != 0) { return res; }
 
-    args->expr0 = args->expr1;
-    args->expr1 = args->expr2;
-    args->expr2 = args->expr3;
-    args->expr3 = NULL;
-    switch (args->type) {
-        case _ExprType_apply2:
-            args->type = _ExprType_apply1;
-            break;
-        case _ExprType_apply3:
-            args->type = _ExprType_apply2;
-            break;
-        default:
-            abort();
+// Writes s as a JSON string.
+static void
+_json_puts(const char* s, FILE* file) {
+    fputc('"', file);
+    for (; *s != '\0'; ++s) {
+        uint8_t c = *s;
+        if (c == '"' || c == '\\') {
+            fputc('\\', file);
+            fputc(c, file);
+        }
+        else if (c < 0x20) {
+            fprintf(file, "\\u%04x", c);
+        }
+        else {
+            fputc(c, file);
+        }
     }
-    expr->expr1 = args;
+    fputc('"', file);
+}
 
-    struct _Nesting deeper = {};
-    res = _icfp_parser_parse_expression(context, file, &deeper, &nested);
-    if (res == 0) {
-        fprintf(stderr, "%s:%d:%d: expecting expression\n", context->filename, context->lineno, context->colno);
-        return 1;
-    }
-    if (res != 1) { return 1; }
-    expr->expr2 = nested;
 
-    struct _Token token;
-    res = _icfp_parser_tokenize(context, file, &token);
-    if (res != 0) { return -1; }
-    if (context->verbose) {
-        fprintf(stderr, "%s:%d:%d: token %d %s\n", context->filename, token.lineno, token.colno, token.type, token.value);
+// The peak of this image only: ru_maxrss keeps that of the process
+// before exec, such as a Python parent forked to run us.
+static long
+_peak_rss_kb(void) {
+    FILE* fp = fopen("/proc/self/status", "r");
+    if (fp != NULL) {
+        char line[256];
+        long kb = -1;
+        while (kb < 0 && fgets(line, sizeof(line), fp) != NULL) {
+            if (sscanf(line, "VmHWM: %ld kB", &kb) != 1) {
+                kb = -1;
+            }
+        }
+        fclose(fp);
+        if (kb >= 0) {
+            return kb;
+        }
     }
-    switch (token.type) {
-        case _TokenType_close_paren:
-            expr->type = _ExprType_define;
-            return 0;
-        default:
-            fprintf(stderr, "%s:%d:%d: expecting a closing paren\n", context->filename, token.lineno, token.colno);
-            return 1;
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
     }
+    return usage.ru_maxrss;
 }
 
 
+struct _BenchPhase {
+    const char* name;
+    uint64_t ns;
+};
+
+
+// Compiles a file in passes over its text in memory, each timed on its
+// own: tokenizing, parsing, folding under -O, resolving names and
+// writing. Tokenizing is a pass of its own, which parsing does again as it
+// goes. Prints one JSON line of the times in ms, the input rate over their
+// sum and the peak RSS so far.
 static int
-_icfp_parser_parse_expression_body(struct _ParserState* context, FILE* file,
-    struct _Nesting* nesting, struct _Expr* expr) {
+icfp_bench_file(const struct _Config* config, const struct _Compiler* prelude, const char* filename, FILE* out) {
+    FILE* fp = fopen(filename, "r");
+    if (fp == NULL) {
+        perror(filename);
+        return 1;
+    }
+    struct _Reader file_reader;
+    const char* text = NULL;
+    size_t size = 0;
+    int res = reader_init(&file_reader, fp);
+    if (res == 0) {
+        res = reader_contents(&file_reader, &text, &size);
+    }
+    if (res != 0) {
+        reader_close(&file_reader);
+        fclose(fp);
+        return res;
+    }
 
-    struct _Expr* nested;
-    nesting->popped = 0;
-    int res = _icfp_parser_parse_expression(context, file, nesting, &nested);
+    struct _Compiler compiler;
+    struct _ParserState* pstate = &compiler.pstate;
+    struct _Reader reader;
+    size_t tokens = 0;
+    res = icfp_compiler_init(&compiler, config, NULL, prelude);
+    uint64_t start = _clock_ns(CLOCK_MONOTONIC);
     if (res == 0) {
-        fprintf(stderr, "%s:%d:%d: expecting expression\n", context->filename, context->lineno, context->colno);
-        return 1;
+        reader_init_text(&reader, text, size);
+        pstate->filename = filename;
+        pstate->lineno = 1;
+        pstate->colno = 1;
+        struct _Token token;
+        for (;;) {
+            res = _icfp_parser_tokenize(pstate, &reader, &token);
+            if (res != 0 || token.type == _TokenType_eof) { break; }
+            ++tokens;
+        }
     }
-    if (res != 1) { return 1; }
-    switch (nested->type) {
-        case _ExprType_identifier:
-            expr->expr0 = nested;
-            if (strcmp(nested->token.value, "\\") == 0) {
-                return _icfp_parser_parse_lambda(context, file, nesting, expr);
+    uint64_t tokenize_ns = _clock_ns(CLOCK_MONOTONIC) - start;
+    icfp_compiler_free(&compiler);
+
+    // the passes after tokenizing work on the same parse
+    struct _Expr** exprs = NULL;
+    size_t exprs_used = 0;
+    size_t exprs_size = 0;
+    if (res == 0) {
+        res = icfp_compiler_init(&compiler, config, NULL, prelude);
+    }
+    struct _WriterState* wstate = &compiler.wstate;
+    start = _clock_ns(CLOCK_MONOTONIC);
+    if (res == 0) {
+        reader_init_text(&reader, text, size);
+        pstate->filename = filename;
+        pstate->lineno = 1;
+        pstate->colno = 1;
+        wstate->filename = filename;
+        for (;;) {
+            struct _Nesting nesting = {};
+            struct _Expr* expr;
+            int parsed = _icfp_parser_parse_expression(pstate, &reader, &nesting, &expr);
+            if (parsed != 1) {
+                res = parsed != 0;
+                break;
             }
-            else if (strcmp(nested->token.value, "define") == 0) {
-                return _icfp_parser_parse_define(context, file, nesting, expr);
+            if (expr->type == _ExprType_define) {
+                _icfp_parser_define(pstate, wstate, expr);
+                continue;
             }
-            break;
-        case _ExprType_apply1:
-        case _ExprType_apply2:
-        case _ExprType_apply3:
-        case _ExprType_lambda:
-            expr->expr0 = nested;
-            break;
-        case _ExprType_literal:
-        case _ExprType_define:
-        case _ExprType_assert:
-        case _ExprType_invalid:
-            fprintf(stderr, "%s:%d:%d: expecting identifier\n", context->filename, nested->lineno, nested->colno);
-            return 1;
+            if (expr->type == _ExprType_assert && !config->out_asserts) {
+                continue;
+            }
+            if (expr->type == _ExprType_invalid || expr->type == _ExprType_identifier) {
+                fprintf(_icfp_stderr, "%s:%d:%d: expecting expression\n", filename, expr->lineno, expr->colno);
+                res = 1;
+                break;
+            }
+            if (exprs_used == exprs_size) {
+                exprs_size = exprs_size ? exprs_size * 2 : 64;
+                exprs = (struct _Expr**) realloc(exprs, exprs_size * sizeof(struct _Expr*));
+            }
+            exprs[exprs_used++] = expr;
+        }
     }
+    uint64_t parse_ns = _clock_ns(CLOCK_MONOTONIC) - start;
 
-    nesting->popped = 0;
-    res = _icfp_parser_parse_expression(context, file, nesting, &nested);
-    if (res == 0) {
-        fprintf(stderr, "%s:%d:%d: expecting expression\n", context->filename, context->lineno, context->colno);
-        return 1;
-    }
-    if (res != 1) { return 1; }
-    switch (nested->type) {
-        case _ExprType_identifier:
-        case _ExprType_apply1:
-        case _ExprType_apply2:
-        case _ExprType_apply3:
-        case _ExprType_literal:
-        case _ExprType_lambda:
-            expr->expr1 = nested;
-            break;
-        case _ExprType_define:
-        case _ExprType_assert:
-        case _ExprType_invalid:
-            fprintf(stderr, "%s:%d:%d: expecting identifier\n", context->filename, nested->lineno, nested->colno);
-            return 1;
+    start = _clock_ns(CLOCK_MONOTONIC);
+    for (size_t i = 0; i < exprs_used && res == 0 && (config->optimize || config->out_common); ++i) {
+        if (config->optimize) {
+            exprs[i] = icfp_fold_toplevel(pstate, wstate, exprs[i]);
+        }
+        if (config->out_common) {
+            exprs[i] = icfp_share_toplevel(pstate, wstate, exprs[i]);
+        }
     }
+    uint64_t optimize_ns = _clock_ns(CLOCK_MONOTONIC) - start;
 
-    nesting->popped = 0;
-    res = _icfp_parser_parse_expression(context, file, nesting, &nested);
-    if (res == 0 && nesting->popped != 0) {
-        expr->type = _ExprType_apply1;
-        if (strcmp(expr->expr0->token.value, "assert") == 0) {
-            expr->type = _ExprType_assert;
+    start = _clock_ns(CLOCK_MONOTONIC);
+    for (size_t i = 0; i < exprs_used && res == 0; ++i) {
+        if (wstate->out_shared) {
+            wstate->defines_used = 0;
+            res = _icfp_collect_expression(wstate, exprs[i], wstate->nametable);
+        }
+        else {
+            res = _icfp_resolve_expression(wstate, exprs[i], wstate->nametable);
         }
-        return 0;
     }
-    if (res != 1) { return 1; }
-    switch (nested->type) {
-        case _ExprType_identifier:
-        case _ExprType_apply1:
-        case _ExprType_apply2:
-        case _ExprType_apply3:
-        case _ExprType_literal:
-            expr->expr2 = nested;
-            break;
-        case _ExprType_lambda:
-        case _ExprType_define:
-        case _ExprType_assert:
-        case _ExprType_invalid:
-            fprintf(stderr, "%s:%d:%d: expecting identifier\n", context->filename, nested->lineno, nested->colno);
-            return 1;
+    uint64_t resolve_ns = _clock_ns(CLOCK_MONOTONIC) - start;
+
+    size_t out_bytes = 0;
+    start = _clock_ns(CLOCK_MONOTONIC);
+    for (size_t i = 0; i < exprs_used && res == 0; ++i) {
+        res = icfp_write_toplevel(wstate, exprs[i]);
+        out_bytes += wstate->out.used;
+        wstate->out.used = 0;
+    }
+    uint64_t write_ns = _clock_ns(CLOCK_MONOTONIC) - start;
+    size_t nodes = pstate->expr_tree.used;
+    icfp_compiler_free(&compiler);
+    free(exprs);
+    reader_close(&file_reader);
+    fclose(fp);
+    if (res != 0) {
+        return res;
     }
 
-    nesting->popped = 0;
-    res = _icfp_parser_parse_expression(context, file, nesting, &nested);
-    if (res == 0 && nesting->popped != 0) {
-        expr->type = _ExprType_apply2;
-        if (strcmp(expr->expr0->token.value, "define") == 0) {
-            expr->type = _ExprType_define;
-        }
-        return 0;
+    struct _BenchPhase phases[] = {
+        {"tokenize", tokenize_ns},
+        {"parse", parse_ns},
+        {"optimize", optimize_ns},
+        {"resolve", resolve_ns},
+        {"write", write_ns},
+    };
+    uint64_t total_ns = 0;
+    for (size_t i = 0; i < sizeof(phases) / sizeof(phases[0]); ++i) {
+        total_ns += phases[i].ns;
     }
-    if (res != 1) { return 1; }
-    switch (nested->type) {
-        case _ExprType_identifier:
-        case _ExprType_apply1:
-        case _ExprType_apply2:
-        case _ExprType_apply3:
-        case _ExprType_literal:
-            expr->expr3 = nested;
-            break;
-        case _ExprType_lambda:
-        case _ExprType_define:
-        case _ExprType_assert:
-        case _ExprType_invalid:
-            fprintf(stderr, "%s:%d:%d: expecting identifier\n", context->filename, nested->lineno, nested->colno);
-            return 1;
+    fprintf(out, "{\"file\":");
+    _json_puts(filename, out);
+    fprintf(out, ",\"bytes\":%zu,\"tokens\":%zu,\"nodes\":%zu,\"out_bytes\":%zu", size, tokens, nodes, out_bytes);
+    for (size_t i = 0; i < sizeof(phases) / sizeof(phases[0]); ++i) {
+        fprintf(out, ",\"%s_ms\":%.3f", phases[i].name, phases[i].ns / 1e6);
+    }
+    fprintf(out, ",\"total_ms\":%.3f,\"mb_s\":%.2f,\"peak_rss_kb\":%ld}\n", total_ns / 1e6,
+        total_ns > 0 ? size * 1e3 / total_ns : 0.0, _peak_rss_kb());
+    return fflush(out) != 0;
+}
+
+
+// What -T counts, summed over the compilers of a run.
+struct _CompileStats {
+    uint64_t parse_ns;
+    uint64_t optimize_ns;
+    uint64_t write_ns;
+    uint64_t eval_ns;
+    size_t tokens;
+    size_t nodes;
+    size_t symbol_bytes;
+    size_t lookups;
+    size_t lookup_depth;
+    size_t nametables;
+    size_t out_bytes;
+};
+
+
+static void
+icfp_compiler_count(const struct _Compiler* context, struct _CompileStats* stats) {
+    const struct _ParserState* pstate = &context->pstate;
+    const struct _NameTableList* scopes = &context->wstate.nametable_list;
+    const struct _EvalState* eval = context->wstate.eval;
+    stats->parse_ns += pstate->parse_ns;
+    stats->optimize_ns += pstate->optimize_ns;
+    stats->write_ns += pstate->write_ns;
+    stats->eval_ns += eval->eval_ns;
+    stats->tokens += pstate->tokens;
+    stats->nodes += pstate->expr_tree.used;
+    stats->symbol_bytes += pstate->symbols.bytes;
+    stats->lookups += scopes->lookups;
+    stats->lookup_depth += scopes->lookup_depth;
+    stats->nametables += scopes->pushed;
+    stats->out_bytes += context->wstate.out.written + eval->written;
+}
+
+
+// Prints the times of the prelude and compile phases, the time spent in
+// each pass, and the counts of the whole run as one JSON line.
+static void
+icfp_compiler_stats(const struct _CompileStats* stats, const struct _StatsTimer* prelude,
+    const struct _StatsTimer* compile, FILE* file) {
+    fprintf(file, "{\"prelude_wall_ms\":%.3f,\"prelude_cpu_ms\":%.3f", prelude->wall_ns / 1e6, prelude->cpu_ns / 1e6);
+    fprintf(file, ",\"compile_wall_ms\":%.3f,\"compile_cpu_ms\":%.3f", compile->wall_ns / 1e6, compile->cpu_ns / 1e6);
+    fprintf(file, ",\"parse_ms\":%.3f,\"optimize_ms\":%.3f,\"write_ms\":%.3f,\"eval_ms\":%.3f",
+        stats->parse_ns / 1e6, stats->optimize_ns / 1e6, stats->write_ns / 1e6, stats->eval_ns / 1e6);
+    fprintf(file, ",\"tokens\":%zu,\"nodes\":%zu,\"symbol_bytes\":%zu", stats->tokens, stats->nodes,
+        stats->symbol_bytes);
+    fprintf(file, ",\"lookups\":%zu,\"lookup_depth\":%.2f,\"nametables\":%zu", stats->lookups,
+        stats->lookups > 0 ? (double) stats->lookup_depth / stats->lookups : 0.0, stats->nametables);
+    fprintf(file, ",\"out_bytes\":%zu,\"peak_rss_kb\":%ld}\n", stats->out_bytes, _peak_rss_kb());
+}
+
+
+// Opens the output for filename in config->outdir, named after it with the
+// extension replaced.
+static FILE*
+_icfp_open_output(const struct _Config* config, const char* filename) {
+    const char* base = strcmp(filename, "-") == 0 ? "stdin" : filename;
+    const char* slash = strrchr(base, '/');
+    if (slash != NULL) {
+        base = slash + 1;
+    }
+    const char* dot = strrchr(base, '.');
+    size_t n = dot != NULL && dot != base ? (size_t) (dot - base) : strlen(base);
+    const char* ext = config->out_cpp ? ".cpp" : config->out_eval ? ".out" : ".icfp";
+    size_t size = strlen(config->outdir) + n + strlen(ext) + 2;
+    char* path = (char*) malloc(size);
+    snprintf(path, size, "%s/%.*s%s", config->outdir, (int) n, base, ext);
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+    }
+    free(path);
+    return file;
+}
+
+
+struct _Job {
+    const char* filename;
+    // output kept for stdout, which takes it in input order
+    char* text;
+    size_t size;
+    int res;
+    int done;
+};
+
+
+struct _JobQueue {
+    const struct _Config* config;
+    const struct _Compiler* prelude;
+    // the jobs' counts under -T, or NULL
+    struct _CompileStats* stats;
+    struct _Job* jobs;
+    size_t count;
+    size_t next;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+};
+
+
+static int
+_icfp_job_run(struct _JobQueue* queue, struct _Job* job) {
+    const struct _Config* config = queue->config;
+    FILE* file;
+    if (config->outdir != NULL) {
+        file = _icfp_open_output(config, job->filename);
     }
-
-    nesting->popped = 0;
-    res = _icfp_parser_parse_expression(context, file, nesting, &nested);
-    if (res == 0 && nesting->popped != 0) {
-        expr->type = _ExprType_apply3;
-        return 0;
+    else {
+        file = open_memstream(&job->text, &job->size);
     }
-    if (res != 1) { return 1; }
-    fprintf(stderr, "%s:%d:%d: expecting close paren\n", context->filename, nested->lineno, nested->colno);
-    return 1;
+    if (file == NULL) {
+        return 1;
+    }
+    struct _Compiler compiler;
+    int res = icfp_compiler_init(&compiler, config, file, queue->prelude);
+    if (res == 0) {
+        res = icfp_compiler_process_file(&compiler, config, job->filename);
+        if (config->verbose) {
+            icfp_compiler_report(&compiler, config);
+        }
+        if (queue->stats != NULL) {
+            pthread_mutex_lock(&queue->lock);
+            icfp_compiler_count(&compiler, queue->stats);
+            pthread_mutex_unlock(&queue->lock);
+        }
+    }
+    icfp_compiler_free(&compiler);
+    if (fclose(file) != 0 && res == 0) {
+        perror(job->filename);
+        res = 1;
+    }
+    return res;
 }
 
 
-static void
-_icfp_parser_log_expr(struct _ParserState* context, struct _Expr* expr, FILE* file) {
-    fprintf(stderr, "%s:%d:%d: ", context->filename, expr->lineno, expr->colno);
-    dump_expr(expr, stderr);
-    fprintf(stderr, "\n");
+static void*
+_icfp_job_worker(void* arg) {
+    struct _JobQueue* queue = (struct _JobQueue*) arg;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED);
+        if (i >= queue->count) {
+            break;
+        }
+        int res = _icfp_job_run(queue, &queue->jobs[i]);
+        pthread_mutex_lock(&queue->lock);
+        queue->jobs[i].res = res;
+        queue->jobs[i].done = 1;
+        pthread_cond_broadcast(&queue->done);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    return NULL;
 }
 
 
+// Compiles every input on its own, on config->jobs threads. Each sees the
+// prelude, which stays read only, and none sees the defines of another.
+// Outputs go to stdout in input order as they complete, and the counts of
+// each to stats unless it is NULL.
 static int
-_icfp_parser_parse_expression(struct _ParserState* context, FILE* file,
-    struct _Nesting* nesting, struct _Expr** parsed_expr) {
-
-    struct _Token token;
-    int res = _icfp_parser_tokenize(context, file, &token);
-    if (res != 0) { return -1; }
-    if (context->verbose) {
-        fprintf(stderr, "%s:%d:%d: token %d %s\n", context->filename, token.lineno, token.colno, token.type, token.value);
+icfp_compile_jobs(const struct _Config* config, const struct _Compiler* prelude, FILE* out_file,
+    struct _CompileStats* stats) {
+    struct _JobQueue queue;
+    queue.config = config;
+    queue.prelude = prelude;
+    queue.stats = stats;
+    queue.count = config->filename_count;
+    queue.jobs = (struct _Job*) calloc(queue.count, sizeof(struct _Job));
+    queue.next = 0;
+    for (size_t i = 0; i < queue.count; ++i) {
+        queue.jobs[i].filename = config->filenames[i];
     }
-    switch (token.type) {
-        case _TokenType_open_paren: {
-            struct _Nesting deeper = {};
-            deeper.level = nesting->level + 1;
-            struct _Expr* expr = expr_tree_push(&context->expr_tree);
-            expr->token = token;
-            expr->lineno = token.lineno;
-            expr->colno = token.colno;
-            int res = _icfp_parser_parse_expression_body(context, file, &deeper, expr);
-            if (res != 0) { return -1; }
-            *parsed_expr = expr;
-            if (context->verbose) {
-                _icfp_parser_log_expr(context, expr, stderr);
-            }
-            return 1;
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.done, NULL);
+
+    size_t nthreads = (size_t) config->jobs < queue.count ? (size_t) config->jobs : queue.count;
+    pthread_t* threads = (pthread_t*) calloc(nthreads, sizeof(pthread_t));
+    size_t started = 0;
+    for (; started < nthreads; ++started) {
+        if (pthread_create(&threads[started], NULL, _icfp_job_worker, &queue) != 0) {
+            break;
         }
-        case _TokenType_close_paren:
-            if (nesting->level > 0) {
-                nesting->popped = 1;
-                return 0;
-            }
-            else {
-                fprintf(stderr, "%s:%d:%d: expecting expression %s\n", context->filename, token.lineno, token.colno, token.value);
-                return -1;
-            }
-        case _TokenType_number:
-        case _TokenType_bool_false:
-        case _TokenType_bool_true:
-        case _TokenType_str: {
-            struct _Expr* expr = expr_tree_push(&context->expr_tree);
-            expr->type = _ExprType_literal;
-            expr->token = token;
-            expr->lineno = token.lineno;
-            expr->colno = token.colno;
-            *parsed_expr = expr;
-            if (context->verbose) {
-                _icfp_parser_log_expr(context, expr, stderr);
-            }
-            return 1;
+    }
+    if (started == 0) {
+        _icfp_job_worker(&queue);
+    }
+
+    int res = 0;
+    for (size_t i = 0; i < queue.count; ++i) {
+        struct _Job* job = &queue.jobs[i];
+        pthread_mutex_lock(&queue.lock);
+        while (!job->done) {
+            pthread_cond_wait(&queue.done, &queue.lock);
         }
-        case _TokenType_identifier: {
-            // fprintf(stderr, "%s:%d:%d: expecting expression %s\n", context->filename, token.lineno, token.colno, token.value);
-            struct _Expr* expr = expr_tree_push(&context->expr_tree);
-            expr->type = _ExprType_identifier;
-            expr->token = token;
-            expr->lineno = token.lineno;
-            expr->colno = token.colno;
-            *parsed_expr = expr;
-            if (context->verbose) {
-                _icfp_parser_log_expr(context, expr, stderr);
-            }
-            return 1;
+        pthread_mutex_unlock(&queue.lock);
+        if (job->size > 0 && fwrite(job->text, 1, job->size, out_file) != job->size) {
+            perror("write");
+            res = 1;
         }
-        case _TokenType_eof:
-            if (nesting->level > 0) {
-                fprintf(stderr, "%s:%d:%d: unexpected EOF\n", context->filename, token.lineno, token.colno);
-                return -1;
-            }
-            return 0;
-        case _TokenType_invalid:
-        case _TokenType_str_start:
-        case _TokenType_str_data:
-        case _TokenType_str_end:
-            fprintf(stderr, "%s:%d:%d: invalid token %c\n", context->filename, token.lineno, token.colno, token.value[0]);
-            return -1;
+        free(job->text);
+        if (res == 0) {
+            res = job->res;
+        }
+    }
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_cond_destroy(&queue.done);
+    pthread_mutex_destroy(&queue.lock);
+    free(queue.jobs);
+    if (fflush(out_file) != 0) {
+        return 1;
     }
+    return res;
 }
 
 
+// Reads the length line of a request. Returns -1 at the end of input
+// before a request starts.
 static int
-icfp_parser_process(struct _ParserState* context, struct _WriterState* wstate, const char* filename, FILE* file) {
-    context->filename = filename;
-    context->lineno = 1;
-    context->colno = 1;
-    switch (wstate->out_format) {
-        case 1:
+_icfp_serve_header(FILE* in, size_t* size) {
+    size_t n = 0;
+    int digits = 0;
+    for (;;) {
+        int c = fgetc(in);
+        if (c == EOF && digits == 0) {
+            return ferror(in) ? 1 : -1;
+        }
+        if (c == '\n' && digits > 0) {
             break;
-        default:
-            fprintf(stderr, "! unhandled output format %d\n", wstate->out_format);
+        }
+        if (c < '0' || c > '9' || n > (_RequestSizeMax - (c - '0')) / 10) {
+            fprintf(_icfp_stderr, "! invalid request header\n");
             return 1;
+        }
+        n = n * 10 + (c - '0');
+        ++digits;
     }
+    *size = n;
+    return 0;
+}
 
-    struct _Expr* expr;
-    int count = 0;
+
+// Compiles requests read from in until it ends. A request is the size of
+// its source in bytes on a line of its own, followed by the source. A
+// reply is a line with the status and the size of its body, followed by
+// the body: the output, or the diagnostics of a failed request, which
+// otherwise go to stderr once the request is done. Each request gets a
+// compiler of its own with the prelude as its parent, and all it allocated
+// is gone once the reply is out.
+static int
+icfp_serve(const struct _Config* config, const struct _Compiler* prelude, FILE* in, FILE* out) {
+    char* text = NULL;
+    size_t textsize = 0;
+    int res;
     for (;;) {
-        if (count > 0) {
-            fputc('\n', wstate->file);
-        }
-        struct _Nesting nesting = {};
-        int res = _icfp_parser_parse_expression(context, file, &nesting, &expr);
-        if (res != 1) { return res; }
-        switch (expr->type) {
-            case _ExprType_literal:
-            case _ExprType_apply1:
-            case _ExprType_apply2:
-            case _ExprType_apply3:
-            case _ExprType_lambda: {
-                int res = _icfp_write_expression(wstate, expr, wstate->nametable);
-                if (res != 0) { return res; }
-                ++count;
+        size_t size;
+        res = _icfp_serve_header(in, &size);
+        if (res != 0) { break; }
+        if (size > textsize) {
+            free(text);
+            textsize = size;
+            text = (char*) malloc(textsize);
+            if (text == NULL) {
+                perror(NULL);
+                res = 1;
                 break;
             }
-            case _ExprType_define: {
-                struct _Expr* args = expr->expr1;
-                struct _Expr* body = expr->expr2;
-                const char* name = args->expr0->token.value;
-                struct _Expr* lamb = expr_tree_push(&context->expr_tree);
-                lamb->type = _ExprType_lambda;
-                lamb->token = expr->token;
-                lamb->lineno = expr->token.lineno;
-                lamb->colno = expr->token.colno;
-                lamb->expr0 = args->expr0;
-                lamb->expr1 = args;
-                lamb->expr2 = body;
-                name_table_put(wstate->nametable, name, lamb);
-                break;
+        }
+        if (fread(text, 1, size, in) != size) {
+            fprintf(_icfp_stderr, "! request is shorter than its header\n");
+            res = 1;
+            break;
+        }
+
+        char* reply = NULL;
+        size_t reply_size = 0;
+        FILE* file = open_memstream(&reply, &reply_size);
+        char* errors = NULL;
+        size_t errors_size = 0;
+        FILE* errors_file = file != NULL ? open_memstream(&errors, &errors_size) : NULL;
+        if (errors_file == NULL) {
+            perror(NULL);
+            if (file != NULL) {
+                fclose(file);
+                free(reply);
             }
-            case _ExprType_assert:
-                if (context->out_asserts != 0) {
-                    int res = _icfp_write_expression(wstate, expr, wstate->nametable);
-                    if (res != 0) { return res; }
-                    ++count;
-                }
-                break;
-            case _ExprType_invalid:
-            case _ExprType_identifier:
-                fprintf(stderr, "%s:%d:%d: expecting expression\n", context->filename, expr->lineno, expr->colno);
-                return 1;
+            res = 1;
+            break;
+        }
+        _icfp_stderr = errors_file;
+        struct _Compiler compiler;
+        int status = icfp_compiler_init(&compiler, config, file, prelude);
+        if (status == 0) {
+            struct _Reader reader;
+            reader_init_text(&reader, text, size);
+            status = icfp_compiler_process(&compiler, config, "<request>", &reader);
+            reader_close(&reader);
+            if (config->verbose) {
+                icfp_compiler_report(&compiler, config);
+            }
+        }
+        icfp_compiler_free(&compiler);
+        _icfp_stderr = stderr;
+        if (fclose(file) != 0) {
+            status = 1;
+        }
+        if (fclose(errors_file) != 0) {
+            status = 1;
+        }
+        if (status != 0) {
+            fprintf(out, "1 %zu\n", errors_size);
+            fwrite(errors, 1, errors_size, out);
+        }
+        else {
+            fwrite(errors, 1, errors_size, stderr);
+            fprintf(out, "0 %zu\n", reply_size);
+            fwrite(reply, 1, reply_size, out);
+        }
+        free(reply);
+        free(errors);
+        if (fflush(out) != 0) {
+            res = 1;
+            break;
         }
     }
-    return 0;
+    free(text);
+    return res < 0 ? 0 : res;
 }
 
 
-struct _Config {
-    int filename_count;
-    const char* filenames[100];
-    int verbose;
-    int out_text;
-    int out_asserts;
+struct _Connection {
+    const struct _Config* config;
+    const struct _Compiler* prelude;
+    int fd;
 };
 
 
+static void*
+_icfp_serve_connection(void* arg) {
+    struct _Connection* conn = (struct _Connection*) arg;
+    FILE* in = fdopen(conn->fd, "r");
+    int fd = dup(conn->fd);
+    FILE* out = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (in != NULL && out != NULL) {
+        icfp_serve(conn->config, conn->prelude, in, out);
+    }
+    if (out != NULL) { fclose(out); }
+    else if (fd >= 0) { close(fd); }
+    if (in != NULL) { fclose(in); }
+    else { close(conn->fd); }
+    free(conn);
+    return NULL;
+}
+
+
+// Listens on a Unix socket at path and serves each connection as a stream
+// of requests on a thread of its own. The prelude stays read only.
 static int
-_parse_args(int argc, const char* argv[], struct _Config* config) {
-    config->filename_count = 0;
-    config->verbose = 0;
-    config->out_text = 1;
-    config->out_asserts = 0;
-    size_t fncap = sizeof(config->filenames) / sizeof(config->filenames[0]);
-    int state = 0;
-    for (size_t argi = 1; argi < argc; ++argi) {
-        const char* arg = argv[argi];
-        int narg = strlen(arg);
-        switch (state) {
-            case 0: {
-                if (narg == 1 && arg[0] == '-') {
-                    if (config->filename_count >= fncap) {
-                        fprintf(stderr, "! filename limit reached, skipping %s\n", arg);
-                    }
-                    else {
-                        config->filenames[config->filename_count++] = arg;
-                    }
-                }
-                else if (narg > 0 && arg[0] == '-') {
-                    if (
-                        strcmp(arg, "-h") == 0 ||
-                        strcmp(arg, "-help") == 0 ||
-                        strcmp(arg, "--help") == 0
-                    ) {
-                        printf("%s", _usage);
-                        exit(0);
-                    }
-                    else if (
-                        strcmp(arg, "-v") == 0 ||
-                        strcmp(arg, "--verbose") == 0
-                    ) {
-                        config->verbose = 1;
-                    }
-                    else if (
-                        strcmp(arg, "-t") == 0 ||
-                        strcmp(arg, "--text") == 0
-                    ) {
-                        config->out_text = 1;
-                    }
-                    else if (
-                        strcmp(arg, "-a") == 0 ||
-                        strcmp(arg, "--asserts") == 0
-                    ) {
-                        config->out_asserts = 1;
-                    }
-                    else {
-                        fprintf(stderr, "! invalid option %s\n", arg);
-                        fprintf(stderr, "%s\n", _usageq);
-                        return 1;
-                    }
-                }
-                else {
-                    if (config->filename_count >= fncap) {
-                        fprintf(stderr, "! filename limit reached, skipping %s\n", arg);
-                    }
-                    else {
-                        config->filenames[config->filename_count++] = arg;
-                    }
-                }
-                break;
+icfp_serve_socket(const struct _Config* config, const struct _Compiler* prelude, const char* path) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // a socket left over from an earlier server is in the way
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return 1;
+    }
+    if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(sock, SOMAXCONN) != 0) {
+        perror(path);
+        close(sock);
+        return 1;
+    }
+    // a client gone before its reply must not take the server down
+    signal(SIGPIPE, SIG_IGN);
+    if (config->verbose) {
+        fprintf(_icfp_stderr, "listening on %s\n", path);
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (;;) {
+        int fd = accept(sock, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
             }
+            perror("accept");
+            break;
+        }
+        struct _Connection* conn = (struct _Connection*) malloc(sizeof(struct _Connection));
+        conn->config = config;
+        conn->prelude = prelude;
+        conn->fd = fd;
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, _icfp_serve_connection, conn) != 0) {
+            _icfp_serve_connection(conn);
         }
     }
-    if (config->filename_count == 0) {
-        config->filenames[config->filename_count++] = "-";
-    }
-    return 0;
+    pthread_attr_destroy(&attr);
+    close(sock);
+    return 1;
 }
 
 
@@ -2069,70 +9739,100 @@ int main(int argc, const char* argv[]) {
 
     FILE* out_file = stdout;
 
-    char* symbs = (char*) calloc(_SymbolBufSizeMax, sizeof(char));
-    size_t symb_size = _SymbolBufSizeMax;
-
-    struct _Expr* exprs = (struct _Expr*) calloc(_ExprTreeSizeMax, sizeof(_Expr));
-    size_t expr_size = _ExprTreeSizeMax;
-
-    char* token_buf = (char*) calloc(_TokenSizeMax, sizeof(char));
-    size_t token_bufsize = _TokenSizeMax;
-
-    struct _Name* names_buf = (struct _Name*) calloc(_NamesSizeMax, sizeof(_Name));
-    size_t names_bufsize = _NamesSizeMax;
-
-    struct _NameTable* name_tables = (struct _NameTable*) calloc(_NameTableListSizeMax, sizeof(_NameTable));
-    size_t name_tables_size = _NameTableListSizeMax;
-    struct _NameTable* root_nametable;
+    _icfp_init_abc94();
 
-    struct _ParserState pstate;
-    pstate.token_buf = token_buf;
-    pstate.token_bufsize = token_bufsize;
-    symbol_list_init(&pstate.symbols, symb_size, symbs);
-    expr_tree_init(&pstate.expr_tree, expr_size, exprs);
-    name_list_init(&pstate.name_list, names_bufsize, names_buf);
-    pstate.verbose = config.verbose;
-    pstate.out_asserts = config.out_asserts;
-
-    _icfp_parser_init_symbols(&pstate);
-
-    struct _WriterState wstate;
-    res = icfp_writer_init(&wstate, out_file, config.out_text);
+    struct _Compiler compiler;
+    res = icfp_compiler_init(&compiler, &config, out_file, NULL);
     if (res != 0) { return res; }
-    wstate.filename = NULL;
-    wstate.verbose = config.verbose;
-    root_nametable = name_table_list_init(&wstate.nametable_list, name_tables_size, name_tables);
-    root_nametable->name_storage = &pstate.name_list;
-    wstate.nametable = root_nametable;
 
-    for (int fni = 0; fni < config.filename_count; ++fni) {
-        const char* filename = config.filenames[fni];
+    struct _StatsTimer prelude_timer;
+    struct _StatsTimer compile_timer;
+    if (config.stats) {
+        stats_timer_start(&prelude_timer);
+    }
+    uint64_t hash = 0;
+    int loaded = 0;
+    if (config.image != NULL) {
+        res = icfp_image_hash(&config, &hash);
+        if (res != 0) { return res; }
+        loaded = icfp_image_load(&compiler, config.image, hash) == 0;
+    }
+    if (!loaded) {
+        compiler.pstate.prelude = 1;
+        for (int i = 0; i < config.prelude_count; ++i) {
+            res = icfp_compiler_process_file(&compiler, &config, config.preludes[i]);
+            if (res != 0) { return res; }
+        }
+        compiler.pstate.prelude = 0;
+        if (config.image != NULL) {
+            res = icfp_image_save(&compiler, config.image, hash);
+            if (res != 0) { return res; }
+        }
+    }
 
-        FILE* fp;
-        if (strcmp(filename, "-") == 0) {
-            filename = "<stdin>";
-            fp = stdin;
+    if ((config.serve || config.jobs > 0) && compiler.image.base != NULL) {
+        image_relocate_all(&compiler.image);
+    }
+    if (config.stats) {
+        stats_timer_stop(&prelude_timer);
+        stats_timer_start(&compile_timer);
+    }
+    if (config.bench) {
+        for (int fni = 0; fni < config.filename_count && res == 0; ++fni) {
+            res = icfp_bench_file(&config, &compiler, config.filenames[fni], out_file);
+        }
+    }
+    else if (config.serve) {
+        if (config.optimize) {
+            icfp_lower_defines(&compiler.pstate, &compiler.wstate);
+        }
+        if (config.socket_path != NULL) {
+            res = icfp_serve_socket(&config, &compiler, config.socket_path);
         }
         else {
-            fp = fopen(filename, "r");
-            if (fp == NULL) {
-                perror(filename);
-                return 1;
-            }
+            res = icfp_serve(&config, &compiler, stdin, out_file);
         }
-
-        if (config.verbose) {
-            fprintf(stderr, "procesing %s\n", filename);
+    }
+    else if (config.jobs > 0) {
+        if (config.optimize) {
+            icfp_lower_defines(&compiler.pstate, &compiler.wstate);
+        }
+        struct _CompileStats stats = {};
+        res = icfp_compile_jobs(&config, &compiler, out_file, config.stats ? &stats : NULL);
+        if (res == 0 && config.stats) {
+            stats_timer_stop(&compile_timer);
+            icfp_compiler_count(&compiler, &stats);
+            icfp_compiler_stats(&stats, &prelude_timer, &compile_timer, stderr);
+        }
+    }
+    else {
+        for (int fni = 0; fni < config.filename_count && res == 0; ++fni) {
+            FILE* file = out_file;
+            if (config.outdir != NULL) {
+                file = _icfp_open_output(&config, config.filenames[fni]);
+                if (file == NULL) { return 1; }
+            }
+            compiler.wstate.file = file;
+            res = icfp_compiler_process_file(&compiler, &config, config.filenames[fni]);
+            if (file != out_file && fclose(file) != 0 && res == 0) {
+                perror(config.filenames[fni]);
+                res = 1;
+            }
         }
-
-        res = icfp_parser_process(&pstate, &wstate, filename, fp);
         if (res != 0) { return res; }
-
-        if (fp != stdin) {
-            fclose(fp);
+        if (config.stats) {
+            stats_timer_stop(&compile_timer);
+            struct _CompileStats stats = {};
+            icfp_compiler_count(&compiler, &stats);
+            icfp_compiler_stats(&stats, &prelude_timer, &compile_timer, stderr);
         }
     }
 
-    return 0;
+    if (config.verbose) {
+        icfp_compiler_report(&compiler, &config);
+    }
+    icfp_compiler_free(&compiler);
+    free(config.filenames);
+    free(config.preludes);
+    return res;
 }
-